@@ -89,9 +89,22 @@ int test_mdb_scan(TestDb *, void *, int, void *, int, void *, int,
 int test_lsm_open(const char *zFilename, int bClear, TestDb **ppDb);
 int test_lsm_lomem_open(const char *zFilename, int bClear, TestDb **ppDb);
 int test_lsm_zip_open(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_bloom_open(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_4k_open(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_leveled_open(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_hybrid_open(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_queue_open(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_2q_open(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_direct_open(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_lz_open(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_lzlevel_open(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_prefix_open(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_vlog_open(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_prealloc_open(const char *zFilename, int bClear, TestDb **ppDb);
 int test_lsm_small_open(const char *zFilename, int bClear, TestDb **ppDb);
 int test_lsm_mt2(const char *zFilename, int bClear, TestDb **ppDb);
 int test_lsm_mt3(const char *zFilename, int bClear, TestDb **ppDb);
+int test_lsm_bg_open(const char *zFilename, int bClear, TestDb **ppDb);
 
 int tdb_lsm_configure(lsm_db *, const char *);
 
@@ -181,6 +194,9 @@ void test_api(const char *zPattern, int *pRc);
 /* lsmtest8.c */
 void do_writer_crash_test(const char *zPattern, int *pRc);
 
+/* lsmtest10.c */
+void do_cksum_test(const char *zPattern, int *pRc);
+
 /*************************************************************************
 ** Interface to functionality in test_datasource.c.
 */
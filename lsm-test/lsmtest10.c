@@ -0,0 +1,204 @@
+
+/*
+** This file contains test cases for the checksum algorithms used by the
+** log file and checkpoints (see lsm_cksum.c).
+*/
+
+/*
+** This test file includes lsmInt.h to get access to the checksum routines
+** and to the checkpoint stored in shared memory. These are required to
+** create log files that use the older checksum algorithm, and to compare
+** the hardware and portable versions of each algorithm.
+*/
+#include "lsmInt.h"
+
+#include "lsmtest.h"
+
+/*
+** Return the checksum algorithm (LSM_CKSUM_FLETCHER or LSM_CKSUM_CRC32C)
+** recorded in the current snapshot of the database that pDb is connected
+** to.
+*/
+static int cksumAlgorithm(TestDb *pDb){
+  lsm_db *db = tdb_lsm(pDb);
+  return lsmCheckpointCksum(db->pShmhdr->aSnap2);
+}
+
+/*
+** Test case "cksum1.lsm". Write a log file using the LSM_CKSUM_FLETCHER
+** algorithm to a database that has never been checkpointed, as older
+** versions of the library did. Then check that:
+**
+**   1) A copy of the database is recovered correctly, and that recovery
+**      switches the database to the algorithm used by the log.
+**
+**   2) Transactions written to the recovered database, and the checkpoint
+**      that follows them, also use LSM_CKSUM_FLETCHER and are themselves
+**      recovered correctly.
+*/
+static void doCksumTest1(int *pRc){
+  const DatasourceDefn defn = {TEST_DATASOURCE_RANDOM, 12, 16, 100, 500};
+  const char *zCfg = "autoflush=65536 autocheckpoint=0";
+  char zCksum[TEST_CKSUM_BYTES];
+  char zCksum2[TEST_CKSUM_BYTES];
+  Datasource *pData;
+  TestDb *pDb = 0;
+  TestDb *pDb2 = 0;
+  int rc;
+
+  pData = testDatasourceNew(&defn);
+  testDeleteLsmdb("testdb2.lsm");
+
+  /* A new database uses CRC32C. Switch it to the older algorithm before
+  ** anything is written to the log file.  */
+  rc = tdb_lsm_open(zCfg, "testdb.lsm", 1, &pDb);
+  if( rc==0 ){
+    lsm_db *db = tdb_lsm(pDb);
+    testCompareInt(LSM_CKSUM_CRC32C, cksumAlgorithm(pDb), &rc);
+    if( rc==0 ) rc = lsmCheckpointLoad(db, 0);
+    if( rc==0 ) lsmCheckpointSetCksum(db, LSM_CKSUM_FLETCHER);
+  }
+  testWriteDatasourceRange(pDb, pData, 0, 2000, &rc);
+  testDeleteDatasourceRange(pDb, pData, 500, 100, &rc);
+  testCksumDatabase(pDb, zCksum);
+
+  /* Recover a copy of the database from the log file. */
+  if( rc==0 ){
+    testCopyLsmdb("testdb.lsm", "testdb2.lsm");
+    rc = tdb_lsm_open(zCfg, "testdb2.lsm", 0, &pDb2);
+  }
+  if( rc==0 ){
+    testCksumDatabase(pDb2, zCksum2);
+    testCompareStr(zCksum, zCksum2, &rc);
+    testCompareInt(LSM_CKSUM_FLETCHER, cksumAlgorithm(pDb2), &rc);
+  }
+  testClose(&pDb);
+
+  /* Write to the recovered database, checkpoint it and write some more.
+  ** Then recover a copy of it.  */
+  testWriteDatasourceRange(pDb2, pData, 2000, 1000, &rc);
+  if( rc==0 ) rc = lsm_flush(tdb_lsm(pDb2));
+  if( rc==0 ) rc = lsm_checkpoint(tdb_lsm(pDb2), 0);
+  testWriteDatasourceRange(pDb2, pData, 3000, 1000, &rc);
+  testDeleteDatasourceRange(pDb2, pData, 0, 100, &rc);
+  testCksumDatabase(pDb2, zCksum);
+  if( rc==0 ){
+    testDeleteLsmdb("testdb.lsm");
+    testCopyLsmdb("testdb2.lsm", "testdb.lsm");
+    rc = tdb_lsm_open(zCfg, "testdb.lsm", 0, &pDb);
+  }
+  if( rc==0 ){
+    testCksumDatabase(pDb, zCksum2);
+    testCompareStr(zCksum, zCksum2, &rc);
+    testCompareInt(LSM_CKSUM_FLETCHER, cksumAlgorithm(pDb), &rc);
+  }
+
+  testClose(&pDb);
+  testClose(&pDb2);
+  testDatasourceFree(pData);
+  *pRc = rc;
+}
+
+/*
+** Portable bit-at-a-time implementations of the two checksum algorithms.
+** These are independent of the table and the hardware versions used by
+** lsmChecksumBytes(). The data is zero padded to a multiple of 8 bytes.
+*/
+static u32 cksumCrcByte(u32 iCrc, u8 c){
+  int i;
+  iCrc ^= c;
+  for(i=0; i<8; i++){
+    iCrc = (iCrc >> 1) ^ (0x82F63B78 & (0 - (iCrc & 0x01)));
+  }
+  return iCrc;
+}
+static void cksumReference(
+  int eCksum,
+  const u8 *a, int n,
+  u32 *pC0, u32 *pC1
+){
+  u32 c0 = *pC0;
+  u32 c1 = *pC1;
+  int i;
+  for(i=0; i<n; i+=8){
+    u8 aUnit[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    memcpy(aUnit, &a[i], MIN(8, n-i));
+    if( eCksum==LSM_CKSUM_CRC32C ){
+      int j;
+      for(j=0; j<4; j++) c0 = cksumCrcByte(c0, aUnit[j]);
+      for(j=4; j<8; j++) c1 = cksumCrcByte(c1, aUnit[j]);
+    }else{
+      c0 += (aUnit[0] + (aUnit[1]<<8) + (aUnit[2]<<16) + ((u32)aUnit[3]<<24))
+          + c1;
+      c1 += (aUnit[4] + (aUnit[5]<<8) + (aUnit[6]<<16) + ((u32)aUnit[7]<<24))
+          + c0;
+    }
+  }
+  *pC0 = c0;
+  *pC1 = c1;
+}
+
+/*
+** Test case "cksum2.lsm". Check that both checksum algorithms produce the
+** same results using the SSE4.1/SSE4.2 or ARMv8 code (if the CPU supports
+** it), the portable code, and the reference implementations above. For
+** buffers of many sizes and alignments.
+*/
+static void doCksumTest2(int *pRc){
+  const int nMax = 4096;
+  u8 *aBuf;
+  int rc = 0;
+  int i;
+
+  aBuf = (u8 *)testMalloc(nMax + 8);
+  for(i=0; i<nMax+8; i++){
+    aBuf[i] = (u8)testPrngValue(i);
+  }
+
+  for(i=0; rc==0 && i<=nMax; i += (i<200 ? 1 : 97)){
+    int iAlign;
+    for(iAlign=0; rc==0 && iAlign<8; iAlign++){
+      int eCksum;
+      for(eCksum=LSM_CKSUM_FLETCHER; eCksum<=LSM_CKSUM_CRC32C; eCksum++){
+        u32 aHw[2];
+        u32 aSoft[2];
+        u32 aRef[2];
+        aHw[0] = aSoft[0] = aRef[0] = testPrngValue(i*8 + iAlign);
+        aHw[1] = aSoft[1] = aRef[1] = testPrngValue(i*8 + iAlign + 1);
+
+        lsmChecksumHardware(1);
+        lsmChecksumBytes(eCksum, (char *)&aBuf[iAlign], i, &aHw[0],&aHw[1]);
+        lsmChecksumHardware(0);
+        lsmChecksumBytes(eCksum, (char *)&aBuf[iAlign], i, &aSoft[0],&aSoft[1]);
+        cksumReference(eCksum, &aBuf[iAlign], i, &aRef[0], &aRef[1]);
+
+        testCompareInt(aRef[0], aSoft[0], &rc);
+        testCompareInt(aRef[1], aSoft[1], &rc);
+        testCompareInt(aRef[0], aHw[0], &rc);
+        testCompareInt(aRef[1], aHw[1], &rc);
+      }
+    }
+  }
+  lsmChecksumHardware(1);
+
+  testFree(aBuf);
+  *pRc = rc;
+}
+
+void do_cksum_test(const char *zPattern, int *pRc){
+  struct Test {
+    const char *zName;
+    void (*xFunc)(int *);
+  } aTest[] = {
+    { "cksum1.lsm", doCksumTest1 },
+    { "cksum2.lsm", doCksumTest2 },
+  };
+  int i;
+  for(i=0; i<ArraySize(aTest); i++){
+    struct Test *p = &aTest[i];
+    if( testCaseBegin(pRc, zPattern, p->zName) ){
+      p->xFunc(pRc);
+      testCaseFinish(*pRc);
+    }
+  }
+}
@@ -1,10 +1,11 @@
 
 /*
-** This file is broken into three semi-autonomous parts:
+** This file is broken into four semi-autonomous parts:
 **
 **   1. The database functions.
 **   2. The thread wrappers.
 **   3. The implementation of the mt1.* tests.
+**   4. The implementation of the mt2.lsm test (group commit).
 */
 
 /*************************************************************************
@@ -623,6 +624,294 @@ static void do_test_mt1(
   }
 }
 
+/*************************************************************************
+** Test case "mt2.lsm" tests group commit (LSM_CONFIG_GROUP_COMMIT).
+**
+** Several threads commit transactions to the same database, each using its
+** own connection with LSM_CONFIG_SAFETY set to LSM_SAFETY_FULL. All
+** connections use a wrapper around the test environment that numbers the
+** writes made to log files. It records the number of the last log write
+** made by each thread, and the number of the last log write completed 
+** before the most recent log sync began. Each log sync also sleeps for a
+** short time, as syncing a real disk would.
+**
+** After each call to lsm_commit() returns, the thread checks that its 
+** transaction was written to the log file and that the log has since been
+** synced. Once all threads have finished, the LSM_INFO_GROUP_COMMIT 
+** counters are used to check that every transaction was made durable by 
+** group commit, and that fewer syncs than commits were required.
+*/
+#ifdef LSM_MUTEX_PTHREADS
+
+#define MT2_NTHREAD  4                  /* Number of writer threads */
+#define MT2_NCOMMIT  200                /* Transactions per writer thread */
+#define MT2_NFILE    16                 /* Maximum open log files */
+#define MT2_SYNC_US  1000               /* Time taken by each log sync */
+
+typedef struct Mt2Env Mt2Env;
+struct Mt2Env {
+  lsm_env env;                          /* Wrapper environment */
+  pthread_mutex_t mutex;                /* Mutex protecting fields below */
+  lsm_file *apLog[MT2_NFILE];           /* Open log files */
+  pthread_t aId[MT2_NTHREAD];           /* Writer thread ids */
+  int abId[MT2_NTHREAD];                /* True once aId[i] is valid */
+  lsm_i64 aLastWrite[MT2_NTHREAD];      /* Last log write by each thread */
+  lsm_i64 iWrite;                       /* Number of log writes so far */
+  lsm_i64 iSynced;                      /* Log writes known to be synced */
+};
+static Mt2Env mt2;
+
+/*
+** Return true if pFile is a log file. The caller must hold mt2.mutex.
+*/
+static int mt2IsLog(lsm_file *pFile){
+  int i;
+  for(i=0; i<MT2_NFILE; i++){
+    if( mt2.apLog[i]==pFile ) return 1;
+  }
+  return 0;
+}
+
+static int mt2Open(
+  lsm_env *pEnv, 
+  const char *zFile, 
+  int flags, 
+  lsm_file **ppFile
+){
+  lsm_env *pRealEnv = tdb_lsm_env();
+  int nFile = strlen(zFile);
+  int rc;
+
+  rc = pRealEnv->xOpen(pRealEnv, zFile, flags, ppFile);
+  if( rc==LSM_OK && nFile>4 && 0==strcmp(&zFile[nFile-4], "-log") ){
+    int i;
+    pthread_mutex_lock(&mt2.mutex);
+    for(i=0; i<MT2_NFILE && mt2.apLog[i]; i++);
+    if( i<MT2_NFILE ) mt2.apLog[i] = *ppFile;
+    pthread_mutex_unlock(&mt2.mutex);
+    if( i==MT2_NFILE ){
+      pRealEnv->xClose(*ppFile);
+      *ppFile = 0;
+      rc = LSM_IOERR;
+    }
+  }
+  return rc;
+}
+
+static int mt2Write(lsm_file *pFile, lsm_i64 iOff, void *pData, int nData){
+  lsm_env *pRealEnv = tdb_lsm_env();
+  int rc;
+
+  rc = pRealEnv->xWrite(pFile, iOff, pData, nData);
+  pthread_mutex_lock(&mt2.mutex);
+  if( rc==LSM_OK && mt2IsLog(pFile) ){
+    int i;
+    mt2.iWrite++;
+    for(i=0; i<MT2_NTHREAD; i++){
+      if( mt2.abId[i] && pthread_equal(mt2.aId[i], pthread_self()) ){
+        mt2.aLastWrite[i] = mt2.iWrite;
+      }
+    }
+  }
+  pthread_mutex_unlock(&mt2.mutex);
+  return rc;
+}
+
+static int mt2Sync(lsm_file *pFile){
+  lsm_env *pRealEnv = tdb_lsm_env();
+  lsm_i64 iWrite;
+  int bLog;
+  int rc;
+
+  pthread_mutex_lock(&mt2.mutex);
+  bLog = mt2IsLog(pFile);
+  iWrite = mt2.iWrite;
+  pthread_mutex_unlock(&mt2.mutex);
+
+  if( bLog ) usleep(MT2_SYNC_US);
+  rc = pRealEnv->xSync(pFile);
+
+  pthread_mutex_lock(&mt2.mutex);
+  if( rc==LSM_OK && bLog && iWrite>mt2.iSynced ) mt2.iSynced = iWrite;
+  pthread_mutex_unlock(&mt2.mutex);
+  return rc;
+}
+
+static int mt2Close(lsm_file *pFile){
+  lsm_env *pRealEnv = tdb_lsm_env();
+  int i;
+  pthread_mutex_lock(&mt2.mutex);
+  for(i=0; i<MT2_NFILE; i++){
+    if( mt2.apLog[i]==pFile ) mt2.apLog[i] = 0;
+  }
+  pthread_mutex_unlock(&mt2.mutex);
+  return pRealEnv->xClose(pFile);
+}
+
+/*
+** Open a connection to database zDb that uses the wrapper environment, 
+** LSM_SAFETY_FULL and group commit.
+*/
+static lsm_db *mt2Connect(const char *zDb, int *pRc){
+  lsm_db *db = 0;
+  if( *pRc==0 ){
+    *pRc = lsm_new(&mt2.env, &db);
+    if( *pRc==0 ){
+      int eSafety = LSM_SAFETY_FULL;
+      int nGroup = 100;
+      lsm_config(db, LSM_CONFIG_SAFETY, &eSafety);
+      lsm_config(db, LSM_CONFIG_GROUP_COMMIT, &nGroup);
+      testCompareInt(100, nGroup, pRc);
+      if( *pRc==0 ) *pRc = lsm_open(db, zDb);
+    }
+  }
+  return db;
+}
+
+static void mt2Main(ThreadSet *pThreadSet, int iThread, void *pCtx){
+  const char *zDb = (const char *)pCtx;
+  lsm_db *db;
+  lsm_i64 iPrev = 0;
+  int rc = 0;
+  int i;
+
+  pthread_mutex_lock(&mt2.mutex);
+  mt2.aId[iThread] = pthread_self();
+  mt2.abId[iThread] = 1;
+  pthread_mutex_unlock(&mt2.mutex);
+
+  db = mt2Connect(zDb, &rc);
+  for(i=0; rc==0 && i<MT2_NCOMMIT; i++){
+    char zKey[32];
+    char zVal[64];
+    lsm_i64 iLast;
+    lsm_i64 iSynced;
+
+    snprintf(zKey, sizeof(zKey), "%d.%.6d", iThread, i);
+    snprintf(zVal, sizeof(zVal), "value %d written by thread %d", i, iThread);
+    /* Another thread may hold the write lock. Retry until it is free. */
+    while( LSM_BUSY==(rc = lsm_begin(db, 1)) ) usleep(10);
+    if( rc==0 ) rc = lsm_insert(db, zKey, strlen(zKey), zVal, strlen(zVal));
+    if( rc==0 ) rc = lsm_commit(db, 0);
+
+    if( rc==0 ){
+      pthread_mutex_lock(&mt2.mutex);
+      iLast = mt2.aLastWrite[iThread];
+      iSynced = mt2.iSynced;
+      pthread_mutex_unlock(&mt2.mutex);
+      if( iLast<=iPrev ){
+        testThreadSetResult(pThreadSet, iThread, 1, 
+            "commit %d not written to log", i
+        );
+        rc = 1;
+      }else if( iSynced<iLast ){
+        testThreadSetResult(pThreadSet, iThread, 1, 
+            "commit %d not synced (write %lld, synced %lld)", i, iLast, iSynced
+        );
+        rc = 1;
+      }
+      iPrev = iLast;
+    }else{
+      testThreadSetResult(pThreadSet, iThread, rc, "commit %d failed", i);
+    }
+  }
+  lsm_close(db);
+
+  if( rc==0 ){
+    testThreadSetResult(pThreadSet, iThread, 0, "%d commits", MT2_NCOMMIT);
+  }
+}
+
+/*
+** Check that database db contains exactly the key-value pairs written
+** by the mt2 threads.
+*/
+static void mt2Check(lsm_db *db, int *pRc){
+  lsm_cursor *pCsr = 0;
+  int nEntry = 0;
+
+  if( *pRc ) return;
+  *pRc = lsm_csr_open(db, &pCsr);
+  if( *pRc==0 ) *pRc = lsm_csr_first(pCsr);
+  while( *pRc==0 && lsm_csr_valid(pCsr) ){
+    const void *pKey; int nKey;
+    const void *pVal; int nVal;
+    char zKey[32];
+    char zVal[64];
+    int iThread = nEntry / MT2_NCOMMIT;
+    int i = nEntry % MT2_NCOMMIT;
+
+    snprintf(zKey, sizeof(zKey), "%d.%.6d", iThread, i);
+    snprintf(zVal, sizeof(zVal), "value %d written by thread %d", i, iThread);
+    lsm_csr_key(pCsr, &pKey, &nKey);
+    lsm_csr_value(pCsr, &pVal, &nVal);
+    testCompareInt(strlen(zKey), nKey, pRc);
+    testCompareInt(strlen(zVal), nVal, pRc);
+    if( *pRc==0 ){
+      testCompareInt(0, memcmp(zKey, pKey, nKey), pRc);
+      testCompareInt(0, memcmp(zVal, pVal, nVal), pRc);
+    }
+    nEntry++;
+    if( *pRc==0 ) *pRc = lsm_csr_next(pCsr);
+  }
+  testCompareInt(MT2_NTHREAD * MT2_NCOMMIT, nEntry, pRc);
+  lsm_csr_close(pCsr);
+}
+
+static void do_test_mt2(const char *zPattern, int *pRc){
+  if( *pRc==0 && testCaseBegin(pRc, zPattern, "mt2.lsm") ){
+    const char *zDb = "testdb.lsm";
+    ThreadSet *pSet;
+    lsm_db *db = 0;
+    int iThread;
+    int nSync = 0;
+    int nCommit = 0;
+
+    memset(&mt2, 0, sizeof(mt2));
+    memcpy(&mt2.env, tdb_lsm_env(), sizeof(lsm_env));
+    mt2.env.xOpen = mt2Open;
+    mt2.env.xWrite = mt2Write;
+    mt2.env.xWritev = 0;
+    mt2.env.xSync = mt2Sync;
+    mt2.env.xClose = mt2Close;
+    pthread_mutex_init(&mt2.mutex, 0);
+
+    /* Connection db stays open while the writer threads run, so that the
+    ** group commit counters are not reset when they close.  */
+    testDeleteLsmdb(zDb);
+    db = mt2Connect(zDb, pRc);
+
+    pSet = testThreadInit(MT2_NTHREAD);
+    for(iThread=0; *pRc==0 && iThread<MT2_NTHREAD; iThread++){
+      testThreadLaunch(pSet, iThread, mt2Main, (void *)zDb);
+    }
+    testThreadWait(pSet, 0);
+    for(iThread=0; *pRc==0 && iThread<MT2_NTHREAD; iThread++){
+      const char *zMsg = 0;
+      *pRc = testThreadGetResult(pSet, iThread, &zMsg);
+      if( *pRc ) testPrintError("thread %d: %s\n", iThread, zMsg);
+    }
+    testThreadShutdown(pSet);
+
+    /* Every commit was made durable by group commit, and at least one
+    ** sync covered more than one commit.  */
+    if( *pRc==0 ){
+      *pRc = lsm_info(db, LSM_INFO_GROUP_COMMIT, &nSync, &nCommit);
+    }
+    testCompareInt(MT2_NTHREAD * MT2_NCOMMIT, nCommit, pRc);
+    if( *pRc==0 && (nSync<=0 || nSync>=nCommit) ){
+      testPrintError("nSync=%d nCommit=%d\n", nSync, nCommit);
+      *pRc = 1;
+    }
+
+    mt2Check(db, pRc);
+    lsm_close(db);
+    pthread_mutex_destroy(&mt2.mutex);
+    testCaseFinish(*pRc);
+  }
+}
+#endif /* LSM_MUTEX_PTHREADS */
+
 void test_mt(
   const char *zSystem,            /* Database system name */
   const char *zPattern,           /* Run test cases that match this pattern */
@@ -630,4 +919,7 @@ void test_mt(
 ){
   if( testThreadSupport()==0 ) return;
   do_test_mt1(zSystem, zPattern, pRc);
+#ifdef LSM_MUTEX_PTHREADS
+  if( 0==strcmp(zSystem, "lsm") ) do_test_mt2(zPattern, pRc);
+#endif
 }
@@ -1,6 +1,7 @@
 
 
 #include "lsmtest.h"
+#include <unistd.h>
 
 
 /*
@@ -139,7 +140,7 @@ static lsm_db *newLsmConnection(
     if( *pRc==0 ){
       if( n1 ) lsm_config(db, LSM_CONFIG_PAGE_SIZE, &n1);
       if( n2 ) lsm_config(db, LSM_CONFIG_BLOCK_SIZE, &n2);
-      *pRc = lsm_open(db, "testdb.lsm");
+      *pRc = lsm_open(db, zDb);
     }
   }
   return db;
@@ -197,10 +198,1341 @@ static void do_test_api2(const char *zPattern, int *pRc){
   }
 }
 
+static int api3Compare(const void *pA, int nA, const void *pB, int nB){
+  int res = memcmp(pA, pB, MIN(nA, nB));
+  if( res==0 ) res = nA - nB;
+  return res;
+}
+
+/*
+** Return true if cursor pCsr points to a key within the range 
+** [pLo/nLo, pHi/nHi). A NULL pointer means the range is unbounded in
+** that direction.
+*/
+static int api3InRange(
+  lsm_cursor *pCsr, 
+  const void *pLo, int nLo, 
+  const void *pHi, int nHi
+){
+  const void *pKey; int nKey;
+  if( lsm_csr_valid(pCsr)==0 ) return 0;
+  lsm_csr_key(pCsr, &pKey, &nKey);
+  return (pLo==0 || api3Compare(pKey, nKey, pLo, nLo)>=0)
+      && (pHi==0 || api3Compare(pKey, nKey, pHi, nHi)<0);
+}
+
+/*
+** Check that a cursor with bounds [pLo/nLo, pHi/nHi) visits the same keys
+** in both directions as an unbounded cursor does within that range. And
+** that seeking to a key outside of the bounds works as documented.
+*/
+static void do_test_api3_range(
+  lsm_db *pDb,
+  const void *pLo, int nLo, 
+  const void *pHi, int nHi,
+  int *pRc
+){
+  lsm_cursor *pCsr = 0;           /* Unbounded cursor */
+  lsm_cursor *pBnd = 0;           /* Cursor with bounds */
+  const void *pKey; int nKey;
+  const void *pKey2; int nKey2;
+
+  if( *pRc ) return;
+  *pRc = lsm_csr_open(pDb, &pCsr);
+  if( *pRc==0 ) *pRc = lsm_csr_open(pDb, &pBnd);
+  if( *pRc==0 ) *pRc = lsm_csr_set_bounds(pBnd, pLo, nLo, pHi, nHi);
+
+  /* Iterate forwards. */
+  if( *pRc==0 ){
+    if( pLo ){
+      lsm_csr_seek(pCsr, pLo, nLo, LSM_SEEK_GE);
+    }else{
+      lsm_csr_first(pCsr);
+    }
+    lsm_csr_first(pBnd);
+  }
+  while( *pRc==0 ){
+    int bValid = api3InRange(pCsr, pLo, nLo, pHi, nHi);
+    testCompareInt(bValid, lsm_csr_valid(pBnd), pRc);
+    if( bValid==0 || *pRc ) break;
+    lsm_csr_key(pCsr, &pKey, &nKey);
+    lsm_csr_key(pBnd, &pKey2, &nKey2);
+    testCompareInt(0, api3Compare(pKey, nKey, pKey2, nKey2), pRc);
+    lsm_csr_next(pCsr);
+    lsm_csr_next(pBnd);
+  }
+
+  /* Iterate backwards. */
+  if( *pRc==0 ){
+    if( pHi ){
+      lsm_csr_seek(pCsr, pHi, nHi, LSM_SEEK_LE);
+      if( lsm_csr_valid(pCsr) && !api3InRange(pCsr, 0, 0, pHi, nHi) ){
+        lsm_csr_prev(pCsr);
+      }
+    }else{
+      lsm_csr_last(pCsr);
+    }
+    lsm_csr_last(pBnd);
+  }
+  while( *pRc==0 ){
+    int bValid = api3InRange(pCsr, pLo, nLo, pHi, nHi);
+    testCompareInt(bValid, lsm_csr_valid(pBnd), pRc);
+    if( bValid==0 || *pRc ) break;
+    lsm_csr_key(pCsr, &pKey, &nKey);
+    lsm_csr_key(pBnd, &pKey2, &nKey2);
+    testCompareInt(0, api3Compare(pKey, nKey, pKey2, nKey2), pRc);
+    lsm_csr_prev(pCsr);
+    lsm_csr_prev(pBnd);
+  }
+
+  /* The largest key smaller than the lower bound is not visible to an
+  ** LSM_SEEK_EQ seek. An LSM_SEEK_GE seek for it finds the first key in
+  ** the range.  */
+  if( *pRc==0 && pLo ){
+    lsm_csr_seek(pCsr, pLo, nLo, LSM_SEEK_LE);
+    if( lsm_csr_valid(pCsr) && !api3InRange(pCsr, pLo, nLo, 0, 0) ){
+      lsm_csr_key(pCsr, &pKey, &nKey);
+      lsm_csr_seek(pBnd, pKey, nKey, LSM_SEEK_EQ);
+      testCompareInt(0, lsm_csr_valid(pBnd), pRc);
+      lsm_csr_seek(pBnd, pKey, nKey, LSM_SEEK_GE);
+      lsm_csr_seek(pCsr, pLo, nLo, LSM_SEEK_GE);
+      testCompareInt(api3InRange(pCsr, pLo, nLo, pHi, nHi),
+          lsm_csr_valid(pBnd), pRc
+      );
+      if( *pRc==0 && lsm_csr_valid(pBnd) ){
+        lsm_csr_key(pCsr, &pKey, &nKey);
+        lsm_csr_key(pBnd, &pKey2, &nKey2);
+        testCompareInt(0, api3Compare(pKey, nKey, pKey2, nKey2), pRc);
+      }
+    }
+  }
+
+  lsm_csr_close(pCsr);
+  lsm_csr_close(pBnd);
+}
+
+/*
+** Test case "api3" tests cursors restricted to a key range using 
+** lsm_csr_set_bounds(). The database is written so that it contains a 
+** number of sorted runs, some with disjoint and some with overlapping 
+** key ranges.
+*/
+static void do_test_api3(const char *zPattern, int *pRc){
+  if( *pRc==0 && testCaseBegin(pRc, zPattern, "api3.lsm") ){
+    const DatasourceDefn defn = { TEST_DATASOURCE_SEQUENCE, 0, 0, 20, 50 };
+    const int aBatch[] = { 3, 0, 2, 1 };
+    Datasource *pData;
+    lsm_db *db = 0;
+    int i;
+
+    testDeleteLsmdb("testdb.lsm");
+    pData = testDatasourceNew(&defn);
+    db = newLsmConnection("testdb.lsm", 1024, 64*1024, pRc);
+
+    /* Write 4 batches of 500 consecutive keys, out of order, each to a 
+    ** sorted run of its own. Then overwrite and delete keys scattered 
+    ** throughout the key space, and merge some of the runs together.  */
+    for(i=0; *pRc==0 && i<2000; i++){
+      void *pKey; int nKey;
+      void *pVal; int nVal;
+      int iKey = aBatch[i/500]*500 + (i%500);
+      testDatasourceEntry(pData, iKey, &pKey, &nKey, &pVal, &nVal);
+      *pRc = lsm_insert(db, pKey, nKey, pVal, nVal);
+      if( *pRc==0 && (i%500)==499 ) *pRc = lsm_flush(db);
+    }
+    for(i=0; *pRc==0 && i<2000; i+=7){
+      void *pKey; int nKey;
+      testDatasourceEntry(pData, i, &pKey, &nKey, 0, 0);
+      if( i%2 ){
+        *pRc = lsm_delete(db, pKey, nKey);
+      }else{
+        *pRc = lsm_insert(db, pKey, nKey, "value", 5);
+      }
+    }
+    if( *pRc==0 ) *pRc = lsm_flush(db);
+    if( *pRc==0 ) *pRc = lsm_work(db, 2, 16, 0);
+
+    do_test_api3_range(db, 0, 0, 0, 0, pRc);
+    for(i=0; *pRc==0 && i<40; i++){
+      void *pKey; int nKey;
+      u8 aA[32]; int nA;
+      u8 aB[32]; int nB;
+      int iA = testPrngValue(i*2) % 2100;
+      int iB = iA + testPrngValue(i*2+1) % 300;
+
+      /* Bounds are either keys from the data source, or keys that fall
+      ** just after them.  */
+      testDatasourceEntry(pData, iA, &pKey, &nKey, 0, 0);
+      memcpy(aA, pKey, nKey);
+      nA = nKey + (i%2);
+      aA[nKey] = 'x';
+      testDatasourceEntry(pData, iB, &pKey, &nKey, 0, 0);
+      memcpy(aB, pKey, nKey);
+      nB = nKey + (i%3)/2;
+      aB[nKey] = 'x';
+
+      do_test_api3_range(db, aA, nA, aB, nB, pRc);
+      do_test_api3_range(db, aA, nA, 0, 0, pRc);
+      do_test_api3_range(db, 0, 0, aB, nB, pRc);
+    }
+
+    lsm_close(db);
+    testDatasourceFree(pData);
+    testCaseFinish(*pRc);
+  }
+}
+
+/*
+** Context object for the xNext callback used by test case "api4". Keys 
+** iFirst..iLast-1 are returned, except that if iSwap is non-zero, entries
+** iSwap and iSwap+1 are returned in the wrong order.
+*/
+typedef struct Api4Ctx Api4Ctx;
+struct Api4Ctx {
+  Datasource *pData;
+  int iNext;
+  int iLast;
+  int iSwap;
+};
+
+static int api4Next(
+  void *pCtx, 
+  const void **ppKey, int *pnKey,
+  const void **ppVal, int *pnVal
+){
+  Api4Ctx *p = (Api4Ctx *)pCtx;
+  if( p->iNext>=p->iLast ){
+    *ppKey = 0;
+  }else{
+    int iKey = p->iNext++;
+    void *pKey; int nKey;
+    void *pVal; int nVal;
+    if( p->iSwap && iKey==p->iSwap ) iKey++;
+    else if( p->iSwap && iKey==p->iSwap+1 ) iKey--;
+    testDatasourceEntry(p->pData, iKey, &pKey, &nKey, &pVal, &nVal);
+    *ppKey = pKey; *pnKey = nKey;
+    *ppVal = pVal; *pnVal = nVal;
+  }
+  return LSM_OK;
+}
+
+/*
+** Check that the database contains the data expected by test case "api4".
+** Keys with values between 1000 and 3000 were bulk-loaded. Even keys 
+** outside of that range have the value "old". There are no other keys.
+*/
+static void api4Check(lsm_db *db, Datasource *pData, int *pRc){
+  lsm_cursor *pCsr = 0;
+  int nEntry = 0;
+  int i;
+
+  if( *pRc ) return;
+  *pRc = lsm_csr_open(db, &pCsr);
+  for(i=0; *pRc==0 && i<4000; i++){
+    void *pKey; int nKey;
+    void *pVal; int nVal;
+    const void *pDbVal; int nDbVal;
+    testDatasourceEntry(pData, i, &pKey, &nKey, &pVal, &nVal);
+    *pRc = lsm_csr_seek(pCsr, pKey, nKey, LSM_SEEK_EQ);
+    if( *pRc ) break;
+    if( i>=1000 && i<3000 ){
+      testCompareInt(1, lsm_csr_valid(pCsr), pRc);
+      if( *pRc==0 ){
+        lsm_csr_value(pCsr, &pDbVal, &nDbVal);
+        testCompareInt(nVal, nDbVal, pRc);
+        testCompareInt(0, memcmp(pVal, pDbVal, nVal), pRc);
+      }
+    }else if( (i%2)==0 ){
+      testCompareInt(1, lsm_csr_valid(pCsr), pRc);
+      if( *pRc==0 ){
+        lsm_csr_value(pCsr, &pDbVal, &nDbVal);
+        testCompareInt(3, nDbVal, pRc);
+        testCompareInt(0, memcmp("old", pDbVal, 3), pRc);
+      }
+    }else{
+      testCompareInt(0, lsm_csr_valid(pCsr), pRc);
+    }
+  }
+
+  if( *pRc==0 ) *pRc = lsm_csr_first(pCsr);
+  while( *pRc==0 && lsm_csr_valid(pCsr) ){
+    nEntry++;
+    *pRc = lsm_csr_next(pCsr);
+  }
+  testCompareInt(2000 + 1000, nEntry, pRc);
+  lsm_csr_close(pCsr);
+}
+
+/*
+** Test case "api4" tests lsm_bulk_load().
+*/
+static void do_test_api4(const char *zPattern, int *pRc){
+  if( *pRc==0 && testCaseBegin(pRc, zPattern, "api4.lsm") ){
+    const DatasourceDefn defn = { TEST_DATASOURCE_SEQUENCE, 0, 0, 20, 200 };
+    Datasource *pData;
+    Api4Ctx ctx;
+    lsm_db *db = 0;
+    int i;
+
+    testDeleteLsmdb("testdb.lsm");
+    pData = testDatasourceNew(&defn);
+    db = newLsmConnection("testdb.lsm", 1024, 64*1024, pRc);
+
+    /* Insert the even keys between 0 and 4000. Only some of them are 
+    ** flushed to disk - the rest are still in the in-memory tree when
+    ** the bulk load begins.  */
+    for(i=0; *pRc==0 && i<4000; i+=2){
+      void *pKey; int nKey;
+      testDatasourceEntry(pData, i, &pKey, &nKey, 0, 0);
+      *pRc = lsm_insert(db, pKey, nKey, "old", 3);
+      if( *pRc==0 && i==2000 ) *pRc = lsm_flush(db);
+    }
+
+    /* A bulk load with keys out of order fails. */
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.pData = pData;
+    ctx.iNext = 1000;
+    ctx.iLast = 3000;
+    ctx.iSwap = 2500;
+    if( *pRc==0 ){
+      testCompareInt(LSM_MISUSE, lsm_bulk_load(db, api4Next, &ctx), pRc);
+    }
+
+    /* Bulk load keys 1000 to 3000. */
+    ctx.iNext = 1000;
+    ctx.iSwap = 0;
+    if( *pRc==0 ) *pRc = lsm_bulk_load(db, api4Next, &ctx);
+    api4Check(db, pData, pRc);
+
+    /* The loaded data survives a crash. In particular, recovering the log
+    ** file does not restore the values that were in the in-memory tree when
+    ** the bulk load began.  */
+    if( *pRc==0 ){
+      lsm_db *db2;
+      testDeleteLsmdb("testdb2.lsm");
+      testCopyLsmdb("testdb.lsm", "testdb2.lsm");
+      db2 = newLsmConnection("testdb2.lsm", 1024, 64*1024, pRc);
+      api4Check(db2, pData, pRc);
+      lsm_close(db2);
+    }
+
+    /* The loaded data survives reopening the database. */
+    lsm_close(db);
+    db = newLsmConnection("testdb.lsm", 1024, 64*1024, pRc);
+    api4Check(db, pData, pRc);
+
+    /* And merging it with the rest of the database. */
+    if( *pRc==0 ) *pRc = lsm_work(db, 1, -1, 0);
+    api4Check(db, pData, pRc);
+
+    lsm_close(db);
+    testDatasourceFree(pData);
+    testCaseFinish(*pRc);
+  }
+}
+
+/*
+** Context object for the xFound callback used by test case "api5".
+*/
+typedef struct Api5Ctx Api5Ctx;
+struct Api5Ctx {
+  lsm_cursor *pCsr;               /* Cursor passed to lsm_csr_multiseek() */
+  lsm_cursor *pCsr2;              /* Cursor used to check results */
+  const void **apKey;             /* Keys searched for */
+  int *anKey;                     /* Sizes of keys in apKey[] */
+  int iPrev;                      /* Index of previous key found (or -1) */
+  int nFound;                     /* Number of keys found */
+  int rc;                         /* Error code */
+};
+
+/*
+** Check that each key reported as found by lsm_csr_multiseek() is also
+** found by lsm_csr_seek(), with the same value. And that any keys skipped
+** over since the previous callback are not found by lsm_csr_seek().
+*/
+static int api5Found(void *pCtx, int iKey){
+  Api5Ctx *p = (Api5Ctx *)pCtx;
+  const void *pVal; int nVal;
+  const void *pVal2; int nVal2;
+  int i;
+
+  for(i=p->iPrev+1; p->rc==0 && i<iKey; i++){
+    p->rc = lsm_csr_seek(p->pCsr2, p->apKey[i], p->anKey[i], LSM_SEEK_EQ);
+    testCompareInt(0, lsm_csr_valid(p->pCsr2), &p->rc);
+  }
+  if( p->rc==0 ){
+    p->rc = lsm_csr_seek(p->pCsr2, p->apKey[iKey], p->anKey[iKey], LSM_SEEK_EQ);
+    testCompareInt(1, lsm_csr_valid(p->pCsr2), &p->rc);
+  }
+  if( p->rc==0 ){
+    lsm_csr_value(p->pCsr, &pVal, &nVal);
+    lsm_csr_value(p->pCsr2, &pVal2, &nVal2);
+    testCompareInt(nVal2, nVal, &p->rc);
+    testCompareInt(0, memcmp(pVal, pVal2, nVal), &p->rc);
+  }
+  p->iPrev = iKey;
+  p->nFound++;
+  return p->rc;
+}
+
+/*
+** Test case "api5" tests lsm_csr_multiseek(), and that seeks that begin
+** their descent part way down a b-tree find the same entries as seeks 
+** that begin at the root.
+*/
+static void do_test_api5(const char *zPattern, int *pRc){
+  if( *pRc==0 && testCaseBegin(pRc, zPattern, "api5.lsm") ){
+    const DatasourceDefn defn = { TEST_DATASOURCE_SEQUENCE, 0, 0, 100, 200 };
+    const int nKey = 1000;
+    Datasource *pData;
+    lsm_db *db = 0;
+    const void **apKey;
+    int *anKey;
+    u8 *aKey;
+    int iPass;
+    int i;
+
+    testDeleteLsmdb("testdb.lsm");
+    pData = testDatasourceNew(&defn);
+    db = newLsmConnection("testdb.lsm", 1024, 64*1024, pRc);
+    apKey = (const void **)testMalloc(sizeof(void *) * nKey);
+    anKey = (int *)testMalloc(sizeof(int) * nKey);
+    aKey = (u8 *)testMalloc(32 * nKey);
+
+    /* Write 3 segments of 10000 entries, each containing every third key
+    ** between 0 and 30000. Then overwrite and delete some of them.  */
+    for(iPass=0; *pRc==0 && iPass<3; iPass++){
+      for(i=iPass; *pRc==0 && i<30000; i+=3){
+        void *pKey; int nKey2;
+        void *pVal; int nVal;
+        testDatasourceEntry(pData, i, &pKey, &nKey2, &pVal, &nVal);
+        *pRc = lsm_insert(db, pKey, nKey2, pVal, nVal);
+      }
+      if( *pRc==0 ) *pRc = lsm_flush(db);
+    }
+    for(i=0; *pRc==0 && i<30000; i+=50){
+      void *pKey; int nKey2;
+      testDatasourceEntry(pData, i, &pKey, &nKey2, 0, 0);
+      if( i%100 ){
+        *pRc = lsm_delete(db, pKey, nKey2);
+      }else{
+        *pRc = lsm_insert(db, pKey, nKey2, "new value", 9);
+      }
+    }
+
+    /* Search for a sorted set of keys, some of which are not present in 
+    ** the database. Then the same keys in descending order.  */
+    for(i=0; i<nKey; i++){
+      void *pKey; int nKey2;
+      testDatasourceEntry(pData, i*31 + (int)(testPrngValue(i) % 31), 
+          &pKey, &nKey2, 0, 0
+      );
+      memcpy(&aKey[i*32], pKey, nKey2);
+      aKey[i*32 + nKey2] = 'x';
+      apKey[i] = &aKey[i*32];
+      anKey[i] = nKey2 + ((i%7)==0);
+    }
+    for(iPass=0; *pRc==0 && iPass<2; iPass++){
+      Api5Ctx ctx;
+      memset(&ctx, 0, sizeof(ctx));
+      ctx.apKey = apKey;
+      ctx.anKey = anKey;
+      ctx.iPrev = -1;
+      *pRc = lsm_csr_open(db, &ctx.pCsr);
+      if( *pRc==0 ) *pRc = lsm_csr_open(db, &ctx.pCsr2);
+      if( *pRc==0 ){
+        *pRc = lsm_csr_multiseek(ctx.pCsr, nKey, apKey, anKey, api5Found, &ctx);
+        if( *pRc==0 ) *pRc = ctx.rc;
+      }
+      for(i=ctx.iPrev+1; *pRc==0 && i<nKey; i++){
+        *pRc = lsm_csr_seek(ctx.pCsr2, apKey[i], anKey[i], LSM_SEEK_EQ);
+        testCompareInt(0, lsm_csr_valid(ctx.pCsr2), pRc);
+      }
+      testCompareInt(1, ctx.nFound>nKey/2, pRc);
+      lsm_csr_close(ctx.pCsr);
+      lsm_csr_close(ctx.pCsr2);
+
+      for(i=0; i<nKey/2; i++){
+        const void *pSwap = apKey[i];
+        int nSwap = anKey[i];
+        apKey[i] = apKey[nKey-1-i];
+        anKey[i] = anKey[nKey-1-i];
+        apKey[nKey-1-i] = pSwap;
+        anKey[nKey-1-i] = nSwap;
+      }
+    }
+
+    lsm_close(db);
+    testFree(apKey);
+    testFree(anKey);
+    testFree(aKey);
+    testDatasourceFree(pData);
+    testCaseFinish(*pRc);
+  }
+}
+
+/*
+** Apply the iOp'th operation of the iBatch'th batch used by test case
+** "api6" to database db. Or, if pBatch is not NULL, append it to pBatch.
+*/
+static void api6Op(
+  Datasource *pData,
+  int iBatch, int iOp,
+  lsm_db *db,
+  lsm_batch *pBatch,
+  int *pRc
+){
+  u32 iVal = testPrngValue(iBatch*1000 + iOp);
+  int iKey = iVal % 2000;
+  int eOp = (iVal / 2000) % 10;
+  u8 aKey[64]; int nKey;
+  void *pKey; void *pVal; int nVal;
+
+  testDatasourceEntry(pData, iKey, &pKey, &nKey, 0, 0);
+  memcpy(aKey, pKey, nKey);
+  if( eOp<6 ){
+    testDatasourceEntry(pData, iKey + iBatch, 0, 0, &pVal, &nVal);
+    if( pBatch ){
+      *pRc = lsm_batch_insert(pBatch, aKey, nKey, pVal, nVal);
+    }else{
+      *pRc = lsm_insert(db, aKey, nKey, pVal, nVal);
+    }
+  }else if( eOp<9 ){
+    if( pBatch ){
+      *pRc = lsm_batch_delete(pBatch, aKey, nKey);
+    }else{
+      *pRc = lsm_delete(db, aKey, nKey);
+    }
+  }else{
+    testDatasourceEntry(pData, iKey+20, &pKey, &nVal, 0, 0);
+    if( pBatch ){
+      *pRc = lsm_batch_delete_range(pBatch, aKey, nKey, pKey, nVal);
+    }else{
+      *pRc = lsm_delete_range(db, aKey, nKey, pKey, nVal);
+    }
+  }
+}
+
+/*
+** Check that databases db1 and db2 contain the same entries.
+*/
+static void api6Compare(lsm_db *db1, lsm_db *db2, int *pRc){
+  lsm_cursor *pCsr1 = 0;
+  lsm_cursor *pCsr2 = 0;
+  int nEntry = 0;
+
+  if( *pRc==0 ) *pRc = lsm_csr_open(db1, &pCsr1);
+  if( *pRc==0 ) *pRc = lsm_csr_open(db2, &pCsr2);
+  if( *pRc==0 ) *pRc = lsm_csr_first(pCsr1);
+  if( *pRc==0 ) *pRc = lsm_csr_first(pCsr2);
+  while( *pRc==0 && lsm_csr_valid(pCsr1) ){
+    const void *p1; int n1;
+    const void *p2; int n2;
+    testCompareInt(1, lsm_csr_valid(pCsr2), pRc);
+    if( *pRc==0 ){
+      lsm_csr_key(pCsr1, &p1, &n1);
+      lsm_csr_key(pCsr2, &p2, &n2);
+      testCompareInt(n2, n1, pRc);
+      testCompareInt(0, memcmp(p1, p2, n1), pRc);
+    }
+    if( *pRc==0 ){
+      lsm_csr_value(pCsr1, &p1, &n1);
+      lsm_csr_value(pCsr2, &p2, &n2);
+      testCompareInt(n2, n1, pRc);
+      testCompareInt(0, memcmp(p1, p2, n1), pRc);
+    }
+    if( *pRc==0 ) *pRc = lsm_csr_next(pCsr1);
+    if( *pRc==0 ) *pRc = lsm_csr_next(pCsr2);
+    nEntry++;
+  }
+  if( *pRc==0 ) testCompareInt(0, lsm_csr_valid(pCsr2), pRc);
+  if( *pRc==0 ) testCompareInt(1, nEntry>100, pRc);
+  lsm_csr_close(pCsr1);
+  lsm_csr_close(pCsr2);
+}
+
+/*
+** Test case "api6" tests lsm_write_batch(). A series of batches, each
+** containing inserts, deletes and delete-ranges that may affect the same
+** key more than once, is written to one database and the same operations
+** written one at a time to a second. The two databases are compared, 
+** before and after the first is recovered from its log file.
+*/
+static void do_test_api6(const char *zPattern, int *pRc){
+  if( *pRc==0 && testCaseBegin(pRc, zPattern, "api6.lsm") ){
+    const DatasourceDefn defn = { TEST_DATASOURCE_SEQUENCE, 0, 0, 20, 100 };
+    const int nBatch = 100;
+    const int nOp = 50;
+    Datasource *pData;
+    lsm_db *db1 = 0;
+    lsm_db *db2 = 0;
+    lsm_db *db3 = 0;
+    lsm_batch *pBatch = 0;
+    int iBatch;
+    int i;
+
+    testDeleteLsmdb("testdb.lsm");
+    testDeleteLsmdb("testdb2.lsm");
+    pData = testDatasourceNew(&defn);
+    db1 = newLsmConnection("testdb.lsm", 0, 0, pRc);
+    db2 = newLsmConnection("testdb2.lsm", 0, 0, pRc);
+    if( *pRc==0 ) *pRc = lsm_batch_new(db1, &pBatch);
+
+    for(iBatch=0; *pRc==0 && iBatch<nBatch; iBatch++){
+      int bRollback = ((iBatch % 10)==5);
+
+      lsm_batch_reset(pBatch);
+      for(i=0; *pRc==0 && i<nOp; i++){
+        api6Op(pData, iBatch, i, db1, pBatch, pRc);
+      }
+
+      /* Write the batch. Every third batch is written as part of an 
+      ** explicit transaction, and some of those transactions are rolled 
+      ** back.  */
+      if( (iBatch % 3)==0 || bRollback ){
+        if( *pRc==0 ) *pRc = lsm_begin(db1, 1);
+        if( *pRc==0 ) *pRc = lsm_write_batch(db1, pBatch);
+        if( *pRc==0 ){
+          *pRc = (bRollback ? lsm_rollback(db1, 0) : lsm_commit(db1, 0));
+        }
+      }else{
+        if( *pRc==0 ) *pRc = lsm_write_batch(db1, pBatch);
+      }
+
+      if( bRollback==0 ){
+        for(i=0; *pRc==0 && i<nOp; i++){
+          api6Op(pData, iBatch, i, db2, 0, pRc);
+        }
+      }
+    }
+    api6Compare(db1, db2, pRc);
+
+    /* Copy the database, log and shm files while db1 is still open. Then
+    ** open the copy, which requires recovering the log file.  */
+    if( *pRc==0 ){
+      testCopyLsmdb("testdb.lsm", "testdb3.lsm");
+      db3 = newLsmConnection("testdb3.lsm", 0, 0, pRc);
+      api6Compare(db3, db2, pRc);
+    }
+
+    lsm_batch_free(pBatch);
+    lsm_close(db1);
+    lsm_close(db2);
+    lsm_close(db3);
+    testDatasourceFree(pData);
+    testCaseFinish(*pRc);
+  }
+}
+
+/*
+** Test case "api7" checks that log records larger than the buffer used
+** to read the log file during recovery are recovered correctly. Values
+** of up to 200KB are written to a database, using both lsm_insert() and
+** lsm_write_batch(), with autoflush set high enough that all of them are
+** still in the log. The database is then copied and recovered.
+*/
+static void do_test_api7(const char *zPattern, int *pRc){
+  if( *pRc==0 && testCaseBegin(pRc, zPattern, "api7.lsm") ){
+    const DatasourceDefn defn = { TEST_DATASOURCE_SEQUENCE, 0, 0, 10, 10 };
+    const int nMaxVal = 200*1024;
+    const int nEntry = 120;
+    int nAutoflush = 64*1024;
+    Datasource *pData;
+    lsm_db *db1 = 0;
+    lsm_db *db3 = 0;
+    lsm_batch *pBatch = 0;
+    u8 *aVal;
+    int i;
+
+    testDeleteLsmdb("testdb.lsm");
+    testDeleteLsmdb("testdb3.lsm");
+    pData = testDatasourceNew(&defn);
+    aVal = (u8 *)testMalloc(nMaxVal);
+    db1 = newLsmConnection("testdb.lsm", 0, 0, pRc);
+    if( *pRc==0 ) lsm_config(db1, LSM_CONFIG_AUTOFLUSH, &nAutoflush);
+    if( *pRc==0 ) *pRc = lsm_batch_new(db1, &pBatch);
+
+    for(i=0; *pRc==0 && i<nEntry; i++){
+      void *pKey; int nKey;
+      u32 iVal = testPrngValue(i);
+      int nVal = 100 + (int)(iVal % (nMaxVal - 100));
+      int j;
+
+      for(j=0; j<nVal; j++) aVal[j] = (u8)(iVal + j);
+      testDatasourceEntry(pData, i, &pKey, &nKey, 0, 0);
+      if( i%2 ){
+        lsm_batch_reset(pBatch);
+        *pRc = lsm_batch_insert(pBatch, pKey, nKey, aVal, nVal);
+        if( *pRc==0 ) *pRc = lsm_write_batch(db1, pBatch);
+      }else{
+        *pRc = lsm_insert(db1, pKey, nKey, aVal, nVal);
+      }
+    }
+
+    /* Copy the database, log and shm files while db1 is still open. Then
+    ** open the copy, which requires recovering the log file.  */
+    if( *pRc==0 ){
+      testCopyLsmdb("testdb.lsm", "testdb3.lsm");
+      db3 = newLsmConnection("testdb3.lsm", 0, 0, pRc);
+      api6Compare(db3, db1, pRc);
+    }
+
+    lsm_batch_free(pBatch);
+    lsm_close(db1);
+    lsm_close(db3);
+    testFree(aVal);
+    testDatasourceFree(pData);
+    testCaseFinish(*pRc);
+  }
+}
+
+/*
+** Open a connection to database zDb for test case "api8". A small maximum
+** in-memory free block list size is configured, so that most of the free
+** block list is stored in the database as FREELIST records.
+*/
+static lsm_db *api8Open(const char *zDb, int *pRc){
+  lsm_db *db = newLsmConnection(zDb, 1024, 64, pRc);
+  if( *pRc==0 ){
+    int nMaxFreelist = 4;
+    int nAutowork = 0;
+    lsm_config(db, LSM_CONFIG_MAX_FREELIST, &nMaxFreelist);
+    lsm_config(db, LSM_CONFIG_AUTOWORK, &nAutowork);
+  }
+  return db;
+}
+
+/*
+** OOM hook used by test case "api8". Set the integer that the context
+** pointer points to.
+*/
+static void api8OomHook(void *pCtx){
+  *(int *)pCtx = 1;
+}
+
+/*
+** Test case "api8" checks that the cached copy of the free block list 
+** used for block allocation stays consistent with the free block list 
+** stored in the database. Each round runs several worker sessions in a 
+** row, many of which fail with an OOM error part way through, so that 
+** their modifications to the free block list are discarded. The free 
+** block list read via the cache is then compared with that loaded by a 
+** new connection, which reads it from the database.
+*/
+static void do_test_api8(const char *zPattern, int *pRc){
+  if( *pRc==0 && testCaseBegin(pRc, zPattern, "api8.lsm") ){
+    const DatasourceDefn defn = { TEST_DATASOURCE_RANDOM, 10, 15, 200, 300 };
+    const int nRound = 12;
+    const int nInsert = 1000;
+    lsm_env *pEnv = tdb_lsm_env();
+    Datasource *pData;
+    lsm_db *db = 0;
+    int nOomTotal = 0;            /* Number of lsm_work() calls that failed */
+    int nNonEmpty = 0;            /* Rounds with a non-empty free block list */
+    int iRound;
+
+    testDeleteLsmdb("testdb.lsm");
+    pData = testDatasourceNew(&defn);
+    db = api8Open("testdb.lsm", pRc);
+
+    for(iRound=0; *pRc==0 && iRound<nRound; iRound++){
+      char *z1 = 0;
+      char *z2 = 0;
+      int nFail;
+      int rc = LSM_OK;
+      int i;
+
+      /* Overwrite a subset of the keys, so that merges free blocks. */
+      for(i=0; *pRc==0 && i<nInsert; i++){
+        void *pKey; int nKey;
+        void *pVal; int nVal;
+        int iKey = (int)(testPrngValue(iRound*nInsert + i) % (nInsert*4));
+        testDatasourceEntry(pData, iKey, &pKey, &nKey, &pVal, &nVal);
+        *pRc = lsm_insert(db, pKey, nKey, pVal, nVal);
+      }
+      if( *pRc==0 ) *pRc = lsm_flush(db);
+
+      /* Worker sessions that fail part way through and are not saved. All
+      ** allocations after the first nFail fail, and nFail grows with each 
+      ** attempt until an attempt runs to completion without an OOM error. 
+      ** Some OOM errors are handled internally, in which case lsm_work() 
+      ** returns LSM_OK and the session is saved.  */
+      for(nFail=1; *pRc==0; nFail += 1 + nFail/8){
+        int bOom = 0;
+        testMallocOom(pEnv, nFail, 1, api8OomHook, (void *)&bOom);
+        rc = lsm_work(db, 2, 256, 0);
+        testMallocOom(pEnv, 0, 0, 0, 0);
+        if( rc==LSM_NOMEM ){
+          nOomTotal++;
+        }else{
+          testCompareInt(LSM_OK, rc, pRc);
+          if( bOom==0 ) break;
+        }
+      }
+
+      /* Followed by worker sessions that are saved. */
+      for(i=0; *pRc==0 && i<3; i++){
+        *pRc = lsm_work(db, 2, 256, 0);
+      }
+
+      /* Compare the free block list read via the cache with that read
+      ** by a new connection.  */
+      if( *pRc==0 ) *pRc = lsm_info(db, LSM_INFO_FREELIST, &z1);
+      lsm_close(db);
+      db = api8Open("testdb.lsm", pRc);
+      if( *pRc==0 ) *pRc = lsm_info(db, LSM_INFO_FREELIST, &z2);
+      if( *pRc==0 ){
+        testCompareStr((z2 ? z2 : ""), (z1 ? z1 : ""), pRc);
+        if( z1 ) nNonEmpty++;
+      }
+      lsm_free(pEnv, z1);
+      lsm_free(pEnv, z2);
+    }
+    testCompareInt(1, nOomTotal>0, pRc);
+    testCompareInt(1, nNonEmpty>nRound/2, pRc);
+
+    lsm_close(db);
+    testDatasourceFree(pData);
+    testCaseFinish(*pRc);
+  }
+}
+
+/*
+** Number of times api9ReadAhead() has been called, and the real 
+** environment it forwards calls to.
+*/
+static int nApi9ReadAhead = 0;
+static lsm_env *pApi9Env = 0;
+
+/*
+** xReadAhead() method of the environment used by test case "api9".
+*/
+static int api9ReadAhead(lsm_file *pFile, lsm_i64 iOff, lsm_i64 nByte){
+  nApi9ReadAhead++;
+  return pApi9Env->xReadAhead(pFile, iOff, nByte);
+}
+
+/*
+** Open database zDb using environment pEnv with 1KB pages, 64KB blocks,
+** mmap() disabled and the read-ahead window set to nReadAhead KB. Then 
+** scan it from start to finish and check that it contains nExpect keys.
+*/
+static void api9Scan(
+  lsm_env *pEnv, 
+  const char *zDb, 
+  int nReadAhead, 
+  int nExpect, 
+  int *pRc
+){
+  lsm_db *db = 0;
+  lsm_cursor *pCsr = 0;
+
+  if( *pRc==0 ){
+    int nPgsz = 1024;
+    int nBlksz = 64;
+    int bMmap = 0;
+    *pRc = lsm_new(pEnv, &db);
+    if( *pRc==0 ){
+      lsm_config(db, LSM_CONFIG_PAGE_SIZE, &nPgsz);
+      lsm_config(db, LSM_CONFIG_BLOCK_SIZE, &nBlksz);
+      lsm_config(db, LSM_CONFIG_MMAP, &bMmap);
+      lsm_config(db, LSM_CONFIG_READAHEAD, &nReadAhead);
+      *pRc = lsm_open(db, zDb);
+    }
+  }
+  if( *pRc==0 ) *pRc = lsm_csr_open(db, &pCsr);
+  if( *pRc==0 ){
+    int nKey = 0;
+    for(*pRc=lsm_csr_first(pCsr); *pRc==0 && lsm_csr_valid(pCsr); ){
+      nKey++;
+      *pRc = lsm_csr_next(pCsr);
+    }
+    testCompareInt(nExpect, nKey, pRc);
+  }
+  lsm_csr_close(pCsr);
+  lsm_close(db);
+}
+
+/*
+** Test case "api9" checks that sequential scans of a database that is 
+** not memory-mapped pass read-ahead hints to the environment's 
+** xReadAhead() method, and that they do not if LSM_CONFIG_READAHEAD is 
+** set to 0. It also scans the database using an environment that does
+** not provide xReadAhead(), in which case the pages are loaded into the
+** page cache instead.
+*/
+static void do_test_api9(const char *zPattern, int *pRc){
+  if( *pRc==0 && testCaseBegin(pRc, zPattern, "api9.lsm") ){
+    const DatasourceDefn defn = { TEST_DATASOURCE_SEQUENCE, 0, 0, 100, 100 };
+    const int nEntry = 5000;
+    Datasource *pData;
+    lsm_env env;
+    lsm_db *db = 0;
+    int i;
+
+    testDeleteLsmdb("testdb.lsm");
+    pData = testDatasourceNew(&defn);
+    db = newLsmConnection("testdb.lsm", 1024, 64, pRc);
+    for(i=0; *pRc==0 && i<nEntry; i++){
+      void *pKey; int nKey;
+      void *pVal; int nVal;
+      testDatasourceEntry(pData, i, &pKey, &nKey, &pVal, &nVal);
+      *pRc = lsm_insert(db, pKey, nKey, pVal, nVal);
+    }
+    if( *pRc==0 ) *pRc = lsm_flush(db);
+    lsm_close(db);
+
+    pApi9Env = tdb_lsm_env();
+    memcpy(&env, pApi9Env, sizeof(lsm_env));
+    if( env.iVersion>=4 && env.xReadAhead ){
+      env.xReadAhead = api9ReadAhead;
+
+      nApi9ReadAhead = 0;
+      api9Scan(&env, "testdb.lsm", 64, nEntry, pRc);
+      testCompareInt(1, nApi9ReadAhead>0, pRc);
+
+      nApi9ReadAhead = 0;
+      api9Scan(&env, "testdb.lsm", 0, nEntry, pRc);
+      testCompareInt(0, nApi9ReadAhead, pRc);
+    }
+
+    env.xReadAhead = 0;
+    api9Scan(&env, "testdb.lsm", 64, nEntry, pRc);
+
+    testDatasourceFree(pData);
+    testCaseFinish(*pRc);
+  }
+}
+
+/*
+** Open database zDb using environment pEnv. Autoflush is set high enough,
+** and auto-checkpoints are disabled, so that everything written by test
+** cases "api10" and "api11" remains in the log file.
+*/
+static lsm_db *api10Open(lsm_env *pEnv, const char *zDb, int *pRc){
+  lsm_db *db = 0;
+  if( *pRc==0 ){
+    int nAutoflush = 64*1024;
+    int nAutockpt = 0;
+    *pRc = lsm_new(pEnv, &db);
+    if( *pRc==0 ){
+      lsm_config(db, LSM_CONFIG_AUTOFLUSH, &nAutoflush);
+      lsm_config(db, LSM_CONFIG_AUTOCHECKPOINT, &nAutockpt);
+      *pRc = lsm_open(db, zDb);
+    }
+  }
+  return db;
+}
+
+/*
+** Write nOp inserts and deletes to database db, starting with operation
+** iOp. Keys are drawn from a set of 8000, so that many are written more
+** than once. Values are between 1000 and 3000 bytes in size.
+*/
+static void api10Write(
+  Datasource *pData, 
+  lsm_db *db, 
+  int iOp, 
+  int nOp, 
+  int *pRc
+){
+  u8 aVal[3000];
+  int i;
+  for(i=iOp; *pRc==0 && i<iOp+nOp; i++){
+    void *pKey; int nKey;
+    u32 iVal = testPrngValue(i);
+    testDatasourceEntry(pData, iVal % 8000, &pKey, &nKey, 0, 0);
+    if( (i%10)==9 ){
+      *pRc = lsm_delete(db, pKey, nKey);
+    }else{
+      int nVal = 1000 + (int)(iVal % 2000);
+      memset(aVal, (int)(i & 0xFF), nVal);
+      *pRc = lsm_insert(db, pKey, nKey, aVal, nVal);
+    }
+  }
+}
+
+/*
+** Test case "api10" recovers a database from a log file of roughly 24MB 
+** that has never been checkpointed - large enough that the records are 
+** applied to the in-memory tree in more than one batch. The log is 
+** recovered twice: once using the test environment, which verifies the
+** log in a helper thread if the library is built with pthreads support 
+** (LSM_MUTEX_PTHREADS), and once using a copy of it without xThreadNew(), 
+** which verifies and applies the log in the same thread.
+*/
+static void do_test_api10(const char *zPattern, int *pRc){
+  if( *pRc==0 && testCaseBegin(pRc, zPattern, "api10.lsm") ){
+    const DatasourceDefn defn = { TEST_DATASOURCE_SEQUENCE, 0, 0, 10, 10 };
+    lsm_env *pEnv = tdb_lsm_env();
+    Datasource *pData;
+    lsm_env env;
+    lsm_db *db1 = 0;
+    lsm_db *db3 = 0;
+
+#ifdef LSM_MUTEX_PTHREADS
+    testCompareInt(1, pEnv->xThreadNew!=0, pRc);
+#endif
+    memcpy(&env, pEnv, sizeof(lsm_env));
+    env.xThreadNew = 0;
+
+    testDeleteLsmdb("testdb.lsm");
+    testDeleteLsmdb("testdb3.lsm");
+    pData = testDatasourceNew(&defn);
+    db1 = api10Open(pEnv, "testdb.lsm", pRc);
+    api10Write(pData, db1, 0, 12000, pRc);
+
+    /* Copy the database, log and shm files while db1 is still open. Then
+    ** open the copy, which requires recovering the log file.  */
+    if( *pRc==0 ){
+      testCopyLsmdb("testdb.lsm", "testdb3.lsm");
+      db3 = api10Open(pEnv, "testdb3.lsm", pRc);
+      api6Compare(db3, db1, pRc);
+      lsm_close(db3);
+      db3 = 0;
+    }
+    if( *pRc==0 ){
+      testCopyLsmdb("testdb.lsm", "testdb3.lsm");
+      db3 = api10Open(&env, "testdb3.lsm", pRc);
+      api6Compare(db3, db1, pRc);
+    }
+
+    lsm_close(db1);
+    lsm_close(db3);
+    testDatasourceFree(pData);
+    testCaseFinish(*pRc);
+  }
+}
+
+/*
+** Test case "api11" opens a database with a checkpoint that refers to 
+** data in the log file after the log file has been removed. Recovery is
+** skipped, leaving the database as of the checkpoint. The new connection
+** then writes to a new log file, which is recovered in turn.
+*/
+static void do_test_api11(const char *zPattern, int *pRc){
+  if( *pRc==0 && testCaseBegin(pRc, zPattern, "api11.lsm") ){
+    const DatasourceDefn defn = { TEST_DATASOURCE_SEQUENCE, 0, 0, 10, 10 };
+    lsm_env *pEnv = tdb_lsm_env();
+    Datasource *pData;
+    lsm_db *db1 = 0;
+    lsm_db *db3 = 0;
+
+    testDeleteLsmdb("testdb.lsm");
+    testDeleteLsmdb("testdb3.lsm");
+    pData = testDatasourceNew(&defn);
+    db1 = api10Open(pEnv, "testdb.lsm", pRc);
+    api10Write(pData, db1, 0, 1000, pRc);
+    if( *pRc==0 ) *pRc = lsm_flush(db1);
+    if( *pRc==0 ) *pRc = lsm_checkpoint(db1, 0);
+
+    /* Copy the database while db1 is open and remove the log file from 
+    ** the copy. Opening it must not recover anything.  */
+    if( *pRc==0 ){
+      testCopyLsmdb("testdb.lsm", "testdb3.lsm");
+      unlink("testdb3.lsm-log");
+      db3 = api10Open(pEnv, "testdb3.lsm", pRc);
+      api6Compare(db3, db1, pRc);
+    }
+
+    /* Write the same data to both databases. Then copy the second while
+    ** it is open and recover the copy from the new log file.  */
+    api10Write(pData, db1, 1000, 1000, pRc);
+    api10Write(pData, db3, 1000, 1000, pRc);
+    api6Compare(db3, db1, pRc);
+    lsm_close(db1);
+    db1 = 0;
+    if( *pRc==0 ){
+      testDeleteLsmdb("testdb.lsm");
+      testCopyLsmdb("testdb3.lsm", "testdb.lsm");
+      db1 = api10Open(pEnv, "testdb.lsm", pRc);
+      api6Compare(db1, db3, pRc);
+    }
+
+    lsm_close(db1);
+    lsm_close(db3);
+    testDatasourceFree(pData);
+    testCaseFinish(*pRc);
+  }
+}
+
+/*
+** Open database zDb for test case "api12". The database uses leveled
+** compaction with a 256KB level base. Each in-memory tree is flushed to
+** disk once it holds 64KB of data.
+*/
+static lsm_db *api12Open(const char *zDb, int *pRc){
+  lsm_db *db = 0;
+  if( *pRc==0 ){
+    int eCompaction = LSM_COMPACTION_LEVELED;
+    int nLevelBase = 256;
+    int nAutoflush = 64;
+    *pRc = lsm_new(tdb_lsm_env(), &db);
+    if( *pRc==0 ){
+      lsm_config(db, LSM_CONFIG_COMPACTION, &eCompaction);
+      lsm_config(db, LSM_CONFIG_LEVEL_BASE, &nLevelBase);
+      lsm_config(db, LSM_CONFIG_AUTOFLUSH, &nAutoflush);
+      *pRc = lsm_open(db, zDb);
+    }
+  }
+  return db;
+}
+
+/*
+** Populate buffers aKey[] and aVal[] with the key and value of entry iKey
+** of test case "api12". Keys are 8 bytes and values API12_NVAL bytes in 
+** size.
+*/
+#define API12_NVAL 100
+static void api12Entry(int iKey, char *aKey, char *aVal){
+  sprintf(aKey, "%.8d", iKey);
+  memset(aVal, 'a' + (iKey % 26), API12_NVAL);
+  memcpy(aVal, aKey, 8);
+}
+
+/*
+** Insert entries 0 to nKey-1 into database db. If bSeq is true, they are
+** inserted in increasing key order. Otherwise, in a scrambled order.
+** Return the number of pages written to the database file.
+*/
+static int api12Write(lsm_db *db, int nKey, int bSeq, int *pRc){
+  int nWrite = 0;
+  int i;
+  for(i=0; *pRc==0 && i<nKey; i++){
+    char aKey[16];
+    char aVal[API12_NVAL];
+    int iKey = (bSeq ? i : (int)(((i64)i * 7919) % nKey));
+    api12Entry(iKey, aKey, aVal);
+    *pRc = lsm_insert(db, aKey, 8, aVal, API12_NVAL);
+  }
+  if( *pRc==0 ) *pRc = lsm_info(db, LSM_INFO_NWRITE, &nWrite);
+  return nWrite;
+}
+
+/*
+** Check that database db contains entries 0 to nKey-1 of test case 
+** "api12", and no others.
+*/
+static void api12Check(lsm_db *db, int nKey, int *pRc){
+  lsm_cursor *pCsr = 0;
+  int i = 0;
+  if( *pRc==0 ) *pRc = lsm_csr_open(db, &pCsr);
+  if( *pRc==0 ) *pRc = lsm_csr_first(pCsr);
+  while( *pRc==0 && lsm_csr_valid(pCsr) ){
+    char aKey[16];
+    char aVal[API12_NVAL];
+    const void *pKey; int nKey2;
+    const void *pVal; int nVal;
+    api12Entry(i, aKey, aVal);
+    lsm_csr_key(pCsr, &pKey, &nKey2);
+    lsm_csr_value(pCsr, &pVal, &nVal);
+    if( nKey2!=8 || memcmp(pKey, aKey, 8)
+     || nVal!=API12_NVAL || memcmp(pVal, aVal, API12_NVAL)
+    ){
+      testPrintError("api12: bad entry at %d\n", i);
+      *pRc = 1;
+    }
+    i++;
+    if( *pRc==0 ) *pRc = lsm_csr_next(pCsr);
+  }
+  lsm_csr_close(pCsr);
+  testCompareInt(nKey, i, pRc);
+}
+
+/*
+** Test case "api12" inserts keys in increasing order into a database that 
+** uses leveled compaction. Since each flushed segment does not overlap 
+** the older segments, it can be moved into the next level instead of 
+** being merged with it. Check that fewer pages are written than when the
+** same keys are inserted in a scrambled order, and that no more than five
+** times the size of the data is written (without moves, sequential keys 
+** are rewritten about as often as scrambled keys). Then check the 
+** database contents.
+*/
+static void do_test_api12(const char *zPattern, int *pRc){
+  if( *pRc==0 && testCaseBegin(pRc, zPattern, "api12.lsm") ){
+    const int nKey = 60000;
+    int nData = nKey * (8 + API12_NVAL) / 4096;
+    int nSeq = 0;
+    int nRand = 0;
+    lsm_db *db = 0;
+
+    testDeleteLsmdb("testdb.lsm");
+    db = api12Open("testdb.lsm", pRc);
+    nSeq = api12Write(db, nKey, 1, pRc);
+    api12Check(db, nKey, pRc);
+    lsm_close(db);
+
+    testDeleteLsmdb("testdb.lsm");
+    db = api12Open("testdb.lsm", pRc);
+    nRand = api12Write(db, nKey, 0, pRc);
+    api12Check(db, nKey, pRc);
+    lsm_close(db);
+
+    testCompareInt(1, nSeq*3 < nRand*2, pRc);
+    testCompareInt(1, nSeq < nData*5, pRc);
+    testCaseFinish(*pRc);
+  }
+}
+
+/*
+** Open a connection for test case "api13". Auto-work and auto-checkpoints
+** are disabled, so that all work is done by explicit lsm_work(), 
+** lsm_flush() and lsm_checkpoint() calls. The in-memory tree is 64KB.
+*/
+static lsm_db *api13Open(const char *zDb, int *pRc){
+  lsm_db *db = 0;
+  if( *pRc==0 ){
+    int nAutowork = 0;
+    int nAutockpt = 0;
+    int nAutoflush = 64;
+    *pRc = lsm_new(tdb_lsm_env(), &db);
+    if( *pRc==0 ){
+      lsm_config(db, LSM_CONFIG_AUTOWORK, &nAutowork);
+      lsm_config(db, LSM_CONFIG_AUTOCHECKPOINT, &nAutockpt);
+      lsm_config(db, LSM_CONFIG_AUTOFLUSH, &nAutoflush);
+      *pRc = lsm_open(db, zDb);
+    }
+  }
+  return db;
+}
+
+/*
+** Insert entries iFirst to iFirst+nKey-1 of test case "api12" into db.
+*/
+static void api13Write(lsm_db *db, int iFirst, int nKey, int *pRc){
+  int i;
+  for(i=iFirst; *pRc==0 && i<iFirst+nKey; i++){
+    char aKey[16];
+    char aVal[API12_NVAL];
+    api12Entry(i, aKey, aVal);
+    *pRc = lsm_insert(db, aKey, 8, aVal, API12_NVAL);
+  }
+}
+
+/*
+** Return the number of pages written to the database file by db so far.
+*/
+static int api13NWrite(lsm_db *db, int *pRc){
+  int nWrite = 0;
+  if( *pRc==0 ) *pRc = lsm_info(db, LSM_INFO_NWRITE, &nWrite);
+  return nWrite;
+}
+
+/*
+** Check that at least nKB KB written at nRate KB per second took at least
+** ms milliseconds, allowing for the 100ms burst permitted by the library.
+*/
+static void api13CheckRate(int nKB, int nRate, int ms, int *pRc){
+  int msMin = (nKB * 1000 / nRate) - 100;
+  if( *pRc==0 && ms<msMin ){
+    testPrintError("api13: %dKB at %dKB/s took %dms\n", nKB, nRate, ms);
+    *pRc = 1;
+  }
+}
+
+/*
+** Test case "api13" tests the LSM_CONFIG_MERGE_RATE and 
+** LSM_CONFIG_CHECKPOINT_RATE limits:
+**
+**   1) A merge of four segments, and then the checkpoint that follows it,
+**      take no less time than writing the data at the configured rates.
+**
+**   2) Flushing an old tree while the current tree is also full (so that 
+**      writers would otherwise be blocked) is not slowed down, even with 
+**      a merge rate far too small to flush the tree in the time allowed.
+**      Once it has been flushed, the writer may continue.
+*/
+static void do_test_api13(const char *zPattern, int *pRc){
+  if( *pRc==0 && testCaseBegin(pRc, zPattern, "api13.lsm") ){
+    const int nRate = 256;
+    int nSlow = 4;
+    int nWrite = 0;
+    int nKB = 0;
+    int ms;
+    int i;
+    lsm_db *db = 0;
+
+    testDeleteLsmdb("testdb.lsm");
+    db = api13Open("testdb.lsm", pRc);
+    for(i=0; i<4; i++){
+      api13Write(db, i*500, 500, pRc);
+      if( *pRc==0 ) *pRc = lsm_flush(db);
+    }
+
+    /* Merge the four segments together at nRate KB per second. */
+    if( *pRc==0 ){
+      int n = nRate;
+      lsm_config(db, LSM_CONFIG_MERGE_RATE, &n);
+      nWrite = api13NWrite(db, pRc);
+      testTimeInit();
+      *pRc = lsm_work(db, 4, -1, 0);
+      ms = testTimeGet();
+      nWrite = api13NWrite(db, pRc) - nWrite;
+      testCompareInt(1, nWrite>=40, pRc);
+      api13CheckRate(nWrite*4, nRate, ms, pRc);
+    }
+
+    /* Checkpoint the database at nRate KB per second. */
+    if( *pRc==0 ){
+      int n = nRate;
+      lsm_config(db, LSM_CONFIG_CHECKPOINT_RATE, &n);
+      testTimeInit();
+      *pRc = lsm_checkpoint(db, &nKB);
+      ms = testTimeGet();
+      testCompareInt(1, nKB>=300, pRc);
+      api13CheckRate(nKB, nRate, ms, pRc);
+    }
+    api12Check(db, 2000, pRc);
+    lsm_close(db);
+
+    /* Fill both the old and current in-memory trees. Then flush the old 
+    ** tree at a merge rate of nSlow KB per second. Even were the limit 
+    ** raised four-fold, this would take several seconds.  */
+    testDeleteLsmdb("testdb.lsm");
+    db = api13Open("testdb.lsm", pRc);
+    if( *pRc==0 ){
+      lsm_config(db, LSM_CONFIG_MERGE_RATE, &nSlow);
+    }
+    for(i=0; *pRc==0; i+=50){
+      int nOld = 0;
+      int nNew = 0;
+      api13Write(db, i, 50, pRc);
+      if( *pRc==0 ) *pRc = lsm_info(db, LSM_INFO_TREE_SIZE, &nOld, &nNew);
+      if( nOld>0 && nNew>=64 ) break;
+    }
+    if( *pRc==0 ){
+      nWrite = api13NWrite(db, pRc);
+      testTimeInit();
+      *pRc = lsm_work(db, 1, -1, 0);
+      ms = testTimeGet();
+      nWrite = api13NWrite(db, pRc) - nWrite;
+      testCompareInt(1, nWrite>=8, pRc);
+      testCompareInt(1, ms<1000, pRc);
+    }
+    api13Write(db, i+50, 500, pRc);
+    api12Check(db, i+550, pRc);
+    lsm_close(db);
+
+    testCaseFinish(*pRc);
+  }
+}
+
 void test_api(
   const char *zPattern,           /* Run test cases that match this pattern */
   int *pRc                        /* IN/OUT: Error code */
 ){
   do_test_api1(zPattern, pRc);
   do_test_api2(zPattern, pRc);
+  do_test_api3(zPattern, pRc);
+  do_test_api4(zPattern, pRc);
+  do_test_api5(zPattern, pRc);
+  do_test_api6(zPattern, pRc);
+  do_test_api7(zPattern, pRc);
+  do_test_api8(zPattern, pRc);
+  do_test_api9(zPattern, pRc);
+  do_test_api10(zPattern, pRc);
+  do_test_api11(zPattern, pRc);
+  do_test_api12(zPattern, pRc);
+  do_test_api13(zPattern, pRc);
 }
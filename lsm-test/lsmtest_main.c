@@ -487,6 +487,10 @@ int do_test(int nArg, char **azArg){
   do_writer_crash_test(zPattern, &rc);
   if( rc ) nFail++;
 
+  rc = 0;
+  do_cksum_test(zPattern, &rc);
+  if( rc ) nFail++;
+
   return (nFail!=0);
 }
 
@@ -692,6 +692,18 @@ static struct Lib {
   { "sqlite3",      "testdb.sqlite",    sql_open },
   { "lsm_small",    "testdb.lsm_small", test_lsm_small_open },
   { "lsm_lomem",    "testdb.lsm_lomem", test_lsm_lomem_open },
+  { "lsm_bloom",    "testdb.lsm_bloom", test_lsm_bloom_open },
+  { "lsm_4k",       "testdb.lsm_4k",    test_lsm_4k_open },
+  { "lsm_leveled",  "testdb.lsm_leveled", test_lsm_leveled_open },
+  { "lsm_hybrid",   "testdb.lsm_hybrid", test_lsm_hybrid_open },
+  { "lsm_queue",    "testdb.lsm_queue", test_lsm_queue_open },
+  { "lsm_2q",       "testdb.lsm_2q",    test_lsm_2q_open },
+  { "lsm_direct",   "testdb.lsm_direct", test_lsm_direct_open },
+  { "lsm_lz",       "testdb.lsm_lz",    test_lsm_lz_open },
+  { "lsm_lzlevel",  "testdb.lsm_lzlevel", test_lsm_lzlevel_open },
+  { "lsm_prefix",   "testdb.lsm_prefix", test_lsm_prefix_open },
+  { "lsm_vlog",     "testdb.lsm_vlog",  test_lsm_vlog_open },
+  { "lsm_prealloc", "testdb.lsm_prealloc", test_lsm_prealloc_open },
 #ifdef HAVE_ZLIB
   { "lsm_zip",      "testdb.lsm_zip",   test_lsm_zip_open },
 #endif
@@ -699,6 +711,7 @@ static struct Lib {
 #ifdef LSM_MUTEX_PTHREADS
   { "lsm_mt2",      "testdb.lsm_mt2",   test_lsm_mt2 },
   { "lsm_mt3",      "testdb.lsm_mt3",   test_lsm_mt3 },
+  { "lsm_bg",       "testdb.lsm_bg",    test_lsm_bg_open },
 #endif
 #ifdef HAVE_LEVELDB
   { "leveldb",      "testdb.leveldb",   test_leveldb_open },
@@ -187,13 +187,15 @@ static int testEnvRead(lsm_file *pFile, lsm_i64 iOff, void *pData, int nData){
   return pRealEnv->xRead(p->pReal, iOff, pData, nData);
 }
 
-static int testEnvWrite(lsm_file *pFile, lsm_i64 iOff, void *pData, int nData){
+/*
+** If the LsmDb is preparing for a simulated crash, save the current 
+** contents of each sector in the range of nByte bytes starting at offset
+** iOff of file p that has not already been saved since the last sync.
+*/
+static void testEnvSaveSectors(LsmFile *p, lsm_i64 iOff, lsm_i64 nByte){
   lsm_env *pRealEnv = tdb_lsm_env();
-  LsmFile *p = (LsmFile *)pFile;
   LsmDb *pDb = p->pDb;
 
-  if( pDb->bCrashed ) return LSM_IOERR;
-
   if( pDb->bPrepareCrash ){
     FileData *pData = &pDb->aFile[p->bLog];
     int iFirst;                 
@@ -201,7 +203,7 @@ static int testEnvWrite(lsm_file *pFile, lsm_i64 iOff, void *pData, int nData){
     int iSector;
 
     iFirst = (iOff / pDb->szSector);
-    iLast =  ((iOff + nData - 1) / pDb->szSector);
+    iLast =  ((iOff + nByte - 1) / pDb->szSector);
 
     if( pData->nSector<(iLast+1) ){
       int nNew = ( ((iLast + 1) + 63) / 64 ) * 64;
@@ -225,6 +227,15 @@ static int testEnvWrite(lsm_file *pFile, lsm_i64 iOff, void *pData, int nData){
       }
     }
   }
+}
+
+static int testEnvWrite(lsm_file *pFile, lsm_i64 iOff, void *pData, int nData){
+  lsm_env *pRealEnv = tdb_lsm_env();
+  LsmFile *p = (LsmFile *)pFile;
+  LsmDb *pDb = p->pDb;
+
+  if( pDb->bCrashed ) return LSM_IOERR;
+  testEnvSaveSectors(p, iOff, nData);
 
   if( pDb->xWriteHook ){
     int rc;
@@ -245,6 +256,80 @@ static int testEnvWrite(lsm_file *pFile, lsm_i64 iOff, void *pData, int nData){
   return pRealEnv->xWrite(p->pReal, iOff, pData, nData);
 }
 
+static int testEnvReadAhead(lsm_file *pFile, lsm_i64 iOff, lsm_i64 nByte){
+  lsm_env *pRealEnv = tdb_lsm_env();
+  LsmFile *p = (LsmFile *)pFile;
+  if( p->pDb->bCrashed ) return LSM_IOERR;
+  if( pRealEnv->iVersion<4 || pRealEnv->xReadAhead==0 ) return LSM_OK;
+  return pRealEnv->xReadAhead(p->pReal, iOff, nByte);
+}
+
+/*
+** Vectored read and write methods. If the real environment does not 
+** provide the corresponding method, the buffers are read or written one
+** at a time.
+*/
+static int testEnvReadv(
+  lsm_file *pFile, 
+  lsm_i64 iOff, 
+  lsm_iovec *aIov, 
+  int nIov
+){
+  lsm_env *pRealEnv = tdb_lsm_env();
+  LsmFile *p = (LsmFile *)pFile;
+  int rc = LSM_OK;
+  int i;
+
+  if( p->pDb->bCrashed ) return LSM_IOERR;
+  if( pRealEnv->iVersion>=5 && pRealEnv->xReadv ){
+    return pRealEnv->xReadv(p->pReal, iOff, aIov, nIov);
+  }
+  for(i=0; rc==LSM_OK && i<nIov; i++){
+    rc = pRealEnv->xRead(p->pReal, iOff, aIov[i].pData, aIov[i].nData);
+    iOff += aIov[i].nData;
+  }
+  return rc;
+}
+
+static int testEnvWritev(
+  lsm_file *pFile, 
+  lsm_i64 iOff, 
+  lsm_iovec *aIov, 
+  int nIov
+){
+  lsm_env *pRealEnv = tdb_lsm_env();
+  LsmFile *p = (LsmFile *)pFile;
+  LsmDb *pDb = p->pDb;
+  lsm_i64 nByte = 0;
+  int rc = LSM_OK;
+  int nUs = 0;
+  struct timeval t1;
+  struct timeval t2;
+  int i;
+
+  if( pDb->bCrashed ) return LSM_IOERR;
+  for(i=0; i<nIov; i++) nByte += aIov[i].nData;
+  testEnvSaveSectors(p, iOff, nByte);
+
+  gettimeofday(&t1, 0);
+  if( pRealEnv->iVersion>=5 && pRealEnv->xWritev ){
+    rc = pRealEnv->xWritev(p->pReal, iOff, aIov, nIov);
+  }else{
+    lsm_i64 iWrite = iOff;
+    for(i=0; rc==LSM_OK && i<nIov; i++){
+      rc = pRealEnv->xWrite(p->pReal, iWrite, aIov[i].pData, aIov[i].nData);
+      iWrite += aIov[i].nData;
+    }
+  }
+  gettimeofday(&t2, 0);
+
+  if( pDb->xWriteHook ){
+    nUs = (t2.tv_sec - t1.tv_sec) * 1000000 + (t2.tv_usec - t1.tv_usec);
+    pDb->xWriteHook(pDb->pWriteCtx, p->bLog, iOff, (int)nByte, nUs);
+  }
+  return rc;
+}
+
 static void doSystemCrash(LsmDb *pDb);
 
 static int testEnvSync(lsm_file *pFile){
@@ -297,6 +382,14 @@ static int testEnvTruncate(lsm_file *pFile, lsm_i64 iOff){
   return pRealEnv->xTruncate(p->pReal, iOff);
 }
 
+static int testEnvFallocate(lsm_file *pFile, lsm_i64 iOff, lsm_i64 nByte){
+  lsm_env *pRealEnv = tdb_lsm_env();
+  LsmFile *p = (LsmFile *)pFile;
+  if( p->pDb->bCrashed ) return LSM_IOERR;
+  if( pRealEnv->iVersion<6 || pRealEnv->xFallocate==0 ) return LSM_OK;
+  return pRealEnv->xFallocate(p->pReal, iOff, nByte);
+}
+
 static int testEnvSectorSize(lsm_file *pFile){
   lsm_env *pRealEnv = tdb_lsm_env();
   LsmFile *p = (LsmFile *)pFile;
@@ -463,7 +556,15 @@ static int testZipUncompress(
   return (rc==Z_OK ? 0 : LSM_ERROR);
 }
 
-static int testConfigureCompression(lsm_db *pDb){
+#endif /* ifdef HAVE_ZLIB */
+
+/*
+** Configure compression for database handle pDb. If iId is 
+** LSM_COMPRESSION_LZ, use the compression built into the library. 
+** Otherwise, use zlib if it is available.
+*/
+static int testConfigureCompression(lsm_db *pDb, int iId){
+#ifdef HAVE_ZLIB
   static lsm_compress zip = {
     0,                            /* Context pointer (unused) */
     1,                            /* Id value */
@@ -471,9 +572,51 @@ static int testConfigureCompression(lsm_db *pDb){
     testZipCompress,              /* xCompress method */
     testZipUncompress             /* xUncompress method */
   };
-  return lsm_config(pDb, LSM_CONFIG_SET_COMPRESSION, &zip);
+#endif
+  lsm_compress lz;
+
+  if( iId!=LSM_COMPRESSION_LZ ){
+#ifdef HAVE_ZLIB
+    return lsm_config(pDb, LSM_CONFIG_SET_COMPRESSION, &zip);
+#else
+    return LSM_OK;
+#endif
+  }
+  memset(&lz, 0, sizeof(lz));
+  lz.iId = LSM_COMPRESSION_LZ;
+  return lsm_config(pDb, LSM_CONFIG_SET_COMPRESSION, &lz);
+}
+
+/*
+** Factory xLevel method used by the "compression_level=N" option. The
+** context pointer points to the value N. Segments written to levels
+** younger than N are stored uncompressed. Those written to levels of age
+** N are compressed using the built-in compression. Older levels use the 
+** database compression methods.
+*/
+static unsigned int testCompressionLevel(void *pCtx, lsm_db *db, int iAge){
+  int nAge = *(int *)pCtx;
+  if( iAge<nAge ) return LSM_COMPRESSION_NONE;
+  if( iAge==nAge ) return LSM_COMPRESSION_LZ;
+  return LSM_COMPRESSION_EMPTY;
+}
+
+/*
+** Configure a compression factory for database handle pDb that selects
+** the compression used by each level as described above.
+*/
+static int testConfigureCompressionLevel(lsm_db *pDb, int nAge){
+  lsm_compress_factory factory;
+  int *pAge;
+
+  pAge = (int *)testMalloc(sizeof(int));
+  *pAge = nAge;
+  memset(&factory, 0, sizeof(factory));
+  factory.pCtx = (void *)pAge;
+  factory.xFree = testFree;
+  factory.xLevel = testCompressionLevel;
+  return lsm_config(pDb, LSM_CONFIG_SET_COMPRESSION_FACTORY, &factory);
 }
-#endif /* ifdef HAVE_ZLIB */
 
 /*
 ** End test compression hooks.
@@ -747,6 +890,7 @@ static void xWorkHook(lsm_db *db, void *pArg){
 #define TEST_MT_MODE     -2
 #define TEST_MT_MIN_CKPT -4
 #define TEST_MT_MAX_CKPT -5
+#define TEST_COMPRESSION_LEVEL -6
 
 int test_lsm_config_str(
   LsmDb *pLsm,
@@ -772,6 +916,22 @@ int test_lsm_config_str(
     { "max_freelist",     0, LSM_CONFIG_MAX_FREELIST },
     { "multi_proc",       0, LSM_CONFIG_MULTIPLE_PROCESSES },
     { "worker_automerge", 1, LSM_CONFIG_AUTOMERGE },
+    { "bloom",            0, LSM_CONFIG_BLOOM },
+    { "background_work",  0, LSM_CONFIG_BACKGROUND_WORK },
+    { "group_commit",     0, LSM_CONFIG_GROUP_COMMIT },
+    { "compaction",       0, LSM_CONFIG_COMPACTION },
+    { "level_base",       0, LSM_CONFIG_LEVEL_BASE },
+    { "level_ratio",      0, LSM_CONFIG_LEVEL_RATIO },
+    { "merge_rate",       0, LSM_CONFIG_MERGE_RATE },
+    { "checkpoint_rate",  0, LSM_CONFIG_CHECKPOINT_RATE },
+    { "max_old_trees",    0, LSM_CONFIG_MAX_OLD_TREES },
+    { "cache_size",       0, LSM_CONFIG_CACHE_SIZE },
+    { "cache_policy",     0, LSM_CONFIG_CACHE_POLICY },
+    { "readahead",        0, LSM_CONFIG_READAHEAD },
+    { "direct_io",        0, LSM_CONFIG_DIRECT_IO },
+    { "prefix_compression", 0, LSM_CONFIG_PREFIX_COMPRESSION },
+    { "value_threshold",    0, LSM_CONFIG_VALUE_THRESHOLD },
+    { "log_prealloc",       0, LSM_CONFIG_LOG_PREALLOC },
     { "test_no_recovery", 0, TEST_NO_RECOVERY },
     { "bg_min_ckpt",      0, TEST_NO_RECOVERY },
 
@@ -779,9 +939,8 @@ int test_lsm_config_str(
     { "mt_min_ckpt",      0, TEST_MT_MIN_CKPT },
     { "mt_max_ckpt",      0, TEST_MT_MAX_CKPT },
 
-#ifdef HAVE_ZLIB
     { "compression",      0, TEST_COMPRESSION },
-#endif
+    { "compression_level",0, TEST_COMPRESSION_LEVEL },
     { 0, 0 }
   };
   const char *z = zStr;
@@ -846,11 +1005,12 @@ int test_lsm_config_str(
           case TEST_MT_MAX_CKPT:
             if( pLsm && iVal>0 ) pLsm->nMtMaxCkpt = iVal*1024;
             break;
-#ifdef HAVE_ZLIB
           case TEST_COMPRESSION:
-            testConfigureCompression(db);
+            testConfigureCompression(db, iVal);
+            break;
+          case TEST_COMPRESSION_LEVEL:
+            testConfigureCompressionLevel(db, iVal);
             break;
-#endif
         }
       }
     }else if( z!=zStart ){
@@ -942,6 +1102,7 @@ static int testLsmOpen(
   pDb->env.xRead = testEnvRead;
   pDb->env.xWrite = testEnvWrite;
   pDb->env.xTruncate = testEnvTruncate;
+  pDb->env.xFallocate = testEnvFallocate;
   pDb->env.xSync = testEnvSync;
   pDb->env.xSectorSize = testEnvSectorSize;
   pDb->env.xRemap = testEnvRemap;
@@ -955,6 +1116,10 @@ static int testLsmOpen(
   pDb->env.xShmUnmap = testEnvShmUnmap;
   pDb->env.xSleep = testEnvSleep;
 
+  pDb->env.xReadAhead = testEnvReadAhead;
+  pDb->env.xReadv = testEnvReadv;
+  pDb->env.xWritev = testEnvWritev;
+
   rc = lsm_new(&pDb->env, &pDb->db);
   if( rc==LSM_OK ){
     int nThread = 1;
@@ -1002,8 +1167,172 @@ int test_lsm_lomem_open(
     /* "max_freelist=4 autocheckpoint=32" */
   const char *zCfg = 
     "page_size=256 block_size=64 autoflush=16 "
-    "autocheckpoint=32"
-    "mmap=0 "
+    "autocheckpoint=32 "
+    "mmap=0 cache_size=64 "
+  ;
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
+int test_lsm_bloom_open(
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = 
+    "page_size=256 block_size=64 autoflush=16 bloom=10 "
+  ;
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
+/*
+** Default (4KB) pages in 64KB blocks, so that each block holds only a
+** few pages and incremental merges are often left partially complete.
+*/
+int test_lsm_4k_open(
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = "block_size=64 autoflush=16 mmap=0 ";
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
+int test_lsm_leveled_open(
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = 
+    "page_size=256 block_size=64 autoflush=16 "
+    "compaction=1 level_base=32 level_ratio=4 "
+  ;
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
+int test_lsm_hybrid_open(
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = 
+    "page_size=256 block_size=64 autoflush=16 compaction=2 "
+  ;
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
+/*
+** With auto-work disabled, nothing is flushed until the database is 
+** closed. So the queue of old trees fills up and reads are served from
+** several in-memory trees at once.
+*/
+int test_lsm_queue_open(
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = 
+    "page_size=256 block_size=64 autoflush=16 autowork=0 max_old_trees=4 "
+  ;
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
+int test_lsm_2q_open(
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = 
+    "page_size=256 block_size=64 autoflush=16 "
+    "mmap=0 cache_size=32 cache_policy=1 "
+  ;
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
+/*
+** Database and log file both opened for direct IO. The database pages are
+** aligned, but log writes are not.
+*/
+int test_lsm_direct_open(
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = 
+    "block_size=64 autoflush=16 "
+    "mmap=0 cache_size=64 direct_io=2 "
+  ;
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
+int test_lsm_lz_open(
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = 
+    "page_size=1024 block_size=64 autoflush=16 "
+    "autocheckpoint=32 compression=2 mmap=0 "
+  ;
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
+/*
+** Built-in compression for older levels only. Segments written to the
+** two youngest levels are stored uncompressed.
+*/
+int test_lsm_lzlevel_open(
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = 
+    "page_size=1024 block_size=64 autoflush=16 "
+    "autocheckpoint=32 compression=2 compression_level=2 mmap=0 "
+  ;
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
+/*
+** Prefix compressed keys, with a restart point every 4 keys. Small pages
+** so that many keys and values overflow onto subsequent pages.
+*/
+int test_lsm_prefix_open(
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = 
+    "page_size=256 block_size=64 autoflush=16 prefix_compression=4 "
+  ;
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
+/*
+** Values larger than 32 bytes stored in value segments. Small pages and
+** blocks so that values span pages and value segments span blocks.
+*/
+int test_lsm_vlog_open(
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = 
+    "page_size=256 block_size=64 autoflush=16 value_threshold=32 "
+  ;
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
+/*
+** Log file preallocated 64KB at a time. Small blocks and frequent 
+** checkpoints so that space in the preallocated log is reused.
+*/
+int test_lsm_prealloc_open(
+  const char *zFilename, 
+  int bClear, 
+  TestDb **ppDb
+){
+  const char *zCfg = 
+    "block_size=64 autoflush=16 autocheckpoint=32 log_prealloc=64 "
   ;
   return testLsmOpen(zCfg, zFilename, bClear, ppDb);
 }
@@ -1332,6 +1661,11 @@ int test_lsm_mt3(const char *zFilename, int bClear, TestDb **ppDb){
   return testLsmOpen(zCfg, zFilename, bClear, ppDb);
 }
 
+int test_lsm_bg_open(const char *zFilename, int bClear, TestDb **ppDb){
+  const char *zCfg = "autoflush=128 background_work=1";
+  return testLsmOpen(zCfg, zFilename, bClear, ppDb);
+}
+
 #else
 static void mt_shutdown(LsmDb *pDb) { 
   unused_parameter(pDb); 
@@ -74,8 +74,8 @@ LIBOBJ+= vdbe.o parse.o \
          fault.o fkey.o fts5.o fts5func.o \
          func.o global.o hash.o \
          icu.o insert.o kv.o kvlsm.o kvmem.o legacy.o \
-         lsm_ckpt.o lsm_file.o lsm_log.o lsm_main.o lsm_mem.o lsm_mutex.o \
-         lsm_shared.o lsm_str.o lsm_sorted.o lsm_tree.o \
+         lsm_cksum.o lsm_ckpt.o lsm_file.o lsm_log.o lsm_lz.o lsm_main.o \
+         lsm_mem.o lsm_mutex.o lsm_shared.o lsm_str.o lsm_sorted.o lsm_tree.o \
          lsm_unix.o lsm_varint.o \
          main.o malloc.o math.o mem.o mem0.o mem1.o mem2.o mem3.o mem5.o \
          mutex.o mutex_noop.o mutex_unix.o mutex_w32.o \
@@ -120,9 +120,11 @@ SRC = \
   $(TOP)/src/legacy.c \
   $(TOP)/src/lsm.h \
   $(TOP)/src/lsmInt.h \
+  $(TOP)/src/lsm_cksum.c \
   $(TOP)/src/lsm_ckpt.c \
   $(TOP)/src/lsm_file.c \
   $(TOP)/src/lsm_log.c \
+  $(TOP)/src/lsm_lz.c \
   $(TOP)/src/lsm_main.c \
   $(TOP)/src/lsm_mem.c \
   $(TOP)/src/lsm_mutex.c \
@@ -297,7 +299,7 @@ LSMTESTSRC = $(TOP)/lsm-test/lsmtest1.c $(TOP)/lsm-test/lsmtest2.c           \
              $(TOP)/lsm-test/lsmtest3.c $(TOP)/lsm-test/lsmtest4.c           \
              $(TOP)/lsm-test/lsmtest5.c $(TOP)/lsm-test/lsmtest6.c           \
              $(TOP)/lsm-test/lsmtest7.c $(TOP)/lsm-test/lsmtest8.c           \
-             $(TOP)/lsm-test/lsmtest9.c                                      \
+             $(TOP)/lsm-test/lsmtest9.c $(TOP)/lsm-test/lsmtest10.c          \
              $(TOP)/lsm-test/lsmtest_datasource.c \
              $(TOP)/lsm-test/lsmtest_func.c $(TOP)/lsm-test/lsmtest_io.c     \
              $(TOP)/lsm-test/lsmtest_main.c $(TOP)/lsm-test/lsmtest_mem.c    \
@@ -185,6 +185,46 @@ int sqlite4KVCursorSeek(
   }
   return rc;
 }
+int sqlite4KVCursorSetBounds(
+  KVCursor *p,
+  const KVByteArray *pLower, KVSize nLower,
+  const KVByteArray *pUpper, KVSize nUpper
+){
+  int rc = SQLITE4_OK;
+  if( p->pStoreVfunc->iVersion>=2 && p->pStoreVfunc->xSetBounds ){
+    rc = p->pStoreVfunc->xSetBounds(p, pLower, nLower, pUpper, nUpper);
+  }
+  if( p->fTrace ){
+    char zLower[52], zUpper[52];
+    binToHex(zLower, sizeof(zLower), pLower, nLower);
+    binToHex(zUpper, sizeof(zUpper), pUpper, nUpper);
+    kvTrace(p->pStore, "xSetBounds(%d,%s,%s) -> %s",
+            p->curId, zLower, zUpper, kvErrName(rc));
+  }
+  return rc;
+}
+int sqlite4KVCursorSeekMany(
+  KVCursor *p,
+  int nKey, const KVByteArray **apKey, const KVSize *anKey,
+  int (*xFound)(void*, int), void *pCtx
+){
+  int rc = SQLITE4_OK;
+  if( p->pStoreVfunc->iVersion>=3 && p->pStoreVfunc->xSeekMany ){
+    rc = p->pStoreVfunc->xSeekMany(p, nKey, apKey, anKey, xFound, pCtx);
+  }else{
+    int i;
+    for(i=0; rc==SQLITE4_OK && i<nKey; i++){
+      rc = p->pStoreVfunc->xSeek(p, apKey[i], anKey[i], 0);
+      if( rc==SQLITE4_OK ){
+        rc = xFound(pCtx, i);
+      }else if( rc==SQLITE4_NOTFOUND ){
+        rc = SQLITE4_OK;
+      }
+    }
+  }
+  kvTrace(p->pStore, "xSeekMany(%d,%d) -> %s", p->curId, nKey, kvErrName(rc));
+  return rc;
+}
 int sqlite4KVCursorNext(KVCursor *p){
   int rc;
   rc = p->pStoreVfunc->xNext(p);
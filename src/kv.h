@@ -121,6 +121,24 @@
 ** one cursor can xDelete and the other cursor is expected to continue
 ** functioning normally, including responding correctly to subsequent
 ** xNext and xPrev calls.
+**
+** The optional xSetBounds method tells the storage engine that the cursor
+** will only be used to visit keys greater than or equal to the lower bound
+** and strictly less than the upper bound. A zero-length bound means the
+** range is unbounded in that direction. An engine may use this to avoid
+** reading data that cannot lie within the range, and may behave as if 
+** keys outside of the range did not exist. Or it may ignore the bounds
+** entirely, so callers must still check that keys returned by the cursor
+** lie within the range.
+**
+** The optional xSeekMany method searches for each of an array of keys 
+** in turn, as if by xSeek with dir==0. For each key that is found, the
+** xFound callback is invoked with the index of the key and with the cursor
+** pointing at the entry, so that it may use xKey and xData. A callback 
+** return value other than SQLITE4_OK stops the search and is returned to
+** the caller. Engines that do not provide xSeekMany are driven by a loop 
+** of xSeek calls instead. The keys should be sorted, as engines may reuse
+** the position of the cursor from one search to the next.
 */
 
 /* Typedefs of datatypes */
@@ -151,6 +169,16 @@ int sqlite4KVCursorSeek(
   const KVByteArray *pKey, KVSize nKey,
   int dir
 );
+int sqlite4KVCursorSetBounds(
+  KVCursor *p,
+  const KVByteArray *pLower, KVSize nLower,
+  const KVByteArray *pUpper, KVSize nUpper
+);
+int sqlite4KVCursorSeekMany(
+  KVCursor *p,
+  int nKey, const KVByteArray **apKey, const KVSize *anKey,
+  int (*xFound)(void*, int), void *pCtx
+);
 int sqlite4KVCursorNext(KVCursor *p);
 int sqlite4KVCursorPrev(KVCursor *p);
 int sqlite4KVCursorDelete(KVCursor *p);
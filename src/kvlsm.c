@@ -27,8 +27,18 @@ struct KVLsm {
   KVStore base;                   /* Base class, must be first */
   lsm_db *pDb;                    /* LSM database handle */
   lsm_cursor *pCsr;               /* LSM cursor holding read-trans open */
+  lsm_batch *pBatch;              /* Writes not yet passed to LSM */
+  int nBatch;                     /* Approximate size of pBatch in bytes */
 };
 
+/*
+** Calls to xReplace are accumulated in KVLsm.pBatch and written to the
+** database using a single call to lsm_write_batch(). The batch is written
+** before any read from the database, before the transaction level changes,
+** or once it grows larger than the following number of bytes.
+*/
+#define KVLSM_MAX_BATCH (256*1024)
+
 /*
 ** An instance of an open cursor pointing into an LSM store.  A subclass
 ** of KVCursor.
@@ -38,6 +48,19 @@ struct KVLsmCsr {
   lsm_cursor *pCsr;               /* LSM cursor handle */
 };
   
+/*
+** Write any accumulated xReplace operations to the database.
+*/
+static int kvlsmFlushBatch(KVLsm *p){
+  int rc = SQLITE4_OK;
+  if( p->nBatch>0 ){
+    rc = lsm_write_batch(p->pDb, p->pBatch);
+    lsm_batch_reset(p->pBatch);
+    p->nBatch = 0;
+  }
+  return rc;
+}
+
 /*
 ** Begin a transaction or subtransaction.
 **
@@ -56,7 +79,8 @@ static int kvlsmBegin(KVStore *pKVStore, int iLevel){
   KVLsm *p = (KVLsm *)pKVStore;
 
   assert( iLevel>0 );
-  if( p->pCsr==0 ){
+  rc = kvlsmFlushBatch(p);
+  if( rc==SQLITE4_OK && p->pCsr==0 ){
     rc = lsm_csr_open(p->pDb, &p->pCsr);
   }
   if( rc==SQLITE4_OK && iLevel>=2 && iLevel>=pKVStore->iTransLevel ){
@@ -82,20 +106,20 @@ static int kvlsmBegin(KVStore *pKVStore, int iLevel){
 ** level when this routine is called.
 **
 ** Commit is divided into two phases.  A rollback is still possible after
-** phase one completes.  In this implementation, phase one is a no-op since
-** phase two cannot fail.
+** phase one completes.  In this implementation, phase one writes any 
+** accumulated xReplace operations to the database.
 **
 ** After this routine returns successfully, the transaction level will be 
 ** equal to iLevel.
 */
 static int kvlsmCommitPhaseOne(KVStore *pKVStore, int iLevel){
-  return SQLITE4_OK;
+  return kvlsmFlushBatch((KVLsm *)pKVStore);
 }
 static int kvlsmCommitPhaseTwo(KVStore *pKVStore, int iLevel){
-  int rc = SQLITE4_OK;
   KVLsm *p = (KVLsm *)pKVStore;
+  int rc = kvlsmFlushBatch(p);
 
-  if( pKVStore->iTransLevel>iLevel ){
+  if( rc==SQLITE4_OK && pKVStore->iTransLevel>iLevel ){
     if( pKVStore->iTransLevel>=2 ){
       rc = lsm_commit(p->pDb, SQLITE4_MAX(0, iLevel-1));
     }
@@ -125,6 +149,8 @@ static int kvlsmRollback(KVStore *pKVStore, int iLevel){
   KVLsm *p = (KVLsm *)pKVStore;
 
   if( pKVStore->iTransLevel>=iLevel ){
+    lsm_batch_reset(p->pBatch);
+    p->nBatch = 0;
     if( pKVStore->iTransLevel>=2 ){
       rc = lsm_rollback(p->pDb, SQLITE4_MAX(0, iLevel-1));
     }
@@ -158,14 +184,29 @@ static int kvlsmRevert(KVStore *pKVStore, int iLevel){
 ** long-term, it will need to make its own copy of these values.
 **
 ** A transaction will always be active when this routine is called.
+**
+** The new entry is added to the KVLsm.pBatch write batch. It is written
+** to the database later on, by kvlsmFlushBatch().
 */
 static int kvlsmReplace(
   KVStore *pKVStore,
   const KVByteArray *aKey, KVSize nKey,
   const KVByteArray *aData, KVSize nData
 ){
+  int rc = SQLITE4_OK;
   KVLsm *p = (KVLsm *)pKVStore;
-  return lsm_insert(p->pDb, (void *)aKey, nKey, (void *)aData, nData);
+
+  if( p->pBatch==0 ){
+    rc = lsm_batch_new(p->pDb, &p->pBatch);
+  }
+  if( rc==SQLITE4_OK ){
+    rc = lsm_batch_insert(p->pBatch, aKey, nKey, aData, nData);
+  }
+  if( rc==SQLITE4_OK ){
+    p->nBatch += 1 + nKey + nData;
+    if( p->nBatch>KVLSM_MAX_BATCH ) rc = kvlsmFlushBatch(p);
+  }
+  return rc;
 }
 
 /*
@@ -220,6 +261,8 @@ static int kvlsmNextEntry(KVCursor *pKVCursor){
   int rc;
   KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
 
+  rc = kvlsmFlushBatch((KVLsm *)pKVCursor->pStore);
+  if( rc!=SQLITE4_OK ) return rc;
   if( lsm_csr_valid(pCsr->pCsr)==0 ) return SQLITE4_NOTFOUND;
   rc = lsm_csr_next(pCsr->pCsr);
   if( rc==LSM_OK && lsm_csr_valid(pCsr->pCsr)==0 ){
@@ -235,6 +278,8 @@ static int kvlsmPrevEntry(KVCursor *pKVCursor){
   int rc;
   KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
 
+  rc = kvlsmFlushBatch((KVLsm *)pKVCursor->pStore);
+  if( rc!=SQLITE4_OK ) return rc;
   if( lsm_csr_valid(pCsr->pCsr)==0 ) return SQLITE4_NOTFOUND;
   rc = lsm_csr_prev(pCsr->pCsr);
   if( rc==LSM_OK && lsm_csr_valid(pCsr->pCsr)==0 ){
@@ -259,6 +304,8 @@ static int kvlsmSeek(
   assert( LSM_SEEK_EQ==0 && LSM_SEEK_GE==1 && LSM_SEEK_LE==-1 );
   assert( LSM_SEEK_LEFAST==-2 );
 
+  rc = kvlsmFlushBatch((KVLsm *)pKVCursor->pStore);
+  if( rc!=SQLITE4_OK ) return rc;
   rc = lsm_csr_seek(pCsr->pCsr, (void *)aKey, nKey, dir);
   if( rc==SQLITE4_OK ){
     if( lsm_csr_valid(pCsr->pCsr)==0 ){
@@ -277,6 +324,34 @@ static int kvlsmSeek(
   return rc;
 }
 
+/*
+** Restrict a cursor to a range of keys.
+*/
+static int kvlsmSetBounds(
+  KVCursor *pKVCursor,
+  const KVByteArray *aLower, KVSize nLower,
+  const KVByteArray *aUpper, KVSize nUpper
+){
+  KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
+  return lsm_csr_set_bounds(pCsr->pCsr, aLower, nLower, aUpper, nUpper);
+}
+
+/*
+** Search for each of an array of keys.
+*/
+static int kvlsmSeekMany(
+  KVCursor *pKVCursor, 
+  int nKey, const KVByteArray **apKey, const KVSize *anKey,
+  int (*xFound)(void*, int), void *pCtx
+){
+  KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
+  int rc = kvlsmFlushBatch((KVLsm *)pKVCursor->pStore);
+  if( rc!=SQLITE4_OK ) return rc;
+  return lsm_csr_multiseek(
+      pCsr->pCsr, nKey, (const void **)apKey, anKey, xFound, pCtx
+  );
+}
+
 /*
 ** Delete the entry that the cursor is pointing to.
 **
@@ -292,6 +367,8 @@ static int kvlsmDelete(KVCursor *pKVCursor){
   KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
 
   assert( lsm_csr_valid(pCsr->pCsr) );
+  rc = kvlsmFlushBatch((KVLsm *)pKVCursor->pStore);
+  if( rc!=SQLITE4_OK ) return rc;
   rc = lsm_csr_key(pCsr->pCsr, &pKey, &nKey);
   if( rc==SQLITE4_OK ){
     rc = lsm_delete(((KVLsm *)(pKVCursor->pStore))->pDb, pKey, nKey);
@@ -309,6 +386,8 @@ static int kvlsmKey(
   KVSize *pN                   /* Make this point to the size of the key */
 ){
   KVLsmCsr *pCsr = (KVLsmCsr *)pKVCursor;
+  int rc = kvlsmFlushBatch((KVLsm *)pKVCursor->pStore);
+  if( rc!=SQLITE4_OK ) return rc;
   if( 0==lsm_csr_valid(pCsr->pCsr) ) return SQLITE4_DONE;
   return lsm_csr_key(pCsr->pCsr, (const void **)paKey, (int *)pN);
 }
@@ -328,6 +407,8 @@ static int kvlsmData(
   void *pData;
   int nData;
 
+  rc = kvlsmFlushBatch((KVLsm *)pKVCursor->pStore);
+  if( rc!=SQLITE4_OK ) return rc;
   rc = lsm_csr_value(pCsr->pCsr, (const void **)&pData, &nData);
   if( rc==SQLITE4_OK ){
     if( n<0 ){
@@ -358,6 +439,7 @@ static int kvlsmClose(KVStore *pKVStore){
   kvlsmRollback(pKVStore, 0);
   assert( p->pCsr==0 );
 
+  lsm_batch_free(p->pBatch);
   lsm_close(p->pDb);
   sqlite4_free(p->base.pEnv, p);
   return SQLITE4_OK;
@@ -367,6 +449,9 @@ static int kvlsmControl(KVStore *pKVStore, int op, void *pArg){
   int rc = SQLITE4_OK;
   KVLsm *p = (KVLsm *)pKVStore;
 
+  rc = kvlsmFlushBatch(p);
+  if( rc!=SQLITE4_OK ) return rc;
+
   switch( op ){
     case SQLITE4_KVCTRL_LSM_HANDLE: {
       lsm_db **ppOut = (lsm_db **)pArg;
@@ -431,7 +516,7 @@ int sqlite4KVStoreOpenLsm(
 
   /* Virtual methods for an LSM data store */
   static const KVStoreMethods kvlsmMethods = {
-    1,                            /* iVersion */
+    3,                            /* iVersion */
     sizeof(KVStoreMethods),       /* szSelf */
     kvlsmReplace,                 /* xReplace */
     kvlsmOpenCursor,              /* xOpenCursor */
@@ -451,7 +536,9 @@ int sqlite4KVStoreOpenLsm(
     kvlsmClose,                   /* xClose */
     kvlsmControl,                 /* xControl */
     kvlsmGetMeta,                 /* xGetMeta */
-    kvlsmPutMeta                  /* xPutMeta */
+    kvlsmPutMeta,                 /* xPutMeta */
+    kvlsmSetBounds,               /* xSetBounds */
+    kvlsmSeekMany                 /* xSeekMany */
   };
 
   KVLsm *pNew;
@@ -23,13 +23,17 @@ extern "C" {
 /*
 ** Opaque handle types.
 */
+typedef struct lsm_batch lsm_batch;         /* Write batch handle */
 typedef struct lsm_compress lsm_compress;   /* Compression library functions */
 typedef struct lsm_compress_factory lsm_compress_factory;
 typedef struct lsm_cursor lsm_cursor;       /* Database cursor handle */
 typedef struct lsm_db lsm_db;               /* Database connection handle */
 typedef struct lsm_env lsm_env;             /* Runtime environment */
 typedef struct lsm_file lsm_file;           /* OS file handle */
+typedef struct lsm_iovec lsm_iovec;         /* Buffer for vectored i/o */
 typedef struct lsm_mutex lsm_mutex;         /* Mutex handle */
+typedef struct lsm_cond lsm_cond;           /* Condition variable handle */
+typedef struct lsm_thread lsm_thread;       /* Thread handle */
 
 /* 64-bit integer type used for file offsets. */
 typedef long long int lsm_i64;              /* 64-bit signed integer type */
@@ -41,6 +45,19 @@ typedef long long int lsm_i64;              /* 64-bit signed integer type */
 
 /* Flags for lsm_env.xOpen() */
 #define LSM_OPEN_READONLY 0x0001
+#define LSM_OPEN_DIRECT   0x0002
+
+/* 
+** An array of these is passed to the lsm_env.xReadv() and xWritev() 
+** methods. Each element describes one buffer of nData bytes. The buffers
+** are read from or written to a single contiguous range of the file, 
+** starting at the offset passed as the second argument to xReadv() or 
+** xWritev().
+*/
+struct lsm_iovec {
+  void *pData;
+  int nData;
+};
 
 /*
 ** CAPI: Database Runtime Environment
@@ -49,7 +66,7 @@ typedef long long int lsm_i64;              /* 64-bit signed integer type */
 */
 struct lsm_env {
   int nByte;                 /* Size of this structure in bytes */
-  int iVersion;              /* Version number of this structure (1) */
+  int iVersion;              /* Version number of this structure (6) */
   /****** file i/o ***********************************************/
   void *pVfsCtx;
   int (*xFullpath)(lsm_env*, const char *, char *, int *);
@@ -86,6 +103,22 @@ struct lsm_env {
   int (*xMutexNotHeld)(lsm_mutex *);        /* Return true if mutex not held */
   /****** other ****************************************************/
   int (*xSleep)(lsm_env*, int microseconds);
+  /****** threads (iVersion>=2) **************************************/
+  int (*xThreadNew)(lsm_env*, void (*)(void *), void *, lsm_thread **);
+  void (*xThreadJoin)(lsm_thread *);       /* Wait for thread, then free */
+  int (*xCondNew)(lsm_env*, lsm_cond **);  /* Get a new condition variable */
+  void (*xCondDel)(lsm_cond *);            /* Delete a condition variable */
+  void (*xCondWait)(lsm_cond *, lsm_mutex *);   /* Wait on a cond. variable */
+  void (*xCondBroadcast)(lsm_cond *);      /* Wake all waiting threads */
+  /****** time (iVersion>=3) *****************************************/
+  int (*xCurrentTime)(lsm_env*, lsm_i64 *); /* Monotonic time in us */
+  /****** read-ahead (iVersion>=4) *********************************/
+  int (*xReadAhead)(lsm_file *, lsm_i64 iOff, lsm_i64 nByte);
+  /****** vectored i/o (iVersion>=5) *********************************/
+  int (*xReadv)(lsm_file *, lsm_i64, lsm_iovec *, int);
+  int (*xWritev)(lsm_file *, lsm_i64, lsm_iovec *, int);
+  /****** preallocation (iVersion>=6) ********************************/
+  int (*xFallocate)(lsm_file *, lsm_i64 iOff, lsm_i64 nByte);
 
   /* New fields may be added in future releases, in which case the
   ** iVersion value will increase. */
@@ -260,6 +293,14 @@ int lsm_config(lsm_db *, int, ...);
 **   of type lsm_compress. The lsm_config() method takes a copy of the 
 **   structures contents.
 **
+**   If the xBound method of the structure is NULL and its iId field is set
+**   to LSM_COMPRESSION_LZ, the compression built into the library is used.
+**   This is a fast LZ77 variant that requires no external library. A 
+**   database that uses it may be opened without configuring compression 
+**   or a compression factory first - the built-in methods are installed 
+**   automatically. If xBound is NULL and iId is any other value, 
+**   compression is disabled.
+**
 **   This option may only be used before lsm_open() is called. Invoking it
 **   after lsm_open() has been called results in an LSM_MISUSE error.
 **
@@ -271,9 +312,283 @@ int lsm_config(lsm_db *, int, ...);
 **   Configure a factory method to be invoked in case of an LSM_MISMATCH
 **   error.
 **
+**   If the xLevel method of the factory is not NULL, it is invoked each 
+**   time a new segment is written to a compressed database. The third 
+**   argument is the age of the level the segment belongs to - 0 for 
+**   segments created by flushing an in-memory tree, and greater values 
+**   for segments created by merging older data. The segment is compressed
+**   using the scheme identified by the returned value, which must be 
+**   either the id of the database compression methods (see 
+**   LSM_CONFIG_SET_COMPRESSION), LSM_COMPRESSION_LZ to use the built-in 
+**   compression, or LSM_COMPRESSION_NONE to store the segment's pages 
+**   uncompressed. Any other value is treated as the database compression 
+**   id. The scheme used by each segment is recorded in the database, so 
+**   the policy may differ between connections and may be changed at any 
+**   time. xLevel has no effect on databases that do not use compression.
+**
 ** LSM_CONFIG_READONLY:
 **   A read/write boolean parameter. This parameter may only be set before
 **   lsm_open() is called.
+**
+** LSM_CONFIG_BLOOM:
+**   A read/write integer parameter. If this option is set to a value N
+**   greater than zero, then each sorted run written to the database file
+**   by this connection is followed by a bloom filter that uses approximately
+**   N bits for each key in the run. When searching for a specific key (i.e.
+**   lsm_csr_seek() with LSM_SEEK_EQ), these filters are used to avoid 
+**   searching runs that cannot contain the key. The maximum value is 32.
+**   The default value is 0 (no bloom filters are written).
+**
+**   Bloom filters are built using the raw bytes of each key. They should
+**   only be enabled if the comparison function considers two keys to be
+**   equal only if they are byte-for-byte identical, as the default 
+**   comparison function does.
+**
+** LSM_CONFIG_BACKGROUND_WORK:
+**   A read/write boolean parameter. This parameter may only be set before
+**   lsm_open() is called. If true, then instead of merging segments and
+**   checkpointing the database from within lsm_commit(), the work is 
+**   handed off to background threads shared by all connections to the 
+**   same database within the process. A worker thread is woken each time
+**   an in-memory tree fills up and a checkpointer thread runs whenever 
+**   more than LSM_CONFIG_AUTOCHECKPOINT KB of data has been written to 
+**   the database file (no checkpointer is started if auto-checkpoints 
+**   are disabled). The threads are shut down when the last connection 
+**   that requested them is closed.
+**
+**   If a writer fills a second in-memory tree before the worker thread 
+**   has flushed the first, lsm_commit() blocks until the worker has 
+**   caught up. Errors encountered by the background threads are passed
+**   to the log callback (see lsm_config_log()) of their private 
+**   connections, which is copied from the connection that started them.
+**   So are all other options that affect merging, flushing, checkpointing
+**   or the page cache, such as LSM_CONFIG_CACHE_SIZE, LSM_CONFIG_READAHEAD
+**   and LSM_CONFIG_LOG_PREALLOC. The work hook is not copied, and the
+**   private connections never perform auto-work or auto-checkpoints.
+**
+**   Background threads require an lsm_env with version 2 or greater and
+**   non-NULL thread and condition variable methods. The default 
+**   environment only provides these if the library is compiled with
+**   LSM_MUTEX_PTHREADS. If they are not available this parameter is 
+**   always zero. The default value is 0.
+**
+** LSM_CONFIG_GROUP_COMMIT:
+**   A read/write integer parameter. If set to a value greater than zero,
+**   then transactions committed while LSM_CONFIG_SAFETY is set to 
+**   LSM_SAFETY_FULL do not sync the log file while holding the write lock.
+**   Instead, lsm_commit() releases the lock and then waits until the log
+**   has been synced by this or some other connection to the same database
+**   in this process. Commits that arrive while a sync is in progress are 
+**   all made durable by the next sync. This means that new data may 
+**   become visible to readers shortly before it is durable. And that if
+**   the sync fails, lsm_commit() returns an error even though the 
+**   transaction is not rolled back.
+**
+**   If other connections are already waiting for a sync when one is about
+**   to start, the syncing connection first sleeps for the configured 
+**   number of microseconds, allowing more commits to join the group. Set
+**   this parameter to 1 to enable group commit with no such delay.
+**
+**   Group commit requires the same environment support as 
+**   LSM_CONFIG_BACKGROUND_WORK. If it is not available, this parameter is
+**   always zero. The default value is 0.
+**
+** LSM_CONFIG_COMPACTION:
+**   A read/write integer parameter. The policy used to select segments
+**   to merge together. It must be set to one of the following values:
+**
+**   LSM_COMPACTION_TIERED:
+**     Each time LSM_CONFIG_AUTOMERGE segments of the same age (number of 
+**     times merged) exist, they are merged into a single segment of the 
+**     next age. This policy minimizes the number of times each entry is
+**     rewritten, at the cost of more segments (and so more space used by
+**     overwritten and deleted entries). This is the default.
+**
+**   LSM_COMPACTION_LEVELED:
+**     The database is kept as a series of levels, each consisting of a
+**     single segment. Level N (N>=1) has a target size of B * (R^(N-1)), 
+**     where B and R are the LSM_CONFIG_LEVEL_BASE and LSM_CONFIG_LEVEL_RATIO
+**     parameters. Once LSM_CONFIG_AUTOMERGE segments have been flushed from
+**     in-memory trees, they are merged into level 1. When a level grows
+**     larger than its target size, it is merged into the next level. This
+**     policy minimizes the space used, at the cost of rewriting each entry
+**     more often. Segments whose key ranges do not overlap those of the
+**     next level are moved into it without being rewritten, so a level may
+**     temporarily consist of up to LSM_CONFIG_AUTOMERGE such segments.
+**     Where keys are inserted in increasing order, this means each entry
+**     is rewritten about once per level.
+**
+**   LSM_COMPACTION_HYBRID:
+**     As for LSM_COMPACTION_TIERED, except that the oldest segment in the 
+**     database is treated as a level. When a merge would produce a segment
+**     adjacent to the oldest segment, and the oldest segment is no more 
+**     than LSM_CONFIG_AUTOMERGE times the size of the merge inputs, the
+**     oldest segment is included in the merge. Most of the space used by 
+**     overwritten and deleted entries is recovered, at a lower cost than 
+**     LSM_COMPACTION_LEVELED.
+**
+** LSM_CONFIG_LEVEL_BASE:
+**   A read/write integer parameter. The target size in KB of level 1 when
+**   using LSM_COMPACTION_LEVELED. The default value is 8192 (8MB).
+**
+** LSM_CONFIG_LEVEL_RATIO:
+**   A read/write integer parameter. The ratio between the target sizes of
+**   adjacent levels when using LSM_COMPACTION_LEVELED. The minimum value
+**   is 2. The default value is 10.
+**
+** LSM_CONFIG_MERGE_RATE:
+**   A read/write integer parameter. If greater than zero, the maximum rate,
+**   in KB per second, at which this connection writes merged and flushed
+**   segment data to the database file. Work performed by lsm_work(), 
+**   auto-work and background threads is paused as required to stay within 
+**   the limit. The limit is raised four-fold once the in-memory tree is 
+**   three quarters of the LSM_CONFIG_AUTOFLUSH size, and lifted entirely 
+**   while the queue of old in-memory trees waiting to be flushed is full
+**   (see LSM_CONFIG_MAX_OLD_TREES). 
+**   Zero (the default) means no limit. Rate limiting requires an lsm_env 
+**   that provides the xCurrentTime() method.
+**
+**   The connection pauses while holding the lock that allows it to work on
+**   the database, so no other connection may merge or flush in-memory 
+**   trees until it is done. Auto-work is performed from within the write 
+**   transaction that triggered it, so when auto-work is paused the write
+**   lock is held as well, and other connections cannot write to the 
+**   database either. To limit merge traffic without delaying writers, use 
+**   background threads (LSM_CONFIG_BACKGROUND_WORK) or call lsm_work() 
+**   from a connection that does not write.
+**
+** LSM_CONFIG_CHECKPOINT_RATE:
+**   A read/write integer parameter. As for LSM_CONFIG_MERGE_RATE, except
+**   that the limit applies to checkpoint traffic - the data synced to disk 
+**   and the meta-page written when a checkpoint is stored in the database
+**   file. Zero (the default) means no limit. The connection pauses while
+**   holding the checkpointer lock, so other connections may continue to 
+**   work on the database but may not checkpoint it. As for merge pauses,
+**   auto-checkpoints performed as part of auto-work also hold the write
+**   lock.
+**
+** LSM_CONFIG_MAX_OLD_TREES:
+**   A read/write integer parameter. When the in-memory tree grows larger
+**   than LSM_CONFIG_AUTOFLUSH, it is marked as immutable ("old") and 
+**   queued to be flushed to disk, and writers continue with a new, empty
+**   in-memory tree. This parameter sets the maximum number of old trees 
+**   that may be queued at any one time. Old trees are flushed to disk in
+**   the order in which they were queued. Once the queue is full, the 
+**   current in-memory tree is allowed to grow until the oldest queued tree
+**   has been flushed. The default value is 1. The maximum value is 8. If 
+**   LSM_CONFIG_USE_LOG is disabled, at most one old tree is queued 
+**   regardless of this setting.
+**
+** LSM_CONFIG_CACHE_SIZE:
+**   A read/write integer parameter. All connections to a single database
+**   within a process share a single cache of database pages. This 
+**   parameter sets the size limit of that cache, in KB. Pages in use by
+**   a connection are never evicted, so the cache may temporarily exceed
+**   this limit. Setting this parameter via any connection affects all 
+**   connections to the same database. The default value is 2048 (2MB). 
+**   This parameter has no effect if LSM_CONFIG_MMAP is enabled.
+**
+** LSM_CONFIG_CACHE_POLICY:
+**   A read/write integer parameter. Selects the replacement policy used by
+**   the page cache shared by all connections to the database within the 
+**   process (see LSM_CONFIG_CACHE_SIZE). Like LSM_CONFIG_CACHE_SIZE, 
+**   setting this parameter via any connection affects all connections to
+**   the same database. Valid values are:
+**
+**   LSM_CACHE_LRU:
+**     Evict the least recently used page. This is the default.
+**
+**   LSM_CACHE_2Q:
+**     A scan-resistant policy. Pages that have been used only once since
+**     they were loaded are evicted before pages that have been used more
+**     than once, so a large scan does not evict pages used by frequent
+**     point lookups. Reads made by merges (lsm_work() and auto-work) do 
+**     not count as uses.
+**
+** LSM_CONFIG_READAHEAD:
+**   A read/write integer parameter. The size of the read-ahead window used
+**   by cursors scanning a segment sequentially, in KB. Once a sequential
+**   scan is detected, data up to this far ahead of the cursor (but not 
+**   beyond the end of the current block) is requested before it is needed.
+**   If the environment provides an xReadAhead() method (iVersion 4 or 
+**   greater), it is used to tell the OS to begin reading the data in the
+**   background. Otherwise, the pages are read into the page cache using a
+**   single larger read. Set to 0 to disable read-ahead. The default value
+**   is 64. This parameter has no effect if LSM_CONFIG_MMAP is enabled.
+**
+** LSM_CONFIG_DIRECT_IO:
+**   A read/write integer parameter. This parameter may only be set before
+**   lsm_open() has been called. Once the database has been opened, it 
+**   reports the value in effect for all connections to the same database 
+**   within the process, which is the value configured by the first of 
+**   them to be opened. Valid values are:
+**
+**   LSM_DIRECT_IO_OFF:
+**     Use ordinary buffered IO. This is the default.
+**
+**   LSM_DIRECT_IO_DB:
+**     Ask the environment to open the database file for direct IO 
+**     (O_DIRECT on unix), so that pages are cached only in the page 
+**     cache configured by LSM_CONFIG_CACHE_SIZE and not also by the 
+**     operating system. Page buffers are allocated with the alignment
+**     direct IO requires and memory-mapping (LSM_CONFIG_MMAP) is not used.
+**
+**   LSM_DIRECT_IO_ALL:
+**     As LSM_DIRECT_IO_DB, but open the log file for direct IO as well. 
+**     Each commit record is padded so that it ends on a boundary of the
+**     sector size reported by the environment for the log file, as it is
+**     when LSM_CONFIG_SAFETY is set to FULL.
+**
+**   If the environment or file-system does not support direct IO, the files 
+**   are opened for buffered IO instead.
+**
+** LSM_CONFIG_PREFIX_COMPRESSION:
+**   A read/write integer parameter. If set to a value N greater than zero,
+**   the keys on each page of a sorted run written by this connection are
+**   prefix compressed - each key is stored as the number of leading bytes 
+**   it shares with the previous key on the page followed by the remaining
+**   bytes. Every N'th key on each page is stored in full, so that keys may
+**   be decoded without reading the entire page. Smaller values make seeks 
+**   within a page faster, larger values save more space. The maximum value
+**   is 255. The default value is 0 (keys are stored in full).
+**
+**   Pages written with and without prefix compression may be mixed freely
+**   in a single database. Versions of this library that do not support 
+**   prefix compression cannot read databases that contain such pages.
+**
+** LSM_CONFIG_VALUE_THRESHOLD:
+**   A read/write integer parameter. If set to a value N greater than zero,
+**   each value larger than N bytes written to a sorted run by this 
+**   connection is stored once in a separate "value segment" within the
+**   database file, and the sorted run stores only a small reference to
+**   it. Such values are then not copied each time the record is merged
+**   into a new level. A value segment is deleted once no record refers to
+**   any value within it. When most of the values in an old value segment
+**   have been overwritten or deleted, the values that remain are moved 
+**   back into the sorted runs by subsequent merges so that the space may
+**   be reclaimed. The default value is 0 (all values are stored in the
+**   sorted runs).
+**
+**   This parameter has no effect if the database uses compression. 
+**   Versions of this library that do not support value segments cannot
+**   read databases that contain them.
+**
+** LSM_CONFIG_LOG_PREALLOC:
+**   A read/write integer parameter. If set to a value N greater than zero,
+**   space for the log file is allocated by this connection N KB at a time 
+**   using the environment's xFallocate() method (iVersion 6 or greater), 
+**   before any log data is written into it. The log file is then only
+**   extended once for every N KB of log data written, instead of by 
+**   almost every commit, so that syncing the log at commit time does not 
+**   usually require the file-system to sync file metadata as well. 
+**   Because space in the log file is reused once the data it contains has
+**   been checkpointed, a value larger than the amount of data written 
+**   between checkpoints means that the log file is normally allocated only 
+**   once. If the last connection to close a database has this parameter 
+**   set, it marks the log file as empty instead of deleting it, so that its
+**   space may be reused the next time the database is opened. The default
+**   value is 0 (the log file grows as data is written to it and is deleted
+**   when the last connection is closed).
 */
 #define LSM_CONFIG_AUTOFLUSH                1
 #define LSM_CONFIG_PAGE_SIZE                2
@@ -290,11 +605,38 @@ int lsm_config(lsm_db *, int, ...);
 #define LSM_CONFIG_GET_COMPRESSION         14
 #define LSM_CONFIG_SET_COMPRESSION_FACTORY 15
 #define LSM_CONFIG_READONLY                16
+#define LSM_CONFIG_BLOOM                   17
+#define LSM_CONFIG_BACKGROUND_WORK         18
+#define LSM_CONFIG_GROUP_COMMIT            19
+#define LSM_CONFIG_COMPACTION              20
+#define LSM_CONFIG_LEVEL_BASE              21
+#define LSM_CONFIG_LEVEL_RATIO             22
+#define LSM_CONFIG_MERGE_RATE              23
+#define LSM_CONFIG_CHECKPOINT_RATE         24
+#define LSM_CONFIG_MAX_OLD_TREES           25
+#define LSM_CONFIG_CACHE_SIZE              26
+#define LSM_CONFIG_CACHE_POLICY            27
+#define LSM_CONFIG_READAHEAD               28
+#define LSM_CONFIG_DIRECT_IO               29
+#define LSM_CONFIG_PREFIX_COMPRESSION      30
+#define LSM_CONFIG_VALUE_THRESHOLD         31
+#define LSM_CONFIG_LOG_PREALLOC            32
 
 #define LSM_SAFETY_OFF    0
 #define LSM_SAFETY_NORMAL 1
 #define LSM_SAFETY_FULL   2
 
+#define LSM_COMPACTION_TIERED  0
+#define LSM_COMPACTION_LEVELED 1
+#define LSM_COMPACTION_HYBRID  2
+
+#define LSM_CACHE_LRU 0
+#define LSM_CACHE_2Q  1
+
+#define LSM_DIRECT_IO_OFF 0
+#define LSM_DIRECT_IO_DB  1
+#define LSM_DIRECT_IO_ALL 2
+
 /*
 ** CAPI: Compression and/or Encryption Hooks
 */
@@ -311,10 +653,12 @@ struct lsm_compress_factory {
   void *pCtx;
   int (*xFactory)(void *, lsm_db *, unsigned int);
   void (*xFree)(void *pCtx);
+  unsigned int (*xLevel)(void *pCtx, lsm_db *, int iAge);
 };
 
 #define LSM_COMPRESSION_EMPTY 0
 #define LSM_COMPRESSION_NONE  1
+#define LSM_COMPRESSION_LZ    2
 
 /*
 ** CAPI: Allocating and Freeing Memory
@@ -453,6 +797,14 @@ int lsm_set_user_version(lsm_db *, unsigned int);
 **   This value should be followed by a single argument of type 
 **   (unsigned int *). If successful, the location pointed to is populated 
 **   with the database compression id before returning.
+**
+** LSM_INFO_GROUP_COMMIT:
+**   This value should be followed by two arguments of type (int *). The 
+**   first is set to the number of log syncs performed by group commit
+**   (see LSM_CONFIG_GROUP_COMMIT) by all connections to the database in 
+**   this process. The second is set to the number of transactions made
+**   durable by those syncs. The ratio of the two is the average number of
+**   commits per sync.
 */
 #define LSM_INFO_NWRITE           1
 #define LSM_INFO_NREAD            2
@@ -467,6 +819,7 @@ int lsm_set_user_version(lsm_db *, unsigned int);
 #define LSM_INFO_TREE_SIZE       11
 #define LSM_INFO_FREELIST_SIZE   12
 #define LSM_INFO_COMPRESSION_ID  13
+#define LSM_INFO_GROUP_COMMIT    14
 
 
 /* 
@@ -524,6 +877,78 @@ int lsm_delete_range(lsm_db *,
     const void *pKey1, int nKey1, const void *pKey2, int nKey2
 );
 
+/*
+** CAPI: Write Batches
+**
+** A write batch is a list of insert, delete and delete-range operations
+** that are applied to the database by a single call to lsm_write_batch().
+** The operations are encoded as a single record in the log file, and take
+** effect in the order in which they were added to the batch.
+**
+** lsm_batch_new() allocates a new, empty, batch for use with database
+** handle pDb. The batch may only be written to the same handle, and must
+** be freed using lsm_batch_free() before the handle is closed.
+**
+** lsm_batch_insert(), lsm_batch_delete() and lsm_batch_delete_range()
+** append an operation to the batch. They have the same semantics as
+** lsm_insert(), lsm_delete() and lsm_delete_range() respectively. The key
+** and value buffers are copied into the batch before these functions
+** return. lsm_batch_reset() removes all operations from a batch.
+**
+** lsm_write_batch() writes the operations in a batch to the database. If
+** no transaction is open, the batch is committed before lsm_write_batch()
+** returns. Otherwise, the batch is written as part of the innermost open
+** transaction. Either way, if an error occurs none of the operations in
+** the batch are applied. The batch itself is not modified.
+*/
+int lsm_batch_new(lsm_db *pDb, lsm_batch **ppBatch);
+int lsm_batch_insert(lsm_batch *, 
+    const void *pKey, int nKey, const void *pVal, int nVal
+);
+int lsm_batch_delete(lsm_batch *, const void *pKey, int nKey);
+int lsm_batch_delete_range(lsm_batch *, 
+    const void *pKey1, int nKey1, const void *pKey2, int nKey2
+);
+void lsm_batch_reset(lsm_batch *);
+void lsm_batch_free(lsm_batch *);
+
+int lsm_write_batch(lsm_db *pDb, lsm_batch *pBatch);
+
+/*
+** CAPI: Bulk Loading Sorted Data
+**
+** Write a sequence of entries, sorted in ascending order by key, directly
+** to a new segment in the database file. The entries bypass the in-memory
+** tree and the log file, so that each byte of data is written to disk
+** once only (until it is merged with other segments).
+**
+** The entries are obtained by repeatedly invoking the xNext callback. Each
+** call should set *ppKey, *pnKey, *ppVal and *pnVal to refer to the next
+** entry and return LSM_OK. The buffers need only remain valid until the
+** next invocation of xNext. Once all entries have been returned, xNext
+** should set *ppKey to NULL and return LSM_OK. If xNext returns any other
+** value, the bulk load is abandoned and the error code returned to the
+** caller.
+**
+** Each key must be strictly greater than the previous one (according to
+** the configured comparison function). Otherwise the bulk load is abandoned
+** and LSM_MISUSE returned. Loaded entries replace any older entries with
+** the same key.
+**
+** Before writing the new segment, the contents of the in-memory tree are
+** flushed to disk. The write lock is held for the duration of the call,
+** and the database is checkpointed before lsm_bulk_load() returns. The
+** xNext callback may not use the database handle. This function may not
+** be called if the handle has an open transaction or cursor. If another
+** connection is currently working on the database structure, LSM_BUSY
+** may be returned.
+*/
+int lsm_bulk_load(lsm_db *pDb,
+    int (*xNext)(void *, const void **ppKey, int *pnKey,
+                         const void **ppVal, int *pnVal),
+    void *pCtx
+);
+
 /*
 ** CAPI: Explicit Database Work and Checkpointing
 **
@@ -598,6 +1023,37 @@ int lsm_csr_close(lsm_cursor *pCsr);
 */
 int lsm_csr_seek(lsm_cursor *pCsr, const void *pKey, int nKey, int eSeek);
 
+/*
+** CAPI: Looking Up Many Keys At Once
+**
+** Search the database for each of the nKey keys in array apKey[]. The size
+** of each key in bytes is stored in the corresponding entry of anKey[].
+** For each key that is present in the database, the xFound callback is
+** invoked with the cursor pointing to the database entry. The first
+** argument passed to xFound is a copy of pCtx and the second the index of
+** the key in apKey[]. The callback may use lsm_csr_key() and 
+** lsm_csr_value() to read the entry.
+**
+** If xFound returns a value other than LSM_OK, no further keys are
+** searched for and that value is returned to the caller. Otherwise, 
+** LSM_OK is returned once all keys have been searched for, or an LSM
+** error code if an error occurs. In either case the cursor is left in 
+** the same state as if lsm_csr_seek(LSM_SEEK_EQ) had been called for 
+** the last key searched for.
+**
+** Each seek on a cursor remembers the path it took through the b-tree of
+** each segment, and the next seek begins its descent at the deepest page 
+** that may contain the key being sought. So although the keys may be 
+** passed in any order, the search is most efficient if they are sorted
+** in ascending or descending order.
+*/
+int lsm_csr_multiseek(
+  lsm_cursor *pCsr, 
+  int nKey, const void **apKey, const int *anKey,
+  int (*xFound)(void *pCtx, int iKey),
+  void *pCtx
+);
+
 int lsm_csr_first(lsm_cursor *pCsr);
 int lsm_csr_last(lsm_cursor *pCsr);
 
@@ -627,6 +1083,32 @@ int lsm_csr_last(lsm_cursor *pCsr);
 int lsm_csr_next(lsm_cursor *pCsr);
 int lsm_csr_prev(lsm_cursor *pCsr);
 
+/*
+** CAPI: Restricting Database Cursors To A Key Range
+**
+** Restrict the cursor passed as the first argument to keys that are 
+** greater than or equal to (pLower/nLower) and strictly less than 
+** (pUpper/nUpper). If either pointer is NULL or the corresponding size is 
+** zero, the range is unbounded in that direction. Passing two NULL bounds
+** removes any restriction set by a previous call.
+**
+** Once bounds have been set, all seek and step functions behave as if the
+** database contained only the keys within them. For example, 
+** lsm_csr_first() moves to the smallest key within the bounds and 
+** lsm_csr_next() leaves the cursor at EOF instead of moving past the upper
+** bound. Seeks are also able to skip sorted runs that contain no keys 
+** within the bounds.
+**
+** Bounds may be set at any time. The current cursor position is not 
+** modified - they take effect with the next seek or step operation. The
+** cursor makes its own copies of the two keys.
+*/
+int lsm_csr_set_bounds(
+  lsm_cursor *pCsr, 
+  const void *pLower, int nLower,
+  const void *pUpper, int nUpper
+);
+
 /*
 ** Values that may be passed as the fourth argument to lsm_csr_seek().
 */
@@ -53,6 +53,31 @@
 #define LSM_DFLT_MMAP               LSM_IS_64_BIT
 #define LSM_DFLT_MULTIPLE_PROCESSES 1
 #define LSM_DFLT_USE_LOG            1
+#define LSM_DFLT_BLOOM              0
+#define LSM_DFLT_BACKGROUND_WORK    0
+#define LSM_DFLT_GROUP_COMMIT       0
+#define LSM_DFLT_COMPACTION         LSM_COMPACTION_TIERED
+#define LSM_DFLT_LEVEL_BASE         (8 * 1024)
+#define LSM_DFLT_LEVEL_RATIO        10
+#define LSM_DFLT_MERGE_RATE         0
+#define LSM_DFLT_CHECKPOINT_RATE    0
+#define LSM_DFLT_MAX_OLD_TREES      1
+#define LSM_DFLT_CACHE_SIZE         (2 * 1024)
+#define LSM_DFLT_CACHE_POLICY       LSM_CACHE_LRU
+#define LSM_DFLT_READAHEAD          64
+#define LSM_DFLT_DIRECT_IO          LSM_DIRECT_IO_OFF
+#define LSM_DFLT_PREFIX_COMPRESSION 0
+#define LSM_DFLT_VALUE_THRESHOLD    0
+#define LSM_DFLT_LOG_PREALLOC       0
+
+/* Maximum number of bits per key in a bloom filter. */
+#define LSM_MAX_BLOOM_BITS          32
+
+/* Maximum restart interval for prefix compressed pages. */
+#define LSM_MAX_PREFIX_RESTART      255
+
+/* Maximum number of old in-memory trees waiting to be flushed. */
+#define LSM_MAX_OLD_TREES           8
 
 /* Initial values for log file checksums. These are only used if the 
 ** database file does not contain a valid checkpoint.  */
@@ -83,6 +108,7 @@ typedef struct MergeInput MergeInput;
 typedef struct MetaPage MetaPage;
 typedef struct MultiCursor MultiCursor;
 typedef struct Page Page;
+typedef struct PageCache PageCache;
 typedef struct Redirect Redirect;
 typedef struct Segment Segment;
 typedef struct SegmentMerger SegmentMerger;
@@ -90,12 +116,15 @@ typedef struct ShmChunk ShmChunk;
 typedef struct ShmHeader ShmHeader;
 typedef struct ShmReader ShmReader;
 typedef struct Snapshot Snapshot;
+typedef struct Trailer Trailer;
 typedef struct TransMark TransMark;
 typedef struct Tree Tree;
 typedef struct TreeCursor TreeCursor;
 typedef struct TreeHeader TreeHeader;
 typedef struct TreeMark TreeMark;
+typedef struct TreeOld TreeOld;
 typedef struct TreeRoot TreeRoot;
+typedef struct ValueSegment ValueSegment;
 
 #ifndef _SQLITEINT_H_
 typedef unsigned char u8;
@@ -157,6 +186,12 @@ int lsmErrorBkpt(int);
 
 #define LSM_MAX_BLOCK_REDIRECTS 16
 
+/*
+** Hard limit on the number of value segments (see struct ValueSegment)
+** that may exist at any one time. See also LSM_CONFIG_VALUE_THRESHOLD.
+*/
+#define LSM_MAX_VALUE_SEGMENTS 16
+
 #define LSM_ATTEMPTS_BEFORE_PROTOCOL 10000
 
 
@@ -172,6 +207,15 @@ int lsmErrorBkpt(int);
 #define LSM_SYSTEMKEY    0x20     /* True if entry is a system key (FREELIST) */
 
 #define LSM_CONTIGUOUS   0x40     /* Used in lsm_tree.c */
+#define LSM_VALUEREF     0x80     /* Value is stored in a value segment */
+
+/*
+** Operation codes used in the serialized form of a write batch (the
+** payload of a log file BATCH record). See lsmTreeInsertBatch().
+*/
+#define LSM_BATCH_INSERT       0x01
+#define LSM_BATCH_DELETE       0x02
+#define LSM_BATCH_DELETE_RANGE 0x03
 
 /*
 ** A string that can grow by appending.
@@ -269,8 +313,26 @@ struct TreeRoot {
   u32 iTransId;
 };
 
+/*
+** An "old" in-memory tree. A tree that has been made read-only by
+** lsmTreeMakeOld() and is waiting to be flushed to disk. 
+*/
+struct TreeOld {
+  TreeRoot root;                  /* Root and height of the old tree */
+  u32 iShmid;                     /* Last shm-id used by the old tree */
+  u32 cksum0;                     /* Log checksum 0 at end of old tree */
+  u32 cksum1;                     /* Log checksum 1 at end of old tree */
+  i64 iLog;                       /* Log offset associated with old tree */
+};
+
 /*
 ** Tree header structure. 
+**
+** aOld[]:
+**   Old trees waiting to be flushed to disk, oldest first. Each is flushed
+**   in turn by the worker, after which the log offset stored in the worker
+**   snapshot is equal to TreeOld.iLog. It is discarded by the next writer
+**   to observe this. No two entries in aOld[] share an iLog value.
 */
 struct TreeHeader {
   u32 iUsedShmid;                 /* Id of first shm chunk used by this tree */
@@ -279,12 +341,9 @@ struct TreeHeader {
   u32 nChunk;                     /* Number of chunks in shared-memory file */
   TreeRoot root;                  /* Root and height of current tree */
   u32 iWrite;                     /* Write offset in shm file */
-  TreeRoot oldroot;               /* Root and height of the previous tree */
-  u32 iOldShmid;                  /* Last shm-id used by previous tree */
   u32 iUsrVersion;                /* get/set_user_version() value */
-  i64 iOldLog;                    /* Log offset associated with old tree */
-  u32 oldcksum0;
-  u32 oldcksum1;
+  u32 nOld;                       /* Number of valid entries in aOld[] */
+  TreeOld aOld[LSM_MAX_OLD_TREES];/* Old trees, oldest first */
   DbLog log;                      /* Current layout of log file */ 
   u32 aCksum[2];                  /* Checksums 1 and 2. */
 };
@@ -339,6 +398,22 @@ struct lsm_db {
   i64 nAutockpt;                  /* Configured by LSM_CONFIG_AUTOCHECKPOINT */
   int bMultiProc;                 /* Configured by L_C_MULTIPLE_PROCESSES */
   int bReadonly;                  /* Configured by LSM_CONFIG_READONLY */
+  int nBloomBits;                 /* Configured by LSM_CONFIG_BLOOM */
+  int bBgWork;                    /* Configured by LSM_CONFIG_BACKGROUND_WORK */
+  int nGroupCommit;               /* Configured by LSM_CONFIG_GROUP_COMMIT */
+  int eCompaction;                /* Configured by LSM_CONFIG_COMPACTION */
+  int nLevelBase;                 /* Configured by LSM_CONFIG_LEVEL_BASE */
+  int nLevelRatio;                /* Configured by LSM_CONFIG_LEVEL_RATIO */
+  int nMergeRate;                 /* Configured by LSM_CONFIG_MERGE_RATE */
+  int nCkptRate;                  /* Configured by L_C_CHECKPOINT_RATE */
+  int nMaxOld;                    /* Configured by LSM_CONFIG_MAX_OLD_TREES */
+  int nCacheSize;                 /* Configured by LSM_CONFIG_CACHE_SIZE */
+  int eCachePolicy;               /* Configured by LSM_CONFIG_CACHE_POLICY */
+  int nReadAhead;                 /* Configured by LSM_CONFIG_READAHEAD */
+  int eDirectIo;                  /* Configured by LSM_CONFIG_DIRECT_IO */
+  int nPrefixRestart;             /* Configured by L_C_PREFIX_COMPRESSION */
+  int nValueThreshold;            /* Configured by L_C_VALUE_THRESHOLD */
+  int nLogPrealloc;               /* Configured by L_C_LOG_PREALLOC */
   lsm_compress compress;          /* Compression callbacks */
   lsm_compress_factory factory;   /* Compression callback factory */
 
@@ -393,10 +468,27 @@ struct Segment {
   Pgno iLastPg;                    /* Last page of this run */
   Pgno iRoot;                      /* Root page number (if any) */
   int nSize;                       /* Size of this run in pages */
+  u32 iCmpId;                      /* Compression id used for this run */
 
   Redirect *pRedirect;             /* Block redirects (or NULL) */
 };
 
+/*
+** A value segment is a chain of pages in the database file used to store
+** large values separately from the sorted runs that refer to them (see
+** LSM_CONFIG_VALUE_THRESHOLD). Records that refer to a value segment have
+** the LSM_VALUEREF flag set.
+**
+** nLive:
+**   Total size in bytes of the values within the segment that are still
+**   referred to by records in the sorted runs. Once this drops to zero
+**   the segment may be deleted.
+*/
+struct ValueSegment {
+  Segment seg;                    /* Pages used by this value segment */
+  i64 nLive;                      /* Bytes of value data still referenced */
+};
+
 /*
 ** iSplitTopic/pSplitKey/nSplitKey:
 **   If nRight>0, this buffer contains a copy of the largest key that has
@@ -441,6 +533,12 @@ struct Level {
 ** iOutputOff:
 **   The byte offset to write to next within the last page of the 
 **   output segment.
+**
+** nKey:
+**   The number of user keys written to the output segment so far. Used to
+**   size the bloom filter once the merge is finished. Or -1 if the output
+**   may not have a bloom filter, because it contains range-delete markers
+**   or because the merge was begun by a version that did not count keys.
 */
 struct MergeInput {
   Pgno iPg;                       /* Page on which next input is stored */
@@ -453,6 +551,7 @@ struct Merge {
   int nSkip;                      /* Number of separators entries to skip */
   int iOutputOff;                 /* Write offset on output page */
   Pgno iCurrentPtr;               /* Current pointer value */
+  int nKey;                       /* User keys written so far (or -1) */
 };
 
 /* 
@@ -486,6 +585,11 @@ struct ShmReader {
 **   value is set to 0. Otherwise, it is set to the meta-page number that
 **   contains the most recently written checkpoint (either 1 or 2).
 **
+** iReuse:
+**   Incremented by a worker each time it reuses a block from the free 
+**   block list. Used to invalidate the page caches of other processes.
+**   See the comments above struct PageCache in lsm_file.c.
+**
 ** hdr1, hdr2:
 **   The two copies of the in-memory tree header. Two copies are required
 **   in case a writer fails while updating one of them.
@@ -495,6 +599,7 @@ struct ShmHeader {
   u32 aSnap2[LSM_META_PAGE_SIZE / 4];
   u32 bWriter;
   u32 iMetaPage;
+  u32 iReuse;
   TreeHeader hdr1;
   TreeHeader hdr2;
   ShmReader aReader[LSM_LOCK_NREADER];
@@ -560,10 +665,18 @@ struct FreelistEntry {
 struct Snapshot {
   Database *pDatabase;            /* Database this snapshot belongs to */
   u32 iCmpId;                     /* Id of compression scheme */
+  int eCksum;                     /* Checksum algorithm (LSM_CKSUM_*) */
   Level *pLevel;                  /* Pointer to level 0 of snapshot (or NULL) */
   i64 iId;                        /* Snapshot id */
+  u32 aCksum[2];                  /* Checksum of checkpoint */
   i64 iLogOff;                    /* Log file offset */
   Redirect redirect;              /* Block redirection array */
+  int nValue;                     /* Number of entries in aValue[] */
+  ValueSegment aValue[LSM_MAX_VALUE_SEGMENTS];  /* aValue[0] is active */
+  Trailer *pTrailer;              /* Run trailers loaded from db file */
+
+  /* Used by client snapshots only */
+  int nRef;                       /* Number of references to this object */
 
   /* Used by worker snapshots only */
   int nBlock;                     /* Number of blocks in database file */
@@ -589,6 +702,7 @@ int lsmCheckpointStore(lsm_db *pDb, int);
 int lsmCheckpointLoad(lsm_db *pDb, int *);
 int lsmCheckpointLoadOk(lsm_db *pDb, int);
 int lsmCheckpointClientCacheOk(lsm_db *);
+int lsmCheckpointSnapshotOk(Snapshot *, u32 *);
 
 u32 lsmCheckpointNBlock(u32 *);
 i64 lsmCheckpointId(u32 *, int);
@@ -596,8 +710,10 @@ u32 lsmCheckpointNWrite(u32 *, int);
 i64 lsmCheckpointLogOffset(u32 *);
 int lsmCheckpointPgsz(u32 *);
 int lsmCheckpointBlksz(u32 *);
+int lsmCheckpointCksum(u32 *);
 void lsmCheckpointLogoffset(u32 *aCkpt, DbLog *pLog);
 void lsmCheckpointZeroLogoffset(lsm_db *);
+void lsmCheckpointSetCksum(lsm_db *, int);
 
 int lsmCheckpointSaveWorker(lsm_db *pDb, int);
 int lsmDatabaseFull(lsm_db *pDb);
@@ -615,17 +731,21 @@ void lsmTreeRelease(lsm_env *, Tree *);
 int lsmTreeInit(lsm_db *);
 int lsmTreeRepair(lsm_db *);
 
-void lsmTreeMakeOld(lsm_db *pDb);
+int lsmTreeMakeOld(lsm_db *pDb);
 void lsmTreeDiscardOld(lsm_db *pDb);
+int lsmTreeDiscardFlushed(lsm_db *pDb, i64 iLogOff);
 int lsmTreeHasOld(lsm_db *pDb);
+int lsmTreeFirstUnflushed(lsm_db *pDb, i64 iLogOff);
 
 int lsmTreeSize(lsm_db *);
+int lsmTreePressure(lsm_db *);
 int lsmTreeEndTransaction(lsm_db *pDb, int bCommit);
 int lsmTreeLoadHeader(lsm_db *pDb, int *);
 int lsmTreeLoadHeaderOk(lsm_db *, int);
 
 int lsmTreeInsert(lsm_db *pDb, void *pKey, int nKey, void *pVal, int nVal);
 int lsmTreeDelete(lsm_db *db, void *pKey1, int nKey1, void *pKey2, int nKey2);
+int lsmTreeInsertBatch(lsm_db *pDb, u8 *aBatch, int nBatch);
 void lsmTreeRollback(lsm_db *pDb, TreeMark *pMark);
 void lsmTreeMark(lsm_db *pDb, TreeMark *pMark);
 
@@ -675,11 +795,20 @@ int lsmMutexHeld(lsm_env *, lsm_mutex *);
 int lsmMutexNotHeld(lsm_env *, lsm_mutex *);
 #endif
 
+int lsmThreadsAvailable(lsm_env *);
+int lsmThreadNew(lsm_env*, void (*)(void *), void *, lsm_thread **);
+void lsmThreadJoin(lsm_env*, lsm_thread *);
+int lsmCondNew(lsm_env*, lsm_cond **);
+void lsmCondDel(lsm_env*, lsm_cond *);
+void lsmCondWait(lsm_env*, lsm_cond *, lsm_mutex *);
+void lsmCondBroadcast(lsm_env*, lsm_cond *);
+
 /**************************************************************************
 ** Start of functions from "lsm_file.c".
 */
 int lsmFsOpen(lsm_db *, const char *, int);
 int lsmFsOpenLog(lsm_db *, int *);
+int lsmFsOpenLogReadonly(lsm_db *, lsm_file **);
 void lsmFsCloseLog(lsm_db *);
 void lsmFsClose(FileSystem *);
 
@@ -694,10 +823,11 @@ void lsmFsSetPageSize(FileSystem *, int);
 int lsmFsFileid(lsm_db *pDb, void **ppId, int *pnId);
 
 /* Creating, populating, gobbling and deleting sorted runs. */
-void lsmFsGobble(lsm_db *, Segment *, Pgno *, int);
+int lsmFsGobble(lsm_db *, Segment *, Pgno *, int);
 int lsmFsSortedDelete(FileSystem *, Snapshot *, int, Segment *);
 int lsmFsSortedFinish(FileSystem *, Segment *);
 int lsmFsSortedAppend(FileSystem *, Snapshot *, Level *, int, Page **);
+int lsmFsValueAppend(FileSystem *, Segment *, Page **);
 int lsmFsSortedPadding(FileSystem *, Snapshot *, Segment *);
 
 /* Functions to retrieve the lsm_env pointer from a FileSystem or Page object */
@@ -736,18 +866,26 @@ int lsmFsPageWritable(Page *);
 
 /* Functions to read, write and sync the log file. */
 int lsmFsWriteLog(FileSystem *pFS, i64 iOff, LsmString *pStr);
+int lsmFsFlushLog(FileSystem *pFS, int bDiscard);
 int lsmFsSyncLog(FileSystem *pFS);
-int lsmFsReadLog(FileSystem *pFS, i64 iOff, int nRead, LsmString *pStr);
+int lsmFsReadLog(FileSystem *, lsm_file *, i64, int, LsmString *);
 int lsmFsTruncateLog(FileSystem *pFS, i64 nByte);
 int lsmFsTruncateDb(FileSystem *pFS, i64 nByte);
 int lsmFsCloseAndDeleteLog(FileSystem *pFS);
+int lsmFsCloseAndResetLog(FileSystem *pFS, i64 iOff);
 
 void lsmFsDeferClose(FileSystem *pFS, LsmFile **pp);
 
 /* And to sync the db file */
 int lsmFsSyncDb(FileSystem *, int);
 
+/* Rate limiting of merge and checkpoint writes. */
+#define LSM_IO_MERGE      0
+#define LSM_IO_CHECKPOINT 1
+void lsmFsThrottle(FileSystem *, int eClass, i64 nByte);
+
 void lsmFsFlushWaiting(FileSystem *, int *);
+void lsmFsFlushBatch(FileSystem *, int *);
 
 /* Used by lsm_info(ARRAY_STRUCTURE) and lsm_config(MMAP) */
 int lsmInfoArrayStructure(lsm_db *pDb, int bBlock, Pgno iFirst, char **pzOut);
@@ -764,12 +902,20 @@ void lsmEnvShmBarrier(lsm_env *);
 void lsmEnvShmUnmap(lsm_env *, lsm_file *, int);
 
 void lsmEnvSleep(lsm_env *, int);
+int lsmEnvCurrentTime(lsm_env *, i64 *);
 
 int lsmFsReadSyncedId(lsm_db *db, int, i64 *piVal);
 
 int lsmFsSegmentContainsPg(FileSystem *pFS, Segment *, Pgno, int *);
 Pgno lsmFsRedirectPage(FileSystem *, Redirect *, Pgno);
 
+/* Page cache shared by all connections to a database within a process */
+int lsmFsCacheNew(lsm_env *, int, PageCache **);
+void lsmFsCacheFree(lsm_env *, PageCache *);
+int lsmFsCacheSize(FileSystem *, int);
+int lsmFsCachePolicy(FileSystem *, int);
+void lsmFsCacheReuse(lsm_db *, int);
+void lsmFsCacheCheck(lsm_db *);
 void lsmFsPurgeCache(FileSystem *);
 
 /*
@@ -792,6 +938,7 @@ int lsmFlushTreeToDisk(lsm_db *pDb);
 void lsmSortedRemap(lsm_db *pDb);
 
 void lsmSortedFreeLevel(lsm_env *pEnv, Level *);
+void lsmSortedFreeTrailer(lsm_env *pEnv, Trailer *);
 
 int lsmSortedAdvanceAll(lsm_db *pDb);
 
@@ -805,6 +952,7 @@ void lsmSortedSaveTreeCursors(lsm_db *);
 int lsmMCursorNew(lsm_db *, MultiCursor **);
 void lsmMCursorClose(MultiCursor *, int);
 int lsmMCursorSeek(MultiCursor *, int, void *, int , int);
+int lsmMCursorSetBounds(MultiCursor *, const void *, int, const void *, int);
 int lsmMCursorFirst(MultiCursor *);
 int lsmMCursorPrev(MultiCursor *);
 int lsmMCursorLast(MultiCursor *);
@@ -814,6 +962,7 @@ int lsmMCursorKey(MultiCursor *, void **, int *);
 int lsmMCursorValue(MultiCursor *, void **, int *);
 int lsmMCursorType(MultiCursor *, int *);
 lsm_db *lsmMCursorDb(MultiCursor *);
+void lsmMCursorReset(MultiCursor *);
 void lsmMCursorFreeCache(lsm_db *);
 
 int lsmSaveCursors(lsm_db *pDb);
@@ -839,6 +988,21 @@ int lsmVarintGet64(const u8 *aData, i64 *piVal);
 int lsmVarintLen32(int);
 int lsmVarintSize(u8 c);
 
+/* 
+** Functions from file "lsm_lz.c".
+*/
+void lsmLzCompression(lsm_compress *);
+
+/* 
+** Functions from file "lsm_cksum.c".
+*/
+#define LSM_CKSUM_FLETCHER 0
+#define LSM_CKSUM_CRC32C   1
+
+void lsmChecksumBytes(int, const char *, int, u32 *, u32 *);
+void lsmChecksumInts(const u32 *, int, u32 *, u32 *);
+int lsmChecksumHardware(int);
+
 /* 
 ** Functions from file "main.c".
 */
@@ -850,6 +1014,7 @@ int lsmInfoFreelist(lsm_db *pDb, char **pzOut);
 */
 int lsmLogBegin(lsm_db *pDb);
 int lsmLogWrite(lsm_db *, void *, int, void *, int);
+int lsmLogBatch(lsm_db *, void *, int);
 int lsmLogCommit(lsm_db *);
 void lsmLogEnd(lsm_db *pDb, int bCommit);
 void lsmLogTell(lsm_db *, LogMark *);
@@ -867,6 +1032,16 @@ int lsmInfoLogStructure(lsm_db *pDb, char **pzVal);
 int lsmDbDatabaseConnect(lsm_db*, const char *);
 void lsmDbDatabaseRelease(lsm_db *);
 
+int lsmDbBgStart(lsm_db *);
+void lsmDbBgStop(lsm_db *);
+void lsmDbBgSignal(lsm_db *, int);
+
+int lsmDbGroupCommitRegister(lsm_db *, i64 *);
+int lsmDbGroupCommitSync(lsm_db *, i64);
+void lsmDbGroupCommitInfo(lsm_db *, int *, int *);
+
+PageCache *lsmDbPageCache(lsm_db *);
+
 int lsmBeginReadTrans(lsm_db *);
 int lsmBeginWriteTrans(lsm_db *);
 int lsmBeginFlush(lsm_db *);
@@ -910,6 +1085,10 @@ DbLog *lsmDatabaseLog(lsm_db *pDb);
 #endif
 
 void lsmFreeSnapshot(lsm_env *, Snapshot *);
+int lsmClientSnapshotLoad(lsm_db *);
+void lsmClientSnapshotRelease(lsm_db *);
+void lsmClientSnapshotEnter(lsm_db *);
+void lsmClientSnapshotLeave(lsm_db *);
 
 
 /* Candidate values for the 3rd argument to lsmShmLock() */
@@ -935,10 +1114,13 @@ int lsmTreeInUse(lsm_db *db, u32 iLsmId, int *pbInUse);
 int lsmFreelistAppend(lsm_env *pEnv, Freelist *p, int iBlk, i64 iId);
 
 int lsmDbMultiProc(lsm_db *);
+int lsmDbDirectIo(lsm_db *);
 void lsmDbDeferredClose(lsm_db *, lsm_file *, LsmFile *);
 LsmFile *lsmDbRecycleFd(lsm_db *);
 
 int lsmWalkFreelist(lsm_db *, int, int (*)(void *, int, i64), void *);
+int lsmFreelistCacheOk(lsm_db *);
+void lsmFreelistCacheSave(lsm_db *, int);
 
 int lsmCheckCompressionId(lsm_db *, u32);
 
@@ -31,11 +31,14 @@
 **     1. The checkpoint id MSW.
 **     2. The checkpoint id LSW.
 **     3. The number of integer values in the entire checkpoint, including 
-**        the two checksum values.
+**        the two checksum values (least significant 16-bits). And the
+**        algorithm used for checkpoint and log checksums (most significant
+**        16-bits, LSM_CKSUM_FLETCHER or LSM_CKSUM_CRC32C).
 **     4. The compression scheme id.
 **     5. The total number of blocks in the database.
 **     6. The block size.
-**     7. The number of levels.
+**     7. The number of levels (least significant 16-bits). And the number
+**        of value segments (most significant 16-bits).
 **     8. The nominal database page size.
 **     9. The number of pages (in total) written to the database file.
 **
@@ -63,8 +66,8 @@
 **     0. Age of the level (least significant 16-bits). And flags mask (most
 **        significant 16-bits).
 **     1. The number of right-hand segments (nRight, possibly 0),
-**     2. Segment record for left-hand segment (8 integers defined below),
-**     3. Segment record for each right-hand segment (8 integers defined below),
+**     2. Segment record for left-hand segment (8 or 9 integers, see below),
+**     3. Segment record for each right-hand segment (8 or 9 integers),
 **     4. If nRight>0, The number of segments involved in the merge
 **     5. if nRight>0, Current nSkip value (see Merge structure defn.),
 **     6. For each segment in the merge:
@@ -74,6 +77,17 @@
 **     7. Page containing current split-key (64-bits - 2 integers).
 **     8. Cell within page containing current split-key.
 **     9. Current pointer value (64-bits - 2 integers).
+**    10. If nRight>0, the number of user keys written to the output segment
+**        so far (see Merge.nKey). Only present if the CKPT_LEVEL_NKEY bit
+**        is set in the flags mask.
+**
+**   For each value segment (see LSM_CONFIG_VALUE_THRESHOLD), starting with
+**   the active segment, four 64-bit fields (8 integers):
+**
+**     1. First page of the segment,
+**     2. Last page of the segment,
+**     3. Size of the segment in pages,
+**     4. Number of bytes of value data still referred to by the database.
 **
 **   The block redirect array:
 **
@@ -106,6 +120,13 @@
 **     2. Last page of array,
 **     3. Root page of array (or 0),
 **     4. Size of array in pages.
+**
+** If the CKPT_LEVEL_CMPID bit is set in the flags mask of a level record,
+** each segment record of the level is followed by a 32-bit integer - the
+** id of the compression scheme used for the segment's pages. Otherwise,
+** all segments of the level use the scheme identified by the checkpoint
+** header. The bit is only set if at least one segment of the level uses 
+** a different scheme (see LSM_CONFIG_SET_COMPRESSION_FACTORY).
 */
 
 /*
@@ -123,11 +144,18 @@
 **   * For each level in the database that is undergoing a merge, add 
 **     the number of segments on the rhs of the level.
 **
+**   * For each value segment in the database, add 1.
+**
 ** A level record not undergoing a merge is 10 integers. A level record 
 ** with nRhs rhs segments and (nRhs+1) input segments (i.e. including the 
 ** separators from the next level) is (11*nRhs+20) integers. The maximum
 ** per right-hand-side level is therefore 21 integers. So the maximum
-** size of all level records in a checkpoint is 21*40=820 integers.
+** size of all level records in a checkpoint is 21*40=820 integers. Levels
+** with per-segment compression ids (CKPT_LEVEL_CMPID) require one more
+** integer for each segment, or 22*40=880 integers in total, plus one key
+** count (CKPT_LEVEL_NKEY) for each level undergoing a merge. A value
+** segment record is 8 integers, so counting each value segment as a rhs
+** segment keeps within the same bound.
 **
 ** TODO: Before pointer values were changed from 32 to 64 bits, the above
 ** used to come to 420 bytes - leaving significant space for a free-list
@@ -201,6 +229,26 @@ static const int one = 1;
 #define CKPT_HDR_LO_CKSUM1 11
 #define CKPT_HDR_LO_CKSUM2 12
 
+/*
+** Extract the size of the checkpoint in integers and the checksum algorithm
+** from the value of the CKPT_HDR_NCKPT field.
+*/
+#define CKPT_NCKPT(x) ((x) & 0xFFFF)
+#define CKPT_CKSUM(x) ((int)((x) >> 16))
+
+/*
+** Bit set in the flags mask of a level record if its segment records are
+** followed by compression ids. This bit is never set in Level.flags.
+*/
+#define CKPT_LEVEL_CMPID  0x8000
+
+/*
+** Bit set in the flags mask of a level record undergoing a merge if the
+** merge record ends with the number of user keys written so far. This bit
+** is never set in Level.flags.
+*/
+#define CKPT_LEVEL_NKEY   0x4000
+
 typedef struct CkptBuffer CkptBuffer;
 
 /*
@@ -219,13 +267,18 @@ struct CkptBuffer {
 ** The value of the nCkpt parameter includes the two checksum values at
 ** the end of the checkpoint. They are not used as inputs to the checksum 
 ** calculation. The checksum is based on the array of (nCkpt-2) integers
-** at aCkpt[].
+** at aCkpt[], using the algorithm identified by the checkpoint header.
 */
 static void ckptChecksum(u32 *aCkpt, u32 nCkpt, u32 *piCksum1, u32 *piCksum2){
   int i;
   u32 cksum1 = 1;
   u32 cksum2 = 2;
 
+  if( CKPT_CKSUM(aCkpt[CKPT_HDR_NCKPT])==LSM_CKSUM_CRC32C ){
+    lsmChecksumInts(aCkpt, nCkpt-2, piCksum1, piCksum2);
+    return;
+  }
+
   if( nCkpt % 2 ){
     cksum1 += aCkpt[nCkpt-3] & 0x0000FFFF;
     cksum2 += aCkpt[nCkpt-3] & 0xFFFF0000;
@@ -301,11 +354,22 @@ static i64 ckptGobble64(u32 *a, int *piIn){
 
 
 /*
-** Append a 6-value segment record corresponding to pSeg to the checkpoint 
-** buffer passed as the third argument.
+** Return the compression id used by segment pSeg of a database with 
+** compression id iCmpId.
+*/
+static u32 ckptSegmentCmpId(Segment *pSeg, u32 iCmpId){
+  return (pSeg->iCmpId==LSM_COMPRESSION_EMPTY ? iCmpId : pSeg->iCmpId);
+}
+
+/*
+** Append an 8-value segment record corresponding to pSeg to the checkpoint 
+** buffer passed as the third argument. If bCmpId is true, follow it with
+** the segment's compression id.
 */
 static void ckptExportSegment(
   Segment *pSeg, 
+  int bCmpId,
+  u32 iCmpId,
   CkptBuffer *p, 
   int *piOut, 
   int *pRc
@@ -314,27 +378,41 @@ static void ckptExportSegment(
   ckptAppend64(p, piOut, pSeg->iLastPg, pRc);
   ckptAppend64(p, piOut, pSeg->iRoot, pRc);
   ckptAppend64(p, piOut, pSeg->nSize, pRc);
+  if( bCmpId ){
+    ckptSetValue(p, (*piOut)++, ckptSegmentCmpId(pSeg, iCmpId), pRc);
+  }
 }
 
 static void ckptExportLevel(
   Level *pLevel,                  /* Level object to serialize */
+  u32 iCmpId,                     /* Database compression id */
   CkptBuffer *p,                  /* Append new level record to this ckpt */
   int *piOut,                     /* IN/OUT: Size of checkpoint so far */
   int *pRc                        /* IN/OUT: Error code */
 ){
   int iOut = *piOut;
   Merge *pMerge;
+  u32 flags = pLevel->flags;
+  int bCmpId;
+  int i;
+
+  /* Set bCmpId if any segment uses a scheme other than the default */
+  bCmpId = (ckptSegmentCmpId(&pLevel->lhs, iCmpId)!=iCmpId);
+  for(i=0; i<pLevel->nRight; i++){
+    if( ckptSegmentCmpId(&pLevel->aRhs[i], iCmpId)!=iCmpId ) bCmpId = 1;
+  }
+  if( bCmpId ) flags |= CKPT_LEVEL_CMPID;
+  if( pLevel->pMerge ) flags |= CKPT_LEVEL_NKEY;
 
   pMerge = pLevel->pMerge;
-  ckptSetValue(p, iOut++, (u32)pLevel->iAge + (u32)(pLevel->flags<<16), pRc);
+  ckptSetValue(p, iOut++, (u32)pLevel->iAge + (flags<<16), pRc);
   ckptSetValue(p, iOut++, pLevel->nRight, pRc);
-  ckptExportSegment(&pLevel->lhs, p, &iOut, pRc);
+  ckptExportSegment(&pLevel->lhs, bCmpId, iCmpId, p, &iOut, pRc);
 
   assert( (pLevel->nRight>0)==(pMerge!=0) );
   if( pMerge ){
-    int i;
     for(i=0; i<pLevel->nRight; i++){
-      ckptExportSegment(&pLevel->aRhs[i], p, &iOut, pRc);
+      ckptExportSegment(&pLevel->aRhs[i], bCmpId, iCmpId, p, &iOut, pRc);
     }
     assert( pMerge->nInput==pLevel->nRight 
          || pMerge->nInput==pLevel->nRight+1 
@@ -348,6 +426,7 @@ static void ckptExportLevel(
     ckptAppend64(p, &iOut, pMerge->splitkey.iPg, pRc);
     ckptSetValue(p, iOut++, pMerge->splitkey.iCell, pRc);
     ckptAppend64(p, &iOut, pMerge->iCurrentPtr, pRc);
+    ckptSetValue(p, iOut++, (u32)pMerge->nKey, pRc);
   }
 
   *piOut = iOut;
@@ -355,6 +434,12 @@ static void ckptExportLevel(
 
 /*
 ** Populate the log offset fields of the checkpoint buffer. 4 values.
+**
+** If bFlush is true, the worker has just flushed one or more old in-memory
+** trees to disk. In this case the log offset and checksums are those of
+** the newest tree flushed, as recorded in the worker snapshot by 
+** sortedNewToplevel(). Otherwise, they are copied from the previous 
+** snapshot.
 */
 static void ckptExportLog(
   lsm_db *pDb, 
@@ -364,14 +449,18 @@ static void ckptExportLog(
   int *pRc
 ){
   int iOut = *piOut;
+  int iOld = -1;                  /* Index of flushed tree in aOld[] */
 
   assert( iOut==CKPT_HDR_LO_MSW );
 
   if( bFlush ){
-    i64 iOff = pDb->treehdr.iOldLog;
-    ckptAppend64(p, &iOut, iOff, pRc);
-    ckptSetValue(p, iOut++, pDb->treehdr.oldcksum0, pRc);
-    ckptSetValue(p, iOut++, pDb->treehdr.oldcksum1, pRc);
+    iOld = lsmTreeFirstUnflushed(pDb, pDb->pWorker->iLogOff) - 1;
+  }
+  if( iOld>=0 ){
+    TreeOld *pOld = &pDb->treehdr.aOld[iOld];
+    ckptAppend64(p, &iOut, pOld->iLog, pRc);
+    ckptSetValue(p, iOut++, pOld->cksum0, pRc);
+    ckptSetValue(p, iOut++, pOld->cksum1, pRc);
   }else{
     for(; iOut<=CKPT_HDR_LO_CKSUM2; iOut++){
       ckptSetValue(p, iOut, pDb->pShmhdr->aSnap2[iOut], pRc);
@@ -431,10 +520,19 @@ static int ckptExportSnapshot(
   /* Serialize nLevel levels. */
   iLevel = 0;
   for(pLevel=lsmDbSnapshotLevel(pSnap); iLevel<nLevel; pLevel=pLevel->pNext){
-    ckptExportLevel(pLevel, &ckpt, &iOut, &rc);
+    ckptExportLevel(pLevel, pDb->compress.iId, &ckpt, &iOut, &rc);
     iLevel++;
   }
 
+  /* Write the value segments */
+  for(i=0; i<pSnap->nValue; i++){
+    ValueSegment *pVal = &pSnap->aValue[i];
+    ckptAppend64(&ckpt, &iOut, pVal->seg.iFirst, &rc);
+    ckptAppend64(&ckpt, &iOut, pVal->seg.iLastPg, &rc);
+    ckptAppend64(&ckpt, &iOut, pVal->seg.nSize, &rc);
+    ckptAppend64(&ckpt, &iOut, pVal->nLive, &rc);
+  }
+
   /* Write the block-redirect list */
   ckptSetValue(&ckpt, iOut++, pSnap->redirect.n, &rc);
   for(i=0; i<pSnap->redirect.n; i++){
@@ -462,11 +560,11 @@ static int ckptExportSnapshot(
   );
   ckptSetValue(&ckpt, CKPT_HDR_ID_MSW, (u32)(iId>>32), &rc);
   ckptSetValue(&ckpt, CKPT_HDR_ID_LSW, (u32)(iId&0xFFFFFFFF), &rc);
-  ckptSetValue(&ckpt, CKPT_HDR_NCKPT, iOut+2, &rc);
+  ckptSetValue(&ckpt, CKPT_HDR_NCKPT, (iOut+2) | (pSnap->eCksum<<16), &rc);
   ckptSetValue(&ckpt, CKPT_HDR_CMPID, pDb->compress.iId, &rc);
   ckptSetValue(&ckpt, CKPT_HDR_NBLOCK, pSnap->nBlock, &rc);
   ckptSetValue(&ckpt, CKPT_HDR_BLKSZ, lsmFsBlockSize(pFS), &rc);
-  ckptSetValue(&ckpt, CKPT_HDR_NLEVEL, nLevel, &rc);
+  ckptSetValue(&ckpt, CKPT_HDR_NLEVEL, nLevel | (pSnap->nValue<<16), &rc);
   ckptSetValue(&ckpt, CKPT_HDR_PGSZ, lsmFsPageSize(pFS), &rc);
   ckptSetValue(&ckpt, CKPT_HDR_NWRITE, pSnap->nWrite, &rc);
 
@@ -504,6 +602,8 @@ static int ckptExportSnapshot(
 static void ckptNewSegment(
   u32 *aIn,
   int *piIn,
+  int bCmpId,                     /* True if record includes compression id */
+  u32 iCmpId,                     /* Database compression id */
   Segment *pSegment               /* Populate this structure */
 ){
   assert( pSegment->iFirst==0 && pSegment->iLastPg==0 );
@@ -512,10 +612,17 @@ static void ckptNewSegment(
   pSegment->iLastPg = ckptGobble64(aIn, piIn);
   pSegment->iRoot = ckptGobble64(aIn, piIn);
   pSegment->nSize = ckptGobble64(aIn, piIn);
+  pSegment->iCmpId = (bCmpId ? aIn[(*piIn)++] : iCmpId);
   assert( pSegment->iFirst );
 }
 
-static int ckptSetupMerge(lsm_db *pDb, u32 *aInt, int *piIn, Level *pLevel){
+static int ckptSetupMerge(
+  lsm_db *pDb, 
+  u32 *aInt, 
+  int *piIn, 
+  int bNKey,                      /* True if the record includes Merge.nKey */
+  Level *pLevel
+){
   Merge *pMerge;                  /* Allocated Merge object */
   int nInput;                     /* Number of input segments in merge */
   int iIn = *piIn;                /* Next value to read from aInt[] */
@@ -541,6 +648,7 @@ static int ckptSetupMerge(lsm_db *pDb, u32 *aInt, int *piIn, Level *pLevel){
   pMerge->splitkey.iPg = ckptGobble64(aInt, &iIn);
   pMerge->splitkey.iCell = (int)aInt[iIn++];
   pMerge->iCurrentPtr = ckptGobble64(aInt, &iIn);
+  pMerge->nKey = (bNKey ? (int)aInt[iIn++] : -1);
 
   /* Set *piIn and return LSM_OK. */
   *piIn = iIn;
@@ -553,6 +661,7 @@ static int ckptLoadLevels(
   u32 *aIn, 
   int *piIn, 
   int nLevel,
+  u32 iCmpId,                     /* Database compression id */
   Level **ppLevel
 ){
   int i;
@@ -564,6 +673,8 @@ static int ckptLoadLevels(
   ppNext = &pRet;
   for(i=0; rc==LSM_OK && i<nLevel; i++){
     int iRight;
+    int bCmpId;
+    int bNKey;
     Level *pLevel;
 
     /* Allocate space for the Level structure and Level.apRight[] array */
@@ -571,27 +682,32 @@ static int ckptLoadLevels(
     if( rc==LSM_OK ){
       pLevel->iAge = (u16)(aIn[iIn] & 0x0000FFFF);
       pLevel->flags = (u16)((aIn[iIn]>>16) & 0x0000FFFF);
+      bCmpId = (pLevel->flags & CKPT_LEVEL_CMPID) ? 1 : 0;
+      bNKey = (pLevel->flags & CKPT_LEVEL_NKEY) ? 1 : 0;
+      pLevel->flags &= ~(CKPT_LEVEL_CMPID|CKPT_LEVEL_NKEY);
       iIn++;
       pLevel->nRight = aIn[iIn++];
       if( pLevel->nRight ){
         int nByte = sizeof(Segment) * pLevel->nRight;
         pLevel->aRhs = (Segment *)lsmMallocZeroRc(pDb->pEnv, nByte, &rc);
       }
-      if( rc==LSM_OK ){
+      if( rc!=LSM_OK ){
+        lsmFree(pDb->pEnv, pLevel);
+      }else{
         *ppNext = pLevel;
         ppNext = &pLevel->pNext;
 
         /* Allocate the main segment */
-        ckptNewSegment(aIn, &iIn, &pLevel->lhs);
+        ckptNewSegment(aIn, &iIn, bCmpId, iCmpId, &pLevel->lhs);
 
         /* Allocate each of the right-hand segments, if any */
         for(iRight=0; iRight<pLevel->nRight; iRight++){
-          ckptNewSegment(aIn, &iIn, &pLevel->aRhs[iRight]);
+          ckptNewSegment(aIn, &iIn, bCmpId, iCmpId, &pLevel->aRhs[iRight]);
         }
 
         /* Set up the Merge object, if required */
         if( pLevel->nRight>0 ){
-          rc = ckptSetupMerge(pDb, aIn, &iIn, pLevel);
+          rc = ckptSetupMerge(pDb, aIn, &iIn, bNKey, pLevel);
         }
       }
     }
@@ -628,7 +744,7 @@ int lsmCheckpointLoadLevels(lsm_db *pDb, void *pVal, int nVal){
 
       ckptChangeEndianness(aIn, nIn);
       nLevel = aIn[0];
-      rc = ckptLoadLevels(pDb, aIn, &iIn, nLevel, &pLevel);
+      rc = ckptLoadLevels(pDb, aIn, &iIn, nLevel, pDb->compress.iId, &pLevel);
       lsmFree(pDb->pEnv, aIn);
       assert( rc==LSM_OK || pLevel==0 );
       if( rc==LSM_OK ){
@@ -677,7 +793,7 @@ int lsmCheckpointLevels(
   ckptSetValue(&ckpt, 0, nLevel, &rc);
   iOut = 1;
   for(i=0; rc==LSM_OK && i<nLevel; i++){
-    ckptExportLevel(p, &ckpt, &iOut, &rc);
+    ckptExportLevel(p, pDb->compress.iId, &ckpt, &iOut, &rc);
     p = p->pNext;
   }
   assert( rc!=LSM_OK || p==0 );
@@ -713,11 +829,12 @@ static i64 ckptLoadId(MetaPage *pPg){
 ** checkpoint.
 */
 static int ckptChecksumOk(u32 *aCkpt){
-  u32 nCkpt = aCkpt[CKPT_HDR_NCKPT];
+  u32 nCkpt = CKPT_NCKPT(aCkpt[CKPT_HDR_NCKPT]);
   u32 cksum1;
   u32 cksum2;
 
   if( nCkpt<CKPT_HDR_NCKPT || nCkpt>(LSM_META_PAGE_SIZE)/sizeof(u32) ) return 0;
+  if( CKPT_CKSUM(aCkpt[CKPT_HDR_NCKPT])>LSM_CKSUM_CRC32C ) return 0;
   ckptChecksum(aCkpt, nCkpt, &cksum1, &cksum2);
   return (cksum1==aCkpt[nCkpt-2] && cksum2==aCkpt[nCkpt-1]);
 }
@@ -744,7 +861,7 @@ static int ckptTryLoad(lsm_db *pDb, MetaPage *pPg, u32 iMeta, int *pRc){
     u8 *aData;                    /* Meta page data */
    
     aData = lsmFsMetaPageData(pPg, &nData);
-    nCkpt = (u32)lsmGetU32(&aData[CKPT_HDR_NCKPT*sizeof(u32)]);
+    nCkpt = CKPT_NCKPT(lsmGetU32(&aData[CKPT_HDR_NCKPT*sizeof(u32)]));
     if( nCkpt<=nData/sizeof(u32) && nCkpt>CKPT_HDR_NCKPT ){
       aCkpt = (u32 *)lsmMallocRc(pDb->pEnv, nCkpt*sizeof(u32), &rc);
     }
@@ -770,6 +887,7 @@ static int ckptTryLoad(lsm_db *pDb, MetaPage *pPg, u32 iMeta, int *pRc){
 /*
 ** Initialize the shared-memory header with an empty snapshot. This function
 ** is called when no valid snapshot can be found in the database header.
+** New databases use LSM_CKSUM_CRC32C checksums.
 */
 static void ckptLoadEmpty(lsm_db *pDb){
   u32 aCkpt[] = {
@@ -791,7 +909,7 @@ static void ckptLoadEmpty(lsm_db *pDb){
   u32 nCkpt = array_size(aCkpt);
   ShmHeader *pShm = pDb->pShmhdr;
 
-  aCkpt[CKPT_HDR_NCKPT] = nCkpt;
+  aCkpt[CKPT_HDR_NCKPT] = nCkpt | (LSM_CKSUM_CRC32C<<16);
   aCkpt[CKPT_HDR_BLKSZ] = pDb->nDfltBlksz;
   aCkpt[CKPT_HDR_PGSZ] = pDb->nDfltPgsz;
   ckptChecksum(aCkpt, array_size(aCkpt), &aCkpt[nCkpt-2], &aCkpt[nCkpt-1]);
@@ -850,7 +968,7 @@ int lsmCheckpointStore(lsm_db *pDb, int iMeta){
     int nData;
     int nCkpt;
 
-    nCkpt = (int)pDb->aSnapshot[CKPT_HDR_NCKPT];
+    nCkpt = (int)CKPT_NCKPT(pDb->aSnapshot[CKPT_HDR_NCKPT]);
     aData = lsmFsMetaPageData(pPg, &nData);
     memcpy(aData, pDb->aSnapshot, nCkpt*sizeof(u32));
     ckptChangeEndianness((u32 *)aData, nCkpt);
@@ -869,7 +987,7 @@ int lsmCheckpointLoad(lsm_db *pDb, int *piRead){
   while( (nRem--)>0 ){
     int nInt;
 
-    nInt = pShm->aSnap1[CKPT_HDR_NCKPT];
+    nInt = CKPT_NCKPT(pShm->aSnap1[CKPT_HDR_NCKPT]);
     if( nInt<=(LSM_META_PAGE_SIZE / sizeof(u32)) ){
       memcpy(pDb->aSnapshot, pShm->aSnap1, nInt*sizeof(u32));
       if( ckptChecksumOk(pDb->aSnapshot) ){
@@ -878,7 +996,7 @@ int lsmCheckpointLoad(lsm_db *pDb, int *piRead){
       }
     }
 
-    nInt = pShm->aSnap2[CKPT_HDR_NCKPT];
+    nInt = CKPT_NCKPT(pShm->aSnap2[CKPT_HDR_NCKPT]);
     if( nInt<=(LSM_META_PAGE_SIZE / sizeof(u32)) ){
       memcpy(pDb->aSnapshot, pShm->aSnap2, nInt*sizeof(u32));
       if( ckptChecksumOk(pDb->aSnapshot) ){
@@ -919,6 +1037,21 @@ int lsmCheckpointClientCacheOk(lsm_db *pDb){
   );
 }
 
+/*
+** Return true if snapshot pSnap was deserialized from checkpoint aCkpt[]
+** (or from an identical copy of it). Used to determine whether or not a
+** snapshot cached by the Database object may be shared by a connection 
+** that has just loaded aCkpt[] from shared-memory.
+*/
+int lsmCheckpointSnapshotOk(Snapshot *pSnap, u32 *aCkpt){
+  u32 nCkpt = CKPT_NCKPT(aCkpt[CKPT_HDR_NCKPT]);
+  return ( pSnap
+        && pSnap->iId==lsmCheckpointId(aCkpt, 0)
+        && pSnap->aCksum[0]==aCkpt[nCkpt-2]
+        && pSnap->aCksum[1]==aCkpt[nCkpt-1]
+  );
+}
+
 int lsmCheckpointLoadWorker(lsm_db *pDb){
   int rc;
   ShmHeader *pShm = pDb->pShmhdr;
@@ -932,8 +1065,8 @@ int lsmCheckpointLoadWorker(lsm_db *pDb){
   );
 
   /* Check that the two snapshots match. If not, repair them. */
-  nInt1 = pShm->aSnap1[CKPT_HDR_NCKPT];
-  nInt2 = pShm->aSnap2[CKPT_HDR_NCKPT];
+  nInt1 = CKPT_NCKPT(pShm->aSnap1[CKPT_HDR_NCKPT]);
+  nInt2 = CKPT_NCKPT(pShm->aSnap2[CKPT_HDR_NCKPT]);
   if( nInt1!=nInt2 || memcmp(pShm->aSnap1, pShm->aSnap2, nInt2*sizeof(u32)) ){
     if( ckptChecksumOk(pShm->aSnap1) ){
       memcpy(pShm->aSnap2, pShm->aSnap1, sizeof(u32)*nInt1);
@@ -971,15 +1104,21 @@ int lsmCheckpointDeserialize(
     Level *pLvl;
     int nFree;
     int i;
-    int nLevel = (int)aCkpt[CKPT_HDR_NLEVEL];
+    int nLevel = (int)(aCkpt[CKPT_HDR_NLEVEL] & 0xFFFF);
+    int nValue = (int)(aCkpt[CKPT_HDR_NLEVEL] >> 16);
     int iIn = CKPT_HDR_SIZE + CKPT_APPENDLIST_SIZE + CKPT_LOGPTR_SIZE;
 
     pNew->iId = lsmCheckpointId(aCkpt, 0);
+    pNew->aCksum[0] = aCkpt[CKPT_NCKPT(aCkpt[CKPT_HDR_NCKPT])-2];
+    pNew->aCksum[1] = aCkpt[CKPT_NCKPT(aCkpt[CKPT_HDR_NCKPT])-1];
     pNew->nBlock = aCkpt[CKPT_HDR_NBLOCK];
     pNew->nWrite = aCkpt[CKPT_HDR_NWRITE];
-    rc = ckptLoadLevels(pDb, aCkpt, &iIn, nLevel, &pNew->pLevel);
+    rc = ckptLoadLevels(
+        pDb, aCkpt, &iIn, nLevel, aCkpt[CKPT_HDR_CMPID], &pNew->pLevel
+    );
     pNew->iLogOff = lsmCheckpointLogOffset(aCkpt);
     pNew->iCmpId = aCkpt[CKPT_HDR_CMPID];
+    pNew->eCksum = CKPT_CKSUM(aCkpt[CKPT_HDR_NCKPT]);
 
     /* Make a copy of the append-list */
     for(i=0; i<LSM_APPLIST_SZ; i++){
@@ -987,9 +1126,23 @@ int lsmCheckpointDeserialize(
       pNew->aiAppend[i] = ckptRead64(a);
     }
 
+    /* Read the value segments */
+    if( rc==LSM_OK && nValue>LSM_MAX_VALUE_SEGMENTS ){
+      rc = LSM_CORRUPT_BKPT;
+    }else if( rc==LSM_OK ){
+      pNew->nValue = nValue;
+      for(i=0; i<nValue; i++){
+        ValueSegment *pVal = &pNew->aValue[i];
+        pVal->seg.iFirst = ckptGobble64(aCkpt, &iIn);
+        pVal->seg.iLastPg = ckptGobble64(aCkpt, &iIn);
+        pVal->seg.nSize = (int)ckptGobble64(aCkpt, &iIn);
+        pVal->nLive = ckptGobble64(aCkpt, &iIn);
+      }
+    }
+
     /* Read the block-redirect list */
     pNew->redirect.n = aCkpt[iIn++];
-    if( pNew->redirect.n ){
+    if( rc==LSM_OK && pNew->redirect.n ){
       pNew->redirect.a = lsmMallocZeroRc(pDb->pEnv, 
           (sizeof(struct RedirectEntry) * LSM_MAX_BLOCK_REDIRECTS), &rc
       );
@@ -1040,7 +1193,7 @@ int lsmCheckpointDeserialize(
 /*
 ** Connection pDb must be the worker connection in order to call this
 ** function. It returns true if the database already contains the maximum
-** number of levels or false otherwise.
+** number of levels (including value segments) or false otherwise.
 **
 ** This is used when flushing the in-memory tree to disk. If the database
 ** is already full, then the caller should invoke lsm_work() or similar
@@ -1058,6 +1211,7 @@ int lsmDatabaseFull(lsm_db *pDb){
   for(p=pDb->pWorker->pLevel; p; p=p->pNext){
     nRhs += (p->nRight ? p->nRight : 1);
   }
+  nRhs += pDb->pWorker->nValue;
 
   return (nRhs >= LSM_MAX_RHS_SEGMENTS);
 }
@@ -1079,17 +1233,25 @@ int lsmCheckpointSaveWorker(lsm_db *pDb, int bFlush){
   void *p = 0;
   int n = 0;
   int rc;
+  int bCache;                     /* True if free block list cache is valid */
 
+  bCache = lsmFreelistCacheOk(pDb);
   pSnap->iId++;
   rc = ckptExportSnapshot(pDb, bFlush, pSnap->iId, 1, &p, &n);
   if( rc!=LSM_OK ) return rc;
   assert( ckptChecksumOk((u32 *)p) );
 
+  /* Record the checksum of the new snapshot, so that the cached free
+  ** block list can be matched against it (see lsmFreelistCacheOk()).  */
+  pSnap->aCksum[0] = ((u32 *)p)[n/sizeof(u32)-2];
+  pSnap->aCksum[1] = ((u32 *)p)[n/sizeof(u32)-1];
+
   assert( n<=LSM_META_PAGE_SIZE );
   memcpy(pShm->aSnap2, p, n);
   lsmShmBarrier(pDb);
   memcpy(pShm->aSnap1, p, n);
   lsmFree(pDb->pEnv, p);
+  lsmFreelistCacheSave(pDb, bCache);
 
   assert( lsmFsIntegrityCheck(pDb) );
   return LSM_OK;
@@ -1121,7 +1283,7 @@ int lsmCheckpointSynced(lsm_db *pDb, i64 *piId, i64 *piLog, u32 *pnWrite){
 
       aData = lsmFsMetaPageData(pPg, &nData);
       assert( nData==LSM_META_PAGE_SIZE );
-      nCkpt = lsmGetU32(&aData[CKPT_HDR_NCKPT*sizeof(u32)]);
+      nCkpt = CKPT_NCKPT(lsmGetU32(&aData[CKPT_HDR_NCKPT*sizeof(u32)]));
       if( nCkpt<(LSM_META_PAGE_SIZE/sizeof(u32)) ){
         u32 *aCopy = lsmMallocRc(pDb->pEnv, sizeof(u32) * nCkpt, &rc);
         if( aCopy ){
@@ -1185,6 +1347,10 @@ int lsmCheckpointPgsz(u32 *aCkpt){ return (int)aCkpt[CKPT_HDR_PGSZ]; }
 
 int lsmCheckpointBlksz(u32 *aCkpt){ return (int)aCkpt[CKPT_HDR_BLKSZ]; }
 
+int lsmCheckpointCksum(u32 *aCkpt){
+  return CKPT_CKSUM(aCkpt[CKPT_HDR_NCKPT]);
+}
+
 void lsmCheckpointLogoffset(
   u32 *aCkpt,
   DbLog *pLog
@@ -1199,9 +1365,11 @@ void lsmCheckpointLogoffset(
 void lsmCheckpointZeroLogoffset(lsm_db *pDb){
   u32 nCkpt;
 
-  nCkpt = pDb->aSnapshot[CKPT_HDR_NCKPT];
+  nCkpt = CKPT_NCKPT(pDb->aSnapshot[CKPT_HDR_NCKPT]);
   assert( nCkpt>CKPT_HDR_NCKPT );
-  assert( nCkpt==pDb->pShmhdr->aSnap1[CKPT_HDR_NCKPT] );
+  assert( pDb->aSnapshot[CKPT_HDR_NCKPT]
+       == pDb->pShmhdr->aSnap1[CKPT_HDR_NCKPT] 
+  );
   assert( 0==memcmp(pDb->aSnapshot, pDb->pShmhdr->aSnap1, nCkpt*sizeof(u32)) );
   assert( 0==memcmp(pDb->aSnapshot, pDb->pShmhdr->aSnap2, nCkpt*sizeof(u32)) );
 
@@ -1215,6 +1383,29 @@ void lsmCheckpointZeroLogoffset(lsm_db *pDb){
   memcpy(pDb->pShmhdr->aSnap2, pDb->aSnapshot, nCkpt*sizeof(u32));
 }
 
+/*
+** Set the checksum algorithm of the snapshot in pDb->aSnapshot[] and the
+** two shared-memory snapshots to eCksum. This is called during recovery
+** if the log file is found to use a different algorithm to that specified
+** by the checkpoint (see lsmLogRecover()).
+*/
+void lsmCheckpointSetCksum(lsm_db *pDb, int eCksum){
+  u32 nCkpt;
+
+  nCkpt = CKPT_NCKPT(pDb->aSnapshot[CKPT_HDR_NCKPT]);
+  assert( nCkpt>CKPT_HDR_NCKPT );
+  assert( 0==memcmp(pDb->aSnapshot, pDb->pShmhdr->aSnap1, nCkpt*sizeof(u32)) );
+  assert( 0==memcmp(pDb->aSnapshot, pDb->pShmhdr->aSnap2, nCkpt*sizeof(u32)) );
+
+  pDb->aSnapshot[CKPT_HDR_NCKPT] = nCkpt | ((u32)eCksum << 16);
+  ckptChecksum(pDb->aSnapshot, nCkpt, 
+      &pDb->aSnapshot[nCkpt-2], &pDb->aSnapshot[nCkpt-1]
+  );
+
+  memcpy(pDb->pShmhdr->aSnap1, pDb->aSnapshot, nCkpt*sizeof(u32));
+  memcpy(pDb->pShmhdr->aSnap2, pDb->aSnapshot, nCkpt*sizeof(u32));
+}
+
 /*
 ** Set the output variable to the number of KB of data written into the
 ** database file since the most recent checkpoint.
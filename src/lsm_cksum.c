@@ -0,0 +1,357 @@
+/*
+** 2026-10-17
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+**
+** Checksum algorithms used by the log file and checkpoints.
+**
+** Each checksum is a pair of 32-bit values, (c0, c1). The algorithm in use
+** by a database is recorded in its checkpoint header (see lsm_ckpt.c):
+**
+**   LSM_CKSUM_FLETCHER:
+**     The original algorithm. Data is treated as an array of 32-bit
+**     little-endian integers x[], processed two at a time:
+**
+**       c0 += x[i] + c1;
+**       c1 += x[i+1] + c0;
+**
+**     Each step depends on the one before, but the recurrence is linear.
+**     So the effect of a block of B integer pairs is:
+**
+**       c0' = F(2B-1)*c0 + F(2B)*c1   + (weighted sum of the block)
+**       c1' = F(2B)*c0   + F(2B+1)*c1 + (weighted sum of the block)
+**
+**     where F(n) is the nth Fibonacci number and the weights are also
+**     Fibonacci numbers. The weighted sums do not depend on (c0, c1), so
+**     they may be calculated using SIMD instructions.
+**
+**   LSM_CKSUM_CRC32C:
+**     Two interleaved CRC32C (Castagnoli) values. c0 covers the first 4
+**     bytes of each 8 byte unit of data and c1 the second 4. No initial
+**     or final inversion is applied, so a checksum may be extended by
+**     further data. The SSE4.2 or ARMv8 crc32c instructions are used if
+**     available, otherwise a lookup table.
+**
+** The log checksum treats the data as a byte array that is zero padded to
+** a multiple of 8 bytes. The checkpoint checksum treats the checkpoint as
+** an array of native integers, each processed as 4 little-endian bytes.
+*/
+#include "lsmInt.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define LSM_CKSUM_X86 1
+# include <immintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+# define LSM_CKSUM_ARM 1
+# include <arm_acle.h>
+#endif
+
+static const int cksumOne = 1;
+#define CKSUM_LITTLE_ENDIAN (*(u8 *)(&cksumOne))
+
+/*
+** True if the SSE4.1, SSE4.2 and ARMv8 code paths have been disabled by
+** lsmChecksumHardware().
+*/
+static int cksumNoHw = 0;
+
+/*
+** Return the 4 bytes at a[] as a 32-bit little-endian integer.
+*/
+static u32 cksumGetU32le(const u8 *a){
+  if( CKSUM_LITTLE_ENDIAN ){
+    u32 v;
+    memcpy(&v, a, sizeof(v));
+    return v;
+  }
+  return ((u32)a[3] << 24) + ((u32)a[2] << 16) + ((u32)a[1] << 8) + a[0];
+}
+
+/*
+** Table for the software CRC32C implementation (reflected polynomial
+** 0x82F63B78).
+*/
+static const u32 aCrc32c[256] = {
+  0x00000000, 0xF26B8303, 0xE13B70F7, 0x1350F3F4, 0xC79A971F, 0x35F1141C,
+  0x26A1E7E8, 0xD4CA64EB, 0x8AD958CF, 0x78B2DBCC, 0x6BE22838, 0x9989AB3B,
+  0x4D43CFD0, 0xBF284CD3, 0xAC78BF27, 0x5E133C24, 0x105EC76F, 0xE235446C,
+  0xF165B798, 0x030E349B, 0xD7C45070, 0x25AFD373, 0x36FF2087, 0xC494A384,
+  0x9A879FA0, 0x68EC1CA3, 0x7BBCEF57, 0x89D76C54, 0x5D1D08BF, 0xAF768BBC,
+  0xBC267848, 0x4E4DFB4B, 0x20BD8EDE, 0xD2D60DDD, 0xC186FE29, 0x33ED7D2A,
+  0xE72719C1, 0x154C9AC2, 0x061C6936, 0xF477EA35, 0xAA64D611, 0x580F5512,
+  0x4B5FA6E6, 0xB93425E5, 0x6DFE410E, 0x9F95C20D, 0x8CC531F9, 0x7EAEB2FA,
+  0x30E349B1, 0xC288CAB2, 0xD1D83946, 0x23B3BA45, 0xF779DEAE, 0x05125DAD,
+  0x1642AE59, 0xE4292D5A, 0xBA3A117E, 0x4851927D, 0x5B016189, 0xA96AE28A,
+  0x7DA08661, 0x8FCB0562, 0x9C9BF696, 0x6EF07595, 0x417B1DBC, 0xB3109EBF,
+  0xA0406D4B, 0x522BEE48, 0x86E18AA3, 0x748A09A0, 0x67DAFA54, 0x95B17957,
+  0xCBA24573, 0x39C9C670, 0x2A993584, 0xD8F2B687, 0x0C38D26C, 0xFE53516F,
+  0xED03A29B, 0x1F682198, 0x5125DAD3, 0xA34E59D0, 0xB01EAA24, 0x42752927,
+  0x96BF4DCC, 0x64D4CECF, 0x77843D3B, 0x85EFBE38, 0xDBFC821C, 0x2997011F,
+  0x3AC7F2EB, 0xC8AC71E8, 0x1C661503, 0xEE0D9600, 0xFD5D65F4, 0x0F36E6F7,
+  0x61C69362, 0x93AD1061, 0x80FDE395, 0x72966096, 0xA65C047D, 0x5437877E,
+  0x4767748A, 0xB50CF789, 0xEB1FCBAD, 0x197448AE, 0x0A24BB5A, 0xF84F3859,
+  0x2C855CB2, 0xDEEEDFB1, 0xCDBE2C45, 0x3FD5AF46, 0x7198540D, 0x83F3D70E,
+  0x90A324FA, 0x62C8A7F9, 0xB602C312, 0x44694011, 0x5739B3E5, 0xA55230E6,
+  0xFB410CC2, 0x092A8FC1, 0x1A7A7C35, 0xE811FF36, 0x3CDB9BDD, 0xCEB018DE,
+  0xDDE0EB2A, 0x2F8B6829, 0x82F63B78, 0x709DB87B, 0x63CD4B8F, 0x91A6C88C,
+  0x456CAC67, 0xB7072F64, 0xA457DC90, 0x563C5F93, 0x082F63B7, 0xFA44E0B4,
+  0xE9141340, 0x1B7F9043, 0xCFB5F4A8, 0x3DDE77AB, 0x2E8E845F, 0xDCE5075C,
+  0x92A8FC17, 0x60C37F14, 0x73938CE0, 0x81F80FE3, 0x55326B08, 0xA759E80B,
+  0xB4091BFF, 0x466298FC, 0x1871A4D8, 0xEA1A27DB, 0xF94AD42F, 0x0B21572C,
+  0xDFEB33C7, 0x2D80B0C4, 0x3ED04330, 0xCCBBC033, 0xA24BB5A6, 0x502036A5,
+  0x4370C551, 0xB11B4652, 0x65D122B9, 0x97BAA1BA, 0x84EA524E, 0x7681D14D,
+  0x2892ED69, 0xDAF96E6A, 0xC9A99D9E, 0x3BC21E9D, 0xEF087A76, 0x1D63F975,
+  0x0E330A81, 0xFC588982, 0xB21572C9, 0x407EF1CA, 0x532E023E, 0xA145813D,
+  0x758FE5D6, 0x87E466D5, 0x94B49521, 0x66DF1622, 0x38CC2A06, 0xCAA7A905,
+  0xD9F75AF1, 0x2B9CD9F2, 0xFF56BD19, 0x0D3D3E1A, 0x1E6DCDEE, 0xEC064EED,
+  0xC38D26C4, 0x31E6A5C7, 0x22B65633, 0xD0DDD530, 0x0417B1DB, 0xF67C32D8,
+  0xE52CC12C, 0x1747422F, 0x49547E0B, 0xBB3FFD08, 0xA86F0EFC, 0x5A048DFF,
+  0x8ECEE914, 0x7CA56A17, 0x6FF599E3, 0x9D9E1AE0, 0xD3D3E1AB, 0x21B862A8,
+  0x32E8915C, 0xC083125F, 0x144976B4, 0xE622F5B7, 0xF5720643, 0x07198540,
+  0x590AB964, 0xAB613A67, 0xB831C993, 0x4A5A4A90, 0x9E902E7B, 0x6CFBAD78,
+  0x7FAB5E8C, 0x8DC0DD8F, 0xE330A81A, 0x115B2B19, 0x020BD8ED, 0xF0605BEE,
+  0x24AA3F05, 0xD6C1BC06, 0xC5914FF2, 0x37FACCF1, 0x69E9F0D5, 0x9B8273D6,
+  0x88D28022, 0x7AB90321, 0xAE7367CA, 0x5C18E4C9, 0x4F48173D, 0xBD23943E,
+  0xF36E6F75, 0x0105EC76, 0x12551F82, 0xE03E9C81, 0x34F4F86A, 0xC69F7B69,
+  0xD5CF889D, 0x27A40B9E, 0x79B737BA, 0x8BDCB4B9, 0x988C474D, 0x6AE7C44E,
+  0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351,
+};
+
+/*
+** Return the CRC32C of the 4 little-endian bytes of iVal, starting from
+** register value iCrc. This is the software version of the crc32c
+** instruction.
+*/
+static u32 cksumCrcSoft(u32 iCrc, u32 iVal){
+  iCrc ^= iVal;
+  iCrc = aCrc32c[iCrc & 0xFF] ^ (iCrc >> 8);
+  iCrc = aCrc32c[iCrc & 0xFF] ^ (iCrc >> 8);
+  iCrc = aCrc32c[iCrc & 0xFF] ^ (iCrc >> 8);
+  iCrc = aCrc32c[iCrc & 0xFF] ^ (iCrc >> 8);
+  return iCrc;
+}
+
+/*
+** Fletcher checksum of the n bytes at a[]. n must be a multiple of 8.
+*/
+static void cksumFletcherSoft(const u8 *a, int n, u32 *pC0, u32 *pC1){
+  u32 c0 = *pC0;
+  u32 c1 = *pC1;
+  int i;
+  for(i=0; i<n; i+=8){
+    c0 += cksumGetU32le(&a[i]) + c1;
+    c1 += cksumGetU32le(&a[i+4]) + c0;
+  }
+  *pC0 = c0;
+  *pC1 = c1;
+}
+
+/*
+** Two lane CRC32C of the n bytes at a[]. n must be a multiple of 8.
+*/
+static void cksumCrcBytesSoft(const u8 *a, int n, u32 *pC0, u32 *pC1){
+  u32 c0 = *pC0;
+  u32 c1 = *pC1;
+  int i;
+  for(i=0; i<n; i+=8){
+    c0 = cksumCrcSoft(c0, cksumGetU32le(&a[i]));
+    c1 = cksumCrcSoft(c1, cksumGetU32le(&a[i+4]));
+  }
+  *pC0 = c0;
+  *pC1 = c1;
+}
+
+#ifdef LSM_CKSUM_X86
+/*
+** Return true if the CPU supports SSE4.2 (and therefore SSE4.1 as well).
+*/
+static int cksumHaveSse42(void){
+  static int bHave = -1;
+  if( bHave<0 ){
+    __builtin_cpu_init();
+    bHave = (__builtin_cpu_supports("sse4.2") ? 1 : 0);
+  }
+  return bHave;
+}
+
+/*
+** SSE4.1 version of cksumFletcherSoft(). Data is processed in blocks of
+** 64 bytes (16 integers). See the comment at the top of this file.
+*/
+__attribute__((target("sse4.2")))
+static void cksumFletcherSse(const u8 *a, int n, u32 *pC0, u32 *pC1){
+  u32 c0 = *pC0;
+  u32 c1 = *pC1;
+  int i;
+  const __m128i w0a = _mm_set_epi32(144, 233, 377, 610);
+  const __m128i w0b = _mm_set_epi32(21, 34, 55, 89);
+  const __m128i w0c = _mm_set_epi32(3, 5, 8, 13);
+  const __m128i w0d = _mm_set_epi32(0, 1, 1, 2);
+  const __m128i w1a = _mm_set_epi32(233, 377, 610, 987);
+  const __m128i w1b = _mm_set_epi32(34, 55, 89, 144);
+  const __m128i w1c = _mm_set_epi32(5, 8, 13, 21);
+  const __m128i w1d = _mm_set_epi32(1, 1, 2, 3);
+
+  for(i=0; (i+64)<=n; i+=64){
+    __m128i xa = _mm_loadu_si128((const __m128i *)&a[i]);
+    __m128i xb = _mm_loadu_si128((const __m128i *)&a[i+16]);
+    __m128i xc = _mm_loadu_si128((const __m128i *)&a[i+32]);
+    __m128i xd = _mm_loadu_si128((const __m128i *)&a[i+48]);
+    __m128i s0, s1;
+
+    s0 = _mm_add_epi32(
+        _mm_add_epi32(_mm_mullo_epi32(xa, w0a), _mm_mullo_epi32(xb, w0b)),
+        _mm_add_epi32(_mm_mullo_epi32(xc, w0c), _mm_mullo_epi32(xd, w0d))
+    );
+    s1 = _mm_add_epi32(
+        _mm_add_epi32(_mm_mullo_epi32(xa, w1a), _mm_mullo_epi32(xb, w1b)),
+        _mm_add_epi32(_mm_mullo_epi32(xc, w1c), _mm_mullo_epi32(xd, w1d))
+    );
+    s0 = _mm_hadd_epi32(s0, s1);
+    s0 = _mm_hadd_epi32(s0, s0);
+
+    {
+      u32 t0 = (u32)_mm_cvtsi128_si32(s0);
+      u32 t1 = (u32)_mm_extract_epi32(s0, 1);
+      u32 n0 = 610*c0 + 987*c1 + t0;
+      c1 = 987*c0 + 1597*c1 + t1;
+      c0 = n0;
+    }
+  }
+
+  *pC0 = c0;
+  *pC1 = c1;
+  if( i<n ) cksumFletcherSoft(&a[i], n-i, pC0, pC1);
+}
+
+/*
+** SSE4.2 version of cksumCrcBytesSoft().
+*/
+__attribute__((target("sse4.2")))
+static void cksumCrcBytesHw(const u8 *a, int n, u32 *pC0, u32 *pC1){
+  u32 c0 = *pC0;
+  u32 c1 = *pC1;
+  int i;
+  for(i=0; i<n; i+=8){
+    c0 = _mm_crc32_u32(c0, cksumGetU32le(&a[i]));
+    c1 = _mm_crc32_u32(c1, cksumGetU32le(&a[i+4]));
+  }
+  *pC0 = c0;
+  *pC1 = c1;
+}
+#endif /* LSM_CKSUM_X86 */
+
+#ifdef LSM_CKSUM_ARM
+/*
+** ARMv8 version of cksumCrcBytesSoft().
+*/
+static void cksumCrcBytesHw(const u8 *a, int n, u32 *pC0, u32 *pC1){
+  u32 c0 = *pC0;
+  u32 c1 = *pC1;
+  int i;
+  for(i=0; i<n; i+=8){
+    c0 = __crc32cw(c0, cksumGetU32le(&a[i]));
+    c1 = __crc32cw(c1, cksumGetU32le(&a[i+4]));
+  }
+  *pC0 = c0;
+  *pC1 = c1;
+}
+#endif /* LSM_CKSUM_ARM */
+
+/*
+** Return true if cksumCrcBytesHw() may be used.
+*/
+static int cksumHaveCrcHw(void){
+  if( cksumNoHw ) return 0;
+#if defined(LSM_CKSUM_X86)
+  return cksumHaveSse42();
+#elif defined(LSM_CKSUM_ARM)
+  return 1;
+#else
+  return 0;
+#endif
+}
+
+/*
+** Enable (if bEnable is true) or disable the SSE4.1, SSE4.2 and ARMv8 
+** versions of the checksum routines. Return true if the CRC32C routine
+** uses hardware instructions once this call has returned. This is used 
+** by test code to compare the results of each version with the portable
+** versions.
+*/
+int lsmChecksumHardware(int bEnable){
+  cksumNoHw = !bEnable;
+  return cksumHaveCrcHw();
+}
+
+/*
+** Update the checksum (*pC0, *pC1) to include the n bytes of data at z[]
+** using algorithm eCksum (either LSM_CKSUM_FLETCHER or LSM_CKSUM_CRC32C).
+** If n is not a multiple of 8, the data is padded with zero bytes.
+*/
+void lsmChecksumBytes(
+  int eCksum,                     /* LSM_CKSUM_* algorithm */
+  const char *z,                  /* Input buffer */
+  int n,                          /* Size of input buffer in bytes */
+  u32 *pC0,                       /* IN/OUT: Checksum value 1 */
+  u32 *pC1                        /* IN/OUT: Checksum value 2 */
+){
+  const u8 *a = (const u8 *)z;
+  int nIn = (n/8) * 8;
+
+  assert( eCksum==LSM_CKSUM_FLETCHER || eCksum==LSM_CKSUM_CRC32C );
+  if( eCksum==LSM_CKSUM_CRC32C ){
+#if defined(LSM_CKSUM_X86) || defined(LSM_CKSUM_ARM)
+    if( cksumHaveCrcHw() ){
+      cksumCrcBytesHw(a, nIn, pC0, pC1);
+    }else
+#endif
+    cksumCrcBytesSoft(a, nIn, pC0, pC1);
+  }else{
+#ifdef LSM_CKSUM_X86
+    if( nIn>=64 && cksumNoHw==0 && cksumHaveSse42() ){
+      cksumFletcherSse(a, nIn, pC0, pC1);
+    }else
+#endif
+    cksumFletcherSoft(a, nIn, pC0, pC1);
+  }
+
+  if( nIn!=n ){
+    u8 aBuf[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    assert( (n-nIn)<8 && n>nIn );
+    memcpy(aBuf, &a[nIn], n-nIn);
+    lsmChecksumBytes(eCksum, (const char *)aBuf, 8, pC0, pC1);
+  }
+}
+
+/*
+** Set (*pC0, *pC1) to the LSM_CKSUM_CRC32C checksum of the array of nInt
+** native integers at aInt[], starting from 1 and 2. The integers are
+** checksummed as if they were written to a buffer in little-endian
+** order and passed to lsmChecksumBytes().
+*/
+void lsmChecksumInts(const u32 *aInt, int nInt, u32 *pC0, u32 *pC1){
+  *pC0 = 1;
+  *pC1 = 2;
+  if( nInt<=0 ) return;
+  if( CKSUM_LITTLE_ENDIAN ){
+    lsmChecksumBytes(LSM_CKSUM_CRC32C, (const char *)aInt, nInt*4, pC0, pC1);
+  }else{
+    int i;
+    for(i=0; i<nInt; i++){
+      if( i & 1 ){
+        *pC1 = cksumCrcSoft(*pC1, aInt[i]);
+      }else{
+        *pC0 = cksumCrcSoft(*pC0, aInt[i]);
+      }
+    }
+    if( nInt & 1 ) *pC1 = cksumCrcSoft(*pC1, 0);
+  }
+}
@@ -81,9 +81,11 @@
 **     lsmFsOpenLog
 **     lsmFsWriteLog
 **     lsmFsSyncLog
+**     lsmFsOpenLogReadonly
 **     lsmFsReadLog
 **     lsmFsTruncateLog
 **     lsmFsCloseAndDeleteLog
+**     lsmFsCloseAndResetLog
 **
 ** COMPRESSED DATABASE FILE FORMAT
 **
@@ -153,6 +155,35 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
+/*
+** Sequential page access tracked for read-ahead. See fsReadAhead().
+*/
+#define LSM_READAHEAD_NSTREAM 4
+#define LSM_READAHEAD_MINSEQ  2
+
+/*
+** Maximum number of pages written to the database file by a single call
+** to lsmEnvWritev(). And the maximum number of bytes of log data buffered
+** before being written to the log file.
+*/
+#define LSM_WRITE_BATCH 32
+#define LSM_LOG_BUFFER  (256*1024)
+
+/*
+** Alignment of page buffers, in bytes, if the database is opened for
+** direct IO (LSM_CONFIG_DIRECT_IO). This is the logical block size of most
+** block devices. If the environment requires a stricter alignment, it
+** copies data through an aligned buffer of its own.
+*/
+#define LSM_DIRECT_ALIGN 512
+
+typedef struct ReadAhead ReadAhead;
+struct ReadAhead {
+  Pgno iLast;                     /* Last page loaded by this stream */
+  i64 iLimit;                     /* Read-ahead issued up to this offset */
+  int nSeq;                       /* Number of sequential page loads */
+};
+
 /*
 ** File-system object. Each database connection allocates a single instance
 ** of the following structure. It is used for all access to the database and
@@ -169,8 +200,49 @@
 **   as the file grows), the Page.aData pointers are updated by iterating
 **   through the contents of this list.
 **
-**   In non-mmap() mode, this list is an LRU list of cached pages with 
-**   nRef==0.
+**   In non-mmap() mode, this list is not used. Clean pages with nRef==0
+**   are cached by the PageCache object shared by all connections to the 
+**   database within the process (pCache), not by the FileSystem.
+**
+** nHash, apHash:
+**   In non-mmap() mode, a hash table containing this connection's page 
+**   handles with nRef>0, keyed by page number. Handles are removed from the
+**   hash table when their ref-count drops to zero.
+**
+** apBatch, nBatch:
+**   In non-mmap() mode, pages written by lsmFsPagePersist() are not written
+**   to disk immediately. Instead, a reference to each is held in apBatch[] 
+**   until either LSM_WRITE_BATCH contiguous pages have accumulated or a 
+**   page that does not follow the last in the batch is persisted. The 
+**   batch is then written using a single vectored write. Since the pages
+**   are referenced, they remain in the hash table, so this connection does
+**   not read stale data from disk. The batch is also flushed before the 
+**   worker snapshot is saved (lsmFsFlushBatch()), as other connections 
+**   may read the pages as soon as this happens.
+**
+** logbuf, iLogBuf:
+**   Log data written by lsmFsWriteLog() that has not yet been written to
+**   the log file, and the offset it is to be written to. It is written 
+**   out at the end of each transaction (lsmFsFlushLog()), or earlier if 
+**   more than LSM_LOG_BUFFER bytes accumulate.
+**
+** nLogAlloc:
+**   If LSM_CONFIG_LOG_PREALLOC is set, the offset of the end of the region
+**   of the log file that has been preallocated by this connection. Before
+**   any data is written to the log file beyond this offset, more space is 
+**   allocated (see fsLogPreallocate()). Zero if the log file is not open.
+**
+** aStream, iStream:
+**   Read-ahead state for non-mmap() mode. Each entry of aStream[] tracks
+**   one sequence of pages loaded in ascending order by lsmFsDbPageNext().
+**   See fsReadAhead() for details.
+**
+** aTat:
+**   Rate limiter state for merge (aTat[LSM_IO_MERGE]) and checkpoint 
+**   (aTat[LSM_IO_CHECKPOINT]) writes. Each entry is the "theoretical arrival
+**   time" in microseconds - the time at which all data written so far
+**   would have been written had it been written at exactly the configured
+**   rate. See lsmFsThrottle() for details.
 */
 struct FileSystem {
   lsm_db *pDb;                    /* Database handle that owns this object */
@@ -186,10 +258,15 @@ struct FileSystem {
   lsm_file *fdDb;                 /* Database file */
   lsm_file *fdLog;                /* Log file */
   int szSector;                   /* Database file sector size */
+  int eDirectIo;                  /* LSM_DIRECT_IO_* value for these files */
+  int bAlign;                     /* True to align buffers for direct IO */
 
   /* If this is a compressed database, a pointer to the compression methods.
-  ** For an uncompressed database, a NULL pointer.  */
+  ** For an uncompressed database, a NULL pointer. Segments of a compressed
+  ** database may instead use the built-in methods at FileSystem.lz, or
+  ** store their pages uncompressed. See fsSegmentCompress().  */
   lsm_compress *pCompress;
+  lsm_compress lz;                /* Built-in (LSM_COMPRESSION_LZ) methods */
   u8 *aIBuffer;                   /* Buffer to compress to */
   u8 *aOBuffer;                   /* Buffer to uncompress from */
   int nBuffer;                    /* Allocated size of aBuffer[] in bytes */
@@ -206,19 +283,42 @@ struct FileSystem {
   int nWrite;                     /* Total number of pages written */
   int nRead;                      /* Total number of pages read */
 
+  /* Rate limiter state */
+  i64 aTat[2];                    /* Indexed by LSM_IO_MERGE etc. */
+
+  /* Write batching */
+  int nBatch;                     /* Number of pages in apBatch[] */
+  Page *apBatch[LSM_WRITE_BATCH]; /* Pages waiting to be written */
+  i64 iLogBuf;                    /* Log file offset of logbuf.z[0] */
+  LsmString logbuf;               /* Log data waiting to be written */
+  i64 nLogAlloc;                  /* Log file bytes already preallocated */
+
+  /* Read-ahead state */
+  int iStream;                    /* Next aStream[] slot to replace */
+  ReadAhead aStream[LSM_READAHEAD_NSTREAM];
+
   /* Page cache parameters for non-mmap() mode */
+  PageCache *pCache;              /* Shared page cache */
   int nOut;                       /* Number of outstanding pages */
-  int nCacheMax;                  /* Configured cache size (in pages) */
-  int nCacheAlloc;                /* Current cache size (in pages) */
   Page *pLruFirst;                /* Head of the LRU list */
   Page *pLruLast;                 /* Tail of the LRU list */
   int nHash;                      /* Number of hash slots in hash table */
   Page **apHash;                  /* nHash Hash slots */
 };
 
+typedef struct CacheEntry CacheEntry;
+typedef struct CacheShard CacheShard;
+
 /*
 ** Database page handle.
 **
+** pEntry:
+**   In non-mmap() mode, if this handle refers to a clean page in the 
+**   shared page cache, a pointer to the cache entry. aData points into
+**   the buffer owned by the cache entry. Otherwise, if this is a page that
+**   is being written by this connection, NULL. In this case the buffer 
+**   is owned by the page handle (PAGE_FREE is set).
+**
 ** pSeg:
 **   When lsmFsSortedAppend() is called on a compressed database, the new
 **   page is not assigned a page number or location in the database file
@@ -239,6 +339,7 @@ struct Page {
   Page *pLruNext;                 /* Next page in LRU list */
   Page *pLruPrev;                 /* Previous page in LRU list */
   FileSystem *pFS;                /* File system that owns this page */
+  CacheEntry *pEntry;             /* Shared cache entry (or NULL) */
 
   /* Only used in compressed database mode: */
   int nCompress;                  /* Compressed size (or 0 for uncomp. db) */
@@ -260,6 +361,129 @@ struct MetaPage {
   FileSystem *pFS;                /* FileSystem that owns this page */
 };
 
+/*
+** Page cache shared by all connections to a database within a process.
+**
+** In non-mmap() mode (including compressed database mode), all connections
+** to a single database within a process share a single PageCache object,
+** owned by the Database object (see lsmDbPageCache()). It caches clean
+** page images, keyed by page number (the byte offset of the page record 
+** in compressed database mode). Each connection still allocates its own 
+** Page handles, but the data of a clean page is stored in a reference 
+** counted CacheEntry. Pages written by a worker are private to the worker 
+** connection until they have been written to disk, at which point their 
+** buffers are handed over to the cache.
+**
+** The cache is divided into LSM_CACHE_NSHARD shards, each with its own 
+** mutex, hash tables and set of queues (see below). The size limit 
+** configured by LSM_CONFIG_CACHE_SIZE is divided evenly between the 
+** shards. Entries in use are never evicted, so the cache may temporarily 
+** exceed the limit.
+**
+** Each shard has two hash tables with the same number of slots. One is
+** keyed by page number and used to look pages up. The other is keyed by
+** the number of the block that each page is stored on, and is used to 
+** find the entries to discard when a block is reused (see below).
+**
+** Replacement policy:
+**
+**   Each shard has three queues - "probation", "protected" and "ghost".
+**   New entries are added to the probation queue. Under LSM_CACHE_LRU, 
+**   every hit moves the entry to the end of the probation queue and the 
+**   other two queues are not used, so the shard behaves as a single LRU
+**   list.
+**
+**   LSM_CACHE_2Q is the 2Q algorithm. The probation queue is a FIFO. A hit
+**   on an entry in the newer half of the probation queue does not move it,
+**   so a page read several times in quick succession (as each page is by
+**   a scan) is not treated as frequently used. A hit on an entry in the 
+**   older half moves it to the protected queue, which is managed as an 
+**   LRU list. When an entry is evicted from the probation queue, its page
+**   image is freed but the entry itself remains in the hash table as part
+**   of the ghost queue, which is limited to half as many entries as the 
+**   shard can hold pages. If a page is loaded while it is in the ghost 
+**   queue, it is added directly to the protected queue. Entries are 
+**   evicted from the protected queue only if the probation queue holds 
+**   less than a quarter of the shard's share of the limit. Additionally,
+**   reads made by a worker connection (merges) are tagged "do not 
+**   promote" - they never move entries to or within the protected queue.
+**
+** Invalidation:
+**
+**   Database pages are never modified in place. So a cached page image
+**   remains valid until the block that it is stored on is freed and then
+**   reused by a worker. No client can be reading from a block at the point
+**   it is reused - the block is free in the snapshots used by all current
+**   clients (see lsmBlockAllocate()). When a worker reuses a block:
+**
+**     * entries for pages on the block are discarded from the cache that 
+**       belongs to the worker's process. In compressed database mode, 
+**       this means entries for page records that start on the block. A
+**       record may also extend onto the next block of its segment. But
+**       blocks are freed in segment order, so when that next block is 
+**       reused, the block the record starts on is free as well and no 
+**       client reads the record until it too has been reused, and
+**
+**     * the ShmHeader.iReuse counter is incremented. Each time a 
+**       connection opens a read transaction or begins work, it compares 
+**       the counter with PageCache.iReuse. If they are not equal, a block 
+**       has been reused by another process and all cache entries are 
+**       discarded. This is done while holding PageCache.pMutex, so that
+**       no other connection can use a stale entry meanwhile.
+*/
+#define LSM_CACHE_NSHARD 8
+
+#define CACHE_PROBATION 0
+#define CACHE_PROTECTED 1
+#define CACHE_GHOST     2
+
+typedef struct CacheQueue CacheQueue;
+
+struct CacheEntry {
+  Pgno iPg;                       /* Page number */
+  u8 *aData;                      /* Page image */
+  int nData;                      /* Size of aData[] in bytes */
+  int nCompress;                  /* Compressed size (compressed db only) */
+  int nRef;                       /* Number of page handles using entry */
+  int bDiscard;                   /* True once removed from hash table */
+  int iQueue;                     /* CACHE_PROBATION, PROTECTED or GHOST */
+  int iBlk;                       /* Block that the page is stored on */
+  u32 iSeq;                       /* Value of CacheShard.iSeq when added */
+  CacheEntry *pHashNext;          /* Next entry in hash slot */
+  CacheEntry *pBlockNext;         /* Next entry in block hash slot */
+  CacheEntry *pBlockPrev;         /* Previous entry in block hash slot */
+  CacheEntry *pLruNext;           /* Next entry in queue */
+  CacheEntry *pLruPrev;           /* Previous entry in queue */
+};
+
+struct CacheQueue {
+  CacheEntry *pFirst;             /* Least recently used entry */
+  CacheEntry *pLast;              /* Most recently used entry */
+  i64 nByte;                      /* Bytes allocated by entries in queue */
+  int nEntry;                     /* Number of entries in queue */
+};
+
+struct CacheShard {
+  lsm_mutex *pMutex;              /* Protects all fields of this shard */
+  i64 nByte;                      /* Bytes allocated by entries in shard */
+  int nEntry;                     /* Entries in hash table */
+  int nHash;                      /* Number of slots in each hash table */
+  CacheEntry **apHash;            /* Hash table keyed by page number */
+  CacheEntry **apBlock;           /* Hash table keyed by block number */
+  CacheQueue aQueue[3];           /* Indexed by CACHE_PROBATION etc. */
+  u32 iSeq;                       /* Entries added to probation queue */
+};
+
+struct PageCache {
+  lsm_env *pEnv;                  /* Environment used for allocations */
+  lsm_mutex *pMutex;              /* Protects iReuse, nMaxByte, ePolicy */
+  u32 iReuse;                     /* Last value of ShmHeader.iReuse seen */
+  i64 nMaxByte;                   /* Configured size limit in bytes */
+  int ePolicy;                    /* LSM_CACHE_LRU or LSM_CACHE_2Q */
+  int bAlign;                     /* True to align buffers for direct IO */
+  CacheShard aShard[LSM_CACHE_NSHARD];
+};
+
 /* 
 ** Values for LsmPage.flags 
 */
@@ -386,34 +610,200 @@ void lsmEnvSleep(lsm_env *pEnv, int nUs){
   pEnv->xSleep(pEnv, nUs);
 }
 
+/*
+** Set *piUs to the current value of the environments monotonic clock in 
+** microseconds and return LSM_OK. Or, if the environment does not provide
+** an xCurrentTime() method, return LSM_ERROR.
+*/
+int lsmEnvCurrentTime(lsm_env *pEnv, i64 *piUs){
+  if( pEnv->iVersion<3 || pEnv->xCurrentTime==0 ) return LSM_ERROR;
+  return pEnv->xCurrentTime(pEnv, piUs);
+}
+
+/*
+** Return true if the environment provides an xReadAhead() method.
+*/
+static int lsmEnvHasReadAhead(lsm_env *pEnv){
+  return (pEnv->iVersion>=4 && pEnv->xReadAhead!=0);
+}
+static int lsmEnvReadAhead(
+  lsm_env *pEnv, 
+  lsm_file *pFile, 
+  lsm_i64 iOff, 
+  lsm_i64 nByte
+){
+  return IOERR_WRAPPER( pEnv->xReadAhead(pFile, iOff, nByte) );
+}
+
+/*
+** Read or write the nIov buffers in aIov[] from or to a contiguous range
+** of file pFile starting at offset iOff. If the environment does not 
+** provide an xReadv() or xWritev() method, the buffers are read or 
+** written one at a time using xRead() or xWrite().
+*/
+static int lsmEnvReadv(
+  lsm_env *pEnv, 
+  lsm_file *pFile, 
+  lsm_i64 iOff, 
+  lsm_iovec *aIov,
+  int nIov
+){
+  int rc = LSM_OK;
+  if( pEnv->iVersion>=5 && pEnv->xReadv ){
+    rc = IOERR_WRAPPER( pEnv->xReadv(pFile, iOff, aIov, nIov) );
+  }else{
+    int i;
+    for(i=0; rc==LSM_OK && i<nIov; i++){
+      rc = lsmEnvRead(pEnv, pFile, iOff, aIov[i].pData, aIov[i].nData);
+      iOff += aIov[i].nData;
+    }
+  }
+  return rc;
+}
+static int lsmEnvWritev(
+  lsm_env *pEnv, 
+  lsm_file *pFile, 
+  lsm_i64 iOff, 
+  lsm_iovec *aIov,
+  int nIov
+){
+  int rc = LSM_OK;
+  if( pEnv->iVersion>=5 && pEnv->xWritev ){
+    rc = IOERR_WRAPPER( pEnv->xWritev(pFile, iOff, aIov, nIov) );
+  }else{
+    int i;
+    for(i=0; rc==LSM_OK && i<nIov; i++){
+      rc = lsmEnvWrite(pEnv, pFile, iOff, aIov[i].pData, aIov[i].nData);
+      iOff += aIov[i].nData;
+    }
+  }
+  return rc;
+}
+
+/*
+** Allocate space for the nByte bytes of file pFile starting at offset 
+** iOff, without modifying any data already stored there. If the 
+** environment does not provide an xFallocate() method, this is a no-op.
+*/
+static int lsmEnvFallocate(
+  lsm_env *pEnv, 
+  lsm_file *pFile, 
+  lsm_i64 iOff, 
+  lsm_i64 nByte
+){
+  if( pEnv->iVersion<6 || pEnv->xFallocate==0 ) return LSM_OK;
+  return IOERR_WRAPPER( pEnv->xFallocate(pFile, iOff, nByte) );
+}
+
+/*
+** This function is called before nByte bytes of data are written to the
+** log file at offset iOff. If LSM_CONFIG_LOG_PREALLOC is set and the write
+** extends past the region of the log file already preallocated, allocate
+** space up to the next multiple of the configured size.
+**
+** Preallocation is an optimization only. If it fails, the error is 
+** ignored - an error that prevents the data from being written will be
+** reported by the write itself.
+*/
+static void fsLogPreallocate(FileSystem *pFS, i64 iOff, int nByte){
+  i64 nPrealloc = (i64)pFS->pDb->nLogPrealloc * 1024;
+  i64 iEnd = iOff + nByte;
+  if( nPrealloc>0 && iEnd>pFS->nLogAlloc ){
+    i64 nNew = ((iEnd + nPrealloc - 1) / nPrealloc) * nPrealloc;
+    lsmEnvFallocate(pFS->pEnv, pFS->fdLog, pFS->nLogAlloc, nNew-pFS->nLogAlloc);
+    pFS->nLogAlloc = nNew;
+  }
+}
+
+/*
+** Write any buffered log data to the log file. If parameter bDiscard is
+** true, discard the buffered data instead. This is done when a write 
+** transaction is rolled back.
+*/
+int lsmFsFlushLog(FileSystem *pFS, int bDiscard){
+  int rc = LSM_OK;
+  LsmString *pBuf = &pFS->logbuf;
+  if( pBuf->n>0 && bDiscard==0 ){
+    fsLogPreallocate(pFS, pFS->iLogBuf, pBuf->n);
+    rc = lsmEnvWrite(pFS->pEnv, pFS->fdLog, pFS->iLogBuf, pBuf->z, pBuf->n);
+  }
+  pBuf->n = 0;
+  return rc;
+}
 
 /*
 ** Write the contents of string buffer pStr into the log file, starting at
 ** offset iOff.
+**
+** The data is buffered in FileSystem.logbuf if it follows directly on 
+** from the data already buffered. If this would cause more than 
+** LSM_LOG_BUFFER bytes to be buffered, the buffered data and pStr are 
+** written together using a single vectored write.
 */
 int lsmFsWriteLog(FileSystem *pFS, i64 iOff, LsmString *pStr){
+  int rc = LSM_OK;
+  LsmString *pBuf = &pFS->logbuf;
+
   assert( pFS->fdLog );
-  return lsmEnvWrite(pFS->pEnv, pFS->fdLog, iOff, pStr->z, pStr->n);
+  if( pBuf->n>0 && iOff!=pFS->iLogBuf+pBuf->n ){
+    rc = lsmFsFlushLog(pFS, 0);
+  }
+  if( rc==LSM_OK ){
+    if( pBuf->n==0 ) pFS->iLogBuf = iOff;
+    if( pBuf->n + pStr->n > LSM_LOG_BUFFER ){
+      lsm_iovec aIov[2];
+      aIov[0].pData = (void *)pBuf->z;
+      aIov[0].nData = pBuf->n;
+      aIov[1].pData = (void *)pStr->z;
+      aIov[1].nData = pStr->n;
+      fsLogPreallocate(pFS, pFS->iLogBuf, pBuf->n + pStr->n);
+      if( pBuf->n==0 ){
+        rc = lsmEnvWritev(pFS->pEnv, pFS->fdLog, iOff, &aIov[1], 1);
+      }else{
+        rc = lsmEnvWritev(pFS->pEnv, pFS->fdLog, pFS->iLogBuf, aIov, 2);
+      }
+      pBuf->n = 0;
+    }else{
+      rc = lsmStringBinAppend(pBuf, (u8 *)pStr->z, pStr->n);
+      if( rc!=LSM_OK ) lsmStringClear(pBuf);
+    }
+  }
+  return rc;
 }
 
 /*
 ** fsync() the log file.
 */
 int lsmFsSyncLog(FileSystem *pFS){
+  int rc;
   assert( pFS->fdLog );
-  return lsmEnvSync(pFS->pEnv, pFS->fdLog);
+  rc = lsmFsFlushLog(pFS, 0);
+  if( rc==LSM_OK ) rc = lsmEnvSync(pFS->pEnv, pFS->fdLog);
+  return rc;
 }
 
 /*
 ** Read nRead bytes of data starting at offset iOff of the log file. Append
-** the results to string buffer pStr.
+** the results to string buffer pStr. If pFile is not NULL, it is a handle
+** opened by lsmFsOpenLogReadonly() to read from. Otherwise, data is read
+** using the file-system object's own log file handle.
 */
-int lsmFsReadLog(FileSystem *pFS, i64 iOff, int nRead, LsmString *pStr){
-  int rc;                         /* Return code */
-  assert( pFS->fdLog );
-  rc = lsmStringExtend(pStr, nRead);
+int lsmFsReadLog(
+  FileSystem *pFS, 
+  lsm_file *pFile, 
+  i64 iOff, 
+  int nRead, 
+  LsmString *pStr
+){
+  int rc = LSM_OK;                /* Return code */
+  if( pFile==0 ){
+    assert( pFS->fdLog );
+    pFile = pFS->fdLog;
+    rc = lsmFsFlushLog(pFS, 0);
+  }
+  if( rc==LSM_OK ) rc = lsmStringExtend(pStr, nRead);
   if( rc==LSM_OK ){
-    rc = lsmEnvRead(pFS->pEnv, pFS->fdLog, iOff, &pStr->z[pStr->n], nRead);
+    rc = lsmEnvRead(pFS->pEnv, pFile, iOff, &pStr->z[pStr->n], nRead);
     pStr->n += nRead;
   }
   return rc;
@@ -423,8 +813,11 @@ int lsmFsReadLog(FileSystem *pFS, i64 iOff, int nRead, LsmString *pStr){
 ** Truncate the log file to nByte bytes in size.
 */
 int lsmFsTruncateLog(FileSystem *pFS, i64 nByte){
+  int rc;
   if( pFS->fdLog==0 ) return LSM_OK;
-  return lsmEnvTruncate(pFS->pEnv, pFS->fdLog, nByte);
+  rc = lsmFsFlushLog(pFS, 0);
+  if( rc==LSM_OK ) rc = lsmEnvTruncate(pFS->pEnv, pFS->fdLog, nByte);
+  return rc;
 }
 
 /*
@@ -443,8 +836,10 @@ int lsmFsCloseAndDeleteLog(FileSystem *pFS){
   char *zDel;
 
   if( pFS->fdLog ){
+    lsmFsFlushLog(pFS, 0);
     lsmEnvClose(pFS->pEnv, pFS->fdLog );
     pFS->fdLog = 0;
+    pFS->nLogAlloc = 0;
   }
 
   zDel = lsmMallocPrintf(pFS->pEnv, "%s-log", pFS->zDb);
@@ -455,6 +850,38 @@ int lsmFsCloseAndDeleteLog(FileSystem *pFS){
   return LSM_OK;
 }
 
+/*
+** Close the log file without deleting it. This is used instead of
+** lsmFsCloseAndDeleteLog() at shutdown if LSM_CONFIG_LOG_PREALLOC is set,
+** so that the space preallocated to the log may be reused. 
+**
+** Before the file is closed, the first few bytes at offset iOff (the log
+** offset stored in the final checkpoint) and at offset 0 are overwritten 
+** with zeroes and the file synced. A zero byte is interpreted
+** as an end-of-log marker, so this prevents recovery from replaying log
+** records already included in the checkpoint. Such records may otherwise
+** pass the checksum test, as the checksum chain is reset whenever the 
+** log wraps around to the start of the file.
+*/
+int lsmFsCloseAndResetLog(FileSystem *pFS, i64 iOff){
+  int rc = LSM_OK;
+  if( pFS->fdLog ){
+    static const u8 aZero[8] = {0, 0, 0, 0, 0, 0, 0, 0};
+    rc = lsmFsFlushLog(pFS, 0);
+    if( rc==LSM_OK ){
+      rc = lsmEnvWrite(pFS->pEnv, pFS->fdLog, 0, aZero, sizeof(aZero));
+    }
+    if( rc==LSM_OK && iOff!=0 ){
+      rc = lsmEnvWrite(pFS->pEnv, pFS->fdLog, iOff, aZero, sizeof(aZero));
+    }
+    if( rc==LSM_OK ) rc = lsmEnvSync(pFS->pEnv, pFS->fdLog);
+    lsmEnvClose(pFS->pEnv, pFS->fdLog);
+    pFS->fdLog = 0;
+    pFS->nLogAlloc = 0;
+  }
+  return rc;
+}
+
 /*
 ** Given that there are currently nHash slots in the hash table, return 
 ** the hash key for file iFile, page iPg.
@@ -478,6 +905,12 @@ static lsm_file *fsOpenFile(
     int flags = (bReadonly ? LSM_OPEN_READONLY : 0);
     const char *zPath = (bLog ? pFS->zLog : pFS->zDb);
 
+    if( pFS->eDirectIo==LSM_DIRECT_IO_ALL 
+     || (pFS->eDirectIo==LSM_DIRECT_IO_DB && bLog==0)
+    ){
+      flags |= LSM_OPEN_DIRECT;
+    }
+
     *pRc = lsmEnvOpen(pFS->pEnv, zPath, flags, &pFile);
   }
   return pFile;
@@ -510,11 +943,27 @@ int lsmFsOpenLog(lsm_db *db, int *pbOpen){
   return rc;
 }
 
+/*
+** Open an additional, read-only, file handle on the log file and set
+** *ppFile to point to it. This is used to read the log file from a
+** second thread during recovery. If the log file does not exist, set
+** *ppFile to NULL and return LSM_OK. The caller closes the handle using
+** lsmEnvClose().
+*/
+int lsmFsOpenLogReadonly(lsm_db *db, lsm_file **ppFile){
+  int rc = LSM_OK;
+  *ppFile = fsOpenFile(db->pFS, 1, 1, &rc);
+  if( rc==LSM_IOERR_NOENT ) rc = LSM_OK;
+  return rc;
+}
+
 void lsmFsCloseLog(lsm_db *db){
   FileSystem *pFS = db->pFS;
   if( pFS->fdLog ){
+    lsmFsFlushLog(pFS, 0);
     lsmEnvClose(pFS->pEnv, pFS->fdLog);
     pFS->fdLog = 0;
+    pFS->nLogAlloc = 0;
   }
 }
 
@@ -554,6 +1003,9 @@ int lsmFsOpen(
     pFS->nMetasize = 4 * 1024;
     pFS->pDb = pDb;
     pFS->pEnv = pDb->pEnv;
+    pFS->eDirectIo = lsmDbDirectIo(pDb);
+    pFS->bAlign = (pFS->eDirectIo!=LSM_DIRECT_IO_OFF);
+    lsmStringInit(&pFS->logbuf, pDb->pEnv);
 
     /* Make a copy of the database and log file names. */
     memcpy(pFS->zDb, zDb, nDb+1);
@@ -562,10 +1014,14 @@ int lsmFsOpen(
 
     /* Allocate the hash-table here. At some point, it should be changed
     ** so that it can grow dynamicly. */
-    pFS->nCacheMax = 2048*1024 / pFS->nPagesize;
     pFS->nHash = 4096;
     pFS->apHash = lsmMallocZeroRc(pDb->pEnv, sizeof(Page *) * pFS->nHash, &rc);
 
+    /* Attach to the page cache shared with other connections */
+    pFS->pCache = lsmDbPageCache(pDb);
+    if( pDb->nCacheSize>=0 ) lsmFsCacheSize(pFS, pDb->nCacheSize);
+    if( pDb->eCachePolicy>=0 ) lsmFsCachePolicy(pFS, pDb->eCachePolicy);
+
     /* Open the database file */
     pLsmFile = lsmDbRecycleFd(pDb);
     if( pLsmFile ){
@@ -591,6 +1047,77 @@ int lsmFsOpen(
   return rc;
 }
 
+/*
+** Allocate a buffer of nByte bytes for page data. If parameter bAlign is 
+** true (because the database is opened for direct IO), the buffer is 
+** aligned to a multiple of LSM_DIRECT_ALIGN bytes. In this case the pointer
+** returned by the underlying allocation is stored immediately before the 
+** buffer. Buffers allocated by this function must be freed by passing the
+** same bAlign value to fsBufferFree().
+*/
+static void *fsBufferMalloc(lsm_env *pEnv, int bAlign, int nByte, int *pRc){
+  u8 *aRet;
+  if( bAlign==0 ){
+    aRet = (u8 *)lsmMallocRc(pEnv, nByte, pRc);
+  }else{
+    int nHdr = sizeof(u8 *);
+    u8 *aAlloc = (u8 *)lsmMallocRc(pEnv, nByte + nHdr + LSM_DIRECT_ALIGN, pRc);
+    aRet = 0;
+    if( aAlloc ){
+      int iAlign = (int)(((size_t)&aAlloc[nHdr]) % LSM_DIRECT_ALIGN);
+      aRet = &aAlloc[nHdr + (LSM_DIRECT_ALIGN - iAlign) % LSM_DIRECT_ALIGN];
+      memcpy(&aRet[-nHdr], (void *)&aAlloc, nHdr);
+    }
+  }
+  return (void *)aRet;
+}
+
+/*
+** Free a buffer allocated by fsBufferMalloc().
+*/
+static void fsBufferFree(lsm_env *pEnv, int bAlign, void *p){
+  if( p && bAlign ){
+    u8 *aAlloc;
+    memcpy((void *)&aAlloc, &((u8 *)p)[-(int)sizeof(u8 *)], sizeof(u8 *));
+    p = (void *)aAlloc;
+  }
+  lsmFree(pEnv, p);
+}
+
+/*
+** Free all unused page handles belonging to the file-system object. In 
+** mmap() mode, these are the pages in the LRU list (which includes those
+** in the pFree list). Otherwise, the pages in the pFree list.
+*/
+static void fsFreePageHandles(FileSystem *pFS){
+  lsm_env *pEnv = pFS->pEnv;
+  Page *pPg;
+
+  pPg = pFS->pLruFirst;
+  while( pPg ){
+    Page *pNext = pPg->pLruNext;
+    if( pPg->flags & PAGE_FREE ){
+      fsBufferFree(pEnv, pFS->bAlign, pPg->aData);
+    }
+    lsmFree(pEnv, pPg);
+    pPg = pNext;
+  }
+  if( pFS->bUseMmap==0 ){
+    pPg = pFS->pFree;
+    while( pPg ){
+      Page *pNext = pPg->pHashNext;
+      assert( pPg->aData==0 && pPg->pEntry==0 );
+      lsmFree(pEnv, pPg);
+      pPg = pNext;
+    }
+  }
+
+  /* Zero pointers that point to deleted page objects */
+  pFS->pLruFirst = 0;
+  pFS->pLruLast = 0;
+  pFS->pFree = 0;
+}
+
 /*
 ** Configure the file-system object according to the current values of
 ** the LSM_CONFIG_MMAP and LSM_CONFIG_SET_COMPRESSION options.
@@ -599,44 +1126,33 @@ int lsmFsConfigure(lsm_db *db){
   FileSystem *pFS = db->pFS;
   if( pFS ){
     lsm_env *pEnv = pFS->pEnv;
-    Page *pPg;
 
     assert( pFS->nOut==0 );
     assert( pFS->pWaiting==0 );
 
     /* Reset any compression/decompression buffers already allocated */
-    lsmFree(pEnv, pFS->aIBuffer);
-    lsmFree(pEnv, pFS->aOBuffer);
+    fsBufferFree(pEnv, pFS->bAlign, pFS->aIBuffer);
+    fsBufferFree(pEnv, pFS->bAlign, pFS->aOBuffer);
     pFS->nBuffer = 0;
 
+    /* Free all allocate page structures */
+    fsFreePageHandles(pFS);
+
     /* Unmap the file, if it is currently mapped */
     if( pFS->pMap ){
       lsmEnvRemap(pEnv, pFS->fdDb, -1, &pFS->pMap, &pFS->nMap);
       pFS->bUseMmap = 0;
     }
 
-    /* Free all allocate page structures */
-    pPg = pFS->pLruFirst;
-    while( pPg ){
-      Page *pNext = pPg->pLruNext;
-      if( pPg->flags & PAGE_FREE ) lsmFree(pEnv, pPg->aData);
-      lsmFree(pEnv, pPg);
-      pPg = pNext;
-    }
-
-    /* Zero pointers that point to deleted page objects */
-    pFS->nCacheAlloc = 0;
-    pFS->pLruFirst = 0;
-    pFS->pLruLast = 0;
-    pFS->pFree = 0;
-
-    /* Configure the FileSystem object */
+    /* Configure the FileSystem object. The database file is never 
+    ** memory-mapped if it was opened for direct IO.  */
     if( db->compress.xCompress ){
       pFS->pCompress = &db->compress;
       pFS->bUseMmap = 0;
+      lsmLzCompression(&pFS->lz);
     }else{
       pFS->pCompress = 0;
-      pFS->bUseMmap = db->bMmap;
+      pFS->bUseMmap = (db->bMmap && pFS->eDirectIo==LSM_DIRECT_IO_OFF);
     }
   }
 
@@ -648,24 +1164,21 @@ int lsmFsConfigure(lsm_db *db){
 */
 void lsmFsClose(FileSystem *pFS){
   if( pFS ){
-    Page *pPg;
     lsm_env *pEnv = pFS->pEnv;
 
-    assert( pFS->nOut==0 );
-    pPg = pFS->pLruFirst;
-    while( pPg ){
-      Page *pNext = pPg->pLruNext;
-      if( pPg->flags & PAGE_FREE ) lsmFree(pEnv, pPg->aData);
-      lsmFree(pEnv, pPg);
-      pPg = pNext;
-    }
+    assert( pFS->nOut==0 && pFS->nBatch==0 );
+    fsFreePageHandles(pFS);
 
     if( pFS->fdDb ) lsmEnvClose(pFS->pEnv, pFS->fdDb );
-    if( pFS->fdLog ) lsmEnvClose(pFS->pEnv, pFS->fdLog );
+    if( pFS->fdLog ){
+      lsmFsFlushLog(pFS, 0);
+      lsmEnvClose(pFS->pEnv, pFS->fdLog );
+    }
+    lsmStringClear(&pFS->logbuf);
     lsmFree(pEnv, pFS->pLsmFile);
     lsmFree(pEnv, pFS->apHash);
-    lsmFree(pEnv, pFS->aIBuffer);
-    lsmFree(pEnv, pFS->aOBuffer);
+    fsBufferFree(pEnv, pFS->bAlign, pFS->aIBuffer);
+    fsBufferFree(pEnv, pFS->bAlign, pFS->aOBuffer);
     lsmFree(pEnv, pFS);
   }
 }
@@ -729,7 +1242,6 @@ int lsmFsBlockSize(FileSystem *pFS){
 */
 void lsmFsSetPageSize(FileSystem *pFS, int nPgsz){
   pFS->nPagesize = nPgsz;
-  pFS->nCacheMax = 2048*1024 / pFS->nPagesize;
 }
 
 /*
@@ -853,115 +1365,732 @@ static void fsPageRemoveFromLru(FileSystem *pFS, Page *pPg){
   }else{
     pFS->pLruLast = pPg->pLruPrev;
   }
-  if( pPg->pLruPrev ){
-    pPg->pLruPrev->pLruNext = pPg->pLruNext;
+  if( pPg->pLruPrev ){
+    pPg->pLruPrev->pLruNext = pPg->pLruNext;
+  }else{
+    pFS->pLruFirst = pPg->pLruNext;
+  }
+  pPg->pLruPrev = 0;
+  pPg->pLruNext = 0;
+}
+
+/*
+** Page pPg is not currently part of the LRU list belonging to pFS. Add it.
+*/
+static void fsPageAddToLru(FileSystem *pFS, Page *pPg){
+  assert( pPg->pLruNext==0 && pPg->pLruPrev==0 );
+  pPg->pLruPrev = pFS->pLruLast;
+  if( pPg->pLruPrev ){
+    pPg->pLruPrev->pLruNext = pPg;
+  }else{
+    pFS->pLruFirst = pPg;
+  }
+  pFS->pLruLast = pPg;
+}
+
+/*
+** Remove page pPg from the hash table, if it is present.
+*/
+static void fsPageRemoveFromHash(FileSystem *pFS, Page *pPg){
+  int iHash;
+  Page **pp;
+
+  iHash = fsHashKey(pFS->nHash, pPg->iPg);
+  for(pp=&pFS->apHash[iHash]; *pp && *pp!=pPg; pp=&(*pp)->pHashNext);
+  if( *pp ) *pp = pPg->pHashNext;
+}
+
+/*
+** Search the hash-table for page iPg. If an entry is round, return a pointer
+** to it. Otherwise, return NULL.
+**
+** Either way, if argument piHash is not NULL set *piHash to the hash slot
+** number that page iPg would be stored in before returning.
+*/
+static Page *fsPageFindInHash(FileSystem *pFS, Pgno iPg, int *piHash){
+  Page *p;                        /* Return value */
+  int iHash = fsHashKey(pFS->nHash, iPg);
+
+  if( piHash ) *piHash = iHash;
+  for(p=pFS->apHash[iHash]; p; p=p->pHashNext){
+    if( p->iPg==iPg) break;
+  }
+  return p;
+}
+
+/*
+** Allocate a new page cache object. Return LSM_OK if successful, or 
+** LSM_NOMEM otherwise.
+*/
+int lsmFsCacheNew(lsm_env *pEnv, int bAlign, PageCache **ppCache){
+  PageCache *p;
+  int rc = LSM_OK;
+  int i;
+
+  p = (PageCache *)lsmMallocZeroRc(pEnv, sizeof(PageCache), &rc);
+  if( p ){
+    p->pEnv = pEnv;
+    p->bAlign = bAlign;
+    p->nMaxByte = (i64)LSM_DFLT_CACHE_SIZE * 1024;
+    p->ePolicy = LSM_DFLT_CACHE_POLICY;
+    if( rc==LSM_OK ) rc = lsmMutexNew(pEnv, &p->pMutex);
+    for(i=0; rc==LSM_OK && i<LSM_CACHE_NSHARD; i++){
+      CacheShard *pShard = &p->aShard[i];
+      pShard->nHash = 256;
+      pShard->apHash = (CacheEntry **)lsmMallocZeroRc(
+          pEnv, sizeof(CacheEntry *) * pShard->nHash, &rc
+      );
+      pShard->apBlock = (CacheEntry **)lsmMallocZeroRc(
+          pEnv, sizeof(CacheEntry *) * pShard->nHash, &rc
+      );
+      if( rc==LSM_OK ) rc = lsmMutexNew(pEnv, &pShard->pMutex);
+    }
+    if( rc!=LSM_OK ){
+      lsmFsCacheFree(pEnv, p);
+      p = 0;
+    }
+  }
+
+  *ppCache = p;
+  return rc;
+}
+
+static void fsCacheEntryFree(PageCache *pCache, CacheEntry *pEntry){
+  fsBufferFree(pCache->pEnv, pCache->bAlign, pEntry->aData);
+  lsmFree(pCache->pEnv, pEntry);
+}
+
+/*
+** Free a page cache object allocated by lsmFsCacheNew(). There may not
+** be any outstanding references to cache entries.
+*/
+void lsmFsCacheFree(lsm_env *pEnv, PageCache *p){
+  if( p ){
+    int i;
+    for(i=0; i<LSM_CACHE_NSHARD; i++){
+      CacheShard *pShard = &p->aShard[i];
+      int iHash;
+      for(iHash=0; pShard->apHash && iHash<pShard->nHash; iHash++){
+        CacheEntry *pEntry = pShard->apHash[iHash];
+        while( pEntry ){
+          CacheEntry *pNext = pEntry->pHashNext;
+          assert( pEntry->nRef==0 );
+          fsCacheEntryFree(p, pEntry);
+          pEntry = pNext;
+        }
+      }
+      lsmFree(pEnv, pShard->apHash);
+      lsmFree(pEnv, pShard->apBlock);
+      lsmMutexDel(pEnv, pShard->pMutex);
+    }
+    lsmMutexDel(pEnv, p->pMutex);
+    lsmFree(pEnv, p);
+  }
+}
+
+/*
+** Return the shard of page cache p that page iPg belongs to.
+*/
+static CacheShard *fsCacheShard(PageCache *p, Pgno iPg){
+  u32 h = (u32)iPg * 2654435761U;
+  return &p->aShard[h >> 29];
+}
+
+/*
+** Remove entry pEntry from the queue of pShard that it is part of.
+*/
+static void fsCacheQueueRemove(CacheShard *pShard, CacheEntry *pEntry){
+  CacheQueue *pQueue = &pShard->aQueue[pEntry->iQueue];
+  if( pEntry->pLruNext ){
+    pEntry->pLruNext->pLruPrev = pEntry->pLruPrev;
+  }else{
+    pQueue->pLast = pEntry->pLruPrev;
+  }
+  if( pEntry->pLruPrev ){
+    pEntry->pLruPrev->pLruNext = pEntry->pLruNext;
+  }else{
+    pQueue->pFirst = pEntry->pLruNext;
+  }
+  pEntry->pLruPrev = 0;
+  pEntry->pLruNext = 0;
+  pQueue->nByte -= sizeof(CacheEntry) + pEntry->nData;
+  pQueue->nEntry--;
+}
+
+/*
+** Add entry pEntry to the most-recently-used end of queue iQueue of 
+** pShard.
+*/
+static void fsCacheQueueAdd(
+  CacheShard *pShard, 
+  CacheEntry *pEntry, 
+  int iQueue
+){
+  CacheQueue *pQueue = &pShard->aQueue[iQueue];
+  assert( pEntry->pLruNext==0 && pEntry->pLruPrev==0 );
+  pEntry->iQueue = iQueue;
+  if( iQueue==CACHE_PROBATION ) pEntry->iSeq = pShard->iSeq++;
+  pEntry->pLruPrev = pQueue->pLast;
+  if( pEntry->pLruPrev ){
+    pEntry->pLruPrev->pLruNext = pEntry;
+  }else{
+    pQueue->pFirst = pEntry;
+  }
+  pQueue->pLast = pEntry;
+  pQueue->nByte += sizeof(CacheEntry) + pEntry->nData;
+  pQueue->nEntry++;
+}
+
+/*
+** This is called each time a connection finds page pEntry in the cache.
+** Move the entry within the queues of pShard according to the replacement 
+** policy in use. If bNoPromote is true (for reads made by a worker 
+** connection) and the 2Q policy is in use, the entry is not moved.
+**
+** Under 2Q, the entry is in the older half of the probation queue if more
+** than half as many entries as are currently in the queue have been added
+** to it since pEntry was.
+*/
+static void fsCacheTouch(
+  PageCache *pCache, 
+  CacheShard *pShard, 
+  CacheEntry *pEntry,
+  int bNoPromote
+){
+  assert( pEntry->iQueue!=CACHE_GHOST );
+  if( pCache->ePolicy==LSM_CACHE_2Q ){
+    if( bNoPromote==0 && (pEntry->iQueue==CACHE_PROTECTED
+     || (pShard->iSeq - pEntry->iSeq)*2 > 
+        (u32)pShard->aQueue[CACHE_PROBATION].nEntry
+    )){
+      fsCacheQueueRemove(pShard, pEntry);
+      fsCacheQueueAdd(pShard, pEntry, CACHE_PROTECTED);
+    }
+  }else{
+    fsCacheQueueRemove(pShard, pEntry);
+    fsCacheQueueAdd(pShard, pEntry, CACHE_PROBATION);
+  }
+}
+
+/*
+** Search the hash table of pShard for page iPg. Return a pointer to the 
+** entry if it is found, or NULL otherwise.
+*/
+static CacheEntry *fsCacheFind(CacheShard *pShard, Pgno iPg){
+  CacheEntry *p;
+  for(p=pShard->apHash[fsHashKey(pShard->nHash, iPg)]; p; p=p->pHashNext){
+    if( p->iPg==iPg ) break;
+  }
+  return p;
+}
+
+/*
+** Add entry pEntry to slot iHash of block hash table apBlock[].
+*/
+static void fsCacheBlockAdd(CacheEntry **apBlock, int iHash, CacheEntry *p){
+  p->pBlockPrev = 0;
+  p->pBlockNext = apBlock[iHash];
+  if( p->pBlockNext ) p->pBlockNext->pBlockPrev = p;
+  apBlock[iHash] = p;
+}
+
+/*
+** Add entry pEntry to the hash tables of pShard and to queue iQueue. If 
+** the number of entries in the hash tables grows larger than twice the 
+** number of slots, attempt to double the number of slots.
+*/
+static void fsCacheInsert(
+  PageCache *pCache, 
+  CacheShard *pShard, 
+  CacheEntry *pEntry,
+  int iQueue                      /* CACHE_PROBATION or CACHE_PROTECTED */
+){
+  int iHash;
+
+  if( pShard->nEntry>=pShard->nHash*2 ){
+    int nNew = pShard->nHash*2;
+    CacheEntry **apNew;
+    CacheEntry **apNewBlock;
+    apNew = (CacheEntry **)lsmMallocZero(pCache->pEnv, sizeof(void*)*nNew);
+    apNewBlock = (CacheEntry **)lsmMallocZero(pCache->pEnv,sizeof(void*)*nNew);
+    if( apNew && apNewBlock ){
+      int i;
+      for(i=0; i<pShard->nHash; i++){
+        CacheEntry *p = pShard->apHash[i];
+        while( p ){
+          CacheEntry *pNext = p->pHashNext;
+          iHash = fsHashKey(nNew, p->iPg);
+          p->pHashNext = apNew[iHash];
+          apNew[iHash] = p;
+          fsCacheBlockAdd(apNewBlock, fsHashKey(nNew, p->iBlk), p);
+          p = pNext;
+        }
+      }
+      lsmFree(pCache->pEnv, pShard->apHash);
+      lsmFree(pCache->pEnv, pShard->apBlock);
+      pShard->apHash = apNew;
+      pShard->apBlock = apNewBlock;
+      pShard->nHash = nNew;
+    }else{
+      lsmFree(pCache->pEnv, apNew);
+      lsmFree(pCache->pEnv, apNewBlock);
+    }
+  }
+
+  iHash = fsHashKey(pShard->nHash, pEntry->iPg);
+  pEntry->pHashNext = pShard->apHash[iHash];
+  pShard->apHash[iHash] = pEntry;
+  fsCacheBlockAdd(
+      pShard->apBlock, fsHashKey(pShard->nHash, pEntry->iBlk), pEntry
+  );
+  pShard->nEntry++;
+  pShard->nByte += sizeof(CacheEntry) + pEntry->nData;
+  fsCacheQueueAdd(pShard, pEntry, iQueue);
+}
+
+/*
+** Remove entry pEntry from the hash tables of pShard. If it is not in use,
+** free it. Otherwise, mark it so that it is freed when the last reference
+** to it is released.
+*/
+static void fsCacheDiscard(
+  PageCache *pCache, 
+  CacheShard *pShard, 
+  CacheEntry *pEntry
+){
+  CacheEntry **pp;
+  int iHash = fsHashKey(pShard->nHash, pEntry->iPg);
+
+  for(pp=&pShard->apHash[iHash]; *pp!=pEntry; pp=&(*pp)->pHashNext);
+  *pp = pEntry->pHashNext;
+  if( pEntry->pBlockNext ){
+    pEntry->pBlockNext->pBlockPrev = pEntry->pBlockPrev;
+  }
+  if( pEntry->pBlockPrev ){
+    pEntry->pBlockPrev->pBlockNext = pEntry->pBlockNext;
+  }else{
+    iHash = fsHashKey(pShard->nHash, pEntry->iBlk);
+    pShard->apBlock[iHash] = pEntry->pBlockNext;
+  }
+  pShard->nEntry--;
+  pShard->nByte -= sizeof(CacheEntry) + pEntry->nData;
+  fsCacheQueueRemove(pShard, pEntry);
+
+  if( pEntry->nRef==0 ){
+    fsCacheEntryFree(pCache, pEntry);
+  }else{
+    pEntry->bDiscard = 1;
+  }
+}
+
+/*
+** Evict entry pEntry, which is not in use, from the cache. Under the 2Q
+** policy, an entry evicted from the probation queue is moved to the ghost
+** queue instead of being discarded.
+*/
+static void fsCacheEvict(
+  PageCache *pCache, 
+  CacheShard *pShard, 
+  CacheEntry *pEntry
+){
+  assert( pEntry->nRef==0 && pEntry->iQueue!=CACHE_GHOST );
+  if( pCache->ePolicy==LSM_CACHE_2Q && pEntry->iQueue==CACHE_PROBATION ){
+    CacheQueue *pGhost = &pShard->aQueue[CACHE_GHOST];
+    i64 nMax = pCache->nMaxByte / LSM_CACHE_NSHARD;
+    int nGhostMax = (int)(nMax / (sizeof(CacheEntry) + pEntry->nData) / 2);
+
+    fsCacheQueueRemove(pShard, pEntry);
+    pShard->nByte -= pEntry->nData;
+    fsBufferFree(pCache->pEnv, pCache->bAlign, pEntry->aData);
+    pEntry->aData = 0;
+    pEntry->nData = 0;
+    fsCacheQueueAdd(pShard, pEntry, CACHE_GHOST);
+    while( pGhost->nEntry>nGhostMax ){
+      fsCacheDiscard(pCache, pShard, pGhost->pFirst);
+    }
+  }else{
+    fsCacheDiscard(pCache, pShard, pEntry);
+  }
+}
+
+/*
+** Evict entries from pShard until it is no larger than its share of the
+** configured cache size, or until all remaining entries are in use. Under
+** the 2Q policy, entries are evicted from the protected queue only if the
+** probation queue is small enough (or contains no entries not in use).
+*/
+static void fsCacheEnforceLimit(PageCache *pCache, CacheShard *pShard){
+  i64 nMax = pCache->nMaxByte / LSM_CACHE_NSHARD;
+  CacheEntry *p1 = pShard->aQueue[CACHE_PROBATION].pFirst;
+  CacheEntry *p2 = pShard->aQueue[CACHE_PROTECTED].pFirst;
+
+  while( pShard->nByte>nMax ){
+    CacheEntry *pVictim;
+    while( p1 && p1->nRef>0 ) p1 = p1->pLruNext;
+    while( p2 && p2->nRef>0 ) p2 = p2->pLruNext;
+
+    if( p1 && (p2==0 || pCache->ePolicy!=LSM_CACHE_2Q
+            || pShard->aQueue[CACHE_PROBATION].nByte>nMax/4)
+    ){
+      pVictim = p1;
+      p1 = p1->pLruNext;
+    }else if( p2 ){
+      pVictim = p2;
+      p2 = p2->pLruNext;
+    }else{
+      break;
+    }
+    fsCacheEvict(pCache, pShard, pVictim);
+  }
+}
+
+/*
+** Discard all entries from the page cache.
+*/
+static void fsCacheDiscardAll(PageCache *pCache){
+  int i;
+  for(i=0; i<LSM_CACHE_NSHARD; i++){
+    CacheShard *pShard = &pCache->aShard[i];
+    int iHash;
+    lsmMutexEnter(pCache->pEnv, pShard->pMutex);
+    for(iHash=0; iHash<pShard->nHash; iHash++){
+      while( pShard->apHash[iHash] ){
+        fsCacheDiscard(pCache, pShard, pShard->apHash[iHash]);
+      }
+    }
+    lsmMutexLeave(pCache->pEnv, pShard->pMutex);
+  }
+}
+
+/*
+** Discard all entries for pages stored on block iBlk from the page cache.
+** Only a single slot of the block hash table of each shard is searched.
+*/
+static void fsCacheDiscardBlock(PageCache *pCache, int iBlk){
+  int i;
+  for(i=0; i<LSM_CACHE_NSHARD; i++){
+    CacheShard *pShard = &pCache->aShard[i];
+    CacheEntry *pEntry;
+    lsmMutexEnter(pCache->pEnv, pShard->pMutex);
+    pEntry = pShard->apBlock[fsHashKey(pShard->nHash, iBlk)];
+    while( pEntry ){
+      CacheEntry *pNext = pEntry->pBlockNext;
+      if( pEntry->iBlk==iBlk ) fsCacheDiscard(pCache, pShard, pEntry);
+      pEntry = pNext;
+    }
+    lsmMutexLeave(pCache->pEnv, pShard->pMutex);
+  }
+}
+
+/*
+** Discard any cached image of page iPg. This is called before a page
+** is written to the database file.
+*/
+static void fsCacheDrop(FileSystem *pFS, Pgno iPg){
+  PageCache *pCache = pFS->pCache;
+  CacheShard *pShard = fsCacheShard(pCache, iPg);
+  CacheEntry *pEntry;
+
+  lsmMutexEnter(pCache->pEnv, pShard->pMutex);
+  pEntry = fsCacheFind(pShard, iPg);
+  if( pEntry ) fsCacheDiscard(pCache, pShard, pEntry);
+  lsmMutexLeave(pCache->pEnv, pShard->pMutex);
+}
+
+/*
+** Release a reference to cache entry pEntry, obtained by fsCacheFetch().
+*/
+static void fsCacheRelease(FileSystem *pFS, CacheEntry *pEntry){
+  PageCache *pCache = pFS->pCache;
+  CacheShard *pShard = fsCacheShard(pCache, pEntry->iPg);
+
+  lsmMutexEnter(pCache->pEnv, pShard->pMutex);
+  assert( pEntry->nRef>0 );
+  pEntry->nRef--;
+  if( pEntry->nRef==0 ){
+    if( pEntry->bDiscard ){
+      fsCacheEntryFree(pCache, pEntry);
+    }else{
+      fsCacheEnforceLimit(pCache, pShard);
+    }
+  }
+  lsmMutexLeave(pCache->pEnv, pShard->pMutex);
+}
+
+/*
+** Page handle pPg has just been written to the database file and its
+** ref-count has dropped to zero. Hand its buffer over to the page cache.
+** Return LSM_OK if successful, or LSM_NOMEM if an OOM occurs. In the
+** latter case the caller remains responsible for the buffer.
+*/
+static int fsCacheDonate(FileSystem *pFS, Page *pPg){
+  PageCache *pCache = pFS->pCache;
+  CacheShard *pShard = fsCacheShard(pCache, pPg->iPg);
+  CacheEntry *pEntry;
+  CacheEntry *pOld;
+
+  assert( (pPg->flags & (PAGE_FREE|PAGE_DIRTY|PAGE_HASPREV))==PAGE_FREE );
+  pEntry = (CacheEntry *)lsmMallocZero(pFS->pEnv, sizeof(CacheEntry));
+  if( pEntry==0 ) return LSM_NOMEM_BKPT;
+  pEntry->iPg = pPg->iPg;
+  pEntry->iBlk = fsPageToBlock(pFS, pPg->iPg);
+  pEntry->aData = pPg->aData;
+  pEntry->nData = pFS->nPagesize;
+  pEntry->nCompress = pPg->nCompress;
+
+  lsmMutexEnter(pCache->pEnv, pShard->pMutex);
+  pOld = fsCacheFind(pShard, pPg->iPg);
+  if( pOld ) fsCacheDiscard(pCache, pShard, pOld);
+  fsCacheInsert(pCache, pShard, pEntry, CACHE_PROBATION);
+  fsCacheEnforceLimit(pCache, pShard);
+  lsmMutexLeave(pCache->pEnv, pShard->pMutex);
+  return LSM_OK;
+}
+
+static int fsReadPagedata(FileSystem *, Segment *, Page *, int *);
+
+/*
+** Page handle p, for which Page.iPg has already been set, is not currently
+** associated with any page data. This function finds or creates the 
+** shared cache entry for the page and points p->aData at its contents. 
+** If the page is not already cached, it is read from the database file.
+**
+** In compressed database mode, if the record at offset p->iPg turns out
+** to be a padding record instead of a page, *pnSpace is set to the size
+** of the padding and the handle is not associated with any cache entry.
+*/
+static int fsCacheFetch(
+  FileSystem *pFS,                /* File-system handle */
+  Segment *pSeg,                  /* Block redirection to use (or NULL) */
+  Page *p,                        /* Page handle to populate */
+  int *pnSpace                    /* OUT: Bytes of free space */
+){
+  PageCache *pCache = pFS->pCache;
+  CacheShard *pShard = fsCacheShard(pCache, p->iPg);
+  CacheEntry *pEntry;
+  CacheEntry *pNew = 0;
+  int rc = LSM_OK;
+  int bNoPromote = (pFS->pDb->pWorker!=0);
+
+  /* Search the cache for the page. A ghost entry counts as a miss. */
+  lsmMutexEnter(pCache->pEnv, pShard->pMutex);
+  pEntry = fsCacheFind(pShard, p->iPg);
+  if( pEntry && pEntry->iQueue==CACHE_GHOST ){
+    pEntry = 0;
+  }else if( pEntry && pEntry->nData!=pFS->nPagesize ){
+    fsCacheDiscard(pCache, pShard, pEntry);
+    pEntry = 0;
+  }
+  if( pEntry ){
+    fsCacheTouch(pCache, pShard, pEntry, bNoPromote);
+    pEntry->nRef++;
+  }
+  lsmMutexLeave(pCache->pEnv, pShard->pMutex);
+
+  if( pEntry==0 ){
+    /* Cache miss. Read the page into a new entry without holding the 
+    ** shard mutex.  */
+    pNew = (CacheEntry *)lsmMallocZeroRc(pFS->pEnv, sizeof(CacheEntry), &rc);
+    if( rc==LSM_OK ){
+      pNew->aData = (u8 *)fsBufferMalloc(
+          pFS->pEnv, pFS->bAlign, pFS->nPagesize, &rc
+      );
+      pNew->nData = pFS->nPagesize;
+      pNew->iPg = p->iPg;
+      pNew->iBlk = fsPageToBlock(pFS, p->iPg);
+    }
+    if( rc==LSM_OK ){
+      p->aData = pNew->aData;
+      if( pFS->pCompress ){
+        rc = fsReadPagedata(pFS, pSeg, p, pnSpace);
+      }else{
+        i64 iOff = (i64)(p->iPg-1) * pFS->nPagesize;
+        rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, p->aData, pFS->nPagesize);
+      }
+      pFS->nRead++;
+    }
+
+    /* Add the new entry to the cache. Unless some other connection loaded
+    ** the same page while this one was reading it. In that case, use the
+    ** existing entry and discard the new one. If the page was found in
+    ** the ghost queue, add the new entry to the protected queue.  */
+    if( rc==LSM_OK && (pnSpace==0 || *pnSpace==0) ){
+      int iQueue = CACHE_PROBATION;
+      pNew->nCompress = p->nCompress;
+      lsmMutexEnter(pCache->pEnv, pShard->pMutex);
+      pEntry = fsCacheFind(pShard, p->iPg);
+      if( pEntry && pEntry->iQueue==CACHE_GHOST ){
+        if( pCache->ePolicy==LSM_CACHE_2Q && bNoPromote==0 ){
+          iQueue = CACHE_PROTECTED;
+        }
+        fsCacheDiscard(pCache, pShard, pEntry);
+        pEntry = 0;
+      }else if( pEntry && pEntry->nData!=pFS->nPagesize ){
+        fsCacheDiscard(pCache, pShard, pEntry);
+        pEntry = 0;
+      }
+      if( pEntry ){
+        fsCacheTouch(pCache, pShard, pEntry, bNoPromote);
+        pEntry->nRef++;
+      }else{
+        pEntry = pNew;
+        pNew = 0;
+        pEntry->nRef++;
+        fsCacheInsert(pCache, pShard, pEntry, iQueue);
+        fsCacheEnforceLimit(pCache, pShard);
+      }
+      lsmMutexLeave(pCache->pEnv, pShard->pMutex);
+    }
+    if( pNew ) fsCacheEntryFree(pCache, pNew);
+  }
+
+  if( pEntry ){
+    p->aData = pEntry->aData;
+    p->nCompress = pEntry->nCompress;
+    p->pEntry = pEntry;
   }else{
-    pFS->pLruFirst = pPg->pLruNext;
+    p->aData = 0;
   }
-  pPg->pLruPrev = 0;
-  pPg->pLruNext = 0;
+  return rc;
 }
 
 /*
-** Page pPg is not currently part of the LRU list belonging to pFS. Add it.
+** Set or query the size limit of the page cache used by file-system pFS.
+** If nKB is zero or greater, the limit is set to nKB KB. The (possibly
+** updated) limit in KB is returned.
 */
-static void fsPageAddToLru(FileSystem *pFS, Page *pPg){
-  assert( pPg->pLruNext==0 && pPg->pLruPrev==0 );
-  pPg->pLruPrev = pFS->pLruLast;
-  if( pPg->pLruPrev ){
-    pPg->pLruPrev->pLruNext = pPg;
-  }else{
-    pFS->pLruFirst = pPg;
+int lsmFsCacheSize(FileSystem *pFS, int nKB){
+  PageCache *pCache = pFS->pCache;
+  int nRet;
+
+  lsmMutexEnter(pCache->pEnv, pCache->pMutex);
+  if( nKB>=0 ){
+    int i;
+    pCache->nMaxByte = (i64)nKB * 1024;
+    for(i=0; i<LSM_CACHE_NSHARD; i++){
+      CacheShard *pShard = &pCache->aShard[i];
+      lsmMutexEnter(pCache->pEnv, pShard->pMutex);
+      fsCacheEnforceLimit(pCache, pShard);
+      lsmMutexLeave(pCache->pEnv, pShard->pMutex);
+    }
   }
-  pFS->pLruLast = pPg;
+  nRet = (int)(pCache->nMaxByte / 1024);
+  lsmMutexLeave(pCache->pEnv, pCache->pMutex);
+
+  return nRet;
 }
 
 /*
-** Remove page pPg from the hash table.
+** Set or query the replacement policy of the page cache used by file-system
+** pFS. If ePolicy is LSM_CACHE_LRU or LSM_CACHE_2Q, the policy is set 
+** accordingly. The (possibly updated) policy is returned.
 */
-static void fsPageRemoveFromHash(FileSystem *pFS, Page *pPg){
-  int iHash;
-  Page **pp;
+int lsmFsCachePolicy(FileSystem *pFS, int ePolicy){
+  PageCache *pCache = pFS->pCache;
+  int eRet;
 
-  iHash = fsHashKey(pFS->nHash, pPg->iPg);
-  for(pp=&pFS->apHash[iHash]; *pp!=pPg; pp=&(*pp)->pHashNext);
-  *pp = pPg->pHashNext;
-}
+  lsmMutexEnter(pCache->pEnv, pCache->pMutex);
+  if( ePolicy==LSM_CACHE_LRU || ePolicy==LSM_CACHE_2Q ){
+    pCache->ePolicy = ePolicy;
+  }
+  eRet = pCache->ePolicy;
+  lsmMutexLeave(pCache->pEnv, pCache->pMutex);
 
+  return eRet;
+}
 
 /*
-** Purge the page cache of all entries with nRef==0.
+** This function is called by a worker connection when it reuses block 
+** iBlk from the free block list. It discards any cached images of pages
+** stored on the block and increments the shared-memory ShmHeader.iReuse 
+** counter to notify other processes.
 */
-void lsmFsPurgeCache(FileSystem *pFS){
-  if( pFS->bUseMmap==0 ){
-    Page *pPg;
-
-    pPg = pFS->pLruFirst;
-    while( pPg ){
-      Page *pNext = pPg->pLruNext;
-      fsPageRemoveFromHash(pFS, pPg);
-      if( pPg->flags & PAGE_FREE ){
-        lsmFree(pFS->pEnv, pPg->aData);
-      }
-      lsmFree(pFS->pEnv, pPg);
-      pPg = pNext;
-      pFS->nCacheAlloc--;
-    }
-    pFS->pLruFirst = 0;
-    pFS->pLruLast = 0;
+void lsmFsCacheReuse(lsm_db *pDb, int iBlk){
+  FileSystem *pFS = pDb->pFS;
+  PageCache *pCache = pFS->pCache;
+  ShmHeader *pShm = pDb->pShmhdr;
+  u32 iReuse = pShm->iReuse;
+
+  assert( pDb->pWorker );
+  pShm->iReuse = iReuse + 1;
+
+  lsmMutexEnter(pCache->pEnv, pCache->pMutex);
+  /* If PageCache.iReuse is not already out of date, update it. Otherwise,
+  ** leave it as is so that the next call to lsmFsCacheCheck() discards
+  ** the entire contents of the cache.  */
+  if( pCache->iReuse==iReuse ) pCache->iReuse = iReuse + 1;
+  fsCacheDiscardBlock(pCache, iBlk);
+  lsmMutexLeave(pCache->pEnv, pCache->pMutex);
+}
 
-    assert( pFS->nCacheAlloc<=pFS->nOut && pFS->nCacheAlloc>=0 );
+/*
+** This is called each time a read transaction is opened and each time
+** a worker snapshot is loaded. If any block has been reused by a worker 
+** in some other process since this process last checked, discard the 
+** entire contents of the page cache.
+*/
+void lsmFsCacheCheck(lsm_db *pDb){
+  PageCache *pCache = pDb->pFS->pCache;
+  u32 iReuse = pDb->pShmhdr->iReuse;
+
+  lsmMutexEnter(pCache->pEnv, pCache->pMutex);
+  if( pCache->iReuse!=iReuse ){
+    pCache->iReuse = iReuse;
+    fsCacheDiscardAll(pCache);
   }
+  lsmMutexLeave(pCache->pEnv, pCache->pMutex);
 }
 
 /*
-** Search the hash-table for page iPg. If an entry is round, return a pointer
-** to it. Otherwise, return NULL.
-**
-** Either way, if argument piHash is not NULL set *piHash to the hash slot
-** number that page iPg would be stored in before returning.
+** Discard all page images in the page cache. This is called when a 
+** read-only connection opens a read transaction on a database that no
+** read-write connection is connected to. In this case the ShmHeader.iReuse
+** counter is not available.
 */
-static Page *fsPageFindInHash(FileSystem *pFS, Pgno iPg, int *piHash){
-  Page *p;                        /* Return value */
-  int iHash = fsHashKey(pFS->nHash, iPg);
+void lsmFsPurgeCache(FileSystem *pFS){
+  PageCache *pCache = pFS->pCache;
+  lsmMutexEnter(pCache->pEnv, pCache->pMutex);
+  fsCacheDiscardAll(pCache);
+  lsmMutexLeave(pCache->pEnv, pCache->pMutex);
+}
 
-  if( piHash ) *piHash = iHash;
-  for(p=pFS->apHash[iHash]; p; p=p->pHashNext){
-    if( p->iPg==iPg) break;
+/*
+** Return a zeroed page handle. In non-mmap() mode, handles are recycled
+** using the FileSystem.pFree list. If an OOM error occurs, set *pRc to
+** LSM_NOMEM and return NULL.
+*/
+static Page *fsPageHandle(FileSystem *pFS, int *pRc){
+  Page *pPage;
+  if( pFS->bUseMmap==0 && pFS->pFree ){
+    pPage = pFS->pFree;
+    pFS->pFree = pPage->pHashNext;
+    memset(pPage, 0, sizeof(Page));
+  }else{
+    pPage = (Page *)lsmMallocZeroRc(pFS->pEnv, sizeof(Page), pRc);
   }
-  return p;
+  return pPage;
 }
 
+/*
+** Allocate a page handle along with a private buffer for the page data.
+*/
 static int fsPageBuffer(
   FileSystem *pFS, 
   Page **ppOut
 ){
   int rc = LSM_OK;
-  Page *pPage = 0;
-  if( pFS->bUseMmap || pFS->pLruFirst==0 || pFS->nCacheAlloc<pFS->nCacheMax ){
-    pPage = lsmMallocZero(pFS->pEnv, sizeof(Page));
-    if( !pPage ){
-      rc = LSM_NOMEM_BKPT;
-    }else{
-      pPage->aData = (u8 *)lsmMalloc(pFS->pEnv, pFS->nPagesize);
-      pPage->flags = PAGE_FREE;
-      if( !pPage->aData ){
-        lsmFree(pFS->pEnv, pPage);
-        rc = LSM_NOMEM_BKPT;
-        pPage = 0;
-      }
-      pFS->nCacheAlloc++;
-    }
-  }else{
-    u8 *aData;
-    pPage = pFS->pLruFirst;
-    aData = pPage->aData;
-    fsPageRemoveFromLru(pFS, pPage);
-    fsPageRemoveFromHash(pFS, pPage);
+  Page *pPage;
 
-    memset(pPage, 0, sizeof(Page));
+  pPage = fsPageHandle(pFS, &rc);
+  if( pPage ){
+    pPage->aData = (u8 *)fsBufferMalloc(
+        pFS->pEnv, pFS->bAlign, pFS->nPagesize, &rc
+    );
     pPage->flags = PAGE_FREE;
-    pPage->aData = aData;
+    if( rc!=LSM_OK ){
+      lsmFree(pFS->pEnv, pPage);
+      pPage = 0;
+    }
   }
 
   *ppOut = pPage;
@@ -970,11 +2099,12 @@ static int fsPageBuffer(
 
 static void fsPageBufferFree(Page *pPg){
   if( pPg->flags & PAGE_FREE ){
-    lsmFree(pPg->pFS->pEnv, pPg->aData);
+    fsBufferFree(pPg->pFS->pEnv, pPg->pFS->bAlign, pPg->aData);
   }
   else if( pPg->pFS->bUseMmap ){
     fsPageRemoveFromLru(pPg->pFS, pPg);
   }
+  if( pPg->pEntry ) fsCacheRelease(pPg->pFS, pPg->pEntry);
   lsmFree(pPg->pFS->pEnv, pPg);
 }
 
@@ -1008,13 +2138,67 @@ static void fsGrowMapping(
 ** fsync() the database file.
 */
 int lsmFsSyncDb(FileSystem *pFS, int nBlock){
-  if( nBlock && pFS->bUseMmap ){
-    int rc = LSM_OK;
+  int rc = LSM_OK;
+  lsmFsFlushBatch(pFS, &rc);
+  if( rc==LSM_OK && nBlock && pFS->bUseMmap ){
     i64 nMin = (i64)nBlock * (i64)pFS->nBlocksize;
     fsGrowMapping(pFS, nMin, &rc);
-    if( rc!=LSM_OK ) return rc;
   }
-  return lsmEnvSync(pFS->pEnv, pFS->fdDb);
+  if( rc==LSM_OK ) rc = lsmEnvSync(pFS->pEnv, pFS->fdDb);
+  return rc;
+}
+
+/*
+** Maximum credit, in microseconds, that a rate limiter may accumulate while
+** idle. This is the longest burst written at full speed after a pause.
+*/
+#define LSM_IO_BURST_US 100000
+
+/*
+** Account for nByte bytes of merge (eClass==LSM_IO_MERGE) or checkpoint
+** (eClass==LSM_IO_CHECKPOINT) traffic. If the connection has been 
+** configured with a rate limit for the class of traffic, sleep for as 
+** long as is required to keep the average write rate at or below it.
+**
+** This is a token bucket implemented as a virtual schedule. Each write
+** pushes aTat[eClass] further into the future by the time the write takes
+** at the configured rate. It is never allowed to fall more than 
+** LSM_IO_BURST_US behind the current time, which limits the credit built
+** up while the connection is idle. If it is ahead of the current time, 
+** this function sleeps until it is not.
+**
+** Merge traffic is limited less while writers are at risk of being 
+** blocked by the in-memory tree (see lsmTreePressure()), so that flushing
+** and merging can catch up.
+*/
+void lsmFsThrottle(FileSystem *pFS, int eClass, i64 nByte){
+  lsm_db *pDb = pFS->pDb;
+  i64 nRate;                      /* Rate limit in bytes per second */
+  i64 iNow;                       /* Current time */
+  i64 iTat;                       /* New value of aTat[eClass] */
+
+  assert( eClass==LSM_IO_MERGE || eClass==LSM_IO_CHECKPOINT );
+  nRate = (eClass==LSM_IO_MERGE ? pDb->nMergeRate : pDb->nCkptRate);
+  if( nRate<=0 || nByte<=0 ) return;
+  if( lsmEnvCurrentTime(pFS->pEnv, &iNow)!=LSM_OK ) return;
+
+  if( eClass==LSM_IO_MERGE ){
+    switch( lsmTreePressure(pDb) ){
+      case 2: return;
+      case 1: nRate = nRate * 4; break;
+    }
+  }
+  nRate = nRate * 1024;
+
+  iTat = LSM_MAX(pFS->aTat[eClass], iNow - LSM_IO_BURST_US);
+  iTat += (nByte * 1000000) / nRate;
+  pFS->aTat[eClass] = iTat;
+
+  while( iTat>iNow ){
+    int nUs = (int)LSM_MIN(iTat - iNow, 1000000);
+    lsmEnvSleep(pFS->pEnv, nUs);
+    if( lsmEnvCurrentTime(pFS->pEnv, &iNow)!=LSM_OK ) break;
+  }
 }
 
 static int fsPageGet(FileSystem *, Segment *, Pgno, int, Page **, int *);
@@ -1240,16 +2424,66 @@ static int fsAddOffset(
   return rc;
 }
 
+/*
+** This function is only called in compressed database mode. Set *pp to
+** point to the compression methods used by the pages of segment pSeg, or 
+** to NULL if the segment's pages are stored uncompressed. If pSeg is NULL,
+** use the methods configured for the database.
+**
+** Return LSM_OK if successful, or LSM_CORRUPT if the compression id 
+** recorded for the segment is not one that may be used by the database.
+*/
+static int fsSegmentCompress(
+  FileSystem *pFS,                /* File-system handle */
+  Segment *pSeg,                  /* Segment to query (or NULL) */
+  lsm_compress **pp               /* OUT: Compression methods (or NULL) */
+){
+  u32 iId = (pSeg ? pSeg->iCmpId : LSM_COMPRESSION_EMPTY);
+
+  assert( pFS->pCompress );
+  if( iId==LSM_COMPRESSION_EMPTY || iId==pFS->pCompress->iId ){
+    *pp = pFS->pCompress;
+  }else if( iId==LSM_COMPRESSION_LZ ){
+    *pp = &pFS->lz;
+  }else if( iId==LSM_COMPRESSION_NONE ){
+    *pp = 0;
+  }else{
+    return LSM_CORRUPT_BKPT;
+  }
+  return LSM_OK;
+}
+
+/*
+** This function is only called in compressed database mode. Return the 
+** compression id to use for the pages of a new segment on the lhs of 
+** level pLvl. This is the id returned by the factory xLevel method, if 
+** there is one and it returns an id that this file-system supports. 
+** Otherwise, it is the id of the database compression methods.
+*/
+static u32 fsLevelCompression(FileSystem *pFS, Level *pLvl){
+  lsm_db *pDb = pFS->pDb;
+  u32 iId = pFS->pCompress->iId;
+  if( pDb->factory.xLevel ){
+    u32 iReq = pDb->factory.xLevel(pDb->factory.pCtx, pDb, (int)pLvl->iAge);
+    if( iReq==LSM_COMPRESSION_LZ || iReq==LSM_COMPRESSION_NONE ) iId = iReq;
+  }
+  return iId;
+}
+
 static int fsAllocateBuffer(FileSystem *pFS, int bWrite){
   u8 **pp;                        /* Pointer to either aIBuffer or aOBuffer */
 
   assert( pFS->pCompress );
 
   /* If neither buffer has been allocated, figure out how large they
-  ** should be. Store this value in FileSystem.nBuffer.  */
+  ** should be. Store this value in FileSystem.nBuffer. The buffers must
+  ** be large enough for the output of any of the methods that a segment
+  ** may use - see fsSegmentCompress().  */
   if( pFS->nBuffer==0 ){
+    int nLz = pFS->lz.xBound(pFS->lz.pCtx, pFS->nPagesize);
     assert( pFS->aIBuffer==0 && pFS->aOBuffer==0 );
     pFS->nBuffer = pFS->pCompress->xBound(pFS->pCompress->pCtx, pFS->nPagesize);
+    pFS->nBuffer = LSM_MAX(pFS->nBuffer, nLz);
     if( pFS->nBuffer<(pFS->szSector+6) ){
       pFS->nBuffer = pFS->szSector+6;
     }
@@ -1257,7 +2491,9 @@ static int fsAllocateBuffer(FileSystem *pFS, int bWrite){
 
   pp = (bWrite ? &pFS->aOBuffer : &pFS->aIBuffer);
   if( *pp==0 ){
-    *pp = lsmMalloc(pFS->pEnv, LSM_MAX(pFS->nBuffer, pFS->nPagesize));
+    int rc = LSM_OK;
+    int nByte = LSM_MAX(pFS->nBuffer, pFS->nPagesize);
+    *pp = fsBufferMalloc(pFS->pEnv, pFS->bAlign, nByte, &rc);
     if( *pp==0 ) return LSM_NOMEM_BKPT;
   }
 
@@ -1277,16 +2513,19 @@ static int fsReadPagedata(
   Page *pPg,                      /* Page to read and uncompress data for */
   int *pnSpace                    /* OUT: Total bytes of free space */
 ){
-  lsm_compress *p = pFS->pCompress;
+  lsm_compress *p = 0;
   i64 iOff = pPg->iPg;
   u8 aSz[3];
   int rc;
 
-  assert( p && pPg->nCompress==0 );
+  assert( pFS->pCompress && pPg->nCompress==0 );
 
   if( fsAllocateBuffer(pFS, 0) ) return LSM_NOMEM;
 
-  rc = fsReadData(pFS, pSeg, iOff, aSz, sizeof(aSz));
+  rc = fsSegmentCompress(pFS, pSeg, &p);
+  if( rc==LSM_OK ){
+    rc = fsReadData(pFS, pSeg, iOff, aSz, sizeof(aSz));
+  }
 
   if( rc==LSM_OK ){
     int bFree;
@@ -1312,10 +2551,16 @@ static int fsReadPagedata(
         }
         if( rc==LSM_OK ){
           int n = pFS->nPagesize;
-          rc = p->xUncompress(p->pCtx, 
-              (char *)pPg->aData, &n, 
-              (const char *)pFS->aIBuffer, pPg->nCompress
-          );
+          if( p ){
+            rc = p->xUncompress(p->pCtx, 
+                (char *)pPg->aData, &n, 
+                (const char *)pFS->aIBuffer, pPg->nCompress
+            );
+          }else{
+            /* The page is stored uncompressed (LSM_COMPRESSION_NONE). */
+            n = pPg->nCompress;
+            if( n==pFS->nPagesize ) memcpy(pPg->aData, pFS->aIBuffer, n);
+          }
           if( rc==LSM_OK && n!=pPg->pFS->nPagesize ){
             rc = LSM_CORRUPT_BKPT;
           }
@@ -1389,32 +2634,32 @@ static int fsPageGet(
     }
 
     if( p==0 ){
-      rc = fsPageBuffer(pFS, &p);
-      if( rc==LSM_OK ){
-        int nSpace = 0;
-        p->iPg = iReal;
-        p->nRef = 0;
-        p->pFS = pFS;
-        assert( p->flags==0 || p->flags==PAGE_FREE );
-
+      int nSpace = 0;
+      if( noContent ){
+        /* The page is about to be written. Give it a private buffer and
+        ** discard any stale image of it from the shared cache.  */
+        rc = fsPageBuffer(pFS, &p);
+        if( rc==LSM_OK ){
 #ifdef LSM_DEBUG
-        memset(p->aData, 0x56, pFS->nPagesize);
+          memset(p->aData, 0x56, pFS->nPagesize);
 #endif
+          fsCacheDrop(pFS, iReal);
+        }
+      }else{
+        p = fsPageHandle(pFS, &rc);
+      }
+
+      if( p ){
+        p->iPg = iReal;
+        p->pFS = pFS;
         assert( p->pLruNext==0 && p->pLruPrev==0 );
         if( noContent==0 ){
-          if( pFS->pCompress ){
-            rc = fsReadPagedata(pFS, pSeg, p, &nSpace);
-          }else{
-            int nByte = pFS->nPagesize;
-            i64 iOff = (i64)(iReal-1) * pFS->nPagesize;
-            rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, p->aData, nByte);
-          }
-          pFS->nRead++;
+          rc = fsCacheFetch(pFS, pSeg, p, &nSpace);
         }
 
-        /* If the xRead() call was successful (or not attempted), link the
-         ** page into the page-cache hash-table. Otherwise, if it failed,
-         ** free the buffer. */
+        /* If the page was successfully loaded (or not required), link the
+        ** page into the private hash-table. Otherwise, if the read failed
+        ** or found a padding record, free the handle. */
         if( rc==LSM_OK && nSpace==0 ){
           p->pHashNext = pFS->apHash[iHash];
           pFS->apHash[iHash] = p;
@@ -1424,8 +2669,6 @@ static int fsPageGet(
           if( pnSpace ) *pnSpace = nSpace;
         }
       }
-    }else if( p->nRef==0 ){
-      fsPageRemoveFromLru(pFS, p);
     }
 
     assert( (rc==LSM_OK && (p || (pnSpace && *pnSpace)))
@@ -1540,6 +2783,10 @@ static int fsFreeBlock(
       return LSM_OK;
     }
   }
+  for(iIn=0; iIn<pSnapshot->nValue; iIn++){
+    Segment *pRun = &pSnapshot->aValue[iIn].seg;
+    if( fsRunEndsBetween(pRun, pIgnore, iFirst, iLast) ) return LSM_OK;
+  }
 
   for(iIn=0; iIn<LSM_APPLIST_SZ; iIn++){
     if( aApp[iIn]<iFirst || aApp[iIn]>iLast ){
@@ -1633,8 +2880,12 @@ static int fsSegmentRedirects(FileSystem *pFS, Segment *p){
 ** the segment pRun. This function gobbles from the start of the run to the
 ** first page that appears in aPgno[] (i.e. so that the aPgno[] entry is
 ** the new first page of the run).
+**
+** Return LSM_OK if successful, or an LSM error code otherwise. If an error
+** occurs, the segment may be left in an inconsistent state. The worker 
+** snapshot must not be saved in this case.
 */
-void lsmFsGobble(
+int lsmFsGobble(
   lsm_db *pDb,
   Segment *pRun, 
   Pgno *aPgno,
@@ -1667,8 +2918,11 @@ void lsmFsGobble(
     iBlk = iNext;
   }
 
-  pRun->nSize -= (pRun->iFirst - fsFirstPageOnBlock(pFS, iBlk));
-  assert( pRun->nSize>0 );
+  if( rc==LSM_OK ){
+    pRun->nSize -= (pRun->iFirst - fsFirstPageOnBlock(pFS, iBlk));
+    assert( pRun->nSize>0 );
+  }
+  return rc;
 }
 
 /*
@@ -1736,6 +2990,185 @@ static int fsGetPageBefore(
   return rc;
 }
 
+/*
+** Read nPage pages starting at page iFirst from the database file using a
+** single vectored read, and add those that are not already cached to the
+** shared page cache (in the probation queue). This is the synchronous fallback
+** used for read-ahead if the environment has no xReadAhead() method. It
+** is only used with non-compressed databases. Errors are ignored - the
+** pages are loaded again individually when they are required.
+*/
+static void fsCacheLoad(FileSystem *pFS, Pgno iFirst, int nPage){
+  PageCache *pCache = pFS->pCache;
+  const int nPgsz = pFS->nPagesize;
+  CacheEntry **apNew;             /* New cache entries */
+  lsm_iovec *aIov;                /* Buffers to read into */
+  int rc = LSM_OK;
+  int i;
+
+  assert( pFS->pCompress==0 && pFS->bUseMmap==0 );
+
+  /* Skip over any leading pages that are already cached */
+  while( nPage>0 ){
+    CacheShard *pShard = fsCacheShard(pCache, iFirst);
+    CacheEntry *pEntry;
+    lsmMutexEnter(pCache->pEnv, pShard->pMutex);
+    pEntry = fsCacheFind(pShard, iFirst);
+    lsmMutexLeave(pCache->pEnv, pShard->pMutex);
+    if( pEntry==0 || pEntry->iQueue==CACHE_GHOST ) break;
+    iFirst++;
+    nPage--;
+  }
+  if( nPage==0 ) return;
+
+  apNew = (CacheEntry **)lsmMallocZero(
+      pFS->pEnv, nPage * (sizeof(CacheEntry *) + sizeof(lsm_iovec))
+  );
+  if( apNew==0 ) return;
+  aIov = (lsm_iovec *)&apNew[nPage];
+
+  /* Allocate the new cache entries. Then read the pages directly into 
+  ** their buffers.  */
+  for(i=0; rc==LSM_OK && i<nPage; i++){
+    apNew[i] = (CacheEntry *)lsmMallocZeroRc(
+        pFS->pEnv, sizeof(CacheEntry), &rc
+    );
+    if( rc==LSM_OK ){
+      apNew[i]->aData = (u8 *)fsBufferMalloc(
+          pFS->pEnv, pFS->bAlign, nPgsz, &rc
+      );
+      apNew[i]->nData = nPgsz;
+      apNew[i]->iPg = iFirst + i;
+      aIov[i].pData = (void *)apNew[i]->aData;
+      aIov[i].nData = nPgsz;
+    }
+  }
+  if( rc==LSM_OK ){
+    rc = lsmEnvReadv(
+        pFS->pEnv, pFS->fdDb, (i64)(iFirst-1) * nPgsz, aIov, nPage
+    );
+  }
+  if( rc==LSM_OK ) pFS->nRead += nPage;
+
+  for(i=0; i<nPage && apNew[i]; i++){
+    CacheEntry *pNew = apNew[i];
+
+    /* Pages that this connection holds a handle on may be dirty, or 
+    ** waiting in the write batch. In either case the version on disk
+    ** may be out of date, so they must not be added to the cache.  */
+    if( rc==LSM_OK && fsPageFindInHash(pFS, pNew->iPg, 0)==0 ){
+      CacheShard *pShard = fsCacheShard(pCache, pNew->iPg);
+
+      /* Do not replace an existing entry. Including a ghost entry, as 
+      ** loading the page when it is actually required promotes it.  */
+      lsmMutexEnter(pCache->pEnv, pShard->pMutex);
+      if( fsCacheFind(pShard, pNew->iPg)==0 ){
+        fsCacheInsert(pCache, pShard, pNew, CACHE_PROBATION);
+        fsCacheEnforceLimit(pCache, pShard);
+        pNew = 0;
+      }
+      lsmMutexLeave(pCache->pEnv, pShard->pMutex);
+    }
+    if( pNew ) fsCacheEntryFree(pCache, pNew);
+  }
+
+  lsmFree(pFS->pEnv, apNew);
+}
+
+/*
+** This function is called by lsmFsDbPageNext() in non-mmap() mode each 
+** time page iPg of segment pRun is about to be loaded (non-compressed 
+** databases) or has just been loaded (compressed databases) because it
+** follows page iPrev.
+**
+** If iPrev is the last page loaded by one of the streams in the 
+** FileSystem.aStream[] array, iPg is part of a sequential scan. Once a 
+** stream has loaded LSM_READAHEAD_MINSEQ pages in a row, this function
+** makes sure that data has been requested for at least the next half of
+** the LSM_CONFIG_READAHEAD window (up to the end of the segment or the 
+** block, whichever comes first - the block that follows is not known 
+** until the last page of this one has been read). If the environment 
+** provides an xReadAhead() method, it is used to request the data 
+** asynchronously. Otherwise, or if the database file was opened for direct
+** IO, in which case a hint to the OS is of no use, the pages of a 
+** non-compressed database are read synchronously, using a single read 
+** call, into the page cache.
+*/
+static void fsReadAhead(
+  FileSystem *pFS,                /* File-system handle */
+  Segment *pRun,                  /* Segment being scanned */
+  Pgno iPrev,                     /* Previous page loaded */
+  Pgno iPg                        /* Page being loaded */
+){
+  i64 nWindow = (i64)pFS->pDb->nReadAhead * 1024;
+  ReadAhead *p = 0;
+  int i;
+
+  if( nWindow<=0 || pFS->bUseMmap || pRun==0 ) return;
+  iPg = lsmFsRedirectPage(pFS, pRun->pRedirect, iPg);
+
+  /* Find the stream this load belongs to. A stream may be stepped over
+  ** the same pair of pages more than once, for example if a cursor and a
+  ** seek on the same segment both advance to the next page.  */
+  for(i=0; p==0 && i<LSM_READAHEAD_NSTREAM; i++){
+    ReadAhead *pStream = &pFS->aStream[i];
+    if( pStream->iLast==iPrev ){
+      p = pStream;
+      p->iLast = iPg;
+      p->nSeq++;
+    }else if( pStream->iLast==iPg && pStream->nSeq>0 ){
+      p = pStream;
+    }
+  }
+  if( p==0 ){
+    p = &pFS->aStream[pFS->iStream];
+    pFS->iStream = (pFS->iStream + 1) % LSM_READAHEAD_NSTREAM;
+    p->iLast = iPg;
+    p->nSeq = 1;
+    p->iLimit = 0;
+  }
+
+  if( p->nSeq>=LSM_READAHEAD_MINSEQ ){
+    const int nPgsz = pFS->nPagesize;
+    int iBlk = fsPageToBlock(pFS, iPg);
+    Pgno iLastPg = fsLastPageOnBlock(pFS, iBlk);
+    i64 iStart;                   /* Offset of page iPg */
+    i64 iEnd;                     /* Read-ahead may not extend past this */
+    Pgno iRunLast;                /* Last page of segment pRun */
+
+    iRunLast = lsmFsRedirectPage(pFS, pRun->pRedirect, pRun->iLastPg);
+    if( fsPageToBlock(pFS, iRunLast)==iBlk ){
+      iLastPg = LSM_MIN(iLastPg, iRunLast);
+    }
+    if( pFS->pCompress ){
+      iStart = iPg;
+      iEnd = iLastPg + 1;
+    }else{
+      iStart = (i64)(iPg-1) * nPgsz;
+      iEnd = (i64)iLastPg * nPgsz;
+      nWindow = LSM_MIN(nWindow, (i64)lsmFsCacheSize(pFS, -1) * 1024 / 4);
+    }
+
+    if( p->iLimit<iStart || p->iLimit>iEnd ) p->iLimit = iStart;
+    if( p->iLimit-iStart < nWindow/2 ){
+      i64 iNew = LSM_MIN(iStart + nWindow, iEnd);
+      if( pFS->pCompress==0 ){
+        iNew -= (iNew % nPgsz);
+      }
+      if( iNew>p->iLimit ){
+        if( pFS->eDirectIo==LSM_DIRECT_IO_OFF 
+         && lsmEnvHasReadAhead(pFS->pEnv) 
+        ){
+          lsmEnvReadAhead(pFS->pEnv, pFS->fdDb, p->iLimit, iNew-p->iLimit);
+        }else if( pFS->pCompress==0 ){
+          fsCacheLoad(pFS, 1 + p->iLimit/nPgsz, (int)((iNew-p->iLimit)/nPgsz));
+        }
+        p->iLimit = iNew;
+      }
+    }
+  }
+}
+
 /*
 ** The first argument to this function is a valid reference to a database
 ** file page that is part of a sorted run. If parameter eDir is -1, this 
@@ -1786,6 +3219,8 @@ int lsmFsDbPageNext(Segment *pRun, Page *pPg, int eDir, Page **ppNext){
       }
     }while( nSpace>0 && rc==LSM_OK );
 
+    if( eDir>0 && *ppNext ) fsReadAhead(pFS, pRun, pPg->iPg, iPg);
+
   }else{
     Redirect *pRedir = pRun ? pRun->pRedirect : 0;
     assert( eDir==1 || eDir==-1 );
@@ -1815,6 +3250,7 @@ int lsmFsDbPageNext(Segment *pRun, Page *pPg, int eDir, Page **ppNext){
       }else{
         iPg++;
       }
+      fsReadAhead(pFS, pRun, pPg->iPg, iPg);
     }
     rc = fsPageGet(pFS, pRun, iPg, 0, ppNext, 0);
   }
@@ -1845,27 +3281,39 @@ static Pgno findAppendPoint(FileSystem *pFS, Level *pLvl){
 }
 
 /*
-** Append a page to the left-hand-side of pLvl. Set the ref-count to 1 and
-** return a pointer to it. The page is writable until either 
-** lsmFsPagePersist() is called on it or the ref-count drops to zero.
+** Append a page to segment p. If p is the left-hand-side of a level, pLvl
+** points to that level. Or, if p is a value segment, pLvl is NULL. Set the
+** ref-count of the new page to 1 and return a pointer to it. The page is 
+** writable until either lsmFsPagePersist() is called on it or the 
+** ref-count drops to zero.
 */
-int lsmFsSortedAppend(
+static int fsSegmentAppend(
   FileSystem *pFS, 
-  Snapshot *pSnapshot,
   Level *pLvl,
+  Segment *p,
   int bDefer,
   Page **ppOut
 ){
   int rc = LSM_OK;
   Page *pPg = 0;
-  *ppOut = 0;
   int iApp = 0;
   int iNext = 0;
-  Segment *p = &pLvl->lhs;
   int iPrev = p->iLastPg;
 
+  *ppOut = 0;
+
   assert( p->pRedirect==0 );
 
+  /* If this is the first page of a new segment, choose the compression
+  ** scheme used for all of its pages.  */
+  if( p->iCmpId==LSM_COMPRESSION_EMPTY ){
+    if( pFS->pCompress ){
+      p->iCmpId = fsLevelCompression(pFS, pLvl);
+    }else{
+      p->iCmpId = LSM_COMPRESSION_NONE;
+    }
+  }
+
   if( pFS->pCompress || bDefer ){
     /* In compressed database mode the page is not assigned a page number
     ** or location in the database file at this point. This will be done
@@ -1934,6 +3382,28 @@ int lsmFsSortedAppend(
   return rc;
 }
 
+/*
+** Append a page to the left-hand-side of pLvl. See fsSegmentAppend().
+*/
+int lsmFsSortedAppend(
+  FileSystem *pFS, 
+  Snapshot *pSnapshot,
+  Level *pLvl,
+  int bDefer,
+  Page **ppOut
+){
+  return fsSegmentAppend(pFS, pLvl, &pLvl->lhs, bDefer, ppOut);
+}
+
+/*
+** Append a page to value segment pSeg. See fsSegmentAppend(). Value
+** segments are only used by databases that are not compressed.
+*/
+int lsmFsValueAppend(FileSystem *pFS, Segment *pSeg, Page **ppOut){
+  assert( pFS->pCompress==0 );
+  return fsSegmentAppend(pFS, 0, pSeg, 0, ppOut);
+}
+
 /*
 ** Mark the sorted run passed as the second argument as finished. 
 */
@@ -2035,7 +3505,7 @@ int lsmFsMetaPageGet(
       fsGrowMapping(pFS, 2*pFS->nMetasize, &rc);
       pPg->aData = (u8 *)(pFS->pMap) + iOff;
     }else{
-      pPg->aData = lsmMallocRc(pFS->pEnv, pFS->nMetasize, &rc);
+      pPg->aData = fsBufferMalloc(pFS->pEnv, pFS->bAlign, pFS->nMetasize, &rc);
       if( rc==LSM_OK && bWrite==0 ){
         rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, pPg->aData, pFS->nMetasize);
       }
@@ -2052,7 +3522,7 @@ int lsmFsMetaPageGet(
     }
 
     if( rc!=LSM_OK ){
-      if( pFS->bUseMmap==0 ) lsmFree(pFS->pEnv, pPg->aData);
+      if( pFS->bUseMmap==0 ) fsBufferFree(pFS->pEnv, pFS->bAlign, pPg->aData);
       lsmFree(pFS->pEnv, pPg);
       pPg = 0;
     }else{
@@ -2080,7 +3550,7 @@ int lsmFsMetaPageRelease(MetaPage *pPg){
         int nWrite = pFS->nMetasize;
         rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iOff, pPg->aData, nWrite);
       }
-      lsmFree(pFS->pEnv, pPg->aData);
+      fsBufferFree(pFS->pEnv, pFS->bAlign, pPg->aData);
     }
 
     lsmFree(pFS->pEnv, pPg);
@@ -2145,20 +3615,25 @@ int lsmFsMoveBlock(FileSystem *pFS, Segment *pSeg, int iTo, int iFrom){
       memcpy(&aMap[iToOff], &aMap[iFromOff], pFS->nBlocksize);
     }
   }else{
-    int nSz = pFS->nPagesize;
-    u8 *aData = (u8 *)lsmMallocRc(pFS->pEnv, nSz, &rc);
+    /* Copy the block LSM_WRITE_BATCH pages at a time. Any pages in the 
+    ** write batch are written out first, in case they are part of block
+    ** iFrom.  */
+    int nSz = LSM_MIN(pFS->nBlocksize, pFS->nPagesize * LSM_WRITE_BATCH);
+    u8 *aData;
+    lsmFsFlushBatch(pFS, &rc);
+    aData = (u8 *)fsBufferMalloc(pFS->pEnv, pFS->bAlign, nSz, &rc);
     if( rc==LSM_OK ){
-      const int nPagePerBlock = (pFS->nBlocksize / pFS->nPagesize);
+      const int nChunk = (pFS->nBlocksize / nSz);
       int i;
-      for(i=0; rc==LSM_OK && i<nPagePerBlock; i++){
-        i64 iOff = iFromOff + i*nSz;
+      for(i=0; rc==LSM_OK && i<nChunk; i++){
+        i64 iOff = iFromOff + (i64)i*nSz;
         rc = lsmEnvRead(pFS->pEnv, pFS->fdDb, iOff, aData, nSz);
         if( rc==LSM_OK ){
-          iOff = iToOff + i*nSz;
+          iOff = iToOff + (i64)i*nSz;
           rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iOff, aData, nSz);
         }
       }
-      lsmFsPurgeCache(pFS);
+      fsBufferFree(pFS->pEnv, pFS->bAlign, aData);
     }
   }
 
@@ -2201,6 +3676,8 @@ static Pgno fsAppendData(
     Pgno iLastOnBlock;
     Pgno iApp = pSeg->iLastPg+1;
 
+    lsmFsThrottle(pFS, LSM_IO_MERGE, nData);
+
     /* If this is the first data written into the segment, find an append-point
     ** or allocate a new block.  */
     if( iApp==1 ){
@@ -2277,24 +3754,36 @@ static Pgno fsAppendData(
 
 /*
 ** This function is only called in compressed database mode. It 
-** compresses the contents of page pPg and writes the result to the 
-** buffer at pFS->aBuffer. The size of the compressed data is stored in
-** pPg->nCompress.
+** compresses the contents of page pPg, using the methods selected for the
+** segment it belongs to, and writes the result to the buffer at 
+** pFS->aOBuffer. The size of the compressed data is stored in
+** pPg->nCompress. If the segment's pages are stored uncompressed, the 
+** page image is copied to the buffer as is.
 **
-** If buffer pFS->aBuffer[] has not been allocated then this function
+** If buffer pFS->aOBuffer[] has not been allocated then this function
 ** allocates it. If this fails, LSM_NOMEM is returned. Otherwise, LSM_OK.
 */
 static int fsCompressIntoBuffer(FileSystem *pFS, Page *pPg){
-  lsm_compress *p = pFS->pCompress;
+  lsm_compress *p = 0;
+  int rc;
 
   if( fsAllocateBuffer(pFS, 1) ) return LSM_NOMEM;
   assert( pPg->nData==pFS->nPagesize );
 
-  pPg->nCompress = pFS->nBuffer;
-  return p->xCompress(p->pCtx, 
-      (char *)pFS->aOBuffer, &pPg->nCompress, 
-      (const char *)pPg->aData, pPg->nData
-  );
+  rc = fsSegmentCompress(pFS, pPg->pSeg, &p);
+  if( rc==LSM_OK ){
+    if( p ){
+      pPg->nCompress = pFS->nBuffer;
+      rc = p->xCompress(p->pCtx, 
+          (char *)pFS->aOBuffer, &pPg->nCompress, 
+          (const char *)pPg->aData, pPg->nData
+      );
+    }else{
+      pPg->nCompress = pPg->nData;
+      memcpy(pFS->aOBuffer, pPg->aData, pPg->nData);
+    }
+  }
+  return rc;
 }
 
 static int fsAppendPage(
@@ -2349,27 +3838,71 @@ void lsmFsFlushWaiting(FileSystem *pFS, int *pRc){
   while( pPg ){
     Page *pNext = pPg->pNextWaiting;
     if( rc==LSM_OK ) rc = lsmFsPagePersist(pPg);
-    assert( pPg->nRef==1 );
+    assert( pPg->nRef==1 || (rc==LSM_OK && pPg->nRef==2) );
     lsmFsPageRelease(pPg);
     pPg = pNext;
   }
   *pRc = rc;
 }
 
-static void fsRemoveHashEntry(FileSystem *pFS, Pgno iPg){
-  Page *p;
-  int iHash = fsHashKey(pFS->nHash, iPg);
+/*
+** Write the pages in the FileSystem.apBatch[] array to the database file
+** using a single vectored write, then release the references held on 
+** them. If *pRc is other than LSM_OK when this function is called, the
+** references are released but the pages are not written. If an error 
+** occurs, *pRc is set to an LSM error code before returning.
+*/
+void lsmFsFlushBatch(FileSystem *pFS, int *pRc){
+  int rc = *pRc;
+  int nBatch = pFS->nBatch;
 
-  for(p=pFS->apHash[iHash]; p && p->iPg!=iPg; p=p->pHashNext);
+  if( nBatch>0 ){
+    Page *apBatch[LSM_WRITE_BATCH];
+    lsm_iovec aIov[LSM_WRITE_BATCH];
+    i64 iOff = (i64)pFS->nPagesize * (i64)(pFS->apBatch[0]->iPg-1);
+    int i;
 
-  if( p ){
-    assert( p->nRef==0 );
-    fsPageRemoveFromHash(pFS, p);
-    p->iPg = 0;
-    iHash = fsHashKey(pFS->nHash, 0);
-    p->pHashNext = pFS->apHash[iHash];
-    pFS->apHash[iHash] = p;
+    /* Take a copy of the batch and clear it before releasing any pages,
+    ** as releasing a page that has been modified since it was added to 
+    ** the batch causes it to be added to a new batch.  */
+    memcpy(apBatch, pFS->apBatch, sizeof(Page *) * nBatch);
+    pFS->nBatch = 0;
+
+    for(i=0; i<nBatch; i++){
+      Page *pPg = apBatch[i];
+      aIov[i].pData = (void *)(pPg->aData - (pPg->flags & PAGE_HASPREV));
+      aIov[i].nData = pFS->nPagesize;
+    }
+    if( rc==LSM_OK ){
+      rc = lsmEnvWritev(pFS->pEnv, pFS->fdDb, iOff, aIov, nBatch);
+    }
+    for(i=0; i<nBatch; i++){
+      int rc2 = lsmFsPageRelease(apBatch[i]);
+      if( rc==LSM_OK ) rc = rc2;
+    }
+  }
+
+  *pRc = rc;
+}
+
+/*
+** Add page pPg to the batch of pages waiting to be written to the 
+** database file. If the page cannot be appended to the current batch,
+** the current batch is flushed first.
+*/
+static int fsBatchPage(FileSystem *pFS, Page *pPg){
+  int rc = LSM_OK;
+  if( pFS->nBatch>0 ){
+    Page *pLast = pFS->apBatch[pFS->nBatch-1];
+    if( pFS->nBatch==LSM_WRITE_BATCH || pLast->iPg+1!=pPg->iPg ){
+      lsmFsFlushBatch(pFS, &rc);
+    }
+  }
+  if( rc==LSM_OK ){
+    pPg->nRef++;
+    pFS->apBatch[pFS->nBatch++] = pPg;
   }
+  return rc;
 }
 
 /*
@@ -2377,6 +3910,10 @@ static void fsRemoveHashEntry(FileSystem *pFS, Pgno iPg){
 ** (or mapping of the database file) with its current contents and mark
 ** the page as clean.
 **
+** In non-mmap() mode, the page is not written immediately. Instead it is
+** added to the write batch (see fsBatchPage()). The caller may not assume
+** that the page is on disk until after lsmFsFlushBatch() is called.
+**
 ** Return LSM_OK if the operation is a success, or an LSM error code
 ** otherwise.
 */
@@ -2401,7 +3938,9 @@ int lsmFsPagePersist(Page *pPg){
       fsAppendData(pFS, pPg->pSeg, pFS->aOBuffer, pPg->nCompress, &rc);
       fsAppendData(pFS, pPg->pSeg, aSz, sizeof(aSz), &rc);
 
-      /* Now that it has a page number, insert the page into the hash table */
+      /* Now that it has a page number, insert the page into the hash table.
+      ** And discard any stale image of the same page from the shared cache.  */
+      fsCacheDrop(pFS, pPg->iPg);
       iHash = fsHashKey(pFS->nHash, pPg->iPg);
       pPg->pHashNext = pFS->apHash[iHash];
       pFS->apHash[iHash] = pPg;
@@ -2434,7 +3973,8 @@ int lsmFsPagePersist(Page *pPg){
 
         if( pFS->bUseMmap==0 ){
           int iHash = fsHashKey(pFS->nHash, pPg->iPg);
-          fsRemoveHashEntry(pFS, pPg->iPg);
+          assert( fsPageFindInHash(pFS, pPg->iPg, 0)==0 );
+          fsCacheDrop(pFS, pPg->iPg);
           pPg->pHashNext = pFS->apHash[iHash];
           pFS->apHash[iHash] = pPg;
           assert( pPg->pHashNext==0 || pPg->pHashNext->iPg!=pPg->iPg );
@@ -2464,16 +4004,16 @@ int lsmFsPagePersist(Page *pPg){
         i64 iOff;                   /* Offset to write within database file */
 
         iOff = (i64)pFS->nPagesize * (i64)(pPg->iPg-1);
+        lsmFsThrottle(pFS, LSM_IO_MERGE, pFS->nPagesize);
         if( pFS->bUseMmap==0 ){
-          u8 *aData = pPg->aData - (pPg->flags & PAGE_HASPREV);
-          rc = lsmEnvWrite(pFS->pEnv, pFS->fdDb, iOff, aData, pFS->nPagesize);
+          rc = fsBatchPage(pFS, pPg);
         }else if( pPg->flags & PAGE_FREE ){
           fsGrowMapping(pFS, iOff + pFS->nPagesize, &rc);
           if( rc==LSM_OK ){
             u8 *aTo = &((u8 *)(pFS->pMap))[iOff];
             u8 *aFrom = pPg->aData - (pPg->flags & PAGE_HASPREV);
             memcpy(aTo, aFrom, pFS->nPagesize);
-            lsmFree(pFS->pEnv, aFrom);
+            fsBufferFree(pFS->pEnv, pFS->bAlign, aFrom);
             pPg->aData = aTo + (pPg->flags & PAGE_HASPREV);
             pPg->flags &= ~PAGE_FREE;
             fsPageAddToLru(pFS, pPg);
@@ -2499,6 +4039,10 @@ int lsmFsPagePersist(Page *pPg){
 ** written is the last byte of a disk sector. This means that if a 
 ** snapshot is taken and checkpointed, subsequent worker processes will
 ** not write to any sector that contains checkpointed data.
+**
+** If no pages have been written to the segment yet, no padding is added.
+** The first page appended to it later on is written at an append-point or
+** to a new block, as for any other new segment.
 */
 int lsmFsSortedPadding(
   FileSystem *pFS, 
@@ -2506,7 +4050,7 @@ int lsmFsSortedPadding(
   Segment *pSeg
 ){
   int rc = LSM_OK;
-  if( pFS->pCompress ){
+  if( pFS->pCompress && pSeg->iFirst ){
     Pgno iLast2;
     Pgno iLast = pSeg->iLastPg;     /* Current last page of segment */
     int nPad;                       /* Bytes of padding required */
@@ -2565,8 +4109,13 @@ int lsmFsPageRelease(Page *pPg){
     assert( pPg->nRef>0 );
     pPg->nRef--;
     if( pPg->nRef==0 ){
-      FileSystem *pFS = pPg->pFS;
       rc = lsmFsPagePersist(pPg);
+    }
+
+    /* If the page was just added to the write batch by lsmFsPagePersist(),
+    ** its ref-count is now non-zero again. */
+    if( pPg->nRef==0 ){
+      FileSystem *pFS = pPg->pFS;
       pFS->nOut--;
 
       assert( pPg->pFS->pCompress 
@@ -2576,19 +4125,30 @@ int lsmFsPageRelease(Page *pPg){
       pPg->aData -= (pPg->flags & PAGE_HASPREV);
       pPg->flags &= ~PAGE_HASPREV;
 
-      if( pFS->bUseMmap ){
-        pPg->pHashNext = pFS->pFree;
-        pFS->pFree = pPg;
-      }else{
-#if 0
-        assert( pPg->pLruNext==0 );
-        assert( pPg->pLruPrev==0 );
+      if( pFS->bUseMmap==0 ){
+        /* Release the reference to the shared cache entry, or hand the
+        ** private buffer of a clean, newly written page over to the 
+        ** shared cache. */
         fsPageRemoveFromHash(pFS, pPg);
+        if( pPg->pEntry ){
+          fsCacheRelease(pFS, pPg->pEntry);
+        }else if( (pPg->flags & PAGE_FREE)
+               && (rc!=LSM_OK || (pPg->flags & PAGE_DIRTY) || pPg->iPg==0
+                || fsCacheDonate(pFS, pPg))
+        ){
+          fsBufferFree(pFS->pEnv, pFS->bAlign, pPg->aData);
+        }
+        pPg->aData = 0;
+        pPg->pEntry = 0;
+      }else if( pPg->flags & PAGE_FREE ){
+        /* In mmap() mode, a page with a private buffer has not been copied
+        ** into the mapping because an error occurred. Such handles are not
+        ** part of the LRU list and may not be recycled, so free it. */
         fsPageBufferFree(pPg);
-#else
-        fsPageAddToLru(pFS, pPg);
-#endif
+        return rc;
       }
+      pPg->pHashNext = pFS->pFree;
+      pFS->pFree = pPg;
     }
   }
 
@@ -2650,6 +4210,12 @@ static Segment *findSegment(Snapshot *pWorker, Pgno iFirst){
       }
     }
   }
+  if( pSeg==0 ){
+    int i;
+    for(i=0; pSeg==0 && i<pWorker->nValue; i++){
+      pSeg = startsWith(&pWorker->aValue[i].seg, iFirst);
+    }
+  }
 
   return pSeg;
 }
@@ -2970,6 +4536,12 @@ int lsmFsIntegrityCheck(lsm_db *pDb){
     }
   }
 
+  /* The active value segment (aValue[0]) is never finished. So, like the
+  ** output of an incremental merge, it may own an extra block.  */
+  for(i=0; i<pWorker->nValue; i++){
+    checkBlocks(pFS, &pWorker->aValue[i].seg, (i==0), nBlock, aUsed);
+  }
+
   /* Mark all blocks in the free-list as used */
   ctx.aUsed = aUsed;
   ctx.nBlock = nBlock;
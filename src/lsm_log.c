@@ -57,9 +57,16 @@
 **
 **   To recover the log file, it must be read twice. The first time to 
 **   determine the location of the last valid commit record. And the second
-**   time to load data into the in-memory tree.
+**   time to load data into the in-memory tree. If threads are available,
+**   the two passes run concurrently - the second pass applies each
+**   transaction as soon as the first has verified its commit record. The
+**   second pass does not recompute checksums, and accumulates records into
+**   large write batches that are sorted before they are inserted into the
+**   tree.
 **
-**   Todo: Surely there is a better way...
+**   The last connection to disconnect from a database checkpoints the
+**   entire log and then deletes the log file. So if there is no log file
+**   when recovery is run, the log is not read at all.
 **
 ** LOG WRAPPING
 **
@@ -159,21 +166,33 @@
 **               * If the first byte was 0x09, an 8 byte checksum.
 **               * The key data.
 **
+**   LOG_BATCH:  * A single 0x0A or 0x0B byte, 
+**               * The number of bytes in the batch, encoded as a varint, 
+**               * If the first byte was 0x0B, an 8 byte checksum.
+**               * The serialized batch (see lsmTreeInsertBatch()).
+**
 **   Varints are as described in lsm_varint.c (SQLite 4 format).
 **
 ** CHECKSUMS:
 **
 **   The checksum is calculated using two 32-bit unsigned integers, s0 and
-**   s1. The initial value for both is 42. It is updated each time a record
-**   is written into the log file by treating the encoded (binary) record as 
-**   an array of 32-bit little-endian integers. Then, if x[] is the integer
-**   array, updating the checksum accumulators as follows:
+**   s1. The initial values are stored in the checkpoint along with the log
+**   offset. It is updated each time a record is written into the log file 
+**   using the algorithm identified by the checkpoint header. For databases
+**   created by older versions of the library (LSM_CKSUM_FLETCHER), the 
+**   encoded (binary) record is treated as an array of 32-bit little-endian
+**   integers. Then, if x[] is the integer array, updating the checksum
+**   accumulators as follows:
 **
 **     for i from 0 to n-1 step 2:
 **       s0 += x[i] + s1;
 **       s1 += x[i+1] + s0;
 **     endfor
 **
+**   Otherwise (LSM_CKSUM_CRC32C), s0 is the CRC32C of the first 4 bytes of
+**   each 8 byte unit of the record and s1 of the second 4 bytes. See
+**   lsm_cksum.c for details.
+**
 **   If the record is not an even multiple of 8-bytes in size it is padded
 **   with zeroes to make it so before the checksum is updated.
 **
@@ -201,6 +220,8 @@
 #define LSM_LOG_WRITE_CKSUM  0x07
 #define LSM_LOG_DELETE       0x08
 #define LSM_LOG_DELETE_CKSUM 0x09
+#define LSM_LOG_BATCH        0x0A
+#define LSM_LOG_BATCH_CKSUM  0x0B
 
 /* Require a checksum every 32KB. */
 #define LSM_CKSUM_MAXDATA (32*1024)
@@ -213,9 +234,12 @@
 **   Commit records must be aligned to end on szSector boundaries. If
 **   the safety-mode is set to NORMAL or OFF, this value is 1. Otherwise,
 **   if the safety-mode is set to FULL, it is the size of the file-system
-**   sectors as reported by lsmFsSectorSize().
+**   sectors as reported by lsmFsSectorSize(). The same is true if the log 
+**   file is opened for direct IO (LSM_DIRECT_IO_ALL), regardless of the
+**   safety-mode.
 */
 struct LogWriter {
+  int eCksum;                     /* Checksum algorithm (LSM_CKSUM_*) */
   u32 cksum0;                     /* Checksum 0 at offset iOff */
   u32 cksum1;                     /* Checksum 1 at offset iOff */
   int iCksumBuf;                  /* Bytes of buf that have been checksummed */
@@ -227,53 +251,6 @@ struct LogWriter {
   LsmString buf;                  /* Buffer containing data not yet written */
 };
 
-/*
-** Return the result of interpreting the first 4 bytes in buffer aIn as 
-** a 32-bit unsigned little-endian integer.
-*/
-static u32 getU32le(u8 *aIn){
-  return ((u32)aIn[3] << 24) 
-       + ((u32)aIn[2] << 16) 
-       + ((u32)aIn[1] << 8) 
-       + ((u32)aIn[0]);
-}
-
-
-/*
-** This function is the same as logCksum(), except that pointer "a" need
-** not be aligned to an 8-byte boundary or padded with zero bytes. This
-** version is slower, but sometimes more convenient to use.
-*/
-static void logCksumUnaligned(
-  char *z,                        /* Input buffer */
-  int n,                          /* Size of input buffer in bytes */
-  u32 *pCksum0,                   /* IN/OUT: Checksum value 1 */
-  u32 *pCksum1                    /* IN/OUT: Checksum value 2 */
-){
-  u8 *a = (u8 *)z;
-  u32 cksum0 = *pCksum0;
-  u32 cksum1 = *pCksum1;
-  int nIn = (n/8) * 8;
-  int i;
-
-  assert( n>0 );
-  for(i=0; i<nIn; i+=8){
-    cksum0 += getU32le(&a[i]) + cksum1;
-    cksum1 += getU32le(&a[i+4]) + cksum0;
-  }
-
-  if( nIn!=n ){
-    u8 aBuf[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-    assert( (n-nIn)<8 && n>nIn );
-    memcpy(aBuf, &a[nIn], n-nIn);
-    cksum0 += getU32le(aBuf) + cksum1;
-    cksum1 += getU32le(&aBuf[4]) + cksum0;
-  }
-
-  *pCksum0 = cksum0;
-  *pCksum1 = cksum1;
-}
-
 /*
 ** Update pLog->cksum0 and pLog->cksum1 so that the first nBuf bytes in the 
 ** write buffer (pLog->buf) are included in the checksum.
@@ -283,7 +260,7 @@ static void logUpdateCksum(LogWriter *pLog, int nBuf){
   assert( pLog->iCksumBuf<=nBuf );
   assert( (nBuf % 8)==0 || nBuf==pLog->buf.n );
   if( nBuf>pLog->iCksumBuf ){
-    logCksumUnaligned(
+    lsmChecksumBytes(pLog->eCksum,
         &pLog->buf.z[pLog->iCksumBuf], nBuf-pLog->iCksumBuf, 
         &pLog->cksum0, &pLog->cksum1
     );
@@ -401,8 +378,13 @@ int lsmLogBegin(lsm_db *pDb){
 
   /* Set the effective sector-size for this transaction. Sectors are assumed
   ** to be one byte in size if the safety-mode is OFF or NORMAL, or as
-  ** reported by lsmFsSectorSize if it is FULL.  */
-  if( pDb->eSafety==LSM_SAFETY_FULL ){
+  ** reported by lsmFsSectorSize if it is FULL. If the log file is opened 
+  ** for direct IO, commits are always padded to the reported sector size
+  ** so that each transaction begins on a boundary the file-system can 
+  ** write to directly.  */
+  if( pDb->eSafety==LSM_SAFETY_FULL 
+   || lsmDbDirectIo(pDb)==LSM_DIRECT_IO_ALL 
+  ){
     pNew->szSector = lsmFsSectorSize(pDb->pFS);
     assert( pNew->szSector>0 );
   }else{
@@ -426,6 +408,7 @@ int lsmLogBegin(lsm_db *pDb){
   assert( aReg[0].iEnd==0 || aReg[0].iEnd>aReg[0].iStart );
   assert( aReg[1].iEnd==0 || aReg[1].iEnd>aReg[1].iStart );
 
+  pNew->eCksum = lsmCheckpointCksum(pDb->aSnapshot);
   pNew->cksum0 = pDb->treehdr.log.cksum0;
   pNew->cksum1 = pDb->treehdr.log.cksum1;
 
@@ -440,6 +423,7 @@ int lsmLogBegin(lsm_db *pDb){
     lsmStringBinAppend(&pNew->buf, aJump, sizeof(aJump));
     logUpdateCksum(pNew, pNew->buf.n);
     rc = lsmFsWriteLog(pDb->pFS, aReg[2].iEnd, &pNew->buf);
+    if( rc==LSM_OK ) rc = lsmFsFlushLog(pDb->pFS, 0);
     pNew->iCksumBuf = pNew->buf.n = 0;
 
     aReg[2].iEnd += 8;
@@ -486,6 +470,10 @@ void lsmLogEnd(lsm_db *pDb, int bCommit){
   if( p==0 ) return;
   pLog = &pDb->treehdr.log;
 
+  /* If the transaction was rolled back, discard any log data that has not
+  ** yet been written to the log file. It is not required.  */
+  if( bCommit==0 ) lsmFsFlushLog(pDb->pFS, 1);
+
   if( bCommit ){
     pLog->aRegion[2].iEnd = p->iOff;
     pLog->cksum0 = p->cksum0;
@@ -638,22 +626,24 @@ static int logFlush(lsm_db *pDb, int eType){
   pLog->buf.z[pLog->buf.n++] = eType;
   memset(&pLog->buf.z[pLog->buf.n], 0, 8);
 
+  /* Write the transaction to the log file. Log data written earlier in the
+  ** transaction may have been buffered by the file-system layer, so flush
+  ** that too. If this is a commit and synchronous=full, the caller 
+  ** (lsm_commit()) is responsible for syncing the log to disk.  */
   rc = logCksumAndFlush(pDb);
-
-  /* If this is a commit and synchronous=full, sync the log to disk. */
-  if( rc==LSM_OK && eType==LSM_LOG_COMMIT && pDb->eSafety==LSM_SAFETY_FULL ){
-    rc = lsmFsSyncLog(pDb->pFS);
-  }
+  if( rc==LSM_OK ) rc = lsmFsFlushLog(pDb->pFS, 0);
   return rc;
 }
 
 /*
-** Append an LSM_LOG_WRITE (if nVal>=0) or LSM_LOG_DELETE (if nVal<0) 
-** record to the database log.
+** Append a record of type eType (LSM_LOG_WRITE, LSM_LOG_DELETE or
+** LSM_LOG_BATCH) to the database log. The value blob is only written if
+** nVal>=0, which is only the case for LSM_LOG_WRITE records.
 */
-int lsmLogWrite(
+static int logWriteRecord(
   lsm_db *pDb,                    /* Database handle */
-  void *pKey, int nKey,           /* Database key to write to log */
+  u8 eType,                       /* Record type (without checksum bit) */
+  void *pKey, int nKey,           /* Database key (or batch) to write */
   void *pVal, int nVal            /* Database value (or nVal<0) to write */
 ){
   int rc = LSM_OK;
@@ -661,7 +651,7 @@ int lsmLogWrite(
   int nReq;                       /* Bytes of space required in log */
   int bCksum = 0;                 /* True to embed a checksum in this record */
 
-  if( pDb->bUseLog==0 ) return LSM_OK;
+  assert( (eType==LSM_LOG_WRITE)==(nVal>=0) );
   pLog = pDb->pLogWriter;
 
   /* Determine how many bytes of space are required, assuming that a checksum
@@ -684,10 +674,11 @@ int lsmLogWrite(
     u8 *a = (u8 *)&pLog->buf.z[pLog->buf.n];
     
     /* Write the record header - the type byte followed by either 1 (for
-    ** DELETE) or 2 (for WRITE) varints.  */
+    ** DELETE or BATCH) or 2 (for WRITE) varints.  */
     assert( LSM_LOG_WRITE_CKSUM == (LSM_LOG_WRITE | 0x0001) );
     assert( LSM_LOG_DELETE_CKSUM == (LSM_LOG_DELETE | 0x0001) );
-    *(a++) = (nVal>=0 ? LSM_LOG_WRITE : LSM_LOG_DELETE) | (u8)bCksum;
+    assert( LSM_LOG_BATCH_CKSUM == (LSM_LOG_BATCH | 0x0001) );
+    *(a++) = eType | (u8)bCksum;
     a += lsmVarintPut32(a, nKey);
     if( nVal>=0 ) a += lsmVarintPut32(a, nVal);
 
@@ -710,6 +701,29 @@ int lsmLogWrite(
   return rc;
 }
 
+/*
+** Append an LSM_LOG_WRITE (if nVal>=0) or LSM_LOG_DELETE (if nVal<0) 
+** record to the database log.
+*/
+int lsmLogWrite(
+  lsm_db *pDb,                    /* Database handle */
+  void *pKey, int nKey,           /* Database key to write to log */
+  void *pVal, int nVal            /* Database value (or nVal<0) to write */
+){
+  u8 eType = (nVal>=0 ? LSM_LOG_WRITE : LSM_LOG_DELETE);
+  if( pDb->bUseLog==0 ) return LSM_OK;
+  return logWriteRecord(pDb, eType, pKey, nKey, pVal, nVal);
+}
+
+/*
+** Append an LSM_LOG_BATCH record containing serialized write batch aBatch
+** (size nBatch bytes) to the database log.
+*/
+int lsmLogBatch(lsm_db *pDb, void *aBatch, int nBatch){
+  if( pDb->bUseLog==0 ) return LSM_OK;
+  return logWriteRecord(pDb, LSM_LOG_BATCH, aBatch, nBatch, 0, -1);
+}
+
 /*
 ** Append an LSM_LOG_COMMIT record to the database log.
 */
@@ -814,15 +828,66 @@ int lsmInfoLogStructure(lsm_db *pDb, char **pzVal){
 typedef struct LogReader LogReader;
 struct LogReader {
   FileSystem *pFS;                /* File system to read from */
+  lsm_file *pFile;                /* File handle to read (or NULL) */
   i64 iOff;                       /* File offset at end of buf content */
   int iBuf;                       /* Current read offset in buf */
   LsmString buf;                  /* Buffer containing file content */
 
+  int eCksum;                     /* Checksum algorithm (LSM_CKSUM_*) */
+  int bNoCksum;                   /* True to skip checksum verification */
   int iCksumBuf;                  /* Offset in buf corresponding to cksum[01] */
   u32 cksum0;                     /* Checksum 0 at offset iCksumBuf */
   u32 cksum1;                     /* Checksum 1 at offset iCksumBuf */
 };
 
+/*
+** Log file recovery reads the log in two passes (see lsmLogRecover()). The
+** first verifies checksums and counts the committed transactions. The 
+** second applies those transactions to the in-memory tree. If the 
+** environment supports threads, the first pass runs in a helper thread 
+** while the second runs in the thread that called lsmLogRecover(). 
+** Each transaction is applied as soon as its commit record has been 
+** verified.
+**
+** An instance of the following structure is shared by the two passes.
+** If there is a helper thread (bThread is true), the nCommit, cksum0, 
+** cksum1, bDone and rc fields are protected by pMutex.
+*/
+typedef struct LogRecover LogRecover;
+struct LogRecover {
+  lsm_env *pEnv;                  /* Environment handle */
+  lsm_file *pFile;                /* Read-only log handle for first pass */
+  LogReader reader;               /* Reader used by first pass */
+  LsmString buf;                  /* Scratch buffer for first pass */
+
+  int nCommit;                    /* Number of commit records verified */
+  u32 cksum0;                     /* Checksum 0 following last commit */
+  u32 cksum1;                     /* Checksum 1 following last commit */
+  int bDone;                      /* True once first pass is finished */
+  int rc;                         /* Error code from first pass */
+
+  int bThread;                    /* True if first pass runs in pThread */
+  lsm_thread *pThread;            /* Helper thread, or NULL */
+  lsm_mutex *pMutex;              /* Mutex protecting the above */
+  lsm_cond *pCond;                /* Signalled when nCommit or bDone change */
+  int nKnown;                     /* Commits known to second pass */
+};
+
+/* 
+** Size of each read made from the log file during recovery. And the size
+** of the write batches used to apply recovered transactions to the 
+** in-memory tree.
+*/
+#define LOG_READ_SIZE     (64*1024)
+#define LOG_BATCH_SIZE    (16*1024*1024)
+
+/*
+** Read nBlob bytes of data from the log. If the data is available 
+** contiguously in p->buf and ppBlob is not NULL, set *ppBlob to point to
+** it. Otherwise, if pBuf is not NULL, copy it into pBuf and set *ppBlob
+** (if not NULL) to point to pBuf->z. If both pBuf and ppBlob are NULL,
+** the data is skipped.
+*/
 static void logReaderBlob(
   LogReader *p,                   /* Log reader object */
   LsmString *pBuf,                /* Dynamic storage, if required */
@@ -830,7 +895,6 @@ static void logReaderBlob(
   u8 **ppBlob,                    /* OUT: Pointer to blob read */
   int *pRc                        /* IN/OUT: Error code */
 ){
-  static const int LOG_READ_SIZE = 512;
   int rc = *pRc;                  /* Return code */
   int nReq = nBlob;               /* Bytes required */
 
@@ -844,8 +908,8 @@ static void logReaderBlob(
       if( nCksum>0 ){
         nCarry = nCksum % 8;
         nCksum = ((nCksum / 8) * 8);
-        if( nCksum>0 ){
-          logCksumUnaligned(
+        if( nCksum>0 && p->bNoCksum==0 ){
+          lsmChecksumBytes(p->eCksum,
               &p->buf.z[p->iCksumBuf], nCksum, &p->cksum0, &p->cksum1
           );
         }
@@ -854,7 +918,7 @@ static void logReaderBlob(
       p->buf.n = nCarry;
       p->iBuf = nCarry;
 
-      rc = lsmFsReadLog(p->pFS, p->iOff, LOG_READ_SIZE, &p->buf);
+      rc = lsmFsReadLog(p->pFS, p->pFile, p->iOff, LOG_READ_SIZE, &p->buf);
       if( rc!=LSM_OK ) break;
       p->iCksumBuf = 0;
       p->iOff += LOG_READ_SIZE;
@@ -867,11 +931,17 @@ static void logReaderBlob(
       nReq = 0;
     }else{
       int nCopy = LSM_MIN(nAvail, nReq);
-      if( nBlob==nReq ){
-        if( ppBlob ) *ppBlob = (u8 *)pBuf->z;
-        pBuf->n = 0;
+      if( pBuf ){
+        if( nBlob==nReq ){
+          /* Size pBuf for the whole blob up front, so that the appends
+          ** below never reallocate the buffer *ppBlob points into. */
+          pBuf->n = 0;
+          rc = lsmStringExtend(pBuf, nBlob);
+          if( rc!=LSM_OK ) break;
+          if( ppBlob ) *ppBlob = (u8 *)pBuf->z;
+        }
+        rc = lsmStringBinAppend(pBuf, (u8 *)&p->buf.z[p->iBuf], nCopy);
       }
-      rc = lsmStringBinAppend(pBuf, (u8 *)&p->buf.z[p->iBuf], nCopy);
       nReq -= nCopy;
       p->iBuf += nCopy;
     }
@@ -912,15 +982,21 @@ static void logReaderCksum(LogReader *p, LsmString *pBuf, int *pbEof, int *pRc){
 
     /* Update in-memory (expected) checksums */
     assert( nCksum>=0 );
-    logCksumUnaligned(&p->buf.z[p->iCksumBuf], nCksum, &p->cksum0, &p->cksum1);
+    if( p->bNoCksum==0 ){
+      lsmChecksumBytes(p->eCksum, 
+          &p->buf.z[p->iCksumBuf], nCksum, &p->cksum0, &p->cksum1
+      );
+    }
     p->iCksumBuf = p->iBuf + 8;
     logReaderBlob(p, pBuf, 8, &pPtr, pRc);
 
     /* Read the checksums from the log file. Set *pbEof if they do not match. */
     if( pPtr ){
-      cksum0 = lsmGetU32(pPtr);
-      cksum1 = lsmGetU32(&pPtr[4]);
-      *pbEof = (cksum0!=p->cksum0 || cksum1!=p->cksum1);
+      if( p->bNoCksum==0 ){
+        cksum0 = lsmGetU32(pPtr);
+        cksum1 = lsmGetU32(&pPtr[4]);
+        *pbEof = (cksum0!=p->cksum0 || cksum1!=p->cksum1);
+      }
       p->iCksumBuf = p->iBuf;
     }
   }
@@ -933,6 +1009,7 @@ static void logReaderInit(
   LogReader *p                    /* Initialize this LogReader object */
 ){
   p->pFS = pDb->pFS;
+  p->pFile = 0;
   p->iOff = pLog->aRegion[2].iStart;
   p->cksum0 = pLog->cksum0;
   p->cksum1 = pLog->cksum1;
@@ -953,160 +1030,430 @@ static int logRequireCksum(LogReader *p, int nByte){
 }
 
 /*
-** Recover the contents of the log file.
+** The first pass of log recovery. Read the log using pRec->reader, 
+** verifying checksums, until the end of the valid log data is reached. 
+** Each time a commit record is verified, increment pRec->nCommit and 
+** store the checksum values that follow it in pRec->cksum0 and cksum1.
 */
-int lsmLogRecover(lsm_db *pDb){
-  LsmString buf1;                 /* Key buffer */
-  LsmString buf2;                 /* Value buffer */
-  LogReader reader;               /* Log reader object */
-  int rc = LSM_OK;                /* Return code */
-  int nCommit = 0;                /* Number of transactions to recover */
-  int iPass;
-  int nJump = 0;                  /* Number of LSM_LOG_JUMP records in pass 0 */
-  DbLog *pLog;
-  int bOpen;
+static void logRecoverVerify(LogRecover *pRec){
+  LogReader *p = &pRec->reader;
+  LsmString *pBuf = &pRec->buf;
+  int nJump = 0;                  /* Number of LSM_LOG_JUMP records */
+  int bEof = 0;
+  int rc = LSM_OK;
 
-  rc = lsmFsOpenLog(pDb, &bOpen);
-  if( rc!=LSM_OK ) return rc;
+  while( rc==LSM_OK && !bEof ){
+    u8 eType = 0;
+    int nByte = 0;
+    int nVal = 0;
+    logReaderByte(p, &eType, &rc);
+
+    switch( eType ){
+      case LSM_LOG_PAD1:
+        break;
+
+      case LSM_LOG_PAD2:
+        logReaderVarint(p, pBuf, &nByte, &rc);
+        logReaderBlob(p, 0, nByte, 0, &rc);
+        break;
+
+      case LSM_LOG_WRITE:
+      case LSM_LOG_WRITE_CKSUM:
+      case LSM_LOG_DELETE:
+      case LSM_LOG_DELETE_CKSUM:
+      case LSM_LOG_BATCH:
+      case LSM_LOG_BATCH_CKSUM:
+        logReaderVarint(p, pBuf, &nByte, &rc);
+        if( eType==LSM_LOG_WRITE || eType==LSM_LOG_WRITE_CKSUM ){
+          logReaderVarint(p, pBuf, &nVal, &rc);
+        }
+        if( eType & 0x01 ){
+          logReaderCksum(p, pBuf, &bEof, &rc);
+        }else{
+          bEof = logRequireCksum(p, nByte+nVal);
+        }
+        if( bEof==0 ) logReaderBlob(p, 0, nByte+nVal, 0, &rc);
+        break;
+
+      case LSM_LOG_COMMIT:
+        logReaderCksum(p, pBuf, &bEof, &rc);
+        if( bEof==0 && rc==LSM_OK ){
+          if( pRec->bThread ) lsmMutexEnter(pRec->pEnv, pRec->pMutex);
+          pRec->nCommit++;
+          pRec->cksum0 = p->cksum0;
+          pRec->cksum1 = p->cksum1;
+          if( pRec->bThread ){
+            lsmCondBroadcast(pRec->pEnv, pRec->pCond);
+            lsmMutexLeave(pRec->pEnv, pRec->pMutex);
+          }
+        }
+        break;
+
+      case LSM_LOG_JUMP:
+        logReaderVarint(p, pBuf, &nByte, &rc);
+        if( rc==LSM_OK ){
+          if( (nJump++)==2 ) bEof = 1;
+          p->iOff = nByte;
+          p->buf.n = p->iBuf;
+        }
+        break;
 
-  rc = lsmTreeInit(pDb);
-  if( rc!=LSM_OK ) return rc;
+      default:
+        /* Including LSM_LOG_EOF */
+        bEof = 1;
+        break;
+    }
+  }
 
-  pLog = &pDb->treehdr.log;
-  lsmCheckpointLogoffset(pDb->pShmhdr->aSnap2, pLog);
+  if( pRec->bThread ) lsmMutexEnter(pRec->pEnv, pRec->pMutex);
+  pRec->rc = rc;
+  pRec->bDone = 1;
+  if( pRec->bThread ){
+    lsmCondBroadcast(pRec->pEnv, pRec->pCond);
+    lsmMutexLeave(pRec->pEnv, pRec->pMutex);
+  }
+}
 
-  logReaderInit(pDb, pLog, 1, &reader);
-  lsmStringInit(&buf1, pDb->pEnv);
-  lsmStringInit(&buf2, pDb->pEnv);
+/*
+** Main routine for the log recovery helper thread.
+*/
+static void logRecoverThreadMain(void *pCtx){
+  logRecoverVerify((LogRecover *)pCtx);
+}
 
-  /* The outer for() loop runs at most twice. The first iteration is to 
-  ** count the number of committed transactions in the log. The second 
-  ** iterates through those transactions and updates the in-memory tree 
-  ** structure with their contents.  */
-  if( bOpen ){
-    for(iPass=0; iPass<2 && rc==LSM_OK; iPass++){
-      int bEof = 0;
-
-      while( rc==LSM_OK && !bEof ){
-        u8 eType = 0;
-        logReaderByte(&reader, &eType, &rc);
-
-        switch( eType ){
-          case LSM_LOG_PAD1:
-            break;
-
-          case LSM_LOG_PAD2: {
-            int nPad;
-            logReaderVarint(&reader, &buf1, &nPad, &rc);
-            logReaderBlob(&reader, &buf1, nPad, 0, &rc);
-            break;
-          }
+/*
+** Called by the second pass of log recovery before it reads the first
+** record of transaction (nApplied+1). Return true if that transaction has
+** been committed, or false if the end of the recoverable log has been 
+** reached. If the first pass is running in a helper thread, this may 
+** require waiting for it to verify the transaction's commit record.
+*/
+static int logRecoverNext(LogRecover *pRec, int nApplied){
+  if( nApplied>=pRec->nKnown && pRec->bThread ){
+    lsmMutexEnter(pRec->pEnv, pRec->pMutex);
+    while( pRec->nCommit<=nApplied && pRec->bDone==0 ){
+      lsmCondWait(pRec->pEnv, pRec->pCond, pRec->pMutex);
+    }
+    pRec->nKnown = (pRec->rc==LSM_OK ? pRec->nCommit : 0);
+    lsmMutexLeave(pRec->pEnv, pRec->pMutex);
+  }else if( pRec->bThread==0 ){
+    pRec->nKnown = pRec->nCommit;
+  }
+  return (nApplied<pRec->nKnown);
+}
 
-          case LSM_LOG_WRITE:
-          case LSM_LOG_WRITE_CKSUM: {
-            int nKey;
-            int nVal;
-            u8 *aVal;
-            logReaderVarint(&reader, &buf1, &nKey, &rc);
-            logReaderVarint(&reader, &buf2, &nVal, &rc);
-
-            if( eType==LSM_LOG_WRITE_CKSUM ){
-              logReaderCksum(&reader, &buf1, &bEof, &rc);
-            }else{
-              bEof = logRequireCksum(&reader, nKey+nVal);
-            }
-            if( bEof ) break;
-
-            logReaderBlob(&reader, &buf1, nKey, 0, &rc);
-            logReaderBlob(&reader, &buf2, nVal, &aVal, &rc);
-            if( iPass==1 && rc==LSM_OK ){ 
-              rc = lsmTreeInsert(pDb, (u8 *)buf1.z, nKey, aVal, nVal);
-            }
-            break;
-          }
+/*
+** Apply the write batch accumulated in buffer pBatch to the in-memory
+** tree. lsmTreeInsertBatch() sorts the operations by key first, which 
+** is much faster than inserting them in log order if the keys are not
+** already sorted.
+*/
+static int logRecoverFlush(lsm_db *pDb, LsmString *pBatch){
+  int rc = LSM_OK;
+  if( pBatch->n>0 ){
+    rc = lsmTreeInsertBatch(pDb, (u8 *)pBatch->z, pBatch->n);
+    pBatch->n = 0;
+  }
+  return rc;
+}
 
-          case LSM_LOG_DELETE:
-          case LSM_LOG_DELETE_CKSUM: {
-            int nKey; u8 *aKey;
-            logReaderVarint(&reader, &buf1, &nKey, &rc);
-
-            if( eType==LSM_LOG_DELETE_CKSUM ){
-              logReaderCksum(&reader, &buf1, &bEof, &rc);
-            }else{
-              bEof = logRequireCksum(&reader, nKey);
-            }
-            if( bEof ) break;
-
-            logReaderBlob(&reader, &buf1, nKey, &aKey, &rc);
-            if( iPass==1 && rc==LSM_OK ){ 
-              rc = lsmTreeInsert(pDb, aKey, nKey, NULL, -1);
-            }
-            break;
-          }
+/*
+** Append the header of a write batch operation (see treeBatchParse() in
+** lsm_tree.c) to buffer pBatch. The key and value must be appended by
+** the caller.
+*/
+static int logRecoverBatchOp(LsmString *pBatch, int eOp, int nKey, int nVal){
+  int rc = lsmStringExtend(pBatch, 1 + 10 + 10);
+  if( rc==LSM_OK ){
+    u8 *a = (u8 *)&pBatch->z[pBatch->n];
+    *(a++) = (u8)eOp;
+    a += lsmVarintPut32(a, nKey);
+    if( nVal>=0 ) a += lsmVarintPut32(a, nVal);
+    pBatch->n = (a - (u8 *)pBatch->z);
+  }
+  return rc;
+}
 
-          case LSM_LOG_COMMIT:
-            logReaderCksum(&reader, &buf1, &bEof, &rc);
-            if( bEof==0 ){
-              nCommit++;
-              assert( nCommit>0 || iPass==1 );
-              if( nCommit==0 ) bEof = 1;
-            }
-            break;
-
-          case LSM_LOG_JUMP: {
-            int iOff = 0;
-            logReaderVarint(&reader, &buf1, &iOff, &rc);
-            if( rc==LSM_OK ){
-              if( iPass==1 ){
-                if( pLog->aRegion[2].iStart==0 ){
-                  assert( pLog->aRegion[1].iStart==0 );
-                  pLog->aRegion[1].iEnd = reader.iOff;
-                }else{
-                  assert( pLog->aRegion[0].iStart==0 );
-                  pLog->aRegion[0].iStart = pLog->aRegion[2].iStart;
-                  pLog->aRegion[0].iEnd = reader.iOff-reader.buf.n+reader.iBuf;
-                }
-                pLog->aRegion[2].iStart = iOff;
-              }else{
-                if( (nJump++)==2 ){
-                  bEof = 1;
-                }
-              }
-
-              reader.iOff = iOff;
-              reader.buf.n = reader.iBuf;
-            }
-            break;
-          }
+/*
+** The second pass of log recovery. Read the log using reader p and apply
+** the transactions verified by the first pass to the in-memory tree.
+** Checksums are not verified again.
+*/
+static int logRecoverApply(
+  lsm_db *pDb,                    /* Database handle */
+  DbLog *pLog,                    /* Log object associated with pDb */
+  LogRecover *pRec,               /* Recovery object */
+  LogReader *p,                   /* Log reader object */
+  LsmString *pBuf1,               /* Scratch buffer */
+  LsmString *pBuf2                /* Buffer used to accumulate batch */
+){
+  int rc = LSM_OK;
+  int nApplied = 0;               /* Transactions applied so far */
+  int bEof = 0;
+  int bNext = 1;                  /* True at start of each transaction */
+
+  p->bNoCksum = 1;
+  pBuf2->n = 0;
+  while( rc==LSM_OK && !bEof ){
+    u8 eType = 0;
+
+    if( bNext ){
+      if( logRecoverNext(pRec, nApplied)==0 ) break;
+      bNext = 0;
+    }
+    logReaderByte(p, &eType, &rc);
+
+    switch( eType ){
+      case LSM_LOG_PAD1:
+        break;
 
-          default:
-            /* Including LSM_LOG_EOF */
-            bEof = 1;
-            break;
+      case LSM_LOG_PAD2: {
+        int nPad;
+        logReaderVarint(p, pBuf1, &nPad, &rc);
+        logReaderBlob(p, 0, nPad, 0, &rc);
+        break;
+      }
+
+      case LSM_LOG_WRITE:
+      case LSM_LOG_WRITE_CKSUM: {
+        int nKey;
+        int nVal;
+        u8 *aVal;
+        logReaderVarint(p, pBuf1, &nKey, &rc);
+        logReaderVarint(p, pBuf1, &nVal, &rc);
+        if( eType==LSM_LOG_WRITE_CKSUM ){
+          logReaderCksum(p, pBuf1, &bEof, &rc);
+        }
+        logReaderBlob(p, pBuf1, nKey, 0, &rc);
+        if( rc==LSM_OK ){
+          rc = logRecoverBatchOp(pBuf2, LSM_BATCH_INSERT, nKey, nVal);
+        }
+        if( rc==LSM_OK ){
+          rc = lsmStringBinAppend(pBuf2, (u8 *)pBuf1->z, nKey);
+        }
+        logReaderBlob(p, pBuf1, nVal, &aVal, &rc);
+        if( rc==LSM_OK ) rc = lsmStringBinAppend(pBuf2, aVal, nVal);
+        break;
+      }
+
+      case LSM_LOG_DELETE:
+      case LSM_LOG_DELETE_CKSUM: {
+        int nKey; u8 *aKey;
+        logReaderVarint(p, pBuf1, &nKey, &rc);
+        if( eType==LSM_LOG_DELETE_CKSUM ){
+          logReaderCksum(p, pBuf1, &bEof, &rc);
+        }
+        logReaderBlob(p, pBuf1, nKey, &aKey, &rc);
+        if( rc==LSM_OK ){
+          rc = logRecoverBatchOp(pBuf2, LSM_BATCH_DELETE, nKey, -1);
         }
+        if( rc==LSM_OK ) rc = lsmStringBinAppend(pBuf2, aKey, nKey);
+        break;
       }
 
-      if( rc==LSM_OK && iPass==0 ){
-        if( nCommit==0 ){
+      case LSM_LOG_BATCH:
+      case LSM_LOG_BATCH_CKSUM: {
+        int nBatch; u8 *aBatch;
+        logReaderVarint(p, pBuf1, &nBatch, &rc);
+        if( eType==LSM_LOG_BATCH_CKSUM ){
+          logReaderCksum(p, pBuf1, &bEof, &rc);
+        }
+        logReaderBlob(p, pBuf1, nBatch, &aBatch, &rc);
+        if( rc==LSM_OK ) rc = lsmStringBinAppend(pBuf2, aBatch, nBatch);
+        break;
+      }
+
+      case LSM_LOG_COMMIT:
+        logReaderCksum(p, pBuf1, &bEof, &rc);
+        nApplied++;
+        bNext = 1;
+        if( pBuf2->n>=LOG_BATCH_SIZE ) rc = logRecoverFlush(pDb, pBuf2);
+        break;
+
+      case LSM_LOG_JUMP: {
+        int iOff = 0;
+        logReaderVarint(p, pBuf1, &iOff, &rc);
+        if( rc==LSM_OK ){
           if( pLog->aRegion[2].iStart==0 ){
-            iPass = 1;
+            assert( pLog->aRegion[1].iStart==0 );
+            pLog->aRegion[1].iEnd = p->iOff;
           }else{
-            pLog->aRegion[2].iStart = 0;
-            iPass = -1;
-            lsmCheckpointZeroLogoffset(pDb);
+            assert( pLog->aRegion[0].iStart==0 );
+            pLog->aRegion[0].iStart = pLog->aRegion[2].iStart;
+            pLog->aRegion[0].iEnd = p->iOff - p->buf.n + p->iBuf;
           }
+          pLog->aRegion[2].iStart = iOff;
+          p->iOff = iOff;
+          p->buf.n = p->iBuf;
         }
-        logReaderInit(pDb, pLog, 0, &reader);
-        nCommit = nCommit * -1;
+        break;
+      }
+
+      default:
+        /* The first pass has verified that this does not happen */
+        assert( 0 );
+        rc = LSM_CORRUPT_BKPT;
+        break;
+    }
+  }
+
+  if( rc==LSM_OK ) rc = logRecoverFlush(pDb, pBuf2);
+  return rc;
+}
+
+/*
+** Start the first pass of log recovery (see logRecoverVerify()). If the
+** environment supports threads, it is run in a helper thread. Otherwise,
+** it is run to completion before this function returns.
+**
+** The helper thread does not allocate memory. Its buffers are allocated 
+** here, before it is started.
+*/
+static int logRecoverStart(lsm_db *pDb, DbLog *pLog, LogRecover *pRec){
+  lsm_env *pEnv = pDb->pEnv;
+  int rc;
+
+  pRec->nCommit = 0;
+  pRec->nKnown = 0;
+  pRec->bDone = 0;
+  pRec->rc = LSM_OK;
+  pRec->cksum0 = pLog->cksum0;
+  pRec->cksum1 = pLog->cksum1;
+  logReaderInit(pDb, pLog, 0, &pRec->reader);
+  pRec->reader.pFile = pRec->pFile;
+  rc = lsmStringExtend(&pRec->reader.buf, LOG_READ_SIZE+8);
+  if( rc==LSM_OK ) rc = lsmStringExtend(&pRec->buf, 16);
+  if( rc!=LSM_OK ) return rc;
+
+  if( lsmThreadsAvailable(pEnv) ){
+    if( pRec->pMutex==0 ) rc = lsmMutexNew(pEnv, &pRec->pMutex);
+    if( rc==LSM_OK && pRec->pCond==0 ) rc = lsmCondNew(pEnv, &pRec->pCond);
+    if( rc==LSM_OK ){
+      pRec->bThread = 1;
+      rc = lsmThreadNew(pEnv, logRecoverThreadMain, (void *)pRec, 
+          &pRec->pThread
+      );
+      if( rc!=LSM_OK ) pRec->bThread = 0;
+    }
+  }else{
+    logRecoverVerify(pRec);
+  }
+
+  return rc;
+}
+
+/*
+** Wait for the first pass of log recovery to finish, if it is running in
+** a helper thread. Then return its error code.
+*/
+static int logRecoverFinish(LogRecover *pRec){
+  if( pRec->bThread ){
+    lsmMutexEnter(pRec->pEnv, pRec->pMutex);
+    while( pRec->bDone==0 ){
+      lsmCondWait(pRec->pEnv, pRec->pCond, pRec->pMutex);
+    }
+    lsmMutexLeave(pRec->pEnv, pRec->pMutex);
+    lsmThreadJoin(pRec->pEnv, pRec->pThread);
+    pRec->pThread = 0;
+    pRec->bThread = 0;
+  }
+  return pRec->rc;
+}
+
+/*
+** Recover the contents of the log file.
+*/
+int lsmLogRecover(lsm_db *pDb){
+  LsmString buf1;                 /* Key buffer */
+  LsmString buf2;                 /* Write batch buffer */
+  LogReader reader;               /* Log reader object */
+  LogRecover rec;                 /* Recovery state */
+  int rc = LSM_OK;                /* Return code */
+  int bExists = 1;                /* True if the log file exists */
+  DbLog *pLog;                    /* Log object being recovered */
+  lsm_file *pFile = 0;            /* Read-only log handle */
+  int bOpen;                      /* True if log file is open */
+
+  /* The last connection to close a database writes a checkpoint that
+  ** includes the entire contents of the log file, then deletes it (see
+  ** doDbDisconnect()). So if there is no log file, there is nothing to
+  ** recover and scanning the log can be skipped altogether. Use the 
+  ** result of opening the read-only handle used by the first pass of
+  ** recovery to determine whether or not the log file exists.  */
+  rc = lsmFsOpenLogReadonly(pDb, &pFile);
+  if( rc==LSM_OK && pFile==0 ) bExists = 0;
+  if( rc==LSM_OK ) rc = lsmFsOpenLog(pDb, &bOpen);
+  if( rc==LSM_OK ) rc = lsmTreeInit(pDb);
+  if( rc!=LSM_OK ){
+    if( pFile ) lsmEnvClose(pDb->pEnv, pFile);
+    return rc;
+  }
+
+  pLog = &pDb->treehdr.log;
+  lsmCheckpointLogoffset(pDb->pShmhdr->aSnap2, pLog);
+
+  memset(&rec, 0, sizeof(rec));
+  rec.pEnv = pDb->pEnv;
+  rec.pFile = pFile;
+  rec.reader.eCksum = lsmCheckpointCksum(pDb->pShmhdr->aSnap2);
+  lsmStringInit(&rec.reader.buf, pDb->pEnv);
+  lsmStringInit(&rec.buf, pDb->pEnv);
+  logReaderInit(pDb, pLog, 1, &reader);
+  lsmStringInit(&buf1, pDb->pEnv);
+  lsmStringInit(&buf2, pDb->pEnv);
+
+  if( bOpen && bExists==0 ){
+    if( pLog->aRegion[2].iStart!=0 ){
+      pLog->aRegion[2].iStart = 0;
+      lsmCheckpointZeroLogoffset(pDb);
+      logReaderInit(pDb, pLog, 0, &reader);
+    }
+  }else if( bOpen ){
+    while( rc==LSM_OK ){
+      int rc2;
+
+      /* Run the two passes. The first may run in a helper thread. */
+      rc = logRecoverStart(pDb, pLog, &rec);
+      if( rc==LSM_OK ){
+        reader.eCksum = rec.reader.eCksum;
+        rc = logRecoverApply(pDb, pLog, &rec, &reader, &buf1, &buf2);
       }
+      rc2 = logRecoverFinish(&rec);
+      if( rc==LSM_OK ) rc = rc2;
+      if( rc!=LSM_OK || rec.nCommit>0 ) break;
+
+      /* If no transactions were recovered, try again from the start of
+      ** the log file (if the log pointer in the checkpoint does not point
+      ** there). Or, if the database has never been checkpointed, the log
+      ** may have been written by a version of the library that did not
+      ** use CRC32C checksums. In that case try the older algorithm before
+      ** concluding that the log is empty.  */
+      if( pLog->aRegion[2].iStart!=0 ){
+        pLog->aRegion[2].iStart = 0;
+        lsmCheckpointZeroLogoffset(pDb);
+      }else if( rec.reader.eCksum==LSM_CKSUM_CRC32C
+             && lsmCheckpointId(pDb->pShmhdr->aSnap2,0)<LSM_INITIAL_SNAPSHOT_ID
+      ){
+        rec.reader.eCksum = LSM_CKSUM_FLETCHER;
+      }else{
+        break;
+      }
+      logReaderInit(pDb, pLog, 0, &reader);
     }
   }
 
-  /* Initialize DbLog object */
+  /* Initialize DbLog object. If the log was recovered using a different
+  ** checksum algorithm to that specified by the checkpoint, update the
+  ** checkpoint so that new log records are written using the same one. */
   if( rc==LSM_OK ){
+    if( rec.nCommit>0 
+     && rec.reader.eCksum!=lsmCheckpointCksum(pDb->pShmhdr->aSnap2) 
+    ){
+      lsmCheckpointSetCksum(pDb, rec.reader.eCksum);
+    }
     pLog->aRegion[2].iEnd = reader.iOff - reader.buf.n + reader.iBuf;
-    pLog->cksum0 = reader.cksum0;
-    pLog->cksum1 = reader.cksum1;
+    pLog->cksum0 = (rec.nCommit>0 ? rec.cksum0 : pLog->cksum0);
+    pLog->cksum1 = (rec.nCommit>0 ? rec.cksum1 : pLog->cksum1);
   }
 
   if( rc==LSM_OK ){
@@ -1119,6 +1466,11 @@ int lsmLogRecover(lsm_db *pDb){
     lsmFsCloseLog(pDb);
   }
 
+  if( pFile ) lsmEnvClose(pDb->pEnv, pFile);
+  lsmCondDel(pDb->pEnv, rec.pCond);
+  lsmMutexDel(pDb->pEnv, rec.pMutex);
+  lsmStringClear(&rec.reader.buf);
+  lsmStringClear(&rec.buf);
   lsmStringClear(&buf1);
   lsmStringClear(&buf2);
   lsmStringClear(&reader.buf);
@@ -0,0 +1,273 @@
+/*
+** 2026-10-17
+**
+** The author disclaims copyright to this source code.  In place of
+** a legal notice, here is a blessing:
+**
+**    May you do good and not evil.
+**    May you find forgiveness for yourself and forgive others.
+**    May you share freely, never taking more than you give.
+**
+*************************************************************************
+**
+** Built-in page compression (LSM_COMPRESSION_LZ).
+**
+** This is a byte-oriented LZ77 variant that favours speed over compression
+** ratio, so that compressing each page written by a merge does not make
+** merges CPU bound. It requires no memory other than a small hash table
+** on the stack.
+**
+** FORMAT:
+**
+**   Compressed data is a series of sequences. Each sequence consists of:
+**
+**     * A token byte. The high 4 bits are the number of literal bytes
+**       that follow (nLit). The low 4 bits are the length of the match
+**       that follows the literals, less LZ_MINMATCH (nMatch).
+**
+**     * If nLit is 15, one or more bytes that are added to it. Each byte
+**       with the value 255 is followed by another.
+**
+**     * nLit literal bytes.
+**
+**     * A 2 byte little-endian offset. The match is a copy of the nMatch
+**       bytes that begin this many bytes before the current end of the
+**       output. The offset may be smaller than nMatch, in which case the
+**       match overlaps itself.
+**
+**     * If the 4 bits of nMatch stored in the token are all set, one or
+**       more bytes that are added to it, encoded as for nLit.
+**
+**   The last sequence consists of only a token byte (with the low 4 bits
+**   clear) and literals. It is identified by the end of the input.
+*/
+#include "lsmInt.h"
+
+#define LZ_HASH_BITS   12
+#define LZ_HASH_SIZE   (1 << LZ_HASH_BITS)
+#define LZ_MINMATCH    4
+#define LZ_MAXOFFSET   65535
+
+/*
+** Return the 4 bytes at a[] as a 32-bit integer in native byte order.
+*/
+static u32 lzRead32(const u8 *a){
+  u32 v;
+  memcpy(&v, a, sizeof(v));
+  return v;
+}
+
+static int lzHash(u32 v){
+  return (int)((v * 2654435761U) >> (32 - LZ_HASH_BITS));
+}
+
+/*
+** Append the length n, less the 15 stored in the token, to buffer aOut at
+** offset *piOut. Return 0 if successful, or 1 if there is not enough
+** space in the buffer.
+*/
+static int lzPutLength(u8 *aOut, int nOut, int *piOut, int n){
+  int iOut = *piOut;
+  n -= 15;
+  while( 1 ){
+    if( iOut>=nOut ) return 1;
+    if( n<255 ) break;
+    aOut[iOut++] = 255;
+    n -= 255;
+  }
+  aOut[iOut++] = (u8)n;
+  *piOut = iOut;
+  return 0;
+}
+
+/*
+** Read a length extension (see lzPutLength) from buffer aIn at offset
+** *piIn and add it to *pn. Return 0 if successful, or 1 if the buffer
+** ends before the length does.
+*/
+static int lzGetLength(const u8 *aIn, int nIn, int *piIn, int *pn){
+  int iIn = *piIn;
+  int n = *pn;
+  u8 c;
+  do {
+    if( iIn>=nIn ) return 1;
+    c = aIn[iIn++];
+    n += c;
+  }while( c==255 );
+  *piIn = iIn;
+  *pn = n;
+  return 0;
+}
+
+/*
+** Append a sequence consisting of the nLit literals at aLit[] followed by
+** a match of nMatch bytes at offset iOffset to buffer aOut at offset
+** *piOut. If nMatch is zero, this is the last sequence and no offset is
+** written. Return 0 if successful, or 1 if there is not enough space in
+** the buffer.
+*/
+static int lzPutSequence(
+  u8 *aOut, int nOut, int *piOut,
+  const u8 *aLit, int nLit,
+  int iOffset, int nMatch
+){
+  int iOut = *piOut;
+  int iToken = iOut;
+  int nM = (nMatch ? nMatch - LZ_MINMATCH : 0);
+
+  if( iOut>=nOut ) return 1;
+  aOut[iToken] = (u8)((LSM_MIN(nLit, 15) << 4) | LSM_MIN(nM, 15));
+  iOut++;
+  if( nLit>=15 && lzPutLength(aOut, nOut, &iOut, nLit) ) return 1;
+  if( iOut+nLit>nOut ) return 1;
+  memcpy(&aOut[iOut], aLit, nLit);
+  iOut += nLit;
+
+  if( nMatch ){
+    if( iOut+2>nOut ) return 1;
+    aOut[iOut++] = (u8)(iOffset & 0xFF);
+    aOut[iOut++] = (u8)(iOffset >> 8);
+    if( nM>=15 && lzPutLength(aOut, nOut, &iOut, nM) ) return 1;
+  }
+
+  *piOut = iOut;
+  return 0;
+}
+
+/*
+** Implementation of lsm_compress.xBound for LSM_COMPRESSION_LZ. This is
+** the size of the output if no matches are found, plus a margin.
+*/
+static int lzBound(void *pCtx, int nSrc){
+  return nSrc + (nSrc / 255) + 16;
+}
+
+/*
+** Implementation of lsm_compress.xCompress for LSM_COMPRESSION_LZ.
+*/
+static int lzCompress(
+  void *pCtx,                     /* Context pointer (unused) */
+  char *zOut, int *pnOut,         /* OUT: Buffer containing compressed data */
+  const char *zIn, int nIn        /* Buffer containing input data */
+){
+  const u8 *aIn = (const u8 *)zIn;
+  u8 *aOut = (u8 *)zOut;
+  int nOut = *pnOut;
+  int iOut = 0;                   /* Bytes written to aOut[] so far */
+  int iLit = 0;                   /* Offset of first pending literal */
+  int i = 0;                      /* Current offset in aIn[] */
+  u16 aHash[LZ_HASH_SIZE];        /* Most recent offset for each hash */
+
+  memset(aHash, 0, sizeof(aHash));
+  while( i+LZ_MINMATCH<=nIn ){
+    u32 v = lzRead32(&aIn[i]);
+    int h = lzHash(v);
+    int iRef;
+
+    /* Only the low 16 bits of each offset are stored in the hash table.
+    ** This is enough for any page, and a stale entry is no more than a
+    ** missed match, as the candidate is always compared with the input. */
+    iRef = i - (u16)(i - aHash[h]);
+    aHash[h] = (u16)i;
+    if( iRef<i && i-iRef<=LZ_MAXOFFSET && lzRead32(&aIn[iRef])==v ){
+      int nMatch = LZ_MINMATCH;
+      while( i+nMatch<nIn && aIn[iRef+nMatch]==aIn[i+nMatch] ) nMatch++;
+      if( lzPutSequence(aOut, nOut, &iOut,
+            &aIn[iLit], i-iLit, i-iRef, nMatch)
+      ){
+        break;
+      }
+      i += nMatch;
+      iLit = i;
+
+      /* Hash the position two bytes before the end of the match as well.
+      ** This improves the ratio for runs of similar records. */
+      if( i+LZ_MINMATCH<=nIn ){
+        aHash[lzHash(lzRead32(&aIn[i-2]))] = (u16)(i-2);
+      }
+    }else{
+      /* Skip ahead faster the longer it has been since the last match,
+      ** so that incompressible data is processed quickly. */
+      i += 1 + ((i - iLit) >> 6);
+    }
+  }
+
+  /* Write the last sequence. If the buffer filled up, start again and
+  ** write the entire input as literals. That requires no more space
+  ** than is reported by lzBound().  */
+  if( i+LZ_MINMATCH<=nIn
+   || lzPutSequence(aOut, nOut, &iOut, &aIn[iLit], nIn-iLit, 0, 0)
+  ){
+    iOut = 0;
+    if( lzPutSequence(aOut, nOut, &iOut, aIn, nIn, 0, 0) ) return LSM_ERROR;
+  }
+
+  *pnOut = iOut;
+  return LSM_OK;
+}
+
+/*
+** Implementation of lsm_compress.xUncompress for LSM_COMPRESSION_LZ.
+*/
+static int lzUncompress(
+  void *pCtx,                     /* Context pointer (unused) */
+  char *zOut, int *pnOut,         /* OUT: Buffer containing uncompressed data */
+  const char *zIn, int nIn        /* Buffer containing input data */
+){
+  const u8 *aIn = (const u8 *)zIn;
+  u8 *aOut = (u8 *)zOut;
+  int nOut = *pnOut;
+  int iIn = 0;
+  int iOut = 0;
+
+  while( iIn<nIn ){
+    int iToken = aIn[iIn++];
+    int nLit = (iToken >> 4);
+    int nMatch = (iToken & 0x0F);
+    int iOffset;
+
+    /* Copy the literals */
+    if( nLit==15 && lzGetLength(aIn, nIn, &iIn, &nLit) ){
+      return LSM_CORRUPT_BKPT;
+    }
+    if( nLit>nIn-iIn || nLit>nOut-iOut ) return LSM_CORRUPT_BKPT;
+    memcpy(&aOut[iOut], &aIn[iIn], nLit);
+    iIn += nLit;
+    iOut += nLit;
+    if( iIn==nIn ) break;
+
+    /* Copy the match */
+    if( iIn+2>nIn ) return LSM_CORRUPT_BKPT;
+    iOffset = aIn[iIn] + (aIn[iIn+1] << 8);
+    iIn += 2;
+    if( nMatch==15 && lzGetLength(aIn, nIn, &iIn, &nMatch) ){
+      return LSM_CORRUPT_BKPT;
+    }
+    nMatch += LZ_MINMATCH;
+    if( iOffset==0 || iOffset>iOut || nMatch>nOut-iOut ){
+      return LSM_CORRUPT_BKPT;
+    }
+    if( iOffset>=nMatch ){
+      memcpy(&aOut[iOut], &aOut[iOut-iOffset], nMatch);
+      iOut += nMatch;
+    }else{
+      int iEnd = iOut + nMatch;
+      for(/* no-op */; iOut<iEnd; iOut++) aOut[iOut] = aOut[iOut-iOffset];
+    }
+  }
+
+  *pnOut = iOut;
+  return LSM_OK;
+}
+
+/*
+** Populate the structure passed as the only argument with the methods
+** that implement LSM_COMPRESSION_LZ.
+*/
+void lsmLzCompression(lsm_compress *p){
+  memset(p, 0, sizeof(lsm_compress));
+  p->iId = LSM_COMPRESSION_LZ;
+  p->xBound = lzBound;
+  p->xCompress = lzCompress;
+  p->xUncompress = lzUncompress;
+}
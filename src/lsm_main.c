@@ -97,6 +97,22 @@ int lsm_new(lsm_env *pEnv, lsm_db **ppDb){
   pDb->iRwclient = -1;
   pDb->bMultiProc = LSM_DFLT_MULTIPLE_PROCESSES;
   pDb->bMmap = LSM_DFLT_MMAP;
+  pDb->nBloomBits = LSM_DFLT_BLOOM;
+  pDb->bBgWork = LSM_DFLT_BACKGROUND_WORK;
+  pDb->nGroupCommit = LSM_DFLT_GROUP_COMMIT;
+  pDb->eCompaction = LSM_DFLT_COMPACTION;
+  pDb->nLevelBase = LSM_DFLT_LEVEL_BASE;
+  pDb->nLevelRatio = LSM_DFLT_LEVEL_RATIO;
+  pDb->nMergeRate = LSM_DFLT_MERGE_RATE;
+  pDb->nCkptRate = LSM_DFLT_CHECKPOINT_RATE;
+  pDb->nMaxOld = LSM_DFLT_MAX_OLD_TREES;
+  pDb->nCacheSize = -1;
+  pDb->eCachePolicy = -1;
+  pDb->nReadAhead = LSM_DFLT_READAHEAD;
+  pDb->eDirectIo = LSM_DFLT_DIRECT_IO;
+  pDb->nPrefixRestart = LSM_DFLT_PREFIX_COMPRESSION;
+  pDb->nValueThreshold = LSM_DFLT_VALUE_THRESHOLD;
+  pDb->nLogPrealloc = LSM_DFLT_LOG_PREALLOC;
   pDb->xLog = xLog;
   pDb->compress.iId = LSM_COMPRESSION_NONE;
   return LSM_OK;
@@ -200,6 +216,15 @@ int lsm_open(lsm_db *pDb, const char *zFilename){
       }
     }
 
+    /* If this connection uses background threads, start them now (or 
+    ** take a reference to the threads started by some other connection).
+    ** If this fails, clear the flag so that lsm_close() does not attempt 
+    ** to release the threads.  */
+    if( pDb->bBgWork ){
+      if( rc==LSM_OK && pDb->bReadonly==0 ) rc = lsmDbBgStart(pDb);
+      if( rc!=LSM_OK || pDb->bReadonly ) pDb->bBgWork = 0;
+    }
+
     lsmFree(pDb->pEnv, zFull);
     assertRwclientLockValue(pDb);
   }
@@ -218,11 +243,11 @@ int lsm_close(lsm_db *pDb){
       rc = LSM_MISUSE_BKPT;
     }else{
       lsmMCursorFreeCache(pDb);
-      lsmFreeSnapshot(pDb->pEnv, pDb->pClient);
-      pDb->pClient = 0;
+      lsmClientSnapshotRelease(pDb);
 
       assertRwclientLockValue(pDb);
 
+      if( pDb->bBgWork ) lsmDbBgStop(pDb);
       lsmDbDatabaseRelease(pDb);
       lsmLogClose(pDb);
       lsmFsClose(pDb->pFS);
@@ -385,6 +410,156 @@ int lsm_config(lsm_db *pDb, int eParam, ...){
       break;
     }
 
+    case LSM_CONFIG_BLOOM: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 ){
+        pDb->nBloomBits = LSM_MIN(*piVal, LSM_MAX_BLOOM_BITS);
+      }
+      *piVal = pDb->nBloomBits;
+      break;
+    }
+
+    case LSM_CONFIG_BACKGROUND_WORK: {
+      int *piVal = va_arg(ap, int *);
+      /* If lsm_open() has been called, this is a read-only parameter. */
+      if( pDb->pDatabase==0 && *piVal>=0 ){
+        pDb->bBgWork = (*piVal!=0 && lsmThreadsAvailable(pDb->pEnv));
+      }
+      *piVal = pDb->bBgWork;
+      break;
+    }
+
+    case LSM_CONFIG_GROUP_COMMIT: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 && lsmThreadsAvailable(pDb->pEnv) ){
+        pDb->nGroupCommit = *piVal;
+      }
+      *piVal = pDb->nGroupCommit;
+      break;
+    }
+
+    case LSM_CONFIG_COMPACTION: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=LSM_COMPACTION_TIERED && *piVal<=LSM_COMPACTION_HYBRID ){
+        pDb->eCompaction = *piVal;
+      }
+      *piVal = pDb->eCompaction;
+      break;
+    }
+
+    case LSM_CONFIG_LEVEL_BASE: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>0 ) pDb->nLevelBase = *piVal;
+      *piVal = pDb->nLevelBase;
+      break;
+    }
+
+    case LSM_CONFIG_LEVEL_RATIO: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=2 ) pDb->nLevelRatio = *piVal;
+      *piVal = pDb->nLevelRatio;
+      break;
+    }
+
+    case LSM_CONFIG_MERGE_RATE: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 ) pDb->nMergeRate = *piVal;
+      *piVal = pDb->nMergeRate;
+      break;
+    }
+
+    case LSM_CONFIG_CHECKPOINT_RATE: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 ) pDb->nCkptRate = *piVal;
+      *piVal = pDb->nCkptRate;
+      break;
+    }
+
+    case LSM_CONFIG_MAX_OLD_TREES: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>0 ){
+        pDb->nMaxOld = LSM_MIN(*piVal, LSM_MAX_OLD_TREES);
+      }
+      *piVal = pDb->nMaxOld;
+      break;
+    }
+
+    case LSM_CONFIG_CACHE_SIZE: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 ){
+        pDb->nCacheSize = *piVal;
+        if( pDb->pFS ) lsmFsCacheSize(pDb->pFS, *piVal);
+      }
+      if( pDb->pFS ){
+        *piVal = lsmFsCacheSize(pDb->pFS, -1);
+      }else if( pDb->nCacheSize>=0 ){
+        *piVal = pDb->nCacheSize;
+      }else{
+        *piVal = LSM_DFLT_CACHE_SIZE;
+      }
+      break;
+    }
+
+    case LSM_CONFIG_CACHE_POLICY: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal==LSM_CACHE_LRU || *piVal==LSM_CACHE_2Q ){
+        pDb->eCachePolicy = *piVal;
+        if( pDb->pFS ) lsmFsCachePolicy(pDb->pFS, *piVal);
+      }
+      if( pDb->pFS ){
+        *piVal = lsmFsCachePolicy(pDb->pFS, -1);
+      }else if( pDb->eCachePolicy>=0 ){
+        *piVal = pDb->eCachePolicy;
+      }else{
+        *piVal = LSM_DFLT_CACHE_POLICY;
+      }
+      break;
+    }
+
+    case LSM_CONFIG_READAHEAD: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 ) pDb->nReadAhead = *piVal;
+      *piVal = pDb->nReadAhead;
+      break;
+    }
+
+    case LSM_CONFIG_DIRECT_IO: {
+      int *piVal = va_arg(ap, int *);
+      if( pDb->pDatabase ){
+        /* If lsm_open() has been called, this is a read-only parameter. */
+        *piVal = lsmDbDirectIo(pDb);
+      }else{
+        if( *piVal>=LSM_DIRECT_IO_OFF && *piVal<=LSM_DIRECT_IO_ALL ){
+          pDb->eDirectIo = *piVal;
+        }
+        *piVal = pDb->eDirectIo;
+      }
+      break;
+    }
+
+    case LSM_CONFIG_PREFIX_COMPRESSION: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 ){
+        pDb->nPrefixRestart = LSM_MIN(*piVal, LSM_MAX_PREFIX_RESTART);
+      }
+      *piVal = pDb->nPrefixRestart;
+      break;
+    }
+
+    case LSM_CONFIG_VALUE_THRESHOLD: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 ) pDb->nValueThreshold = *piVal;
+      *piVal = pDb->nValueThreshold;
+      break;
+    }
+
+    case LSM_CONFIG_LOG_PREALLOC: {
+      int *piVal = va_arg(ap, int *);
+      if( *piVal>=0 ) pDb->nLogPrealloc = *piVal;
+      *piVal = pDb->nLogPrealloc;
+      break;
+    }
+
     case LSM_CONFIG_SET_COMPRESSION: {
       lsm_compress *p = va_arg(ap, lsm_compress *);
       if( pDb->iReader>=0 && pDb->bInFactory==0 ){
@@ -395,7 +570,9 @@ int lsm_config(lsm_db *pDb, int eParam, ...){
           /* Invoke any destructor belonging to the current compression. */
           pDb->compress.xFree(pDb->compress.pCtx);
         }
-        if( p->xBound==0 ){
+        if( p->xBound==0 && p->iId==LSM_COMPRESSION_LZ ){
+          lsmLzCompression(&pDb->compress);
+        }else if( p->xBound==0 ){
           memset(&pDb->compress, 0, sizeof(lsm_compress));
           pDb->compress.iId = LSM_COMPRESSION_NONE;
         }else{
@@ -524,20 +701,25 @@ int lsmInfoFreelist(lsm_db *pDb, char **pzOut){
 static int infoTreeSize(lsm_db *db, int *pnOldKB, int *pnNewKB){
   ShmHeader *pShm = db->pShmhdr;
   TreeHeader *p = &pShm->hdr1;
+  i64 iLogOff;
+  int nOld;
+  int nOldByte = 0;
+  int i;
 
   /* The following code suffers from two race conditions, as it accesses and
   ** trusts the contents of shared memory without verifying checksums:
   **
-  **   * The two values read - TreeHeader.root.nByte and oldroot.nByte - are 
-  **     32-bit fields. It is assumed that reading from one of these
-  **     is atomic - that it is not possible to read a partially written
-  **     garbage value. However the two values may be mutually inconsistent. 
+  **   * The values read - TreeHeader.root.nByte, TreeHeader.nOld and the
+  **     nByte field of each old tree - are 32-bit fields. It is assumed that
+  **     reading from one of these is atomic - that it is not possible to
+  **     read a partially written garbage value. However the values may be
+  **     mutually inconsistent. 
   **
-  **   * TreeHeader.iLogOff is a 64-bit value. And lsmCheckpointLogOffset()
+  **   * TreeOld.iLog is a 64-bit value. And lsmCheckpointLogOffset()
   **     reads a 64-bit value from a snapshot stored in shared memory. It
   **     is assumed that in each case it is possible to read a partially
   **     written garbage value. If this occurs, then the value returned
-  **     for the size of the "old" tree may reflect the size of an "old"
+  **     for the size of the "old" trees may include the size of an "old"
   **     tree that was recently flushed to disk.
   **
   ** Given the context in which this function is called (as a result of an
@@ -545,15 +727,19 @@ static int infoTreeSize(lsm_db *db, int *pnOldKB, int *pnNewKB){
   ** be problems.
   */
   *pnNewKB = ((int)p->root.nByte + 1023) / 1024;
-  if( p->iOldShmid ){
-    if( p->iOldLog==lsmCheckpointLogOffset(pShm->aSnap1) ){
-      *pnOldKB = 0;
+
+  /* Old trees up to and including the one with a log offset equal to that
+  ** of the most recent snapshot have been flushed to disk already.  */
+  iLogOff = lsmCheckpointLogOffset(pShm->aSnap1);
+  nOld = LSM_MIN((int)p->nOld, LSM_MAX_OLD_TREES);
+  for(i=0; i<nOld; i++){
+    if( p->aOld[i].iLog==iLogOff ){
+      nOldByte = 0;
     }else{
-      *pnOldKB = ((int)p->oldroot.nByte + 1023) / 1024;
+      nOldByte += (int)p->aOld[i].root.nByte;
     }
-  }else{
-    *pnOldKB = 0;
   }
+  *pnOldKB = (nOldByte + 1023) / 1024;
 
   return LSM_OK;
 }
@@ -635,6 +821,13 @@ int lsm_info(lsm_db *pDb, int eParam, ...){
       break;
     }
 
+    case LSM_INFO_GROUP_COMMIT: {
+      int *pnSync = va_arg(ap, int *);
+      int *pnCommit = va_arg(ap, int *);
+      lsmDbGroupCommitInfo(pDb, pnSync, pnCommit);
+      break;
+    }
+
     case LSM_INFO_COMPRESSION_ID: {
       unsigned int *piOut = va_arg(ap, unsigned int *);
       if( pDb->pClient ){
@@ -654,6 +847,32 @@ int lsm_info(lsm_db *pDb, int eParam, ...){
   return rc;
 }
 
+/*
+** This function is called after the in-memory tree has been written to.
+** Parameter nBefore is the size of the tree before the write. If auto-work
+** is enabled and the tree has grown past one or more multiples of the
+** auto-work quantum, do a corresponding amount of work on the database
+** file.
+*/
+static int dbAutoWork(lsm_db *pDb, int nBefore){
+  int rc = LSM_OK;
+  int pgsz = lsmFsPageSize(pDb->pFS);
+  int nQuant = LSM_AUTOWORK_QUANT * pgsz;
+  int nAfter;
+  int nDiff;
+
+  if( nQuant>pDb->nTreeLimit ){
+    nQuant = pDb->nTreeLimit;
+  }
+
+  nAfter = lsmTreeSize(pDb);
+  nDiff = (nAfter/nQuant) - (nBefore/nQuant);
+  if( pDb->bAutowork && pDb->bBgWork==0 && nDiff!=0 ){
+    rc = lsmSortedAutoWork(pDb, nDiff * LSM_AUTOWORK_QUANT);
+  }
+  return rc;
+}
+
 static int doWriteOp(
   lsm_db *pDb,
   int bDeleteRange,
@@ -679,27 +898,14 @@ static int doWriteOp(
   lsmSortedSaveTreeCursors(pDb);
 
   if( rc==LSM_OK ){
-    int pgsz = lsmFsPageSize(pDb->pFS);
-    int nQuant = LSM_AUTOWORK_QUANT * pgsz;
-    int nBefore;
-    int nAfter;
-    int nDiff;
-
-    if( nQuant>pDb->nTreeLimit ){
-      nQuant = pDb->nTreeLimit;
-    }
-
-    nBefore = lsmTreeSize(pDb);
+    int nBefore = lsmTreeSize(pDb);
     if( bDeleteRange ){
       rc = lsmTreeDelete(pDb, (void *)pKey, nKey, (void *)pVal, nVal);
     }else{
       rc = lsmTreeInsert(pDb, (void *)pKey, nKey, (void *)pVal, nVal);
     }
-
-    nAfter = lsmTreeSize(pDb);
-    nDiff = (nAfter/nQuant) - (nBefore/nQuant);
-    if( rc==LSM_OK && pDb->bAutowork && nDiff!=0 ){
-      rc = lsmSortedAutoWork(pDb, nDiff * LSM_AUTOWORK_QUANT);
+    if( rc==LSM_OK ){
+      rc = dbAutoWork(pDb, nBefore);
     }
   }
 
@@ -749,6 +955,146 @@ int lsm_delete_range(
   return rc;
 }
 
+/*
+** A write batch. Buffer buf contains the serialized operations, in the
+** format described in lsm_tree.c (see treeBatchParse()).
+*/
+struct lsm_batch {
+  lsm_db *pDb;                    /* Database handle batch belongs to */
+  int nOp;                        /* Number of operations in batch */
+  LsmString buf;                  /* Serialized operations */
+};
+
+/*
+** Allocate a new, empty, write batch.
+*/
+int lsm_batch_new(lsm_db *pDb, lsm_batch **ppBatch){
+  int rc = LSM_OK;
+  lsm_batch *pNew;
+
+  pNew = (lsm_batch *)lsmMallocZeroRc(pDb->pEnv, sizeof(lsm_batch), &rc);
+  if( pNew ){
+    pNew->pDb = pDb;
+    lsmStringInit(&pNew->buf, pDb->pEnv);
+  }
+  *ppBatch = pNew;
+  return rc;
+}
+
+/*
+** Append an operation to write batch p. If nVal is negative, no value
+** is appended (this is used for LSM_BATCH_DELETE operations).
+*/
+static int batchAppend(
+  lsm_batch *p,                   /* Write batch */
+  int eOp,                        /* LSM_BATCH_XXX constant */
+  const void *pKey, int nKey,     /* Key (or start of range) */
+  const void *pVal, int nVal      /* Value (or end of range) */
+){
+  int rc;
+  int nReq = 1 + lsmVarintLen32(nKey) + nKey;
+  if( nVal>=0 ) nReq += lsmVarintLen32(nVal) + nVal;
+
+  rc = lsmStringExtend(&p->buf, nReq);
+  if( rc==LSM_OK ){
+    u8 *a = (u8 *)&p->buf.z[p->buf.n];
+    *(a++) = (u8)eOp;
+    a += lsmVarintPut32(a, nKey);
+    if( nVal>=0 ) a += lsmVarintPut32(a, nVal);
+    memcpy(a, pKey, nKey);
+    a += nKey;
+    if( nVal>0 ){
+      memcpy(a, pVal, nVal);
+      a += nVal;
+    }
+    p->buf.n = (a - (u8 *)p->buf.z);
+    p->nOp++;
+  }
+  return rc;
+}
+
+int lsm_batch_insert(
+  lsm_batch *p,                   /* Write batch */
+  const void *pKey, int nKey,     /* Key to write */
+  const void *pVal, int nVal      /* Value to write */
+){
+  if( nVal<0 ) return lsm_batch_delete(p, pKey, nKey);
+  return batchAppend(p, LSM_BATCH_INSERT, pKey, nKey, pVal, nVal);
+}
+
+int lsm_batch_delete(lsm_batch *p, const void *pKey, int nKey){
+  return batchAppend(p, LSM_BATCH_DELETE, pKey, nKey, 0, -1);
+}
+
+int lsm_batch_delete_range(
+  lsm_batch *p,                   /* Write batch */
+  const void *pKey1, int nKey1,   /* Lower bound of range to delete */
+  const void *pKey2, int nKey2    /* Upper bound of range to delete */
+){
+  int rc = LSM_OK;
+  if( p->pDb->xCmp((void *)pKey1, nKey1, (void *)pKey2, nKey2)<0 ){
+    rc = batchAppend(p, LSM_BATCH_DELETE_RANGE, pKey1, nKey1, pKey2, nKey2);
+  }
+  return rc;
+}
+
+void lsm_batch_reset(lsm_batch *p){
+  if( p ){
+    p->buf.n = 0;
+    p->nOp = 0;
+  }
+}
+
+void lsm_batch_free(lsm_batch *p){
+  if( p ){
+    lsm_env *pEnv = p->pDb->pEnv;
+    lsmStringClear(&p->buf);
+    lsmFree(pEnv, p);
+  }
+}
+
+/*
+** Write the contents of a write batch to the database. The batch is
+** written to the log as a single record, then applied to the in-memory
+** tree as a single nested transaction.
+*/
+int lsm_write_batch(lsm_db *pDb, lsm_batch *pBatch){
+  int rc = LSM_OK;                /* Return code */
+  int iLevel = pDb->nTransOpen;   /* Transaction level on entry */
+
+  if( pBatch->pDb!=pDb ) return LSM_MISUSE_BKPT;
+  if( pBatch->nOp==0 ) return LSM_OK;
+
+  rc = lsm_begin(pDb, iLevel+1);
+  if( rc==LSM_OK ){
+    rc = lsmLogBatch(pDb, pBatch->buf.z, pBatch->buf.n);
+  }
+
+  lsmSortedSaveTreeCursors(pDb);
+
+  if( rc==LSM_OK ){
+    int nBefore = lsmTreeSize(pDb);
+    rc = lsmTreeInsertBatch(pDb, (u8 *)pBatch->buf.z, pBatch->buf.n);
+    if( rc==LSM_OK ){
+      rc = dbAutoWork(pDb, nBefore);
+    }
+  }
+
+  /* Commit the nested transaction opened above into the enclosing one (or
+  ** to disk, if there is no enclosing transaction). Or, if an error has
+  ** occurred, roll it back.  */
+  if( rc==LSM_OK ){
+    rc = lsm_commit(pDb, iLevel);
+  }else if( iLevel==0 ){
+    lsm_rollback(pDb, 0);
+  }else{
+    lsm_rollback(pDb, iLevel+1);
+    lsm_commit(pDb, iLevel);
+  }
+
+  return rc;
+}
+
 /*
 ** Open a new cursor handle. 
 **
@@ -810,6 +1156,35 @@ int lsm_csr_seek(lsm_cursor *pCsr, const void *pKey, int nKey, int eSeek){
   return lsmMCursorSeek((MultiCursor *)pCsr, 0, (void *)pKey, nKey, eSeek);
 }
 
+int lsm_csr_multiseek(
+  lsm_cursor *pCsr, 
+  int nKey, const void **apKey, const int *anKey,
+  int (*xFound)(void *, int),
+  void *pCtx
+){
+  MultiCursor *p = (MultiCursor *)pCsr;
+  int rc = LSM_OK;
+  int i;
+
+  for(i=0; rc==LSM_OK && i<nKey; i++){
+    rc = lsmMCursorSeek(p, 0, (void *)apKey[i], anKey[i], LSM_SEEK_EQ);
+    if( rc==LSM_OK && lsmMCursorValid(p) ){
+      rc = xFound(pCtx, i);
+    }
+  }
+  return rc;
+}
+
+int lsm_csr_set_bounds(
+  lsm_cursor *pCsr, 
+  const void *pLower, int nLower,
+  const void *pUpper, int nUpper
+){
+  return lsmMCursorSetBounds(
+      (MultiCursor *)pCsr, pLower, nLower, pUpper, nUpper
+  );
+}
+
 int lsm_csr_next(lsm_cursor *pCsr){
   return lsmMCursorNext((MultiCursor *)pCsr);
 }
@@ -923,12 +1298,22 @@ int lsm_commit(lsm_db *pDb, int iLevel){
 
   if( iLevel<pDb->nTransOpen ){
     if( iLevel==0 ){
-      /* Commit the transaction to disk. */
+      i64 iSeq = 0;               /* Group commit sequence number */
+
+      /* Commit the transaction to disk. If group commit is enabled, the
+      ** log is synced after the write lock has been released.  */
       if( rc==LSM_OK ) rc = lsmLogCommit(pDb);
       if( rc==LSM_OK && pDb->eSafety==LSM_SAFETY_FULL ){
-        rc = lsmFsSyncLog(pDb->pFS);
+        if( pDb->nGroupCommit>0 && pDb->bUseLog ){
+          rc = lsmDbGroupCommitRegister(pDb, &iSeq);
+        }else{
+          rc = lsmFsSyncLog(pDb->pFS);
+        }
       }
       lsmFinishWriteTrans(pDb, (rc==LSM_OK));
+      if( rc==LSM_OK && iSeq ){
+        rc = lsmDbGroupCommitSync(pDb, iSeq);
+      }
     }
     pDb->nTransOpen = iLevel;
   }
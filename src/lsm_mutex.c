@@ -10,7 +10,7 @@
 **
 *************************************************************************
 **
-** Mutex functions for LSM.
+** Mutex, condition variable and thread functions for LSM.
 */
 #include "lsmInt.h"
 
@@ -86,3 +86,64 @@ int lsmMutexNotHeld(lsm_env *pEnv, lsm_mutex *pMutex){
   return pEnv->xMutexNotHeld ? pEnv->xMutexNotHeld(pMutex) : 1;
 }
 #endif
+
+/*
+** Return true if the environment provides the thread and condition 
+** variable methods required to run background threads.
+*/
+int lsmThreadsAvailable(lsm_env *pEnv){
+  return (pEnv->iVersion>=2 
+       && pEnv->xThreadNew && pEnv->xThreadJoin
+       && pEnv->xCondNew && pEnv->xCondDel 
+       && pEnv->xCondWait && pEnv->xCondBroadcast
+  );
+}
+
+/*
+** Start a new thread that runs xMain(pArg).
+*/
+int lsmThreadNew(
+  lsm_env *pEnv, 
+  void (*xMain)(void *), 
+  void *pArg, 
+  lsm_thread **ppNew
+){
+  return pEnv->xThreadNew(pEnv, xMain, pArg, ppNew);
+}
+
+/*
+** Wait for a thread started by lsmThreadNew() to exit, then free it.
+*/
+void lsmThreadJoin(lsm_env *pEnv, lsm_thread *pThread){
+  if( pThread ) pEnv->xThreadJoin(pThread);
+}
+
+/*
+** Allocate a new condition variable.
+*/
+int lsmCondNew(lsm_env *pEnv, lsm_cond **ppNew){
+  return pEnv->xCondNew(pEnv, ppNew);
+}
+
+/*
+** Free a condition variable allocated by lsmCondNew().
+*/
+void lsmCondDel(lsm_env *pEnv, lsm_cond *pCond){
+  if( pCond ) pEnv->xCondDel(pCond);
+}
+
+/*
+** Atomically release mutex pMutex and wait on condition variable pCond.
+** The mutex is held again when this function returns. The caller must 
+** hold pMutex exactly once.
+*/
+void lsmCondWait(lsm_env *pEnv, lsm_cond *pCond, lsm_mutex *pMutex){
+  pEnv->xCondWait(pCond, pMutex);
+}
+
+/*
+** Wake up all threads waiting on condition variable pCond.
+*/
+void lsmCondBroadcast(lsm_env *pEnv, lsm_cond *pCond){
+  pEnv->xCondBroadcast(pCond);
+}
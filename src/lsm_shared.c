@@ -28,6 +28,9 @@ static struct SharedData {
   Database *pDatabase;            /* Linked list of all Database objects */
 } gShared;
 
+typedef struct BgWork BgWork;
+typedef struct BgThread BgThread;
+
 /*
 ** Database structure. There is one such structure for each distinct 
 ** database accessed by this process. They are stored in the singly linked 
@@ -39,6 +42,31 @@ static struct SharedData {
 **   In multi-process mode, this file descriptor is used to obtain locks 
 **   and to access shared-memory. In single process mode, its only job is
 **   to hold the exclusive lock on the file.
+**
+** pClient:
+**   The client snapshot most recently deserialized by any connection to
+**   this database within this process (see lsmClientSnapshotLoad()). 
+**   Client snapshots are never modified once they have been deserialized, 
+**   except for data that is loaded from the database file on demand (run
+**   trailers and merge split-keys - which are only accessed while holding
+**   pSnapMutex). So a connection that loads a checkpoint with the same id
+**   and checksum as this snapshot shares it instead of deserializing the
+**   checkpoint again. Snapshot.nRef counts the connections using the
+**   snapshot, plus one for this pointer.
+**
+** freeCache:
+**   A copy of the entire free block list (excluding entries that have been
+**   deleted) as seen by the worker snapshot with id iFreeId and checksum
+**   aFreeCksum[], sorted by block number. If it is valid for the current
+**   worker snapshot, lsmWalkFreelist() iterates through this array instead
+**   of walking the part of the free block list stored in the LSM, which 
+**   requires a cursor to be opened on all levels of the database. It is 
+**   kept up to date by freelistAppend(), and the snapshot it is valid for
+**   updated each time the worker snapshot is saved (lsmFreelistCacheSave()).
+**   bFreeDirty is set if the worker has modified the free block list since 
+**   the snapshot was last saved. If it is still set when the next worker
+**   snapshot is loaded, the modifications were discarded, so the cache is
+**   discarded as well.
 **   
 */
 struct Database {
@@ -51,12 +79,41 @@ struct Database {
   /* Protected by the local mutex (pClientMutex) */
   int bReadonly;                  /* True if Database.pFile is read-only */
   int bMultiProc;                 /* True if running in multi-process mode */
+  int eDirectIo;                  /* LSM_DIRECT_IO_* value for all clients */
   lsm_file *pFile;                /* Used for locks/shm in multi-proc mode */
   LsmFile *pLsmFile;              /* List of deferred closes */
   lsm_mutex *pClientMutex;        /* Protects the apShmChunk[] and pConn */
   int nShmChunk;                  /* Number of entries in apShmChunk[] array */
   void **apShmChunk;              /* Array of "shared" memory regions */
   lsm_db *pConn;                  /* List of connections to this db. */
+
+  /* Page cache shared by connections. Has its own mutexes */
+  PageCache *pCache;              /* Shared page cache */
+
+  /* Cached free block list. Protected by the WORKER lock */
+  Freelist freeCache;             /* Copy of free block list (or empty) */
+  int bFreeCache;                 /* True if freeCache has been populated */
+  int bFreeDirty;                 /* True if modified since last saved */
+  i64 iFreeId;                    /* Id of worker snapshot freeCache is for */
+  u32 aFreeCksum[2];              /* Checksum of the same snapshot */
+
+  /* Shared client snapshot. Protected by pSnapMutex */
+  lsm_mutex *pSnapMutex;          /* Protects pClient and Snapshot.nRef */
+  Snapshot *pClient;              /* Most recent client snapshot (or NULL) */
+
+  /* Protected by pBgMutex */
+  lsm_mutex *pBgMutex;            /* Protects pBg. Allocated on demand */
+  BgWork *pBg;                    /* Background threads (or NULL) */
+
+  /* Group commit state. Protected by pCommitMutex */
+  lsm_mutex *pCommitMutex;        /* Allocated on demand */
+  lsm_cond *pCommitCond;          /* Broadcast after each group sync */
+  i64 iCommitSeq;                 /* Sequence number of most recent commit */
+  i64 iSyncSeq;                   /* Commits up to this one are synced */
+  int bSyncing;                   /* True while a group sync is running */
+  int nSyncWait;                  /* Connections waiting for a group sync */
+  int nGroupSync;                 /* Total number of group syncs */
+  int nGroupCommit;               /* Commits made durable by group syncs */
 };
 
 /*
@@ -91,6 +148,97 @@ static void assertNotInFreelist(Freelist *p, int iBlk){
 # define assertNotInFreelist(x,y)
 #endif
 
+/*
+** Return true if the cached free block list (Database.freeCache) is valid
+** for the worker snapshot currently held by connection pDb.
+*/
+int lsmFreelistCacheOk(lsm_db *pDb){
+  Database *p = pDb->pDatabase;
+  Snapshot *pWorker = pDb->pWorker;
+  return ( p->bFreeCache 
+        && p->iFreeId==pWorker->iId
+        && p->aFreeCksum[0]==pWorker->aCksum[0]
+        && p->aFreeCksum[1]==pWorker->aCksum[1]
+  );
+}
+
+/*
+** This is called after the worker snapshot held by connection pDb has
+** been saved to shared-memory. If parameter bCache is true, then the 
+** cached free block list was valid for the worker snapshot before it was
+** saved. In this case, mark it as valid for the saved snapshot.
+*/
+void lsmFreelistCacheSave(lsm_db *pDb, int bCache){
+  Database *p = pDb->pDatabase;
+
+  if( bCache ){
+    p->iFreeId = pDb->pWorker->iId;
+    p->aFreeCksum[0] = pDb->pWorker->aCksum[0];
+    p->aFreeCksum[1] = pDb->pWorker->aCksum[1];
+  }
+  p->bFreeDirty = 0;
+}
+
+/*
+** This is called each time a worker snapshot is loaded from shared-memory.
+** If the previous worker modified the free block list but did not save
+** its snapshot, discard the cached free block list.
+*/
+static void freelistCacheCheck(lsm_db *pDb){
+  Database *p = pDb->pDatabase;
+  if( p->bFreeDirty ){
+    p->bFreeCache = 0;
+    p->bFreeDirty = 0;
+  }
+}
+
+/*
+** Set the entry for block iBlk in the cached free block list to iId. Or,
+** if iId is -1, remove block iBlk from the list. Return LSM_OK if 
+** successful, or LSM_NOMEM if an OOM error occurs.
+*/
+static int freelistCacheSet(lsm_env *pEnv, Freelist *p, int iBlk, i64 iId){
+  int iMin = 0;
+  int iMax = p->nEntry;
+
+  /* Set iMin to the index of the first entry with iBlk>=iBlk */
+  while( iMin<iMax ){
+    int iMid = (iMin + iMax) / 2;
+    if( p->aEntry[iMid].iBlk<iBlk ){
+      iMin = iMid+1;
+    }else{
+      iMax = iMid;
+    }
+  }
+
+  if( iMin<p->nEntry && p->aEntry[iMin].iBlk==iBlk ){
+    if( iId<0 ){
+      int nByte = sizeof(FreelistEntry)*(p->nEntry-iMin-1);
+      memmove(&p->aEntry[iMin], &p->aEntry[iMin+1], nByte);
+      p->nEntry--;
+    }else{
+      p->aEntry[iMin].iId = iId;
+    }
+  }else if( iId>=0 ){
+    if( p->nAlloc==p->nEntry ){
+      int nNew = (p->nAlloc==0 ? 64 : p->nAlloc*2);
+      FreelistEntry *aNew = (FreelistEntry *)lsmRealloc(
+          pEnv, p->aEntry, sizeof(FreelistEntry) * nNew
+      );
+      if( !aNew ) return LSM_NOMEM_BKPT;
+      p->nAlloc = nNew;
+      p->aEntry = aNew;
+    }
+    memmove(&p->aEntry[iMin+1], &p->aEntry[iMin], 
+        sizeof(FreelistEntry)*(p->nEntry-iMin)
+    );
+    p->aEntry[iMin].iBlk = iBlk;
+    p->aEntry[iMin].iId = iId;
+    p->nEntry++;
+  }
+  return LSM_OK;
+}
+
 /*
 ** Append an entry to the free-list. If (iId==-1), this is a delete.
 */
@@ -134,6 +282,16 @@ int freelistAppend(lsm_db *db, int iBlk, i64 iId){
     p->nEntry++;
   }
 
+  /* Update the cached free block list, if it is valid. If an OOM occurs,
+  ** discard the cache instead of returning an error.  */
+  db->pDatabase->bFreeDirty = 1;
+  if( lsmFreelistCacheOk(db) ){
+    Database *pDatabase = db->pDatabase;
+    if( freelistCacheSet(pEnv, &pDatabase->freeCache, iBlk, iId) ){
+      pDatabase->bFreeCache = 0;
+    }
+  }
+
   return LSM_OK;
 }
 
@@ -145,7 +303,18 @@ static void freeDatabase(lsm_env *pEnv, Database *p){
   assert( holdingGlobalMutex(pEnv) );
   if( p ){
     /* Free the mutexes */
+    assert( p->pBg==0 );
     lsmMutexDel(pEnv, p->pClientMutex);
+    lsmMutexDel(pEnv, p->pSnapMutex);
+    lsmMutexDel(pEnv, p->pBgMutex);
+    lsmMutexDel(pEnv, p->pCommitMutex);
+    lsmCondDel(pEnv, p->pCommitCond);
+
+    /* Free the shared page cache and client snapshot */
+    lsmFsCacheFree(pEnv, p->pCache);
+    assert( p->pClient==0 || p->pClient->nRef==1 );
+    lsmFreeSnapshot(pEnv, p->pClient);
+    lsmFree(pEnv, p->freeCache.aEntry);
 
     if( p->pFile ){
       lsmEnvClose(pEnv, p->pFile);
@@ -202,11 +371,17 @@ static int dbTruncate(lsm_db *pDb, i64 iInUse){
 }
 
 
+static int freelistWalkAll(lsm_db *, int, int (*)(void *, int, i64), void *);
+
 /*
 ** This function is called during database shutdown (when the number of
 ** connections drops from one to zero). It truncates the database file
 ** to as small a size as possible without truncating away any blocks that
 ** contain data.
+**
+** The free block list is read directly from the database instead of via
+** the cached copy (see lsmWalkFreelist()). Only the last few entries are 
+** required, and the Database object is about to be freed anyway.
 */
 static int dbTruncateFile(lsm_db *pDb){
   int rc;
@@ -214,6 +389,7 @@ static int dbTruncateFile(lsm_db *pDb){
   assert( pDb->pWorker==0 );
   assert( lsmShmAssertLock(pDb, LSM_LOCK_DMS1, LSM_LOCK_EXCL) );
   rc = lsmCheckpointLoadWorker(pDb);
+  freelistCacheCheck(pDb);
 
   if( rc==LSM_OK ){
     DbTruncateCtx ctx;
@@ -223,7 +399,7 @@ static int dbTruncateFile(lsm_db *pDb){
     ** contains data. */
     ctx.nBlock = pDb->pWorker->nBlock;
     ctx.iInUse = -1;
-    rc = lsmWalkFreelist(pDb, 1, dbTruncateCb, (void *)&ctx);
+    rc = freelistWalkAll(pDb, 1, dbTruncateCb, (void *)&ctx);
 
     /* If the last block that contains data is not already the last block in
     ** the database file, truncate the database file so that it is. */
@@ -298,10 +474,18 @@ static void doDbDisconnect(lsm_db *pDb){
           Database *p = pDb->pDatabase;
 
           /* The log file may only be deleted if there are no clients 
-          ** read-only clients running rotrans transactions.  */
+          ** read-only clients running rotrans transactions. If 
+          ** LSM_CONFIG_LOG_PREALLOC is set, it is reset instead of deleted,
+          ** so that the space allocated to it may be reused when the db is
+          ** next opened.  */
           rc = lsmDetectRoTrans(pDb, &bRotrans);
           if( rc==LSM_OK && bRotrans==0 ){
-            lsmFsCloseAndDeleteLog(pDb->pFS);
+            if( pDb->nLogPrealloc ){
+              i64 iOff = (lsmCheckpointLogOffset(pDb->pShmhdr->aSnap1) >> 1);
+              lsmFsCloseAndResetLog(pDb->pFS, iOff);
+            }else{
+              lsmFsCloseAndDeleteLog(pDb->pFS);
+            }
           }
 
           /* The database may only be truncated if there exist no read-only
@@ -456,14 +640,22 @@ int lsmDbDatabaseConnect(
       p = (Database *)lsmMallocZeroRc(pEnv, sizeof(Database)+nName+1, &rc);
 
       /* If the allocation was successful, fill in other fields and
-      ** allocate the client mutex. */ 
+      ** allocate the client and snapshot mutexes. */ 
       if( rc==LSM_OK ){
         p->bMultiProc = pDb->bMultiProc;
+        p->eDirectIo = pDb->eDirectIo;
         p->zName = (char *)&p[1];
         p->nName = nName;
         memcpy((void *)p->zName, zName, nName+1);
         rc = lsmMutexNew(pEnv, &p->pClientMutex);
       }
+      if( rc==LSM_OK ){
+        rc = lsmMutexNew(pEnv, &p->pSnapMutex);
+      }
+      if( rc==LSM_OK ){
+        int bAlign = (p->eDirectIo!=LSM_DIRECT_IO_OFF);
+        rc = lsmFsCacheNew(pEnv, bAlign, &p->pCache);
+      }
 
       /* If nothing has gone wrong so far, open the shared fd. And if that
       ** succeeds and this connection requested single-process mode, 
@@ -532,6 +724,14 @@ static void dbDeferClose(lsm_db *pDb){
   }
 }
 
+/*
+** Return a pointer to the page cache shared by all connections to the
+** database that connection db is connected to.
+*/
+PageCache *lsmDbPageCache(lsm_db *db){
+  return db->pDatabase->pCache;
+}
+
 LsmFile *lsmDbRecycleFd(lsm_db *db){
   LsmFile *pRet;
   Database *p = db->pDatabase;
@@ -594,6 +794,445 @@ void lsmDbDatabaseRelease(lsm_db *pDb){
   }
 }
 
+/*************************************************************************
+** Background work and checkpoint threads (LSM_CONFIG_BACKGROUND_WORK).
+**
+** Each Database object may have a single BgWork object associated with it.
+** It is created by the first connection that requests background work
+** (in lsm_open()) and deleted when the last such connection is closed. The
+** BgWork object owns up to two threads, each with a private connection to
+** the database:
+**
+**   * The worker thread calls lsm_work() each time it is signalled that
+**     an in-memory tree has filled up, and keeps calling it until there
+**     is no more work to do. Its connection does not perform 
+**     auto-checkpoints.
+**
+**   * The checkpointer thread runs after each call to lsm_work() made by
+**     the worker thread. It checkpoints the database if more than 
+**     BgWork.nCkpt bytes have been written to the database file since the
+**     last checkpoint.
+**
+** All fields of the BgWork object are protected by Database.pBgMutex. 
+** BgWork.pCond is broadcast each time any of them is modified, waking both
+** threads and any writers blocked in lsmDbBgSignal().
+*/
+struct BgThread {
+  lsm_db *db;                     /* Private connection used by thread */
+  lsm_thread *pThread;            /* Thread handle */
+  int bPending;                   /* True if there may be work to do */
+  int (*xWork)(BgWork *, int *); /* Do one unit of work */
+  BgWork *pBg;                    /* BgWork object this thread belongs to */
+};
+
+struct BgWork {
+  lsm_env *pEnv;                  /* Environment used by threads */
+  lsm_mutex *pMutex;              /* Database.pBgMutex */
+  lsm_cond *pCond;                /* Broadcast whenever state changes */
+  int nRef;                       /* Number of connections using threads */
+  int bShutdown;                  /* Set to true to stop threads */
+  u32 nReq;                       /* Number of requests made of worker */
+  u32 nDone;                      /* Value of nReq when last work started */
+  i64 nCkpt;                      /* Auto-checkpoint threshold in bytes */
+  BgThread worker;                /* Worker thread */
+  BgThread ckpter;                /* Checkpointer thread */
+};
+
+/*
+** Maximum amount of data (in KB) written by each call to lsm_work() made
+** by the worker thread. Since lsm_work() always flushes any old in-memory
+** tree to disk before merging existing segments, writers waiting for the 
+** worker to catch up are released after the first such call. Between 
+** calls the worker also checks if it has been asked to shut down.
+*/
+#define LSM_BG_WORK_KB 256
+
+/*
+** Call lsm_work() once on the worker thread connection. Set *pbMore to
+** true if any data was written (and so there may be more work to do).
+*/
+static int bgDoWork(BgWork *p, int *pbMore){
+  int nWrite = 0;
+  int rc;
+
+  rc = lsm_work(p->worker.db, 0, LSM_BG_WORK_KB, &nWrite);
+  *pbMore = (rc==LSM_OK && nWrite>0);
+  return rc;
+}
+
+/*
+** Checkpoint the database using the checkpointer thread connection if
+** enough data has been written to the database file since the most
+** recent checkpoint.
+*/
+static int bgDoCheckpoint(BgWork *p, int *pbMore){
+  lsm_db *db = p->ckpter.db;
+  int nKB = 0;
+  int rc;
+
+  *pbMore = 0;
+  rc = lsm_info(db, LSM_INFO_CHECKPOINT_SIZE, &nKB);
+  if( rc==LSM_OK && ((i64)nKB * 1024)>=p->nCkpt ){
+    rc = lsm_checkpoint(db, 0);
+  }
+  return rc;
+}
+
+/*
+** Main routine for both background threads. 
+*/
+static void bgThreadMain(void *pCtx){
+  BgThread *pThread = (BgThread *)pCtx;
+  BgWork *p = pThread->pBg;
+  lsm_env *pEnv = p->pEnv;
+
+  lsmMutexEnter(pEnv, p->pMutex);
+  while( p->bShutdown==0 ){
+    if( pThread->bPending ){
+      u32 nReq = p->nReq;
+      int bMore = 0;
+      int rc;
+
+      pThread->bPending = 0;
+      lsmMutexLeave(pEnv, p->pMutex);
+      rc = pThread->xWork(p, &bMore);
+
+      /* LSM_BUSY just means some other connection is already doing the 
+      ** work (or holds a lock that prevents it). Any other error is 
+      ** passed to the log callback.  */
+      if( rc!=LSM_OK && rc!=LSM_BUSY ){
+        lsmLogMessage(pThread->db, rc, "background %s thread error", 
+            (pThread==&p->worker ? "work" : "checkpoint")
+        );
+      }
+      lsmMutexEnter(pEnv, p->pMutex);
+      if( pThread==&p->worker ){
+        p->nDone = nReq;
+        p->ckpter.bPending = 1;
+      }
+      if( bMore ) pThread->bPending = 1;
+      lsmCondBroadcast(pEnv, p->pCond);
+    }else{
+      lsmCondWait(pEnv, p->pCond, p->pMutex);
+    }
+  }
+  lsmMutexLeave(pEnv, p->pMutex);
+}
+
+/*
+** Open a private connection for background thread pThread and start the 
+** thread. Connection pDb is the connection that requested the threads. The
+** new connection copies each option of pDb that affects merging, flushing,
+** checkpointing or the files and page cache used to do so. 
+**
+** The following are deliberately not copied:
+**
+**   * LSM_CONFIG_AUTOWORK and LSM_CONFIG_AUTOCHECKPOINT. The private 
+**     connection never performs auto-work or auto-checkpoints. Instead the
+**     threads are woken as described for LSM_CONFIG_BACKGROUND_WORK.
+**
+**   * LSM_CONFIG_BACKGROUND_WORK itself, LSM_CONFIG_READONLY and 
+**     LSM_CONFIG_GROUP_COMMIT. The private connection does not start 
+**     threads of its own, must be able to write to the database and never
+**     commits a write transaction.
+**
+**   * The work hook (lsm_config_work_hook()). It is passed the connection
+**     that did the work, which the application has no other access to.
+*/
+static int bgThreadStart(
+  lsm_db *pDb,                    /* Connection requesting threads */
+  BgWork *p,                      /* BgWork object */
+  BgThread *pThread,              /* Thread to start */
+  int (*xWork)(BgWork *, int *)   /* Work function for thread */
+){
+  lsm_db *db = 0;
+  int rc;
+
+  rc = lsm_new(pDb->pEnv, &db);
+  if( rc==LSM_OK ){
+    db->eSafety = pDb->eSafety;
+    db->nMerge = pDb->nMerge;
+    db->nDfltPgsz = pDb->nDfltPgsz;
+    db->nDfltBlksz = pDb->nDfltBlksz;
+    db->nMaxFreelist = pDb->nMaxFreelist;
+    db->bMmap = pDb->bMmap;
+    db->bMultiProc = pDb->bMultiProc;
+    db->bUseLog = pDb->bUseLog;
+    db->nBloomBits = pDb->nBloomBits;
+    db->nPrefixRestart = pDb->nPrefixRestart;
+    db->nValueThreshold = pDb->nValueThreshold;
+    db->eCompaction = pDb->eCompaction;
+    db->nLevelBase = pDb->nLevelBase;
+    db->nLevelRatio = pDb->nLevelRatio;
+    db->nTreeLimit = pDb->nTreeLimit;
+    db->nMergeRate = pDb->nMergeRate;
+    db->nCkptRate = pDb->nCkptRate;
+    db->nMaxOld = pDb->nMaxOld;
+    db->nCacheSize = pDb->nCacheSize;
+    db->eCachePolicy = pDb->eCachePolicy;
+    db->nReadAhead = pDb->nReadAhead;
+    db->eDirectIo = pDb->eDirectIo;
+    db->nLogPrealloc = pDb->nLogPrealloc;
+    db->xCmp = pDb->xCmp;
+    db->xLog = pDb->xLog;
+    db->pLogCtx = pDb->pLogCtx;
+    db->compress = pDb->compress;
+    db->compress.xFree = 0;
+    db->factory = pDb->factory;
+    db->factory.xFree = 0;
+    db->bAutowork = 0;
+    db->nAutockpt = 0;
+    rc = lsm_open(db, pDb->pDatabase->zName);
+  }
+
+  pThread->db = db;
+  pThread->xWork = xWork;
+  pThread->pBg = p;
+  if( rc==LSM_OK ){
+    rc = lsmThreadNew(pDb->pEnv, bgThreadMain, (void *)pThread, 
+        &pThread->pThread
+    );
+  }
+  return rc;
+}
+
+/*
+** Stop any threads started by BgWork object p, close their connections
+** and free the object itself. The caller must not be holding the 
+** Database.pBgMutex mutex.
+*/
+static void bgWorkFree(lsm_env *pEnv, BgWork *p){
+  if( p ){
+    BgThread *aThread[2];
+    int i;
+
+    if( p->pCond ){
+      lsmMutexEnter(pEnv, p->pMutex);
+      p->bShutdown = 1;
+      lsmCondBroadcast(pEnv, p->pCond);
+      lsmMutexLeave(pEnv, p->pMutex);
+    }
+
+    aThread[0] = &p->worker;
+    aThread[1] = &p->ckpter;
+    for(i=0; i<2; i++){
+      lsmThreadJoin(pEnv, aThread[i]->pThread);
+      lsm_close(aThread[i]->db);
+    }
+    lsmCondDel(pEnv, p->pCond);
+    lsmFree(pEnv, p);
+  }
+}
+
+/*
+** Connection pDb has just been opened with LSM_CONFIG_BACKGROUND_WORK set.
+** Start the background threads for its database, or if they have already
+** been started by another connection, add a reference to them. Each 
+** successful call must be matched by a call to lsmDbBgStop().
+*/
+int lsmDbBgStart(lsm_db *pDb){
+  lsm_env *pEnv = pDb->pEnv;
+  Database *p = pDb->pDatabase;
+  BgWork *pNew = 0;
+  int rc = LSM_OK;
+
+  /* Allocate the Database.pBgMutex mutex, if it is not already allocated */
+  lsmMutexEnter(pEnv, p->pClientMutex);
+  if( p->pBgMutex==0 ){
+    rc = lsmMutexNew(pEnv, &p->pBgMutex);
+  }
+  lsmMutexLeave(pEnv, p->pClientMutex);
+  if( rc!=LSM_OK ) return rc;
+
+  lsmMutexEnter(pEnv, p->pBgMutex);
+  if( p->pBg==0 ){
+    pNew = (BgWork *)lsmMallocZeroRc(pEnv, sizeof(BgWork), &rc);
+    if( rc==LSM_OK ){
+      pNew->pEnv = pEnv;
+      pNew->pMutex = p->pBgMutex;
+      pNew->nCkpt = pDb->nAutockpt;
+      rc = lsmCondNew(pEnv, &pNew->pCond);
+    }
+    if( rc==LSM_OK ){
+      rc = bgThreadStart(pDb, pNew, &pNew->worker, bgDoWork);
+    }
+    if( rc==LSM_OK && pNew->nCkpt>0 ){
+      rc = bgThreadStart(pDb, pNew, &pNew->ckpter, bgDoCheckpoint);
+    }
+    if( rc==LSM_OK ){
+      p->pBg = pNew;
+      pNew = 0;
+    }
+  }
+  if( rc==LSM_OK ){
+    p->pBg->nRef++;
+  }
+  lsmMutexLeave(pEnv, p->pBgMutex);
+
+  /* If an error occurred, free any partially constructed BgWork object.
+  ** This must be done without holding pBgMutex, as the threads may need
+  ** to grab it in order to exit.  */
+  bgWorkFree(pEnv, pNew);
+  return rc;
+}
+
+/*
+** Release the reference to the background threads taken by an earlier
+** call to lsmDbBgStart(). If this is the last reference, stop the threads.
+*/
+void lsmDbBgStop(lsm_db *pDb){
+  lsm_env *pEnv = pDb->pEnv;
+  Database *p = pDb->pDatabase;
+  BgWork *pFree = 0;
+
+  lsmMutexEnter(pEnv, p->pBgMutex);
+  assert( p->pBg && p->pBg->nRef>0 );
+  p->pBg->nRef--;
+  if( p->pBg->nRef==0 ){
+    pFree = p->pBg;
+    p->pBg = 0;
+  }
+  lsmMutexLeave(pEnv, p->pBgMutex);
+
+  bgWorkFree(pEnv, pFree);
+}
+
+/*
+** Signal the background worker thread that an in-memory tree is ready
+** to be flushed to disk. If parameter bWait is true, do not return until
+** the worker has completed a call to lsm_work() started after this call 
+** was made.
+*/
+void lsmDbBgSignal(lsm_db *pDb, int bWait){
+  lsm_env *pEnv = pDb->pEnv;
+  Database *p = pDb->pDatabase;
+  BgWork *pBg;
+  u32 nReq;
+
+  lsmMutexEnter(pEnv, p->pBgMutex);
+  pBg = p->pBg;
+  nReq = ++pBg->nReq;
+  pBg->worker.bPending = 1;
+  lsmCondBroadcast(pEnv, pBg->pCond);
+  if( bWait ){
+    while( (int)(pBg->nDone - nReq)<0 ){
+      lsmCondWait(pEnv, pBg->pCond, p->pBgMutex);
+    }
+  }
+  lsmMutexLeave(pEnv, p->pBgMutex);
+}
+
+/*************************************************************************
+** Group commit (LSM_CONFIG_GROUP_COMMIT).
+**
+** Each transaction committed with group commit enabled is assigned a 
+** sequence number while the committing connection still holds the WRITER
+** lock, after its COMMIT record has been written to the log file. Once 
+** the lock has been released, the connection waits until 
+** Database.iSyncSeq is greater than or equal to its sequence number. 
+**
+** If no sync is in progress, the waiting connection becomes the leader.
+** It reads the current value of Database.iCommitSeq, syncs the log file,
+** then sets iSyncSeq to the value read. Since all log data for commits up
+** to that sequence number had been written before the sync started, they
+** are all durable once it has finished.
+*/
+
+/*
+** Assign a group commit sequence number to the transaction that connection
+** pDb has just written to the log file. The caller must be holding the
+** WRITER lock.
+*/
+int lsmDbGroupCommitRegister(lsm_db *pDb, i64 *piSeq){
+  lsm_env *pEnv = pDb->pEnv;
+  Database *p = pDb->pDatabase;
+  int rc = LSM_OK;
+
+  assert( lsmShmAssertLock(pDb, LSM_LOCK_WRITER, LSM_LOCK_EXCL) );
+
+  /* Allocate the mutex and condition variable, if required. */
+  lsmMutexEnter(pEnv, p->pClientMutex);
+  if( p->pCommitMutex==0 ){
+    rc = lsmMutexNew(pEnv, &p->pCommitMutex);
+  }
+  if( rc==LSM_OK && p->pCommitCond==0 ){
+    rc = lsmCondNew(pEnv, &p->pCommitCond);
+  }
+  lsmMutexLeave(pEnv, p->pClientMutex);
+
+  if( rc==LSM_OK ){
+    lsmMutexEnter(pEnv, p->pCommitMutex);
+    *piSeq = ++p->iCommitSeq;
+    lsmMutexLeave(pEnv, p->pCommitMutex);
+  }
+  return rc;
+}
+
+/*
+** Wait until the transaction assigned sequence number iSeq by an earlier
+** call to lsmDbGroupCommitRegister() has been synced to disk, syncing the
+** log file using connection pDb if no other connection is already doing 
+** so.
+*/
+int lsmDbGroupCommitSync(lsm_db *pDb, i64 iSeq){
+  lsm_env *pEnv = pDb->pEnv;
+  Database *p = pDb->pDatabase;
+  int rc = LSM_OK;
+
+  lsmMutexEnter(pEnv, p->pCommitMutex);
+  while( rc==LSM_OK && p->iSyncSeq<iSeq ){
+    if( p->bSyncing ){
+      p->nSyncWait++;
+      lsmCondWait(pEnv, p->pCommitCond, p->pCommitMutex);
+      p->nSyncWait--;
+    }else{
+      i64 iTarget;
+
+      p->bSyncing = 1;
+      if( p->nSyncWait>0 ){
+        /* Other connections are committing concurrently. Give them a 
+        ** chance to add their transactions to this group.  */
+        lsmMutexLeave(pEnv, p->pCommitMutex);
+        lsmEnvSleep(pEnv, pDb->nGroupCommit);
+        lsmMutexEnter(pEnv, p->pCommitMutex);
+      }
+      iTarget = p->iCommitSeq;
+      lsmMutexLeave(pEnv, p->pCommitMutex);
+
+      rc = lsmFsSyncLog(pDb->pFS);
+
+      lsmMutexEnter(pEnv, p->pCommitMutex);
+      p->bSyncing = 0;
+      if( rc==LSM_OK ){
+        p->nGroupSync++;
+        p->nGroupCommit += (int)(iTarget - p->iSyncSeq);
+        p->iSyncSeq = iTarget;
+      }
+      lsmCondBroadcast(pEnv, p->pCommitCond);
+    }
+  }
+  lsmMutexLeave(pEnv, p->pCommitMutex);
+
+  return rc;
+}
+
+/*
+** Implementation of the LSM_INFO_GROUP_COMMIT request.
+*/
+void lsmDbGroupCommitInfo(lsm_db *pDb, int *pnSync, int *pnCommit){
+  lsm_env *pEnv = pDb->pEnv;
+  Database *p = pDb->pDatabase;
+
+  *pnSync = 0;
+  *pnCommit = 0;
+  if( p && p->pCommitMutex ){
+    lsmMutexEnter(pEnv, p->pCommitMutex);
+    *pnSync = p->nGroupSync;
+    *pnCommit = p->nGroupCommit;
+    lsmMutexLeave(pEnv, p->pCommitMutex);
+  }
+}
+
 Level *lsmDbSnapshotLevel(Snapshot *pSnapshot){
   return pSnapshot->pLevel;
 }
@@ -665,8 +1304,11 @@ static int walkFreelistCb(void *pCtx, int iBlk, i64 iSnapshot){
 ** that lsmSortedWalkFreelist() only considers those free-list elements
 ** stored within the LSM. This function also merges in any in-memory 
 ** elements.
+**
+** This function always reads the free block list from the database. See
+** lsmWalkFreelist() for the version that uses the cached copy.
 */
-int lsmWalkFreelist(
+static int freelistWalkAll(
   lsm_db *pDb,                    /* Database handle (must be worker) */
   int bReverse,                   /* True to iterate from largest to smallest */
   int (*x)(void *, int, i64),     /* Callback function */
@@ -724,6 +1366,111 @@ int lsmWalkFreelist(
 }
 
 
+/*
+** Context object and callback used by freelistCacheLoad().
+*/
+typedef struct FreelistCacheCtx FreelistCacheCtx;
+struct FreelistCacheCtx {
+  lsm_env *pEnv;
+  Freelist list;
+  int rc;
+};
+static int freelistCacheLoadCb(void *pCtx, int iBlk, i64 iSnapshot){
+  FreelistCacheCtx *p = (FreelistCacheCtx *)pCtx;
+  assert( p->list.nEntry==0 || p->list.aEntry[p->list.nEntry-1].iBlk<iBlk );
+  p->rc = freelistCacheSet(p->pEnv, &p->list, iBlk, iSnapshot);
+  return (p->rc!=LSM_OK);
+}
+
+/*
+** Populate the cached free block list (Database.freeCache) by reading the
+** entire free block list of the worker snapshot currently held by pDb.
+*/
+static int freelistCacheLoad(lsm_db *pDb){
+  Database *p = pDb->pDatabase;
+  FreelistCacheCtx ctx;
+  int rc;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.pEnv = pDb->pEnv;
+  rc = freelistWalkAll(pDb, 0, freelistCacheLoadCb, (void *)&ctx);
+  if( rc==LSM_OK ) rc = ctx.rc;
+  if( rc==LSM_OK ){
+    lsmFree(pDb->pEnv, p->freeCache.aEntry);
+    p->freeCache = ctx.list;
+    p->bFreeCache = 1;
+    p->iFreeId = pDb->pWorker->iId;
+    p->aFreeCksum[0] = pDb->pWorker->aCksum[0];
+    p->aFreeCksum[1] = pDb->pWorker->aCksum[1];
+  }else{
+    lsmFree(pDb->pEnv, ctx.list.aEntry);
+  }
+  return rc;
+}
+
+#ifdef LSM_DEBUG_EXPENSIVE
+/*
+** Assert that the cached free block list matches the free block list
+** stored in the database.
+*/
+static void assertFreelistCacheOk(lsm_db *pDb){
+  Freelist *pCache = &pDb->pDatabase->freeCache;
+  FreelistCacheCtx ctx;
+  int rc;
+
+  memset(&ctx, 0, sizeof(ctx));
+  ctx.pEnv = pDb->pEnv;
+  rc = freelistWalkAll(pDb, 0, freelistCacheLoadCb, (void *)&ctx);
+  if( rc==LSM_OK && ctx.rc==LSM_OK ){
+    assert( ctx.list.nEntry==pCache->nEntry );
+    assert( ctx.list.nEntry==0 || 0==memcmp(ctx.list.aEntry, pCache->aEntry,
+          sizeof(FreelistEntry) * ctx.list.nEntry
+    ));
+  }
+  lsmFree(pDb->pEnv, ctx.list.aEntry);
+}
+#else
+# define assertFreelistCacheOk(x)
+#endif
+
+/*
+** The database handle passed as the first argument must be the worker
+** connection. This function iterates through the contents of the current
+** free block list, invoking the supplied callback once for each list
+** element, in ascending order of block number (or descending, if bReverse
+** is true). Iteration stops early if the callback returns non-zero.
+**
+** The free block list is read from the cached copy maintained by the
+** Database object. The cache is populated first if it is not valid for
+** the current worker snapshot.
+*/
+int lsmWalkFreelist(
+  lsm_db *pDb,                    /* Database handle (must be worker) */
+  int bReverse,                   /* True to iterate from largest to smallest */
+  int (*x)(void *, int, i64),     /* Callback function */
+  void *pCtx                      /* First argument to pass to callback */
+){
+  Freelist *pCache = &pDb->pDatabase->freeCache;
+  int rc = LSM_OK;
+
+  assert( pDb->pWorker );
+  if( lsmFreelistCacheOk(pDb)==0 ){
+    rc = freelistCacheLoad(pDb);
+  }else{
+    assertFreelistCacheOk(pDb);
+  }
+
+  if( rc==LSM_OK ){
+    int i;
+    for(i=0; i<pCache->nEntry; i++){
+      FreelistEntry *pEntry;
+      pEntry = &pCache->aEntry[bReverse ? (pCache->nEntry-1-i) : i];
+      if( x(pCtx, pEntry->iBlk, pEntry->iId) ) break;
+    }
+  }
+  return rc;
+}
+
 typedef struct FindFreeblockCtx FindFreeblockCtx;
 struct FindFreeblockCtx {
   i64 iInUse;
@@ -841,6 +1588,9 @@ int lsmBlockAllocate(lsm_db *pDb, int iBefore, int *piBlk){
       if( rc==LSM_OK ){
         rc = dbTruncate(pDb, iInUse);
       }
+      if( rc==LSM_OK ){
+        lsmFsCacheReuse(pDb, iRet);
+      }
     }else{
       iRet = ++(p->nBlock);
 #ifdef LSM_LOG_FREELIST
@@ -940,6 +1690,17 @@ int lsmCheckpointWrite(lsm_db *pDb, int bTruncate, u32 *pnWrite){
 
     if( rc==LSM_OK && bDone==0 ){
       int iMeta = (pShm->iMetaPage % 2) + 1;
+      FileSystem *pFS = pDb->pFS;
+      i64 nPg;                    /* Pages written since last checkpoint */
+
+      /* Pages written since the checkpoint currently stored in the database
+      ** file are synced to disk by this checkpoint, along with a meta page.
+      ** Count them against the LSM_CONFIG_CHECKPOINT_RATE limit.  */
+      nPg = (i64)(lsmCheckpointNWrite(pDb->aSnapshot, 0) - nWrite);
+      lsmFsThrottle(pFS, LSM_IO_CHECKPOINT, 
+          nPg * lsmFsPageSize(pFS) + LSM_META_PAGE_SIZE
+      );
+
       if( pDb->eSafety!=LSM_SAFETY_OFF ){
         rc = lsmFsSyncDb(pDb->pFS, nBlock);
       }
@@ -977,6 +1738,10 @@ int lsmBeginWork(lsm_db *pDb){
   /* Deserialize the current worker snapshot */
   if( rc==LSM_OK ){
     rc = lsmCheckpointLoadWorker(pDb);
+    freelistCacheCheck(pDb);
+  }
+  if( rc==LSM_OK ){
+    lsmFsCacheCheck(pDb);
   }
   return rc;
 }
@@ -984,12 +1749,86 @@ int lsmBeginWork(lsm_db *pDb){
 void lsmFreeSnapshot(lsm_env *pEnv, Snapshot *p){
   if( p ){
     lsmSortedFreeLevel(pEnv, p->pLevel);
+    lsmSortedFreeTrailer(pEnv, p->pTrailer);
     lsmFree(pEnv, p->freelist.aEntry);
     lsmFree(pEnv, p->redirect.a);
     lsmFree(pEnv, p);
   }
 }
 
+/*
+** Decrement the reference count of client snapshot pSnap. If it drops
+** to zero, free the snapshot.
+*/
+static void dbSnapshotRelease(lsm_env *pEnv, Database *p, Snapshot *pSnap){
+  if( pSnap ){
+    int nRef;
+    lsmMutexEnter(pEnv, p->pSnapMutex);
+    nRef = --pSnap->nRef;
+    lsmMutexLeave(pEnv, p->pSnapMutex);
+    if( nRef==0 ) lsmFreeSnapshot(pEnv, pSnap);
+  }
+}
+
+/*
+** Set pDb->pClient to a deserialized version of the checkpoint currently
+** stored in pDb->aSnapshot[]. If the snapshot cached by the Database 
+** object was deserialized from the same checkpoint, share it. Otherwise,
+** deserialize the checkpoint and replace the cached snapshot with the 
+** result. Return LSM_OK if successful, or an LSM error code otherwise.
+*/
+int lsmClientSnapshotLoad(lsm_db *pDb){
+  int rc = LSM_OK;
+  Database *p = pDb->pDatabase;
+  Snapshot *pSnap = 0;
+
+  assert( pDb->pClient==0 );
+  lsmMutexEnter(pDb->pEnv, p->pSnapMutex);
+  if( lsmCheckpointSnapshotOk(p->pClient, pDb->aSnapshot) ){
+    pSnap = p->pClient;
+    pSnap->nRef++;
+  }
+  lsmMutexLeave(pDb->pEnv, p->pSnapMutex);
+
+  if( pSnap==0 ){
+    rc = lsmCheckpointDeserialize(pDb, 0, pDb->aSnapshot, &pSnap);
+    if( rc==LSM_OK ){
+      Snapshot *pOld;
+      pSnap->nRef = 2;
+      lsmMutexEnter(pDb->pEnv, p->pSnapMutex);
+      pOld = p->pClient;
+      p->pClient = pSnap;
+      lsmMutexLeave(pDb->pEnv, p->pSnapMutex);
+      dbSnapshotRelease(pDb->pEnv, p, pOld);
+    }
+  }
+
+  pDb->pClient = pSnap;
+  return rc;
+}
+
+/*
+** Release the reference to client snapshot pDb->pClient (if any) and set
+** pDb->pClient to NULL.
+*/
+void lsmClientSnapshotRelease(lsm_db *pDb){
+  if( pDb->pClient ){
+    dbSnapshotRelease(pDb->pEnv, pDb->pDatabase, pDb->pClient);
+    pDb->pClient = 0;
+  }
+}
+
+/*
+** Enter and leave the mutex that must be held to access the parts of a
+** client snapshot that are loaded on demand (see Database.pClient).
+*/
+void lsmClientSnapshotEnter(lsm_db *pDb){
+  lsmMutexEnter(pDb->pEnv, pDb->pDatabase->pSnapMutex);
+}
+void lsmClientSnapshotLeave(lsm_db *pDb){
+  lsmMutexLeave(pDb->pEnv, pDb->pDatabase->pSnapMutex);
+}
+
 /*
 ** Attempt to populate one of the read-lock slots to contain lock values
 ** iLsm/iShm. Or, if such a slot exists already, this function is a no-op.
@@ -1061,6 +1900,10 @@ void lsmFinishWork(lsm_db *pDb, int bFlush, int *pRc){
   int rc = *pRc;
   assert( rc!=0 || pDb->pWorker );
   if( pDb->pWorker ){
+    /* Write out (or, if an error has occurred, discard) any pages still
+    ** in the write batch.  */
+    lsmFsFlushBatch(pDb->pFS, &rc);
+
     /* If no error has occurred, serialize the worker snapshot and write
     ** it to shared memory.  */
     if( rc==LSM_OK ){
@@ -1104,7 +1947,9 @@ int lsmFinishRecovery(lsm_db *pDb){
 **
 ** If the check shows that the current compression are incompatible and there
 ** is a compression factory registered, give it a chance to install new
-** compression routines.
+** compression routines. If there is no factory, or it does not install
+** compatible routines, and the database uses the built-in compression 
+** (LSM_COMPRESSION_LZ), install the built-in routines.
 **
 ** If, after any registered factory is invoked, the compression functions
 ** are still incompatible, return LSM_MISMATCH. Otherwise, LSM_OK.
@@ -1116,6 +1961,14 @@ int lsmCheckCompressionId(lsm_db *pDb, u32 iReq){
       pDb->factory.xFactory(pDb->factory.pCtx, pDb, iReq);
       pDb->bInFactory = 0;
     }
+    if( pDb->compress.iId!=iReq && iReq==LSM_COMPRESSION_LZ ){
+      lsm_compress lz;
+      memset(&lz, 0, sizeof(lsm_compress));
+      lz.iId = LSM_COMPRESSION_LZ;
+      pDb->bInFactory = 1;
+      lsm_config(pDb, LSM_CONFIG_SET_COMPRESSION, &lz);
+      pDb->bInFactory = 0;
+    }
     if( pDb->compress.iId!=iReq ){
       /* Incompatible */
       return LSM_MISMATCH;
@@ -1149,10 +2002,8 @@ int lsmBeginReadTrans(lsm_db *pDb){
     /* Load the database snapshot */
     if( rc==LSM_OK ){
       if( lsmCheckpointClientCacheOk(pDb)==0 ){
-        lsmFreeSnapshot(pDb->pEnv, pDb->pClient);
-        pDb->pClient = 0;
+        lsmClientSnapshotRelease(pDb);
         lsmMCursorFreeCache(pDb);
-        lsmFsPurgeCache(pDb->pFS);
         rc = lsmCheckpointLoad(pDb, &iSnap);
       }else{
         iSnap = 1;
@@ -1174,11 +2025,10 @@ int lsmBeginReadTrans(lsm_db *pDb){
          && lsmCheckpointLoadOk(pDb, iSnap)
         ){
           /* Read lock has been successfully obtained. Deserialize the 
-          ** checkpoint just loaded. TODO: This will be removed after 
-          ** lsm_sorted.c is changed to work directly from the serialized
-          ** version of the snapshot.  */
+          ** checkpoint just loaded, or share the copy already deserialized
+          ** by another connection.  */
           if( pDb->pClient==0 ){
-            rc = lsmCheckpointDeserialize(pDb, 0, pDb->aSnapshot,&pDb->pClient);
+            rc = lsmClientSnapshotLoad(pDb);
           }
           assert( (rc==LSM_OK)==(pDb->pClient!=0) );
           assert( pDb->iReader>=0 );
@@ -1200,11 +2050,11 @@ int lsmBeginReadTrans(lsm_db *pDb){
 #if 0
 if( rc==LSM_OK && pDb->pClient ){
   fprintf(stderr, 
-      "reading %p: snapshot:%d used-shmid:%d trans-id:%d iOldShmid=%d\n",
+      "reading %p: snapshot:%d used-shmid:%d trans-id:%d nOld=%d\n",
       (void *)pDb,
       (int)pDb->pClient->iId, (int)pDb->treehdr.iUsedShmid, 
       (int)pDb->treehdr.root.iTransId,
-      (int)pDb->treehdr.iOldShmid
+      (int)pDb->treehdr.nOld
   );
 }
 #endif
@@ -1213,6 +2063,11 @@ if( rc==LSM_OK && pDb->pClient ){
   if( rc==LSM_OK ){
     rc = lsmShmCacheChunks(pDb, pDb->treehdr.nChunk);
   }
+  if( rc==LSM_OK && pDb->iReader>=0 ){
+    /* Now that the read-lock is held, discard the contents of the shared
+    ** page cache if a block has been reused since it was last checked. */
+    lsmFsCacheCheck(pDb);
+  }
   if( rc!=LSM_OK ){
     dbReleaseReadlock(pDb);
   }
@@ -1282,6 +2137,7 @@ int lsmBeginRoTrans(lsm_db *db){
         if( rc==LSM_OK ){
           db->pShmhdr = (ShmHeader *)db->apShm[0];
           memset(db->pShmhdr, 0, sizeof(ShmHeader));
+          lsmFsPurgeCache(db->pFS);
           rc = lsmCheckpointRecover(db);
           if( rc==LSM_OK ){
             rc = lsmLogRecover(db);
@@ -1379,8 +2235,7 @@ int lsmBeginWriteTrans(lsm_db *pDb){
     TreeHeader *p = &pDb->treehdr;
     pShm->bWriter = 1;
     p->root.iTransId++;
-    if( lsmTreeHasOld(pDb) && p->iOldLog==pDb->pClient->iLogOff ){
-      lsmTreeDiscardOld(pDb);
+    if( lsmTreeDiscardFlushed(pDb, pDb->pClient->iLogOff) ){
       pDb->bDiscardOld = 1;
     }
   }else{
@@ -1406,16 +2261,21 @@ int lsmBeginWriteTrans(lsm_db *pDb){
 int lsmFinishWriteTrans(lsm_db *pDb, int bCommit){
   int rc = LSM_OK;
   int bFlush = 0;
+  int bWait = 0;
 
   lsmLogEnd(pDb, bCommit);
   if( rc==LSM_OK && bCommit && lsmTreeSize(pDb)>pDb->nTreeLimit ){
     bFlush = 1;
-    lsmTreeMakeOld(pDb);
+
+    /* If the queue of old trees waiting to be flushed is already full, the
+    ** live tree cannot be marked as old. If background threads are in
+    ** use, this writer waits for the worker thread to catch up.  */
+    bWait = (lsmTreeMakeOld(pDb)==0);
   }
   lsmTreeEndTransaction(pDb, bCommit);
 
   if( rc==LSM_OK ){
-    if( bFlush && pDb->bAutowork ){
+    if( bFlush && pDb->bAutowork && pDb->bBgWork==0 ){
       rc = lsmSortedAutoWork(pDb, 1);
     }else if( bCommit && pDb->bDiscardOld ){
       rc = dbSetReadLock(pDb, pDb->pClient->iId, pDb->treehdr.iUsedShmid);
@@ -1424,7 +2284,9 @@ int lsmFinishWriteTrans(lsm_db *pDb, int bCommit){
   pDb->bDiscardOld = 0;
   lsmShmLock(pDb, LSM_LOCK_WRITER, LSM_LOCK_UNLOCK, 0);
 
-  if( bFlush && pDb->bAutowork==0 && pDb->xWork ){
+  if( bFlush && pDb->bBgWork ){
+    lsmDbBgSignal(pDb, bWait);
+  }else if( bFlush && pDb->bAutowork==0 && pDb->xWork ){
     pDb->xWork(pDb, pDb->pWorkCtx);
   }
   return rc;
@@ -1618,6 +2480,15 @@ int lsmDbMultiProc(lsm_db *pDb){
   return pDb->pDatabase && pDb->pDatabase->bMultiProc;
 }
 
+/*
+** Return the LSM_DIRECT_IO_* value in effect for the database that 
+** connection pDb is connected to. This is the value configured by the
+** first connection to open the database within this process. 
+*/
+int lsmDbDirectIo(lsm_db *pDb){
+  return pDb->pDatabase ? pDb->pDatabase->eDirectIo : LSM_DIRECT_IO_OFF;
+}
+
 
 /*************************************************************************
 **************************************************************************
@@ -65,6 +65,88 @@
 **
 **   Finally, the blob of data containing the key, and for LSM_INSERT
 **   records, the value as well.
+**
+**   If the LSM_VALUEREF flag is set (LSM_INSERT records only), the value 
+**   stored in the record is not the user value itself, but a reference to
+**   it within a value segment. See VALUE SEGMENTS below.
+**
+** PREFIX COMPRESSION:
+**
+**   If LSM_CONFIG_PREFIX_COMPRESSION is set to N when a page is written, 
+**   the SEGMENT_PREFIX_FLAG bit is set in its footer flags field and N is
+**   stored in the most significant byte of the same field. Each record on
+**   such a page has an extra varint field, following the pointer, that 
+**   contains the number of leading bytes its key shares with the key of 
+**   the previous record on the page (nPrefix). The key size field that 
+**   follows it is the size of the remaining suffix of the key, and only
+**   the suffix is stored in the record body. 
+**
+**   Every N'th record on the page, starting with the first, is a "restart
+**   point" with nPrefix set to 0. So a key may always be reconstructed by
+**   reading forward from the nearest restart point at or before it. The 
+**   page may also contain other records for which nPrefix is 0. 
+**
+**   B-tree pages and run trailers are never prefix compressed.
+**
+** RUN TRAILERS:
+**
+**   When a sorted run is completed, a trailer is appended to it, following
+**   any b-tree pages. Trailer pages contain no records (N==0) and have the
+**   SEGMENT_TRAILER_FLAG bit set in the footer flags field. So code that
+**   iterates through a run skips them in the same way as the second and
+**   subsequent pages of an oversized record.
+**
+**   The first page of the trailer begins with a 16 byte header containing
+**   the following 32-bit big-endian integers:
+**
+**     * Size of the bloom filter bitmap in bytes (or 0).
+**     * Number of bloom filter hash functions (or 0).
+**     * Size of the smallest user key in the run in bytes.
+**     * Size of the largest user key in the run in bytes.
+**
+**   The header is followed by the smallest and largest user keys in the
+**   run, then by the bloom filter bitmap, continuing onto as many 
+**   subsequent pages as required. If the run contains no user keys, both
+**   key size fields are set to 0xFFFFFFFF and no keys are stored. The 
+**   pointer field in the footer of the final trailer page is set to the
+**   page number of the first, or to zero if the trailer fits on a single
+**   page. This allows the trailer to be located starting from the last 
+**   page of the run, the page number of which is stored in each checkpoint.
+**
+**   Records that are only separator keys, copied from the b-tree of the
+**   next level, are ignored when determining the smallest and largest keys.
+**   Such records are only used to find fraction cascade pointers, and a 
+**   run is never skipped while the next level still depends on them.
+**
+**   A bloom filter containing all user keys in the run is only written if
+**   LSM_CONFIG_BLOOM is set when the run is completed, and never for runs
+**   that contain range-delete markers.
+**
+** VALUE SEGMENTS:
+**
+**   If LSM_CONFIG_VALUE_THRESHOLD is set to N when a sorted run is written,
+**   each user value larger than N bytes is appended to the active value 
+**   segment instead of being stored in the run. Value segments are chains
+**   of pages within the database file, allocated in the same way as sorted
+**   runs, and are listed in the checkpoint (see lsm_ckpt.c). Each value
+**   segment page contains no records (N==0) and has the SEGMENT_VALUE_FLAG
+**   bit set in the footer flags field. Values are stored end to end in the
+**   data areas of the pages, and may span pages. The record in the sorted
+**   run has the LSM_VALUEREF flag set, and its value is a reference made
+**   up of the following varints:
+**
+**     * The first page of the value segment (identifies the segment).
+**     * The page on which the value starts.
+**     * The offset within that page at which the value starts.
+**     * The size of the value in bytes.
+**
+**   When a record with the LSM_VALUEREF flag set is merged, only the 
+**   reference is copied. The live byte count of each value segment is 
+**   increased as references to it are written and decreased as the
+**   records containing them are consumed by merges. Once the count for a
+**   value segment drops to zero, it is deleted. If it drops below half the
+**   size of a segment other than the active one, merges copy the remaining
+**   values back into the sorted runs. 
 */
 
 #ifndef _LSM_INT_H
@@ -82,6 +164,7 @@
 #define rtIsDelete(eType)    (((eType) & 0x0F)==LSM_POINT_DELETE)
 
 #define rtIsSeparator(eType) (((eType) & LSM_SEPARATOR)!=0)
+#define rtIsSeparatorOnly(eType) (((eType) & 0x0F)==0)
 #define rtIsWrite(eType)     (((eType) & LSM_INSERT)!=0)
 #define rtIsSystem(eType)    (((eType) & LSM_SYSTEMKEY)!=0)
 
@@ -98,9 +181,42 @@
 #define SEGMENT_BTREE_FLAG     0x0001
 #define PGFTR_SKIP_NEXT_FLAG   0x0002
 #define PGFTR_SKIP_THIS_FLAG   0x0004
+#define SEGMENT_TRAILER_FLAG   0x0008
+#define SEGMENT_PREFIX_FLAG    0x0010
+#define SEGMENT_VALUE_FLAG     0x0020
+
+/*
+** Return the restart interval of a page with footer flags field f, or 0
+** if the keys on the page are not prefix compressed.
+*/
+#define SEGMENT_PREFIX_RESTART(f) \
+  (((f) & SEGMENT_PREFIX_FLAG) ? (((f) >> 8) & 0xFF) : 0)
+
+/*
+** The maximum size of a value reference stored in a record with the 
+** LSM_VALUEREF flag set - two 64-bit varints and two 32-bit varints. 
+*/
+#define VALUEREF_MAX_SIZE (9 + 9 + 5 + 5)
+
+/*
+** Size of the header at the start of the first page of a run trailer.
+** And the value stored in its key size fields if the run contains no
+** user keys.
+*/
+#define TRAILER_HDR_SIZE 16
+#define TRAILER_NO_KEYS  0xFFFFFFFF
+
+/*
+** The LSM_COMPACTION_LEVELED policy only makes trivial moves while the 
+** database contains fewer than this many segments. This is half of the
+** LSM_MAX_RHS_SEGMENTS limit enforced by lsmDatabaseFull().
+*/
+#define SORTED_MAX_TRIVIAL_SEGMENTS 20
 
 typedef struct SegmentPtr SegmentPtr;
 typedef struct Blob Blob;
+typedef struct BtreeFinger BtreeFinger;
+typedef struct FingerPg FingerPg;
 
 struct Blob {
   lsm_env *pEnv;
@@ -109,6 +225,38 @@ struct Blob {
   int nAlloc;
 };
 
+/*
+** A BtreeFinger records the path taken through the b-tree of a segment by
+** the most recent seek on a client cursor, along with the range of keys 
+** that may be reached via each page on that path. A key range is bounded
+** by the separator keys either side of the pointer followed in the parent
+** page. The lower bound is inclusive, the upper bound exclusive, and a
+** bound for which bLo or bHi is clear is unbounded.
+**
+** When the cursor is next used to seek within the segment, the descent 
+** begins at the deepest page on the path whose key range contains the key
+** being sought instead of at the root page. For a sequence of seeks for
+** nearby keys, as made by lsm_csr_multiseek(), this avoids loading most
+** b-tree pages (and the pages containing any indirect keys they use) more
+** than once.
+**
+** At most FINGER_MAX_DEPTH pages are recorded. Since the key ranges of
+** pages at each level of a b-tree do not overlap, starting the descent at
+** any recorded page that contains the key finds the same leaf as starting
+** at the root.
+*/
+#define FINGER_MAX_DEPTH 16
+struct FingerPg {
+  Pgno iPg;                       /* Page number */
+  int bLo, bHi;                   /* True if lower/upper bound is set */
+  int iLoTopic, iHiTopic;         /* Topics of lower and upper bounds */
+  Blob lo, hi;                    /* Lower and upper bound keys */
+};
+struct BtreeFinger {
+  int nPg;                        /* Number of valid entries in aPg[] */
+  FingerPg aPg[FINGER_MAX_DEPTH]; /* aPg[0] is the root page */
+};
+
 /*
 ** A SegmentPtr object may be used for one of two purposes:
 **
@@ -133,10 +281,42 @@ struct SegmentPtr {
   Pgno iPgPtr;                  /* Cascade pointer offset */
   void *pKey; int nKey;         /* Key associated with current record */
   void *pVal; int nVal;         /* Current record value (eType==WRITE only) */
+  int iKeyCell;                 /* Cell of pPg pKey was loaded from, or -1 */
 
   /* Blobs used to allocate buffers for pKey and pVal as required */
   Blob blob1;
   Blob blob2;
+
+  /* Path of most recent b-tree seek. Client cursors only. */
+  BtreeFinger *pFinger;
+};
+
+/*
+** An in-memory copy of the trailer stored at the end of a sorted run.
+** Trailer objects are loaded on demand and stored in a linked list attached
+** to the snapshot that the segment belongs to (Snapshot.pTrailer).
+** If the segment does not have a bloom filter, nHash is set to zero. If
+** the smallest and largest user keys in the segment are not known (because
+** it has no trailer), bRange is set to zero. If they are known but the
+** segment contains no user keys, bRange is set and nMin to -1.
+**
+** Trailers attached to the worker snapshot contain the key range only. 
+** Since the Level objects of the worker snapshot may be freed while the
+** snapshot is in use, these trailers are identified by the first and last
+** pages of the segment instead of by pSeg, which is set to NULL.
+*/
+struct Trailer {
+  Segment *pSeg;                  /* Segment this trailer belongs to */
+  Pgno iFirst;                    /* First page of segment (worker only) */
+  Pgno iLastPg;                   /* Last page of segment (worker only) */
+  int nHash;                      /* Number of hash functions (or 0) */
+  u32 nBit;                       /* Number of bits in aBit[] */
+  u8 *aBit;                       /* Filter bitmap */
+  u8 *aBuf;                       /* Buffer for aBit[], aMin[] and aMax[] */
+  int bRange;                     /* True if aMin/aMax are valid */
+  u8 *aMin; int nMin;             /* Smallest user key in segment */
+  u8 *aMax; int nMax;             /* Largest user key in segment */
+  Trailer *pNext;                 /* Next trailer in Snapshot.pTrailer list */
 };
 
 /*
@@ -175,8 +355,14 @@ struct BtreeCursor {
 
 
 /*
-** A cursor used for merged searches or iterations through up to one
-** Tree structure and any number of sorted files.
+** Size of the MultiCursor.apTreeCsr[] array. Room for a cursor on the
+** current in-memory tree and on each old tree.
+*/
+#define CURSOR_NTREE (1 + LSM_MAX_OLD_TREES)
+
+/*
+** A cursor used for merged searches or iterations through the in-memory
+** trees and any number of sorted files.
 **
 **   lsmMCursorNew()
 **   lsmMCursorSeek()
@@ -188,6 +374,12 @@ struct BtreeCursor {
 **   lsmMCursorValue()
 **   lsmMCursorValid()
 **
+** apTreeCsr[]:
+**   apTreeCsr[0] is a cursor on the current in-memory tree, if any. 
+**   apTreeCsr[1] is a cursor on the newest old tree that has not yet been
+**   flushed to disk, apTreeCsr[2] on the next newest, and so on. Unused
+**   entries are set to NULL.
+**
 ** iFree:
 **   This variable is only used by cursors providing input data for a
 **   new top-level segment. Such cursors only ever iterate forwards, not
@@ -203,7 +395,7 @@ struct MultiCursor {
   Blob val;                       /* Cache of current value */
 
   /* All the component cursors: */
-  TreeCursor *apTreeCsr[2];       /* Up to two tree cursors */
+  TreeCursor *apTreeCsr[CURSOR_NTREE]; /* Current and old tree cursors */
   int iFree;                      /* Next element of free-list (-ve for eof) */
   SegmentPtr *aPtr;               /* Array of segment pointers */
   int nPtr;                       /* Size of array aPtr[] */
@@ -218,6 +410,11 @@ struct MultiCursor {
 
   /* Used by worker cursors only */
   Pgno *pPrevMergePtr;
+
+  /* Used by client cursors only */
+  Snapshot *pSnap;                /* Snapshot that owns any run trailers */
+  Blob lower;                     /* Lower bound set by lsm_csr_set_bounds() */
+  Blob upper;                     /* Upper bound set by lsm_csr_set_bounds() */
 };
 
 /*
@@ -225,9 +422,15 @@ struct MultiCursor {
 ** cursor of a multi-cursor.
 */
 #define CURSOR_DATA_TREE0     0   /* Current tree cursor (apTreeCsr[0]) */
-#define CURSOR_DATA_TREE1     1   /* The "old" tree, if any (apTreeCsr[1]) */
-#define CURSOR_DATA_SYSTEM    2   /* Free-list entries (new-toplevel only) */
-#define CURSOR_DATA_SEGMENT   3   /* First segment pointer (aPtr[0]) */
+#define CURSOR_DATA_SYSTEM    (CURSOR_DATA_TREE0 + CURSOR_NTREE)
+#define CURSOR_DATA_SEGMENT   (CURSOR_DATA_SYSTEM + 1)
+
+/*
+** CURSOR_DATA_SYSTEM identifies the free-list entries (new-toplevel only)
+** and CURSOR_DATA_SEGMENT the first segment pointer (aPtr[0]). The 
+** following is true if iKey identifies one of the tree cursors.
+*/
+#define mcursorIsTree(iKey) ((iKey)<CURSOR_DATA_SYSTEM)
 
 /*
 ** CURSOR_IGNORE_DELETE
@@ -254,6 +457,11 @@ struct MultiCursor {
 **   Cursor has undergone a successful lsm_csr_seek(LSM_SEEK_EQ) operation.
 **   The key and value are stored in MultiCursor.key and MultiCursor.val
 **   respectively.
+**
+** CURSOR_VALUE_GC
+**   This cursor is being used as the input of a merge. As each record is
+**   consumed, release its reference to a value segment (if any). See
+**   sortedValueRelease().
 */
 #define CURSOR_IGNORE_DELETE    0x00000001
 #define CURSOR_FLUSH_FREELIST   0x00000002
@@ -262,6 +470,7 @@ struct MultiCursor {
 #define CURSOR_PREV_OK          0x00000040
 #define CURSOR_READ_SEPARATORS  0x00000080
 #define CURSOR_SEEK_EQ          0x00000100
+#define CURSOR_VALUE_GC         0x00000200
 
 typedef struct MergeWorker MergeWorker;
 typedef struct Hierarchy Hierarchy;
@@ -294,6 +503,12 @@ struct MergeWorker {
   Pgno *aGobble;                  /* Gobble point for each input segment */
 
   Pgno iIndirect;
+  Blob prefix;                    /* Copy of last key written to pPage */
+  int nPrefixRec;                 /* Value of nRec after prefix was written */
+  Page *pValPg;                   /* Current value segment page (or NULL) */
+  int iValOff;                    /* Write offset within pValPg */
+  Blob val;                       /* Value loaded from a value segment */
+  u8 aRef[VALUEREF_MAX_SIZE];     /* Value reference written to output */
   struct SavedPgno {
     Pgno iPgno;
     int bStore;
@@ -485,6 +700,91 @@ static int pageGetFlags(u8 *aData, int nData){
   return (int)lsmGetU16(&aData[SEGMENT_FLAGS_OFFSET(nData)]);
 }
 
+/*
+** Decode the value reference stored in buffer aRef[], size nRef bytes (see
+** VALUE SEGMENTS at the top of this file). Return LSM_OK if successful, or
+** LSM_CORRUPT if the buffer does not contain a well-formed reference.
+*/
+static int sortedValueRefDecode(
+  void *aRef, int nRef,           /* Reference to decode */
+  Pgno *piId,                     /* OUT: First page of value segment */
+  Pgno *piPg,                     /* OUT: Page value starts on */
+  int *piOff,                     /* OUT: Offset of value within page */
+  int *pnVal                      /* OUT: Size of value in bytes */
+){
+  u8 aBuf[VALUEREF_MAX_SIZE + 9];
+  int i = 0;
+
+  if( nRef<4 || nRef>VALUEREF_MAX_SIZE ) return LSM_CORRUPT_BKPT;
+  memset(aBuf, 0, sizeof(aBuf));
+  memcpy(aBuf, aRef, nRef);
+  i += lsmVarintGet64(&aBuf[i], piId);
+  i += lsmVarintGet64(&aBuf[i], piPg);
+  i += lsmVarintGet32(&aBuf[i], piOff);
+  i += lsmVarintGet32(&aBuf[i], pnVal);
+  if( i!=nRef || *piOff<0 || *pnVal<0 ) return LSM_CORRUPT_BKPT;
+  return LSM_OK;
+}
+
+/*
+** Return the index in pSnap->aValue[] of the value segment that starts on
+** page iId. Or, if there is no such value segment, return -1.
+*/
+static int sortedFindValueSegment(Snapshot *pSnap, Pgno iId){
+  int i;
+  for(i=0; i<pSnap->nValue; i++){
+    if( pSnap->aValue[i].seg.iFirst==iId ) return i;
+  }
+  return -1;
+}
+
+/*
+** Load the value identified by value reference pRef/nRef from the value
+** segments of snapshot pSnap into blob pOut.
+*/
+static int sortedValueLoad(
+  lsm_db *pDb,                    /* Database handle */
+  Snapshot *pSnap,                /* Snapshot that contains the reference */
+  void *pRef, int nRef,           /* Value reference */
+  Blob *pOut                      /* OUT: Populate this blob with the value */
+){
+  Pgno iId;                       /* Value segment id */
+  Pgno iPg;                       /* Page the value starts on */
+  int iOff;                       /* Offset of value within page iPg */
+  int nVal;                       /* Size of value in bytes */
+  int iSeg;                       /* Index of value segment in pSnap */
+  int rc;
+
+  rc = sortedValueRefDecode(pRef, nRef, &iId, &iPg, &iOff, &nVal);
+  if( rc==LSM_OK ){
+    iSeg = (pSnap ? sortedFindValueSegment(pSnap, iId) : -1);
+    if( iSeg<0 ) rc = LSM_CORRUPT_BKPT;
+  }
+  if( rc==LSM_OK ){
+    Segment *pSeg = &pSnap->aValue[iSeg].seg;
+    Page *pPg = 0;
+    rc = lsmFsDbPageGet(pDb->pFS, pSeg, iPg, &pPg);
+    if( rc==LSM_OK ){
+      void *pData = 0;
+      int nData;
+      u8 *aData = fsPageData(pPg, &nData);
+
+      if( (pageGetFlags(aData, nData) & SEGMENT_VALUE_FLAG)==0
+       || iOff>=SEGMENT_EOF(nData, 0)
+      ){
+        rc = LSM_CORRUPT_BKPT;
+      }else{
+        rc = sortedReadData(pSeg, pPg, iOff, nVal, &pData, pOut);
+      }
+      if( rc==LSM_OK && pData!=pOut->pData ){
+        rc = sortedBlobSet(pDb->pEnv, pOut, pData, nVal);
+      }
+      lsmFsPageRelease(pPg);
+    }
+  }
+  return rc;
+}
+
 static u8 *pageGetCell(u8 *aData, int nData, int iCell){
   return &aData[lsmGetU16(&aData[SEGMENT_CELLPTR_OFFSET(nData, iCell)])];
 }
@@ -512,6 +812,69 @@ static Pgno pageGetRecordPtr(u8 *aData, int nData, int iCell){
   return iRet;
 }
 
+/*
+** Page pPg is a prefix compressed page (see PREFIX COMPRESSION above). 
+** Reconstruct the key belonging to cell iCell and store it in blob pKey.
+**
+** If bNext is true, pKey already contains the key belonging to cell 
+** (iCell-1), and only cell iCell is decoded. Otherwise, cells are decoded
+** starting at the restart point at or before iCell. Blob pTmp is used 
+** for any key suffix that overflows onto subsequent pages.
+*/
+static int sortedPrefixKey(
+  Segment *pSeg,                  /* Segment pPg belongs to */
+  Page *pPg,                      /* Page to read from */
+  int iCell,                      /* Index of cell on page to read */
+  int bNext,                      /* True if pKey holds key of (iCell-1) */
+  Blob *pKey,                     /* OUT: Key of cell iCell */
+  Blob *pTmp                      /* Buffer for overflow suffixes */
+){
+  int rc = LSM_OK;
+  lsm_env *pEnv = lsmPageEnv(pPg);
+  u8 *aData;
+  int nData;
+  int nRestart;
+  int nKey;
+  int i;
+
+  aData = fsPageData(pPg, &nData);
+  nRestart = SEGMENT_PREFIX_RESTART(pageGetFlags(aData, nData));
+  assert( nRestart>0 && iCell<pageGetNRec(aData, nData) );
+
+  if( bNext ){
+    i = iCell;
+    nKey = pKey->nData;
+  }else{
+    i = iCell - (iCell % nRestart);
+    nKey = 0;
+  }
+
+  for(/* no-op */; rc==LSM_OK && i<=iCell; i++){
+    u8 *aCell = pageGetCell(aData, nData, i);
+    int eType = *aCell++;
+    int nDummy;
+    int nPrefix;
+    int nSuffix;
+    void *pSuffix;
+
+    aCell += lsmVarintGet32(aCell, &nDummy);
+    aCell += lsmVarintGet32(aCell, &nPrefix);
+    aCell += lsmVarintGet32(aCell, &nSuffix);
+    if( rtIsWrite(eType) ) aCell += lsmVarintGet32(aCell, &nDummy);
+    if( nPrefix>nKey ) return LSM_CORRUPT_BKPT;
+
+    rc = sortedReadData(pSeg, pPg, aCell-aData, nSuffix, &pSuffix, pTmp);
+    if( rc==LSM_OK ) rc = sortedBlobGrow(pEnv, pKey, nPrefix+nSuffix);
+    if( rc==LSM_OK ){
+      memcpy(&((u8 *)pKey->pData)[nPrefix], pSuffix, nSuffix);
+      nKey = nPrefix + nSuffix;
+      pKey->nData = nKey;
+    }
+  }
+
+  return rc;
+}
+
 static u8 *pageGetKey(
   Segment *pSeg,                  /* Segment pPg belongs to */
   Page *pPg,                      /* Page to read from */
@@ -525,20 +888,31 @@ static u8 *pageGetKey(
   int eType;
   u8 *aData;
   int nData;
+  int flags;
 
   aData = fsPageData(pPg, &nData);
+  flags = pageGetFlags(aData, nData);
 
-  assert( !(pageGetFlags(aData, nData) & SEGMENT_BTREE_FLAG) );
+  assert( !(flags & SEGMENT_BTREE_FLAG) );
   assert( iCell<pageGetNRec(aData, nData) );
 
   pKey = pageGetCell(aData, nData, iCell);
   eType = *pKey++;
+  *piTopic = rtTopic(eType);
+
+  if( flags & SEGMENT_PREFIX_FLAG ){
+    Blob tmp = {0, 0, 0, 0};
+    int rc = sortedPrefixKey(pSeg, pPg, iCell, 0, pBlob, &tmp);
+    sortedBlobFree(&tmp);
+    *pnKey = (rc==LSM_OK ? pBlob->nData : 0);
+    return (u8 *)pBlob->pData;
+  }
+
   pKey += lsmVarintGet32(pKey, &nDummy);
   pKey += lsmVarintGet32(pKey, pnKey);
   if( rtIsWrite(eType) ){
     pKey += lsmVarintGet32(pKey, &nDummy);
   }
-  *piTopic = rtTopic(eType);
 
   sortedReadData(pSeg, pPg, pKey-aData, *pnKey, (void **)&pKey, pBlob);
   return pKey;
@@ -555,6 +929,17 @@ static int pageGetKeyCopy(
   int rc = LSM_OK;
   int nKey;
   u8 *aKey;
+  u8 *aData;
+  int nData;
+
+  aData = fsPageData(pPg, &nData);
+  if( pageGetFlags(aData, nData) & SEGMENT_PREFIX_FLAG ){
+    Blob tmp = {0, 0, 0, 0};
+    *piTopic = rtTopic(*pageGetCell(aData, nData, iCell));
+    rc = sortedPrefixKey(pSeg, pPg, iCell, 0, pBlob, &tmp);
+    sortedBlobFree(&tmp);
+    return rc;
+  }
 
   aKey = pageGetKey(pSeg, pPg, iCell, piTopic, &nKey, pBlob);
   assert( (void *)aKey!=pBlob->pData || nKey==pBlob->nData );
@@ -1001,6 +1386,7 @@ static void segmentPtrSetPage(SegmentPtr *pPtr, Page *pNext){
     pPtr->iPtr = pageGetPtr(aData, nData);
   }
   pPtr->pPg = pNext;
+  pPtr->iKeyCell = -1;
 }
 
 /*
@@ -1048,6 +1434,54 @@ static int segmentPtrNextPage(
   return rc;
 }
 
+/*
+** Load the key belonging to cell iCell of the prefix compressed page 
+** currently loaded by pPtr into pPtr->blob1. The record header has already
+** been decoded - the key shares its first nPrefix bytes with the previous
+** key on the page and the remaining nSuffix bytes are stored at offset 
+** iOff of the page.
+**
+** If pPtr already holds the key belonging to cell (iCell-1), only the 
+** suffix needs to be read. This makes iterating through a page cheap.
+** Otherwise, the key is reconstructed starting from the nearest restart
+** point.
+*/
+static int segmentPtrPrefixKey(
+  SegmentPtr *pPtr,               /* Segment pointer to load key for */
+  int iCell,                      /* Cell to load key of */
+  int nPrefix,                    /* Bytes shared with key of (iCell-1) */
+  int iOff,                       /* Offset of suffix within page */
+  int nSuffix                     /* Size of suffix in bytes */
+){
+  lsm_env *pEnv = lsmPageEnv(pPtr->pPg);
+  int rc = LSM_OK;
+
+  if( iCell>0 && pPtr->iKeyCell==iCell-1 && pPtr->nKey>=nPrefix ){
+    void *pSuffix;
+    if( pPtr->pKey!=pPtr->blob1.pData ){
+      rc = sortedBlobSet(pEnv, &pPtr->blob1, pPtr->pKey, nPrefix);
+    }
+    if( rc==LSM_OK ){
+      rc = sortedBlobGrow(pEnv, &pPtr->blob1, nPrefix+nSuffix);
+    }
+    if( rc==LSM_OK ){
+      rc = segmentPtrReadData(pPtr, iOff, nSuffix, &pSuffix, &pPtr->blob2);
+    }
+    if( rc==LSM_OK ){
+      memcpy(&((u8 *)pPtr->blob1.pData)[nPrefix], pSuffix, nSuffix);
+      pPtr->blob1.nData = nPrefix + nSuffix;
+    }
+  }else{
+    rc = sortedPrefixKey(
+        pPtr->pSeg, pPtr->pPg, iCell, 0, &pPtr->blob1, &pPtr->blob2
+    );
+  }
+
+  pPtr->pKey = pPtr->blob1.pData;
+  pPtr->nKey = pPtr->blob1.nData;
+  return rc;
+}
+
 static int segmentPtrLoadCell(
   SegmentPtr *pPtr,              /* Load page into this SegmentPtr object */
   int iNew                       /* Cell number of new cell */
@@ -1057,6 +1491,8 @@ static int segmentPtrLoadCell(
     u8 *aData;                    /* Pointer to page data buffer */
     int iOff;                     /* Offset in aData[] to read from */
     int nPgsz;                    /* Size of page (aData[]) in bytes */
+    int nPrefix = 0;              /* Bytes shared with previous key */
+    int nKey;                     /* Size of key (or suffix) on page */
 
     assert( iNew<pPtr->nCell );
     pPtr->iCell = iNew;
@@ -1065,18 +1501,27 @@ static int segmentPtrLoadCell(
     pPtr->eType = aData[iOff];
     iOff++;
     iOff += GETVARINT64(&aData[iOff], pPtr->iPgPtr);
-    iOff += GETVARINT32(&aData[iOff], pPtr->nKey);
+    if( pPtr->flags & SEGMENT_PREFIX_FLAG ){
+      iOff += GETVARINT32(&aData[iOff], nPrefix);
+    }
+    iOff += GETVARINT32(&aData[iOff], nKey);
     if( rtIsWrite(pPtr->eType) ){
       iOff += GETVARINT32(&aData[iOff], pPtr->nVal);
     }
-    assert( pPtr->nKey>=0 );
+    assert( nKey>=0 );
 
-    rc = segmentPtrReadData(
-        pPtr, iOff, pPtr->nKey, &pPtr->pKey, &pPtr->blob1
-    );
+    if( nPrefix ){
+      rc = segmentPtrPrefixKey(pPtr, iNew, nPrefix, iOff, nKey);
+    }else{
+      pPtr->nKey = nKey;
+      rc = segmentPtrReadData(
+          pPtr, iOff, pPtr->nKey, &pPtr->pKey, &pPtr->blob1
+      );
+    }
+    pPtr->iKeyCell = (rc==LSM_OK ? iNew : -1);
     if( rc==LSM_OK && rtIsWrite(pPtr->eType) ){
       rc = segmentPtrReadData(
-          pPtr, iOff+pPtr->nKey, pPtr->nVal, &pPtr->pVal, &pPtr->blob2
+          pPtr, iOff+nKey, pPtr->nVal, &pPtr->pVal, &pPtr->blob2
       );
     }else{
       pPtr->nVal = 0;
@@ -1106,19 +1551,27 @@ static Segment *sortedSplitkeySegment(Level *pLevel){
   return pSeg;
 }
 
-static void sortedSplitkey(lsm_db *pDb, Level *pLevel, int *pRc){
+/*
+** Load a copy of the split-key of level pLevel, which must be undergoing
+** a merge, into blob *pBlob. Set *piTopic to the topic of the key. Level
+** pLevel itself is not modified.
+*/
+static int sortedSplitkeyLoad(
+  lsm_db *pDb,                    /* Database handle */
+  Level *pLevel,                  /* Level to load the split-key of */
+  int *piTopic,                   /* OUT: Topic of split-key */
+  Blob *pBlob                     /* OUT: Split-key */
+){
   Segment *pSeg;
   Page *pPg = 0;
   lsm_env *pEnv = pDb->pEnv;      /* Environment handle */
-  int rc = *pRc;
+  int rc;
   Merge *pMerge = pLevel->pMerge;
 
   pSeg = sortedSplitkeySegment(pLevel);
+  rc = lsmFsDbPageGet(pDb->pFS, pSeg, pMerge->splitkey.iPg, &pPg);
   if( rc==LSM_OK ){
-    rc = lsmFsDbPageGet(pDb->pFS, pSeg, pMerge->splitkey.iPg, &pPg);
-  }
-  if( rc==LSM_OK ){
-    int iTopic;
+    int iTopic = 0;
     Blob blob = {0, 0, 0, 0};
     u8 *aData;
     int nData;
@@ -1140,13 +1593,12 @@ static void sortedSplitkey(lsm_db *pDb, Level *pLevel, int *pRc){
       );
     }
 
-    pLevel->iSplitTopic = iTopic;
-    pLevel->pSplitKey = blob.pData;
-    pLevel->nSplitKey = blob.nData;
+    *piTopic = iTopic;
+    *pBlob = blob;
     lsmFsPageRelease(pPg);
   }
 
-  *pRc = rc;
+  return rc;
 }
 
 static void segmentPtrReset(SegmentPtr *pPtr){
@@ -1159,6 +1611,7 @@ static void segmentPtrReset(SegmentPtr *pPtr){
   pPtr->nVal = 0;
   pPtr->eType = 0;
   pPtr->iCell = 0;
+  pPtr->iKeyCell = -1;
   sortedBlobFree(&pPtr->blob1);
   sortedBlobFree(&pPtr->blob2);
 }
@@ -1218,6 +1671,7 @@ static int segmentPtrAdvance(
       pPtr->eType |= (pLvl->iSplitTopic ? LSM_SYSTEMKEY : 0);
       pPtr->pKey = pLvl->pSplitKey;
       pPtr->nKey = pLvl->nSplitKey;
+      pPtr->iKeyCell = -1;
     }
 
   }while( pCsr 
@@ -1432,10 +1886,13 @@ static int segmentPtrSearchOversized(
     int res;                      /* Result of comparison */
     Page *pNext;
 
-    /* Load the last key on the current page. */
+    /* Load the last key on the current page. This overwrites blob1, so 
+    ** the key currently loaded by pPtr may no longer be used to decode
+    ** prefix compressed keys.  */
     pLastKey = pageGetKey(pPtr->pSeg,
         pPtr->pPg, pPtr->nCell-1, &iLastTopic, &nLastKey, &pPtr->blob1
     );
+    pPtr->iKeyCell = -1;
 
     /* If the loaded key is >= than (pKey/nKey), break out of the loop.
     ** If (pKey/nKey) is present in this array, it must be on the current 
@@ -1618,6 +2075,79 @@ static int segmentPtrFwdPointer(
   return rc;
 }
 
+/*
+** This function is used by segmentPtrSeek() in place of a binary search of
+** all cells when the page loaded by pPtr is prefix compressed. Since the 
+** keys at restart points are stored in full, a binary search of the 
+** restart points is used to find the last one with a key smaller than or
+** equal to (iTopic/pKey/nKey). The cells that follow it are then visited
+** in order, which allows each key to be reconstructed from its 
+** predecessor.
+**
+** When this function returns, pPtr is left pointing to the cell with a key
+** equal to that sought if there is one. Otherwise, it is left pointing to
+** one of the two cells either side of it. *pRes is set to the result of
+** comparing the key of that cell with the key sought and *piPtrOut to the
+** pointer belonging to the largest key on the page that is smaller than
+** or equal to it (or is left unmodified if there is no such key).
+*/
+static int segmentPtrSeekPrefix(
+  MultiCursor *pCsr,              /* Cursor context */
+  SegmentPtr *pPtr,               /* Pointer to seek */
+  int iTopic,                     /* Key topic to seek to */
+  void *pKey, int nKey,           /* Key to seek to */
+  int *pRes,                      /* OUT: Result of final comparison */
+  Pgno *piPtrOut                  /* IN/OUT: FC pointer */
+){
+  int (*xCmp)(void *, int, void *, int) = pCsr->pDb->xCmp;
+  int nRestart = SEGMENT_PREFIX_RESTART(pPtr->flags);
+  int rc = LSM_OK;
+  int res = 0;
+  int iMin = 0;                   /* Index of first restart point */
+  int iMax;                       /* Index of last restart point */
+  int iCell;
+  int iEnd;
+
+  assert( nRestart>0 );
+  iMax = (pPtr->nCell-1) / nRestart;
+
+  /* Binary search the restart points. */
+  while( 1 ){
+    int iTry = (iMin+iMax+1)/2;
+    rc = segmentPtrLoadCell(pPtr, iTry*nRestart);
+    if( rc!=LSM_OK ) return rc;
+    res = sortedKeyCompare(xCmp, rtTopic(pPtr->eType), 
+        pPtr->pKey, pPtr->nKey, iTopic, pKey, nKey
+    );
+    if( res<=0 ) *piPtrOut = pPtr->iPtr + pPtr->iPgPtr;
+    if( res==0 || iMin==iMax ) break;
+    if( res>0 ){
+      iMax = iTry-1;
+    }else{
+      iMin = iTry;
+      if( iMin==iMax ) break;
+    }
+  }
+
+  /* If the sought key is larger than the key of restart point iMin, scan
+  ** forward through the cells that follow it. Stop at the first cell with
+  ** a key equal to or larger than the sought key.  */
+  if( res<0 ){
+    iEnd = LSM_MIN((iMin+1)*nRestart, pPtr->nCell);
+    for(iCell=pPtr->iCell+1; res<0 && iCell<iEnd; iCell++){
+      rc = segmentPtrLoadCell(pPtr, iCell);
+      if( rc!=LSM_OK ) return rc;
+      res = sortedKeyCompare(xCmp, rtTopic(pPtr->eType), 
+          pPtr->pKey, pPtr->nKey, iTopic, pKey, nKey
+      );
+      if( res<=0 ) *piPtrOut = pPtr->iPtr + pPtr->iPgPtr;
+    }
+  }
+
+  *pRes = res;
+  return rc;
+}
+
 static int segmentPtrSeek(
   MultiCursor *pCsr,              /* Cursor context */
   SegmentPtr *pPtr,               /* Pointer to seek */
@@ -1660,41 +2190,48 @@ static int segmentPtrSeek(
   if( pPtr->nCell==0 ){
     segmentPtrReset(pPtr);
   }else{
-    iMin = 0;
-    iMax = pPtr->nCell-1;
+    if( pPtr->flags & SEGMENT_PREFIX_FLAG ){
+      rc = segmentPtrSeekPrefix(pCsr, pPtr, iTopic, pKey, nKey, &res, &iPtrOut);
+    }else{
+      iMin = 0;
+      iMax = pPtr->nCell-1;
 
-    while( 1 ){
-      int iTry = (iMin+iMax)/2;
-      void *pKeyT; int nKeyT;       /* Key for cell iTry */
-      int iTopicT;
+      while( 1 ){
+        int iTry = (iMin+iMax)/2;
+        void *pKeyT; int nKeyT;       /* Key for cell iTry */
+        int iTopicT;
 
-      assert( iTry<iMax || iMin==iMax );
+        assert( iTry<iMax || iMin==iMax );
 
-      rc = segmentPtrLoadCell(pPtr, iTry);
-      if( rc!=LSM_OK ) break;
+        rc = segmentPtrLoadCell(pPtr, iTry);
+        if( rc!=LSM_OK ) break;
 
-      segmentPtrKey(pPtr, &pKeyT, &nKeyT);
-      iTopicT = rtTopic(pPtr->eType);
+        segmentPtrKey(pPtr, &pKeyT, &nKeyT);
+        iTopicT = rtTopic(pPtr->eType);
 
-      res = sortedKeyCompare(xCmp, iTopicT, pKeyT, nKeyT, iTopic, pKey, nKey);
-      if( res<=0 ){
-        iPtrOut = pPtr->iPtr + pPtr->iPgPtr;
+        res = sortedKeyCompare(xCmp, iTopicT, pKeyT, nKeyT, iTopic, pKey, nKey);
+        if( res<=0 ){
+          iPtrOut = pPtr->iPtr + pPtr->iPgPtr;
+        }
+
+        if( res==0 || iMin==iMax ){
+          break;
+        }else if( res>0 ){
+          iMax = LSM_MAX(iTry-1, iMin);
+        }else{
+          iMin = iTry+1;
+        }
       }
 
-      if( res==0 || iMin==iMax ){
-        break;
-      }else if( res>0 ){
-        iMax = LSM_MAX(iTry-1, iMin);
-      }else{
-        iMin = iTry+1;
+      if( rc==LSM_OK ){
+        assert( res==0 || (iMin==iMax && iMin>=0 && iMin<pPtr->nCell) );
+        if( res ){
+          rc = segmentPtrLoadCell(pPtr, iMin);
+        }
       }
     }
 
     if( rc==LSM_OK ){
-      assert( res==0 || (iMin==iMax && iMin>=0 && iMin<pPtr->nCell) );
-      if( res ){
-        rc = segmentPtrLoadCell(pPtr, iMin);
-      }
       assert( rc!=LSM_OK || res>0 || iPtrOut==(pPtr->iPtr + pPtr->iPgPtr) );
 
       if( rc==LSM_OK ){
@@ -1711,7 +2248,13 @@ static int segmentPtrSeek(
               *pbStop = 1;
               pCsr->eType = pPtr->eType;
               rc = sortedBlobSet(pEnv, &pCsr->key, pPtr->pKey, pPtr->nKey);
-              if( rc==LSM_OK ){
+              if( rc==LSM_OK && (eType & LSM_VALUEREF) ){
+                Snapshot *pSnap = pCsr->pSnap;
+                if( pSnap==0 ) pSnap = pCsr->pDb->pWorker;
+                rc = sortedValueLoad(pCsr->pDb, pSnap, 
+                    pPtr->pVal, pPtr->nVal, &pCsr->val
+                );
+              }else if( rc==LSM_OK ){
                 rc = sortedBlobSet(pEnv, &pCsr->val, pPtr->pVal, pPtr->nVal);
               }
               pCsr->flags |= CURSOR_SEEK_EQ;
@@ -1754,28 +2297,93 @@ static int segmentPtrSeek(
   return rc;
 }
 
+/*
+** Free a BtreeFinger object and the buffers it owns.
+*/
+static void fingerFree(lsm_env *pEnv, BtreeFinger *pFinger){
+  if( pFinger ){
+    int i;
+    for(i=0; i<FINGER_MAX_DEPTH; i++){
+      sortedBlobFree(&pFinger->aPg[i].lo);
+      sortedBlobFree(&pFinger->aPg[i].hi);
+    }
+    lsmFree(pEnv, pFinger);
+  }
+}
+
+/*
+** Return true if key (iTopic/pKey/nKey) lies within the key range of
+** page p of a BtreeFinger.
+*/
+static int fingerContains(
+  MultiCursor *pCsr,
+  FingerPg *p,
+  int iTopic, void *pKey, int nKey
+){
+  int (*xCmp)(void *, int, void *, int) = pCsr->pDb->xCmp;
+  if( p->bLo && 0>sortedKeyCompare(xCmp, iTopic, pKey, nKey, 
+        p->iLoTopic, p->lo.pData, p->lo.nData
+  )){
+    return 0;
+  }
+  if( p->bHi && 0<=sortedKeyCompare(xCmp, iTopic, pKey, nKey, 
+        p->iHiTopic, p->hi.pData, p->hi.nData
+  )){
+    return 0;
+  }
+  return 1;
+}
+
 static int seekInBtree(
   MultiCursor *pCsr,              /* Multi-cursor object */
   Segment *pSeg,                  /* Seek within this segment */
   int iTopic,
   void *pKey, int nKey,           /* Key to seek to */
   Pgno *aPg,                      /* OUT: Page numbers */
+  BtreeFinger *pFinger,           /* IN/OUT: Path of previous seek (or NULL) */
   Page **ppPg                     /* OUT: Leaf (sorted-run) page reference */
 ){
+  lsm_env *pEnv = pCsr->pDb->pEnv;
   int i = 0;
-  int rc;
+  int rc = LSM_OK;
   int iPg;
+  int iDepth = 0;                 /* Depth of page iPg in b-tree */
   Page *pPg = 0;
   Blob blob = {0, 0, 0};
 
+  assert( pFinger==0 || aPg==0 );
   iPg = pSeg->iRoot;
+
+  /* If there is a finger, begin the descent at the deepest page on the
+  ** recorded path that may contain the key. */
+  if( pFinger && pFinger->nPg>0 ){
+    for(iDepth=pFinger->nPg-1; iDepth>0; iDepth--){
+      if( fingerContains(pCsr, &pFinger->aPg[iDepth], iTopic, pKey, nKey) ){
+        break;
+      }
+    }
+    iPg = pFinger->aPg[iDepth].iPg;
+    assert( iDepth>0 || iPg==pSeg->iRoot );
+  }else if( pFinger ){
+    pFinger->aPg[0].bLo = 0;
+    pFinger->aPg[0].bHi = 0;
+  }
+
   do {
     Pgno *piFirst = 0;
+    FingerPg *pChild = 0;         /* Finger entry for child page, if any */
     if( aPg ){
       aPg[i++] = iPg;
       piFirst = &aPg[i];
     }
 
+    /* Record page iPg in the finger. The bounds of this entry were set
+    ** when its parent page was searched.  */
+    if( pFinger && iDepth<FINGER_MAX_DEPTH ){
+      pFinger->aPg[iDepth].iPg = iPg;
+      pFinger->nPg = iDepth+1;
+    }
+
     rc = lsmFsDbPageGet(pCsr->pDb->pFS, pSeg, iPg, &pPg);
     assert( rc==LSM_OK || pPg==0 );
     if( rc==LSM_OK ){
@@ -1790,12 +2398,33 @@ static int seekInBtree(
       flags = pageGetFlags(aData, nData);
       if( (flags & SEGMENT_BTREE_FLAG)==0 ) break;
 
+      /* The bounds of the finger entry for the child page are inherited
+      ** from this page, then narrowed by the search below.  */
+      if( pFinger && iDepth+1<FINGER_MAX_DEPTH ){
+        FingerPg *pThis = &pFinger->aPg[iDepth];
+        pChild = &pFinger->aPg[iDepth+1];
+        pChild->bLo = pThis->bLo;
+        pChild->bHi = pThis->bHi;
+        pChild->iLoTopic = pThis->iLoTopic;
+        pChild->iHiTopic = pThis->iHiTopic;
+        if( pThis->bLo ){
+          rc = sortedBlobSet(pEnv, &pChild->lo,
+              pThis->lo.pData, pThis->lo.nData
+          );
+        }
+        if( pThis->bHi && rc==LSM_OK ){
+          rc = sortedBlobSet(pEnv, &pChild->hi,
+              pThis->hi.pData, pThis->hi.nData
+          );
+        }
+      }
+
       iPg = pageGetPtr(aData, nData);
       nRec = pageGetNRec(aData, nData);
 
       iMin = 0;
       iMax = nRec-1;
-      while( iMax>=iMin ){
+      while( rc==LSM_OK && iMax>=iMin ){
         int iTry = (iMin+iMax)/2;
         void *pKeyT; int nKeyT;       /* Key for cell iTry */
         int iTopicT;                  /* Topic for key pKeyT/nKeyT */
@@ -1815,6 +2444,24 @@ static int seekInBtree(
         res = sortedKeyCompare(
             pCsr->pDb->xCmp, iTopic, pKey, nKey, iTopicT, pKeyT, nKeyT
         );
+
+        /* The final values of iMin-1 and iMax+1 are the cells either side
+        ** of the pointer followed. Since iMin only increases and iMax only
+        ** decreases, the last key copied into each child bound is that of
+        ** the corresponding cell.  */
+        if( pChild ){
+          if( res<0 ){
+            pChild->bHi = 1;
+            pChild->iHiTopic = iTopicT;
+            rc = sortedBlobSet(pEnv, &pChild->hi, pKeyT, nKeyT);
+          }else{
+            pChild->bLo = 1;
+            pChild->iLoTopic = iTopicT;
+            rc = sortedBlobSet(pEnv, &pChild->lo, pKeyT, nKeyT);
+          }
+          if( rc!=LSM_OK ) break;
+        }
+
         if( res<0 ){
           iPg = iPtr;
           iMax = iTry-1;
@@ -1824,10 +2471,12 @@ static int seekInBtree(
       }
       lsmFsPageRelease(pPg);
       pPg = 0;
+      iDepth++;
     }
   }while( rc==LSM_OK );
 
   sortedBlobFree(&blob);
+  if( pFinger && rc!=LSM_OK ) pFinger->nPg = 0;
   assert( (rc==LSM_OK)==(pPg!=0) );
   if( ppPg ){
     *ppPg = pPg;
@@ -1837,23 +2486,361 @@ static int seekInBtree(
   return rc;
 }
 
-static int seekInSegment(
-  MultiCursor *pCsr, 
-  SegmentPtr *pPtr,
-  int iTopic,
-  void *pKey, int nKey,
-  int iPg,                        /* Page to search */
-  int eSeek,                      /* Search bias - see above */
+/*
+** Return a 32-bit hash of the key passed as the only argument. This is
+** used to populate and query bloom filters.
+*/
+static u32 sortedBloomHash(const u8 *aKey, int nKey){
+  u32 h = 0x811C9DC5;
+  int i;
+  for(i=0; i<nKey; i++){
+    h = (h ^ aKey[i]) * 0x01000193;
+  }
+  h ^= (h >> 16);
+  h *= 0x85EBCA6B;
+  h ^= (h >> 13);
+  h *= 0xC2B2AE35;
+  h ^= (h >> 16);
+  return h;
+}
+
+/*
+** Add the key with hash value h to the nBit bit bloom filter aBit[]. Or, 
+** if bQuery is true, return true if the key may be present in the filter,
+** or false if it is definitely not.
+*/
+static int sortedBloomBits(u8 *aBit, u32 nBit, int nHash, u32 h, int bQuery){
+  u32 delta = (h >> 17) | (h << 15);
+  int i;
+  for(i=0; i<nHash; i++){
+    u32 iBit = h % nBit;
+    if( bQuery ){
+      if( (aBit[iBit/8] & (1 << (iBit%8)))==0 ) return 0;
+    }else{
+      aBit[iBit/8] |= (1 << (iBit%8));
+    }
+    h += delta;
+  }
+  return 1;
+}
+
+/*
+** Return the number of hash functions to use with a bloom filter that
+** uses nBitPerKey bits for each key.
+*/
+static int sortedBloomNHash(int nBitPerKey){
+  int nHash = (nBitPerKey * 69) / 100;   /* Approximately nBitPerKey*ln(2) */
+  return LSM_MAX(1, LSM_MIN(nHash, 30));
+}
+
+void lsmSortedFreeTrailer(lsm_env *pEnv, Trailer *pTrailer){
+  Trailer *p;
+  Trailer *pNext;
+  for(p=pTrailer; p; p=pNext){
+    pNext = p->pNext;
+    lsmFree(pEnv, p->aBuf);
+    lsmFree(pEnv, p);
+  }
+}
+
+/*
+** Load the trailer belonging to segment p->pSeg, if any, into Trailer 
+** object p. If the segment has no trailer, leave p->nHash and p->bRange
+** set to zero. If bRangeOnly is true, only the smallest and largest keys
+** are loaded and p->nHash is left set to zero even if the segment has a
+** bloom filter.
+*/
+static int sortedTrailerLoad(lsm_db *pDb, Trailer *p, int bRangeOnly){
+  FileSystem *pFS = pDb->pFS;
+  Segment *pSeg = p->pSeg;
+  Page *pPg = 0;
+  int rc;
+
+  rc = lsmFsDbPageLast(pFS, pSeg, &pPg);
+  if( rc==LSM_OK ){
+    u8 *aData;
+    int nData;
+    aData = fsPageData(pPg, &nData);
+    if( pageGetNRec(aData, nData)==0 
+     && (pageGetFlags(aData, nData) & SEGMENT_TRAILER_FLAG)
+    ){
+      Pgno iFirst = pageGetPtr(aData, nData);
+      u32 nByte = 0;              /* Size of bitmap in bytes */
+      u32 nHash = 0;              /* Number of hash functions */
+      u32 nMin = 0;               /* Size of smallest key */
+      u32 nMax = 0;               /* Size of largest key */
+      i64 nBuf = 0;               /* Total size of trailer in bytes */
+      int nDone = 0;              /* Bytes of trailer loaded so far */
+
+      if( iFirst ){
+        lsmFsPageRelease(pPg);
+        pPg = 0;
+        rc = lsmFsDbPageGet(pFS, pSeg, iFirst, &pPg);
+        if( rc==LSM_OK ) aData = fsPageData(pPg, &nData);
+      }
+
+      if( rc==LSM_OK ){
+        nByte = lsmGetU32(&aData[0]);
+        nHash = lsmGetU32(&aData[4]);
+        nMin = lsmGetU32(&aData[8]);
+        nMax = lsmGetU32(&aData[12]);
+        nBuf = TRAILER_HDR_SIZE + (i64)nByte;
+        if( nMin!=TRAILER_NO_KEYS ) nBuf += (i64)nMin + nMax;
+        if( (nByte==0)!=(nHash==0) || nHash>30 || nBuf>0x7FFFFFFF
+         || (nMin==TRAILER_NO_KEYS)!=(nMax==TRAILER_NO_KEYS)
+        ){
+          rc = LSM_CORRUPT_BKPT;
+        }else{
+          if( bRangeOnly ){
+            nBuf -= nByte;
+            nByte = nHash = 0;
+          }
+          p->aBuf = (u8 *)lsmMallocRc(pDb->pEnv, (int)nBuf, &rc);
+        }
+      }
+
+      while( rc==LSM_OK ){
+        Page *pNext = 0;
+        int nCopy = LSM_MIN((int)nBuf-nDone, SEGMENT_EOF(nData, 0));
+        memcpy(&p->aBuf[nDone], aData, nCopy);
+        nDone += nCopy;
+        if( nDone==(int)nBuf ) break;
+
+        rc = lsmFsDbPageNext(pSeg, pPg, 1, &pNext);
+        lsmFsPageRelease(pPg);
+        pPg = pNext;
+        if( rc==LSM_OK && pPg==0 ) rc = LSM_CORRUPT_BKPT;
+        if( rc==LSM_OK ){
+          aData = fsPageData(pPg, &nData);
+          if( (pageGetFlags(aData, nData) & SEGMENT_TRAILER_FLAG)==0 ){
+            rc = LSM_CORRUPT_BKPT;
+          }
+        }
+      }
+
+      if( rc==LSM_OK ){
+        u8 *aKey = &p->aBuf[TRAILER_HDR_SIZE];
+        p->bRange = 1;
+        if( nMin==TRAILER_NO_KEYS ){
+          p->nMin = -1;
+        }else{
+          p->aMin = aKey;
+          p->nMin = (int)nMin;
+          p->aMax = &aKey[nMin];
+          p->nMax = (int)nMax;
+          aKey += nMin + nMax;
+        }
+        p->aBit = aKey;
+        p->nBit = nByte * 8;
+        p->nHash = (int)nHash;
+      }
+    }
+  }
+  lsmFsPageRelease(pPg);
+  return rc;
+}
+
+/*
+** Search the list of trailers attached to snapshot pSnap for the one that
+** belongs to segment pSeg. Return a pointer to it, or NULL if it has not
+** been loaded. The caller must hold the client snapshot mutex.
+*/
+static Trailer *sortedTrailerSearch(Snapshot *pSnap, Segment *pSeg){
+  Trailer *p;
+  for(p=pSnap->pTrailer; p && p->pSeg!=pSeg; p=p->pNext);
+  return p;
+}
+
+/*
+** Return the trailer belonging to segment pSeg, loading it into the 
+** client snapshot that cursor pCsr is reading from if it is not already 
+** present. Since the contents of a client snapshot are never modified, 
+** a trailer may be used for as long as the snapshot exists.
+**
+** Client snapshots may be shared by connections running in different
+** threads, so the list of trailers is only accessed while holding the
+** client snapshot mutex. The trailer is loaded without holding the mutex.
+** If another connection loads the same trailer in the meantime, the copy
+** loaded by this call is discarded.
+*/
+static Trailer *sortedTrailerFind(MultiCursor *pCsr, Segment *pSeg, int *pRc){
+  lsm_db *pDb = pCsr->pDb;
+  Snapshot *pSnap = pCsr->pSnap;
+  Trailer *p;
+
+  assert( pSnap );
+  lsmClientSnapshotEnter(pDb);
+  p = sortedTrailerSearch(pSnap, pSeg);
+  lsmClientSnapshotLeave(pDb);
+
+  if( p==0 && *pRc==LSM_OK ){
+    p = (Trailer *)lsmMallocZeroRc(pDb->pEnv, sizeof(Trailer), pRc);
+    if( p ){
+      p->pSeg = pSeg;
+      *pRc = sortedTrailerLoad(pDb, p, 0);
+      if( *pRc==LSM_OK ){
+        Trailer *pExist;
+        lsmClientSnapshotEnter(pDb);
+        pExist = sortedTrailerSearch(pSnap, pSeg);
+        if( pExist==0 ){
+          p->pNext = pSnap->pTrailer;
+          pSnap->pTrailer = p;
+        }
+        lsmClientSnapshotLeave(pDb);
+        if( pExist ){
+          lsmSortedFreeTrailer(pDb->pEnv, p);
+          p = pExist;
+        }
+      }else{
+        lsmSortedFreeTrailer(pDb->pEnv, p);
+        p = 0;
+      }
+    }
+  }
+  return p;
+}
+
+/*
+** Return the trailer belonging to segment pSeg of the worker snapshot,
+** loading it into the worker snapshot if it is not already present. Only
+** the key range is loaded. NULL is returned if an error occurs.
+**
+** A trailer loaded by this function is reused until the worker snapshot is 
+** freed at the end of the current work transaction. This is safe because
+** a segment is never modified once its trailer has been written, and the 
+** pages of a segment are not reused by another segment until after the 
+** worker snapshot has been checkpointed.
+*/
+static Trailer *sortedWorkerTrailer(lsm_db *pDb, Segment *pSeg, int *pRc){
+  Snapshot *pWorker = pDb->pWorker;
+  Trailer *p;
+
+  for(p=pWorker->pTrailer; p; p=p->pNext){
+    if( p->iFirst==pSeg->iFirst && p->iLastPg==pSeg->iLastPg ) break;
+  }
+
+  if( p==0 && *pRc==LSM_OK ){
+    p = (Trailer *)lsmMallocZeroRc(pDb->pEnv, sizeof(Trailer), pRc);
+    if( p ){
+      p->pSeg = pSeg;
+      *pRc = sortedTrailerLoad(pDb, p, 1);
+      p->pSeg = 0;
+      if( *pRc==LSM_OK ){
+        p->iFirst = pSeg->iFirst;
+        p->iLastPg = pSeg->iLastPg;
+        p->pNext = pWorker->pTrailer;
+        pWorker->pTrailer = p;
+      }else{
+        lsmSortedFreeTrailer(pDb->pEnv, p);
+        p = 0;
+      }
+    }
+  }
+  return p;
+}
+
+/*
+** Segment pSeg is about to be searched for key pKey/nKey by client cursor 
+** pCsr using seek bias eSeek. If the segment trailer shows that the search
+** cannot find any key the cursor may visit, set *pbMiss to true before 
+** returning. Otherwise, leave *pbMiss unmodified.
+**
+** For LSM_SEEK_EQ, the key range recorded in the trailer is tested against
+** the search key, and then the bloom filter is queried (if there is one).
+** For LSM_SEEK_GE and LSM_SEEK_LE the key range is tested against the
+** range between the search key and the upper or lower bound set by
+** lsm_csr_set_bounds(), if any.
+*/
+static int sortedTrailerQuery(
+  MultiCursor *pCsr,              /* Client cursor performing the seek */
+  Segment *pSeg,                  /* Segment to query the trailer of */
+  void *pKey, int nKey,           /* Key being sought */
+  int eSeek,                      /* Search bias */
+  int *pbMiss                     /* OUT: Set to true if segment may be skipped */
+){
+  int (*xCmp)(void *, int, void *, int) = pCsr->pDb->xCmp;
+  int rc = LSM_OK;
+  int bMiss = 0;
+  Trailer *p;
+
+  p = sortedTrailerFind(pCsr, pSeg, &rc);
+  if( p && p->bRange ){
+    if( p->nMin<0 ){
+      bMiss = 1;
+    }else if( eSeek==LSM_SEEK_EQ ){
+      bMiss = (xCmp(pKey, nKey, p->aMin, p->nMin)<0 
+            || xCmp(pKey, nKey, p->aMax, p->nMax)>0
+      );
+    }else if( eSeek==LSM_SEEK_GE ){
+      Blob *pUpper = &pCsr->upper;
+      bMiss = (xCmp(p->aMax, p->nMax, pKey, nKey)<0 || (pUpper->nData 
+            && xCmp(p->aMin, p->nMin, pUpper->pData, pUpper->nData)>=0)
+      );
+    }else{
+      Blob *pLower = &pCsr->lower;
+      assert( eSeek==LSM_SEEK_LE );
+      bMiss = (xCmp(p->aMin, p->nMin, pKey, nKey)>0 || (pLower->nData 
+            && xCmp(p->aMax, p->nMax, pLower->pData, pLower->nData)<0)
+      );
+    }
+  }
+
+  if( p && p->nHash && bMiss==0 && eSeek==LSM_SEEK_EQ ){
+    u32 h = sortedBloomHash((const u8 *)pKey, nKey);
+    if( 0==sortedBloomBits(p->aBit, p->nBit, p->nHash, h, 1) ) bMiss = 1;
+  }
+
+  if( bMiss ) *pbMiss = 1;
+  return rc;
+}
+
+static int seekInSegment(
+  MultiCursor *pCsr, 
+  SegmentPtr *pPtr,
+  int iTopic,
+  void *pKey, int nKey,
+  int iPg,                        /* Page to search */
+  int eSeek,                      /* Search bias - see above */
+  int bSkip,                      /* True if segment may be skipped */
   int *piPtr,                     /* OUT: FC pointer */
   int *pbStop                     /* OUT: Stop search flag */
 ){
   int iPtr = iPg;
   int rc = LSM_OK;
 
+  /* If the segment trailer indicates that the search cannot find a key
+  ** in this segment, there is no need to search it. The caller has already
+  ** checked that the fraction cascade pointer that the search would have 
+  ** returned via *piPtr is not required.  */
+  if( bSkip ){
+    int bMiss = 0;
+    assert( iTopic==0 );
+    rc = sortedTrailerQuery(pCsr, pPtr->pSeg, pKey, nKey, eSeek, &bMiss);
+    if( rc!=LSM_OK || bMiss ){
+      segmentPtrReset(pPtr);
+      *piPtr = 0;
+      return rc;
+    }
+  }
+
   if( pPtr->pSeg->iRoot ){
     Page *pPg;
+    BtreeFinger *pFinger = 0;
     assert( pPtr->pSeg->iRoot!=0 );
-    rc = seekInBtree(pCsr, pPtr->pSeg, iTopic, pKey, nKey, 0, &pPg);
+
+    /* Client cursors record the path taken by each b-tree seek, so that
+    ** subsequent seeks for nearby keys need not begin at the root. */
+    if( pCsr->pSnap && iTopic==0 ){
+      if( pPtr->pFinger==0 ){
+        pPtr->pFinger = (BtreeFinger *)lsmMallocZeroRc(
+            pCsr->pDb->pEnv, sizeof(BtreeFinger), &rc
+        );
+      }
+      pFinger = pPtr->pFinger;
+    }
+    if( rc==LSM_OK ){
+      rc = seekInBtree(pCsr, pPtr->pSeg, iTopic, pKey, nKey, 0, pFinger, &pPg);
+    }
     if( rc==LSM_OK ) segmentPtrSetPage(pPtr, pPg);
   }else{
     if( iPtr==0 ){
@@ -1884,6 +2871,18 @@ static int seekInSegment(
 **   In case (a), the multi-cursor CURSOR_SEEK_EQ flag is set and the pCsr->key
 **   and pCsr->val blobs populated before returning.
 */
+/*
+** Return true if a seek within level pLvl may require the fraction 
+** cascade pointer obtained by seeking within the previous segment. This
+** is the case if the first segment of pLvl that may be searched does not
+** have a b-tree hierarchy.
+*/
+static int sortedLevelUsesPtr(Level *pLvl){
+  if( pLvl==0 ) return 0;
+  if( pLvl->nRight ) return (pLvl->aRhs[0].iRoot==0);
+  return (pLvl->lhs.iRoot==0);
+}
+
 static int seekInLevel(
   MultiCursor *pCsr,              /* Sorted cursor object to seek */
   SegmentPtr *aPtr,               /* Pointer to array of (nRhs+1) SPs */
@@ -1899,6 +2898,16 @@ static int seekInLevel(
   int res = -1;                   /* Result of xCmp(pKey, split) */
   int nRhs = pLvl->nRight;        /* Number of right-hand-side segments */
   int bStop = 0;
+  int bSkip = 0;                  /* True if segments may be skipped */
+  int bLastSkip = 0;              /* True if final segment may be skipped */
+
+  /* Run trailers are only used by client cursors seeking for user keys.
+  ** And a segment may only be skipped if the FC pointer that would be 
+  ** obtained by searching it is not required to search the next segment.  */
+  if( iTopic==0 && pCsr->pSnap ){
+    bSkip = 1;
+    bLastSkip = !sortedLevelUsesPtr(pLvl->pNext);
+  }
 
   /* If this is a composite level (one currently undergoing an incremental
   ** merge), figure out if the search key is larger or smaller than the
@@ -1916,8 +2925,8 @@ static int seekInLevel(
     int iPtr = 0;
     if( nRhs==0 ) iPtr = *piPgno;
 
-    rc = seekInSegment(
-        pCsr, &aPtr[0], iTopic, pKey, nKey, iPtr, eSeek, &iOut, &bStop
+    rc = seekInSegment(pCsr, &aPtr[0], iTopic, pKey, nKey, 
+        iPtr, eSeek, (nRhs==0 && bLastSkip), &iOut, &bStop
     );
     if( rc==LSM_OK && nRhs>0 && eSeek==LSM_SEEK_GE && aPtr[0].pPg==0 ){
       res = 0;
@@ -1930,23 +2939,54 @@ static int seekInLevel(
     int i;
     for(i=1; rc==LSM_OK && i<=nRhs && bStop==0; i++){
       SegmentPtr *pPtr = &aPtr[i];
+      int bSkipRhs = (i==nRhs ? bLastSkip : (bSkip && pLvl->aRhs[i].iRoot));
       iOut = 0;
       rc = seekInSegment(
-          pCsr, pPtr, iTopic, pKey, nKey, iPtr, eSeek, &iOut, &bStop
+          pCsr, pPtr, iTopic, pKey, nKey, iPtr, eSeek, bSkipRhs, &iOut, &bStop
       );
       iPtr = iOut;
 
       /* If the segment-pointer has settled on a key that is smaller than
-      ** the splitkey, invalidate the segment-pointer.  */
+      ** the splitkey, invalidate the segment-pointer. Unless it is an LE
+      ** seek and the key opens a range-delete. In that case the range
+      ** extends past the split-key to a key larger than pKey/nKey, so
+      ** point the segment-pointer at a delete marker on the split-key
+      ** instead, as segmentPtrAdvance() does when iterating backwards.
+      **
+      ** Or unless it is a GE seek. This happens when pKey/nKey is smaller
+      ** than the split-key but the left-hand-side of the level contains
+      ** no keys larger than or equal to it. The first key visited in this
+      ** level is then the first key in the rhs segment that is not smaller
+      ** than the split-key, so advance the segment-pointer to it.  */
       if( pPtr->pPg ){
         res = sortedKeyCompare(pCsr->pDb->xCmp, 
             rtTopic(pPtr->eType), pPtr->pKey, pPtr->nKey, 
             pLvl->iSplitTopic, pLvl->pSplitKey, pLvl->nSplitKey
         );
-        if( res<0 ) segmentPtrReset(pPtr);
+        while( rc==LSM_OK && res<0 && eSeek==LSM_SEEK_GE ){
+          rc = segmentPtrAdvance(pCsr, pPtr, 0);
+          if( rc!=LSM_OK || pPtr->pPg==0 ) break;
+          res = sortedKeyCompare(pCsr->pDb->xCmp,
+              rtTopic(pPtr->eType), pPtr->pKey, pPtr->nKey,
+              pLvl->iSplitTopic, pLvl->pSplitKey, pLvl->nSplitKey
+          );
+        }
+        if( rc==LSM_OK && pPtr->pPg && res<0 ){
+          if( eSeek==LSM_SEEK_LE && (pPtr->eType & LSM_START_DELETE) ){
+            pPtr->eType = LSM_START_DELETE | LSM_POINT_DELETE;
+            pPtr->eType |= (pLvl->iSplitTopic ? LSM_SYSTEMKEY : 0);
+            pPtr->pKey = pLvl->pSplitKey;
+            pPtr->nKey = pLvl->nSplitKey;
+            pPtr->pVal = 0;
+            pPtr->nVal = 0;
+            pPtr->iKeyCell = -1;
+          }else{
+            segmentPtrReset(pPtr);
+          }
+        }
       }
 
-      if( aPtr[i].pKey ) bHit = 1;
+      if( aPtr[i].pPg ) bHit = 1;
     }
 
     if( rc==LSM_OK && eSeek==LSM_SEEK_LE && bHit==0 ){
@@ -1971,9 +3011,8 @@ static void multiCursorGetKey(
   void *pKey = 0;
   int eType = 0;
 
-  switch( iKey ){
-    case CURSOR_DATA_TREE0:
-    case CURSOR_DATA_TREE1: {
+  switch( mcursorIsTree(iKey) ? CURSOR_DATA_TREE0 : iKey ){
+    case CURSOR_DATA_TREE0: {
       TreeCursor *pTreeCsr = pCsr->apTreeCsr[iKey-CURSOR_DATA_TREE0];
       if( lsmTreeCursorValid(pTreeCsr) ){
         int nVal;
@@ -2217,13 +3256,15 @@ static void mcursorFreeComponents(MultiCursor *pCsr){
   int i;
   lsm_env *pEnv = pCsr->pDb->pEnv;
 
-  /* Close the tree cursor, if any. */
-  lsmTreeCursorDestroy(pCsr->apTreeCsr[0]);
-  lsmTreeCursorDestroy(pCsr->apTreeCsr[1]);
+  /* Close the tree cursors, if any. */
+  for(i=0; i<CURSOR_NTREE; i++){
+    lsmTreeCursorDestroy(pCsr->apTreeCsr[i]);
+  }
 
   /* Reset the segment pointers */
   for(i=0; i<pCsr->nPtr; i++){
     segmentPtrReset(&pCsr->aPtr[i]);
+    fingerFree(pEnv, pCsr->aPtr[i].pFinger);
   }
 
   /* And the b-tree cursor, if any */
@@ -2240,9 +3281,9 @@ static void mcursorFreeComponents(MultiCursor *pCsr){
   pCsr->nTree = 0;
   pCsr->aTree = 0;
   pCsr->pSystemVal = 0;
-  pCsr->apTreeCsr[0] = 0;
-  pCsr->apTreeCsr[1] = 0;
+  memset(pCsr->apTreeCsr, 0, sizeof(pCsr->apTreeCsr));
   pCsr->pBtCsr = 0;
+  pCsr->pSnap = 0;
 }
 
 void lsmMCursorFreeCache(lsm_db *pDb){
@@ -2287,8 +3328,13 @@ void lsmMCursorClose(MultiCursor *pCsr, int bCache){
       }
 
       /* Reset the tree cursors */
-      lsmTreeCursorReset(pCsr->apTreeCsr[0]);
-      lsmTreeCursorReset(pCsr->apTreeCsr[1]);
+      for(i=0; i<CURSOR_NTREE; i++){
+        lsmTreeCursorReset(pCsr->apTreeCsr[i]);
+      }
+
+      /* Clear any bounds set by lsm_csr_set_bounds() */
+      pCsr->lower.nData = 0;
+      pCsr->upper.nData = 0;
 
       /* Add the cursor to the pCsrCache list */
       pCsr->pNext = pDb->pCsrCache;
@@ -2297,6 +3343,8 @@ void lsmMCursorClose(MultiCursor *pCsr, int bCache){
       /* Free the allocation used to cache the current key, if any. */
       sortedBlobFree(&pCsr->key);
       sortedBlobFree(&pCsr->val);
+      sortedBlobFree(&pCsr->lower);
+      sortedBlobFree(&pCsr->upper);
 
       /* Free the component cursors */
       mcursorFreeComponents(pCsr);
@@ -2312,18 +3360,41 @@ void lsmMCursorClose(MultiCursor *pCsr, int bCache){
 #define TREE_BOTH 2
 
 /*
-** Parameter eTree is one of TREE_OLD or TREE_BOTH.
+** Replace any cursors on old in-memory trees in pCsr->apTreeCsr[] with 
+** cursors on the old trees that have not yet been flushed to disk 
+** according to snapshot pSnap, newest first. If bOldest is true, open 
+** a cursor on the oldest such tree only.
+*/
+static int multiCursorAddOld(MultiCursor *pCsr, Snapshot *pSnap, int bOldest){
+  int rc = LSM_OK;
+  lsm_db *db = pCsr->pDb;
+  int nOld = lsmTreeHasOld(db);
+  int iFirst = lsmTreeFirstUnflushed(db, pSnap->iLogOff);
+  int i;
+
+  if( bOldest ) nOld = LSM_MIN(nOld, iFirst+1);
+  for(i=1; i<CURSOR_NTREE; i++){
+    lsmTreeCursorDestroy(pCsr->apTreeCsr[i]);
+    pCsr->apTreeCsr[i] = 0;
+  }
+  for(i=nOld; rc==LSM_OK && i>iFirst; i--){
+    rc = lsmTreeCursorNew(db, i, &pCsr->apTreeCsr[nOld-i+1]);
+  }
+  return rc;
+}
+
+/*
+** Parameter eTree is one of TREE_OLD or TREE_BOTH. If it is TREE_OLD, add
+** a cursor on the oldest in-memory tree that has not yet been flushed. Or,
+** if it is TREE_BOTH, on all unflushed old trees and the current tree.
 */
 static int multiCursorAddTree(MultiCursor *pCsr, Snapshot *pSnap, int eTree){
   int rc = LSM_OK;
   lsm_db *db = pCsr->pDb;
 
-  /* Add a tree cursor on the 'old' tree, if it exists. */
-  if( eTree!=TREE_NONE 
-   && lsmTreeHasOld(db) 
-   && db->treehdr.iOldLog!=pSnap->iLogOff 
-  ){
-    rc = lsmTreeCursorNew(db, 1, &pCsr->apTreeCsr[1]);
+  /* Add tree cursors on the 'old' trees, if they exist. */
+  if( eTree!=TREE_NONE ){
+    rc = multiCursorAddOld(pCsr, pSnap, eTree==TREE_OLD);
   }
 
   /* Add a tree cursor on the 'current' tree, if required. */
@@ -2352,7 +3423,53 @@ static int multiCursorAddRhs(MultiCursor *pCsr, Level *pLvl){
   return LSM_OK;
 }
 
-static void multiCursorAddOne(MultiCursor *pCsr, Level *pLvl, int *pRc){
+/*
+** Make sure the split-key of level pLvl, which must be undergoing a merge,
+** has been loaded. 
+**
+** If bShared is true, pLvl belongs to a client snapshot that may be shared
+** with connections running in other threads. In this case pLvl->pSplitKey
+** is only accessed while holding the client snapshot mutex. The key is
+** loaded without holding the mutex, then published under it - unless 
+** another connection has loaded it in the meantime, in which case the copy
+** loaded by this call is discarded.
+*/
+static void sortedSplitkey(lsm_db *pDb, Level *pLvl, int bShared, int *pRc){
+  int bLoad;
+
+  if( bShared ) lsmClientSnapshotEnter(pDb);
+  bLoad = (pLvl->pSplitKey==0);
+  if( bShared ) lsmClientSnapshotLeave(pDb);
+
+  if( bLoad && *pRc==LSM_OK ){
+    int iTopic = 0;
+    Blob blob = {0, 0, 0, 0};
+    *pRc = sortedSplitkeyLoad(pDb, pLvl, &iTopic, &blob);
+    if( *pRc==LSM_OK ){
+      if( bShared ) lsmClientSnapshotEnter(pDb);
+      if( pLvl->pSplitKey==0 ){
+        pLvl->iSplitTopic = iTopic;
+        pLvl->pSplitKey = blob.pData;
+        pLvl->nSplitKey = blob.nData;
+        blob.pData = 0;
+      }
+      if( bShared ) lsmClientSnapshotLeave(pDb);
+    }
+    sortedBlobFree(&blob);
+  }
+}
+
+/*
+** Add the segments of level pLvl to cursor pCsr. If pLvl is undergoing a
+** merge, also make sure its split-key has been loaded. Parameter bShared
+** is passed through to sortedSplitkey().
+*/
+static void multiCursorAddOne(
+  MultiCursor *pCsr,              /* Cursor to add segments to */
+  Level *pLvl,                    /* Level to add */
+  int bShared,                    /* True if pLvl is part of a client snapshot */
+  int *pRc                        /* IN/OUT: Error code */
+){
   if( *pRc==LSM_OK ){
     int iPtr = pCsr->nPtr;
     int i;
@@ -2365,9 +3482,7 @@ static void multiCursorAddOne(MultiCursor *pCsr, Level *pLvl, int *pRc){
       iPtr++;
     }
 
-    if( pLvl->nRight && pLvl->pSplitKey==0 ){
-      sortedSplitkey(pCsr->pDb, pLvl, pRc);
-    }
+    if( pLvl->nRight ) sortedSplitkey(pCsr->pDb, pLvl, bShared, pRc);
     pCsr->nPtr = iPtr;
   }
 }
@@ -2377,6 +3492,7 @@ static int multiCursorAddAll(MultiCursor *pCsr, Snapshot *pSnap){
   int nPtr = 0;
   int iPtr = 0;
   int rc = LSM_OK;
+  int bShared = (pSnap==pCsr->pDb->pClient);
 
   for(pLvl=pSnap->pLevel; pLvl; pLvl=pLvl->pNext){
     /* If the LEVEL_INCOMPLETE flag is set, then this function is being
@@ -2393,7 +3509,7 @@ static int multiCursorAddAll(MultiCursor *pCsr, Snapshot *pSnap){
 
   for(pLvl=pSnap->pLevel; pLvl; pLvl=pLvl->pNext){
     if( (pLvl->flags & LEVEL_INCOMPLETE)==0 ){
-      multiCursorAddOne(pCsr, pLvl, &rc);
+      multiCursorAddOne(pCsr, pLvl, bShared, &rc);
     }
   }
 
@@ -2407,6 +3523,7 @@ static int multiCursorInit(MultiCursor *pCsr, Snapshot *pSnap){
     rc = multiCursorAddTree(pCsr, pSnap, TREE_BOTH);
   }
   pCsr->flags |= (CURSOR_IGNORE_SYSTEM | CURSOR_IGNORE_DELETE);
+  pCsr->pSnap = pSnap;
   return rc;
 }
 
@@ -2436,7 +3553,7 @@ void lsmSortedRemap(lsm_db *pDb){
 }
 
 static void multiCursorReadSeparators(MultiCursor *pCsr){
-  if( pCsr->nPtr>0 ){
+  if( pCsr && pCsr->nPtr>0 ){
     pCsr->flags |= CURSOR_READ_SEPARATORS;
   }
 }
@@ -2474,7 +3591,6 @@ int lsmMCursorNew(
   int rc = LSM_OK;
 
   if( pDb->pCsrCache ){
-    int bOld;                     /* True if there is an old in-memory tree */
 
     /* Remove a cursor from the pCsrCache list and add it to the open list. */
     pCsr = pDb->pCsrCache;
@@ -2482,15 +3598,11 @@ int lsmMCursorNew(
     pCsr->pNext = pDb->pCsr;
     pDb->pCsr = pCsr;
 
-    /* The cursor can almost be used as is, except that the old in-memory
-    ** tree cursor may be present and not required, or required and not
-    ** present. Fix this if required.  */
-    bOld = (lsmTreeHasOld(pDb) && pDb->treehdr.iOldLog!=pDb->pClient->iLogOff);
-    if( !bOld && pCsr->apTreeCsr[1] ){
-      lsmTreeCursorDestroy(pCsr->apTreeCsr[1]);
-      pCsr->apTreeCsr[1] = 0;
-    }else if( bOld && !pCsr->apTreeCsr[1] ){
-      rc = lsmTreeCursorNew(pDb, 1, &pCsr->apTreeCsr[1]);
+    /* The cursor can almost be used as is, except that the set of old 
+    ** in-memory trees that have not been flushed may have changed. Reopen
+    ** the old tree cursors if there are any old trees. */
+    if( lsmTreeHasOld(pDb) || pCsr->apTreeCsr[1] ){
+      rc = multiCursorAddOld(pCsr, pDb->pClient, 0);
     }
 
   }else{
@@ -2518,9 +3630,8 @@ static int multiCursorGetVal(
   *ppVal = 0;
   *pnVal = 0;
 
-  switch( iVal ){
-    case CURSOR_DATA_TREE0:
-    case CURSOR_DATA_TREE1: {
+  switch( mcursorIsTree(iVal) ? CURSOR_DATA_TREE0 : iVal ){
+    case CURSOR_DATA_TREE0: {
       TreeCursor *pTreeCsr = pCsr->apTreeCsr[iVal-CURSOR_DATA_TREE0];
       if( lsmTreeCursorValid(pTreeCsr) ){
         lsmTreeCursorValue(pTreeCsr, ppVal, pnVal);
@@ -2564,6 +3675,43 @@ static int multiCursorGetVal(
 
 static int multiCursorAdvance(MultiCursor *pCsr, int bReverse);
 
+/*
+** True if bounds have been set on cursor pCsr by lsm_csr_set_bounds().
+*/
+#define mcursorHasBounds(pCsr) ((pCsr)->lower.nData || (pCsr)->upper.nData)
+
+/*
+** Return true if the user key that cursor pCsr currently points to lies
+** outside of the bounds set by lsm_csr_set_bounds(). The cursor must point
+** to a valid entry when this is called.
+*/
+static int multiCursorOutOfBounds(MultiCursor *pCsr){
+  int (*xCmp)(void *, int, void *, int) = pCsr->pDb->xCmp;
+  Blob *pLower = &pCsr->lower;
+  Blob *pUpper = &pCsr->upper;
+  void *pKey;
+  int nKey;
+
+  if( mcursorHasBounds(pCsr)==0 || rtTopic(pCsr->eType) ) return 0;
+  lsmMCursorKey(pCsr, &pKey, &nKey);
+  return (pLower->nData && xCmp(pKey, nKey, pLower->pData, pLower->nData)<0)
+      || (pUpper->nData && xCmp(pKey, nKey, pUpper->pData, pUpper->nData)>=0);
+}
+
+/*
+** If cursor pCsr points to a key outside of the bounds set by
+** lsm_csr_set_bounds(), move it to EOF.
+*/
+static void multiCursorCheckBounds(MultiCursor *pCsr){
+  if( mcursorHasBounds(pCsr) 
+   && lsmMCursorValid(pCsr) 
+   && multiCursorOutOfBounds(pCsr) 
+  ){
+    pCsr->flags &= ~CURSOR_SEEK_EQ;
+    lsmMCursorReset(pCsr);
+  }
+}
+
 /*
 ** This function is called by worker connections to walk the part of the
 ** free-list stored within the LSM data structure.
@@ -2836,9 +3984,9 @@ static int multiCursorSetupTree(MultiCursor *pCsr, int bRev){
     for(i=pCsr->nTree-1; i>0; i--){
       multiCursorDoCompare(pCsr, i, bRev);
     }
+    assertCursorTree(pCsr);
   }
 
-  assertCursorTree(pCsr);
   multiCursorCacheKey(pCsr, &rc);
 
   if( rc==LSM_OK && mcursorLocationOk(pCsr, 0)==0 ){
@@ -2852,12 +4000,12 @@ static int multiCursorEnd(MultiCursor *pCsr, int bLast){
   int rc = LSM_OK;
   int i;
 
-  pCsr->flags &= ~(CURSOR_NEXT_OK | CURSOR_PREV_OK);
+  pCsr->flags &= ~(CURSOR_NEXT_OK | CURSOR_PREV_OK | CURSOR_SEEK_EQ);
   pCsr->flags |= (bLast ? CURSOR_PREV_OK : CURSOR_NEXT_OK);
   pCsr->iFree = 0;
 
-  /* Position the two in-memory tree cursors */
-  for(i=0; rc==LSM_OK && i<2; i++){
+  /* Position the in-memory tree cursors */
+  for(i=0; rc==LSM_OK && i<CURSOR_NTREE; i++){
     if( pCsr->apTreeCsr[i] ){
       rc = lsmTreeCursorEnd(pCsr->apTreeCsr[i], bLast);
     }
@@ -2884,8 +4032,10 @@ static int multiCursorEnd(MultiCursor *pCsr, int bLast){
       assert( pPtr->pSeg==&pLvl->lhs || pPtr->pSeg==&pLvl->aRhs[0] );
 
       if( bLhs ){
+        /* Test pPg, not pKey. If the lhs contains only separator keys,
+        ** segmentPtrEnd() advances past them to EOF and pKey is stale. */
         rc = segmentPtrEnd(pCsr, pPtr, 0);
-        if( pPtr->pKey ) bHit = 1;
+        if( pPtr->pPg ) bHit = 1;
       }
       for(iRhs=0; iRhs<pLvl->nRight && rc==LSM_OK; iRhs++){
         if( bHit ){
@@ -2916,7 +4066,7 @@ int mcursorSave(MultiCursor *pCsr){
   int rc = LSM_OK;
   if( pCsr->aTree ){
     int iTree = pCsr->aTree[1];
-    if( iTree==CURSOR_DATA_TREE0 || iTree==CURSOR_DATA_TREE1 ){
+    if( mcursorIsTree(iTree) ){
       multiCursorCacheKey(pCsr, &rc);
     }
   }
@@ -2956,11 +4106,29 @@ int lsmRestoreCursors(lsm_db *pDb){
 }
 
 int lsmMCursorFirst(MultiCursor *pCsr){
-  return multiCursorEnd(pCsr, 0);
+  int rc;
+  if( pCsr->lower.nData ){
+    rc = lsmMCursorSeek(
+        pCsr, 0, pCsr->lower.pData, pCsr->lower.nData, LSM_SEEK_GE
+    );
+  }else{
+    rc = multiCursorEnd(pCsr, 0);
+    if( rc==LSM_OK ) multiCursorCheckBounds(pCsr);
+  }
+  return rc;
 }
 
 int lsmMCursorLast(MultiCursor *pCsr){
-  return multiCursorEnd(pCsr, 1);
+  int rc;
+  if( pCsr->upper.nData ){
+    rc = lsmMCursorSeek(
+        pCsr, 0, pCsr->upper.pData, pCsr->upper.nData, LSM_SEEK_LE
+    );
+  }else{
+    rc = multiCursorEnd(pCsr, 1);
+    if( rc==LSM_OK ) multiCursorCheckBounds(pCsr);
+  }
+  return rc;
 }
 
 lsm_db *lsmMCursorDb(MultiCursor *pCsr){
@@ -2969,8 +4137,9 @@ lsm_db *lsmMCursorDb(MultiCursor *pCsr){
 
 void lsmMCursorReset(MultiCursor *pCsr){
   int i;
-  lsmTreeCursorReset(pCsr->apTreeCsr[0]);
-  lsmTreeCursorReset(pCsr->apTreeCsr[1]);
+  for(i=0; i<CURSOR_NTREE; i++){
+    lsmTreeCursorReset(pCsr->apTreeCsr[i]);
+  }
   for(i=0; i<pCsr->nPtr; i++){
     segmentPtrReset(&pCsr->aPtr[i]);
   }
@@ -3027,9 +4196,10 @@ static int treeCursorSeek(
 
 
 /*
-** Seek the cursor.
+** Seek the cursor. This function ignores any bounds set by 
+** lsm_csr_set_bounds() - see lsmMCursorSeek() below.
 */
-int lsmMCursorSeek(
+static int multiCursorSeek(
   MultiCursor *pCsr, 
   int iTopic, 
   void *pKey, int nKey, 
@@ -3040,9 +4210,11 @@ int lsmMCursorSeek(
   int rc = LSM_OK;                /* Return code */
   int iPtr = 0;                   /* Used to iterate through pCsr->aPtr[] */
   Pgno iPgno = 0;                 /* FC pointer value */
+  int i;
 
-  assert( pCsr->apTreeCsr[0]==0 || iTopic==0 );
-  assert( pCsr->apTreeCsr[1]==0 || iTopic==0 );
+  for(i=0; i<CURSOR_NTREE; i++){
+    assert( pCsr->apTreeCsr[i]==0 || iTopic==0 );
+  }
 
   if( eESeek==LSM_SEEK_LEFAST ) eESeek = LSM_SEEK_LE;
 
@@ -3051,9 +4223,8 @@ int lsmMCursorSeek(
   assert( pCsr->nPtr==0 || pCsr->aPtr[0].pLevel );
 
   pCsr->flags &= ~(CURSOR_NEXT_OK | CURSOR_PREV_OK | CURSOR_SEEK_EQ);
-  rc = treeCursorSeek(pCsr, pCsr->apTreeCsr[0], pKey, nKey, eESeek, &bStop);
-  if( rc==LSM_OK && bStop==0 ){
-    rc = treeCursorSeek(pCsr, pCsr->apTreeCsr[1], pKey, nKey, eESeek, &bStop);
+  for(i=0; rc==LSM_OK && bStop==0 && i<CURSOR_NTREE; i++){
+    rc = treeCursorSeek(pCsr, pCsr->apTreeCsr[i], pKey, nKey, eESeek, &bStop);
   }
 
   /* Seek all segment pointers. */
@@ -3096,13 +4267,74 @@ int lsmMCursorSeek(
   return rc;
 }
 
+/*
+** Seek the cursor. If bounds have been set by lsm_csr_set_bounds(), an
+** LSM_SEEK_GE or LSM_SEEK_LE search key outside of them is replaced by 
+** the nearest bound before seeking, and an LSM_SEEK_EQ search for a key 
+** outside of them leaves the cursor at EOF without searching at all.
+*/
+int lsmMCursorSeek(
+  MultiCursor *pCsr, 
+  int iTopic, 
+  void *pKey, int nKey, 
+  int eSeek
+){
+  int rc = LSM_OK;
+
+  if( iTopic==0 && mcursorHasBounds(pCsr) ){
+    int (*xCmp)(void *, int, void *, int) = pCsr->pDb->xCmp;
+    Blob *pLower = &pCsr->lower;
+    Blob *pUpper = &pCsr->upper;
+    int bUpper = 0;               /* True if seeking to the upper bound */
+
+    if( eSeek==LSM_SEEK_EQ ){
+      if( (pLower->nData && xCmp(pKey, nKey, pLower->pData, pLower->nData)<0)
+       || (pUpper->nData && xCmp(pKey, nKey, pUpper->pData, pUpper->nData)>=0)
+      ){
+        pCsr->flags &= ~(CURSOR_NEXT_OK | CURSOR_PREV_OK | CURSOR_SEEK_EQ);
+        lsmMCursorReset(pCsr);
+        return LSM_OK;
+      }
+    }else if( eSeek==LSM_SEEK_GE ){
+      if( pLower->nData && xCmp(pKey, nKey, pLower->pData, pLower->nData)<0 ){
+        pKey = pLower->pData;
+        nKey = pLower->nData;
+      }
+    }else{
+      if( pUpper->nData && xCmp(pKey, nKey, pUpper->pData, pUpper->nData)>=0 ){
+        pKey = pUpper->pData;
+        nKey = pUpper->nData;
+        bUpper = 1;
+      }
+    }
+
+    rc = multiCursorSeek(pCsr, 0, pKey, nKey, eSeek);
+
+    /* The upper bound is exclusive. So if an LSM_SEEK_LE or LSM_SEEK_LEFAST
+    ** seek that used it as the search key found an exact match, step back
+    ** one entry.  */
+    if( rc==LSM_OK && bUpper && lsmMCursorValid(pCsr) ){
+      void *pCsrKey; int nCsrKey;
+      lsmMCursorKey(pCsr, &pCsrKey, &nCsrKey);
+      if( xCmp(pCsrKey, nCsrKey, pKey, nKey)==0 ){
+        rc = multiCursorAdvance(pCsr, 1);
+      }
+    }
+    if( rc==LSM_OK ) multiCursorCheckBounds(pCsr);
+  }else{
+    rc = multiCursorSeek(pCsr, iTopic, pKey, nKey, eSeek);
+  }
+
+  return rc;
+}
+
 int lsmMCursorValid(MultiCursor *pCsr){
   int res = 0;
   if( pCsr->flags & CURSOR_SEEK_EQ ){
     res = 1;
   }else if( pCsr->aTree ){
     int iKey = pCsr->aTree[1];
-    if( iKey==CURSOR_DATA_TREE0 || iKey==CURSOR_DATA_TREE1 ){
+    if( mcursorIsTree(iKey) ){
       res = lsmTreeCursorValid(pCsr->apTreeCsr[iKey-CURSOR_DATA_TREE0]);
     }else{
       void *pKey; 
@@ -3143,6 +4375,10 @@ static int mcursorAdvanceOk(
     multiCursorCacheKey(pCsr, pRc);
     assert( pCsr->eType==eNewType );
 
+    /* If the cursor has moved outside of the bounds set by 
+    ** lsm_csr_set_bounds(), stop here. The caller moves it to EOF.  */
+    if( *pRc==LSM_OK && multiCursorOutOfBounds(pCsr) ) return 1;
+
     /* If this cursor is configured to skip deleted keys, and the current
     ** cursor points to a SORTED_DELETE entry, then the cursor has not been 
     ** successfully advanced.  
@@ -3182,6 +4418,56 @@ static void flCsrAdvance(MultiCursor *pCsr){
   }
 }
 
+/*
+** Segment pointer pPtr belongs to a merge cursor (one with the 
+** CURSOR_VALUE_GC flag set) and is about to be advanced past its current
+** record. If the record refers to a value in a value segment, the 
+** reference is being dropped. Subtract the size of the value from the live
+** byte count of the value segment. If the count drops to zero, delete the
+** segment.
+**
+** The active value segment (aValue[0]) may be deleted too. It cannot be 
+** in use by the current merge, as any values written by the merge are 
+** still live. While there are sealed segments, an empty active segment is
+** left in aValue[0]. Once no value segments remain, nValue is set to 0.
+*/
+static int sortedValueRelease(MultiCursor *pCsr, SegmentPtr *pPtr){
+  int rc = LSM_OK;
+  if( pPtr->pPg && (pPtr->eType & LSM_VALUEREF) ){
+    lsm_db *pDb = pCsr->pDb;
+    Snapshot *pWorker = pDb->pWorker;
+    Pgno iId, iPg;
+    int iOff, nVal;
+    int iSeg = -1;
+
+    rc = sortedValueRefDecode(pPtr->pVal, pPtr->nVal, &iId, &iPg, &iOff, &nVal);
+    if( rc==LSM_OK ){
+      iSeg = sortedFindValueSegment(pWorker, iId);
+      if( iSeg<0 ) rc = LSM_CORRUPT_BKPT;
+    }
+    if( rc==LSM_OK ){
+      ValueSegment *p = &pWorker->aValue[iSeg];
+      p->nLive -= nVal;
+      if( p->nLive<=0 ){
+        if( iSeg==0 ) rc = lsmFsSortedFinish(pDb->pFS, &p->seg);
+        if( rc==LSM_OK ){
+          rc = lsmFsSortedDelete(pDb->pFS, pWorker, 1, &p->seg);
+        }
+        if( iSeg>0 ){
+          pWorker->nValue--;
+          memmove(p, &p[1], sizeof(ValueSegment) * (pWorker->nValue - iSeg));
+        }else{
+          memset(p, 0, sizeof(ValueSegment));
+        }
+        if( pWorker->nValue==1 && pWorker->aValue[0].seg.iFirst==0 ){
+          pWorker->nValue = 0;
+        }
+      }
+    }
+  }
+  return rc;
+}
+
 static int multiCursorAdvance(MultiCursor *pCsr, int bReverse){
   int rc = LSM_OK;                /* Return Code */
   if( lsmMCursorValid(pCsr) ){
@@ -3205,7 +4491,7 @@ static int multiCursorAdvance(MultiCursor *pCsr, int bReverse){
         }
       }
 
-      if( iKey==CURSOR_DATA_TREE0 || iKey==CURSOR_DATA_TREE1 ){
+      if( mcursorIsTree(iKey) ){
         TreeCursor *pTreeCsr = pCsr->apTreeCsr[iKey-CURSOR_DATA_TREE0];
         if( bReverse ){
           rc = lsmTreeCursorPrev(pTreeCsr);
@@ -3220,7 +4506,13 @@ static int multiCursorAdvance(MultiCursor *pCsr, int bReverse){
         assert( bReverse==0 && pCsr->pBtCsr );
         rc = btreeCursorNext(pCsr->pBtCsr);
       }else{
-        rc = segmentCursorAdvance(pCsr, iKey-CURSOR_DATA_SEGMENT, bReverse);
+        if( pCsr->flags & CURSOR_VALUE_GC ){
+          assert( bReverse==0 );
+          rc = sortedValueRelease(pCsr, &pCsr->aPtr[iKey-CURSOR_DATA_SEGMENT]);
+        }
+        if( rc==LSM_OK ){
+          rc = segmentCursorAdvance(pCsr, iKey-CURSOR_DATA_SEGMENT, bReverse);
+        }
       }
       if( rc==LSM_OK ){
         int i;
@@ -3235,13 +4527,45 @@ static int multiCursorAdvance(MultiCursor *pCsr, int bReverse){
 }
 
 int lsmMCursorNext(MultiCursor *pCsr){
+  int rc;
   if( (pCsr->flags & CURSOR_NEXT_OK)==0 ) return LSM_MISUSE_BKPT;
-  return multiCursorAdvance(pCsr, 0);
+  rc = multiCursorAdvance(pCsr, 0);
+  if( rc==LSM_OK ) multiCursorCheckBounds(pCsr);
+  return rc;
 }
 
 int lsmMCursorPrev(MultiCursor *pCsr){
+  int rc;
   if( (pCsr->flags & CURSOR_PREV_OK)==0 ) return LSM_MISUSE_BKPT;
-  return multiCursorAdvance(pCsr, 1);
+  rc = multiCursorAdvance(pCsr, 1);
+  if( rc==LSM_OK ) multiCursorCheckBounds(pCsr);
+  return rc;
+}
+
+/*
+** Set or clear the bounds of client cursor pCsr. See lsm_csr_set_bounds().
+*/
+int lsmMCursorSetBounds(
+  MultiCursor *pCsr, 
+  const void *pLower, int nLower,
+  const void *pUpper, int nUpper
+){
+  lsm_env *pEnv = pCsr->pDb->pEnv;
+  int rc = LSM_OK;
+
+  pCsr->lower.nData = 0;
+  pCsr->upper.nData = 0;
+  if( pLower && nLower>0 ){
+    rc = sortedBlobSet(pEnv, &pCsr->lower, (void *)pLower, nLower);
+  }
+  if( rc==LSM_OK && pUpper && nUpper>0 ){
+    rc = sortedBlobSet(pEnv, &pCsr->upper, (void *)pUpper, nUpper);
+  }
+  if( rc!=LSM_OK ){
+    pCsr->lower.nData = 0;
+    pCsr->upper.nData = 0;
+  }
+  return rc;
 }
 
 int lsmMCursorKey(MultiCursor *pCsr, void **ppKey, int *pnKey){
@@ -3251,7 +4575,7 @@ int lsmMCursorKey(MultiCursor *pCsr, void **ppKey, int *pnKey){
   }else{
     int iKey = pCsr->aTree[1];
 
-    if( iKey==CURSOR_DATA_TREE0 || iKey==CURSOR_DATA_TREE1 ){
+    if( mcursorIsTree(iKey) ){
       TreeCursor *pTreeCsr = pCsr->apTreeCsr[iKey-CURSOR_DATA_TREE0];
       lsmTreeCursorKey(pTreeCsr, 0, ppKey, pnKey);
     }else{
@@ -3308,7 +4632,13 @@ int lsmMCursorValue(MultiCursor *pCsr, void **ppVal, int *pnVal){
     assert( mcursorLocationOk(pCsr, (pCsr->flags & CURSOR_IGNORE_DELETE)) );
 
     rc = multiCursorGetVal(pCsr, pCsr->aTree[1], &pVal, &nVal);
-    if( pVal && rc==LSM_OK ){
+    if( pVal && rc==LSM_OK && (pCsr->eType & LSM_VALUEREF) ){
+      Snapshot *pSnap = pCsr->pSnap;
+      if( pSnap==0 ) pSnap = pCsr->pDb->pWorker;
+      rc = sortedValueLoad(pCsr->pDb, pSnap, pVal, nVal, &pCsr->val);
+      pVal = pCsr->val.pData;
+      nVal = pCsr->val.nData;
+    }else if( pVal && rc==LSM_OK ){
       rc = sortedBlobSet(pCsr->pDb->pEnv, &pCsr->val, pVal, nVal);
       pVal = pCsr->val.pData;
     }
@@ -3383,7 +4713,6 @@ static int mergeWorkerMoveHierarchy(
   for(i=0; rc==LSM_OK && i<nHier; i++){
     Page *pNew = 0;
     rc = lsmFsSortedAppend(pDb->pFS, pDb->pWorker, pMW->pLevel, 1, &pNew);
-    assert( rc==LSM_OK );
 
     if( rc==LSM_OK ){
       u8 *a1; int n1;
@@ -3477,6 +4806,7 @@ static int mergeWorkerLoadHierarchy(MergeWorker *pMW){
             pEnv, apHier, sizeof(Page *)*(nHier+1)
         );
         if( apNew==0 ){
+          lsmFsPageRelease(pPg);
           rc = LSM_NOMEM_BKPT;
           break;
         }
@@ -3774,6 +5104,9 @@ static void mergeWorkerReleaseAll(MergeWorker *pMW){
   lsmFree(pMW->pDb->pEnv, pMW->hier.apHier);
   pMW->hier.apHier = 0;
   pMW->hier.nHier = 0;
+
+  lsmFsPageRelease(pMW->pValPg);
+  pMW->pValPg = 0;
 }
 
 static int keyszToSkip(FileSystem *pFS, int nKey){
@@ -3932,6 +5265,232 @@ static int mergeWorkerFirstPage(MergeWorker *pMW){
   return rc;
 }
 
+/*
+** Return the number of leading bytes that key (aKey/nKey) shares with the
+** last key written by merge-worker pMW, if it may be omitted from cell
+** nRec of the current output page. The restart interval of the page is
+** nRestart, or 0 if prefix compression is not in use.
+**
+** Prefix compression is not used for restart points, or if the previous
+** key written to the page is not available to this merge worker.
+*/
+static int mergeWorkerPrefix(
+  MergeWorker *pMW,               /* Merge worker object */
+  int nRec,                       /* Cell number the key will be written to */
+  int nRestart,                   /* Restart interval of page (or 0) */
+  u8 *aKey, int nKey              /* Key to be written */
+){
+  int nPrefix = 0;
+  if( nRestart && (nRec % nRestart) && pMW->nPrefixRec==nRec ){
+    u8 *aPrev = (u8 *)pMW->prefix.pData;
+    int nMax = LSM_MIN(nKey, pMW->prefix.nData);
+    while( nPrefix<nMax && aPrev[nPrefix]==aKey[nPrefix] ) nPrefix++;
+  }
+  return nPrefix;
+}
+
+/*
+** Persist and release the current value segment page of merge-worker 
+** pMW, if any.
+*/
+static int mergeWorkerValueRelease(MergeWorker *pMW){
+  int rc = LSM_OK;
+  if( pMW->pValPg ){
+    rc = lsmFsPagePersist(pMW->pValPg);
+    lsmFsPageRelease(pMW->pValPg);
+    pMW->pValPg = 0;
+  }
+  return rc;
+}
+
+/*
+** Append a new page to the active value segment of the worker snapshot
+** and make it the current value segment page of merge-worker pMW.
+*/
+static int mergeWorkerValuePage(MergeWorker *pMW){
+  lsm_db *pDb = pMW->pDb;
+  Page *pNext = 0;
+  int rc;
+
+  rc = lsmFsValueAppend(pDb->pFS, &pDb->pWorker->aValue[0].seg, &pNext);
+  if( rc==LSM_OK ){
+    u8 *aData;                    /* Data buffer belonging to page pNext */
+    int nData;                    /* Size of aData[] in bytes */
+
+    rc = mergeWorkerValueRelease(pMW);
+    pMW->pValPg = pNext;
+    pMW->iValOff = 0;
+    aData = fsPageData(pNext, &nData);
+    lsmPutU16(&aData[SEGMENT_NRECORD_OFFSET(nData)], 0);
+    lsmPutU16(&aData[SEGMENT_FLAGS_OFFSET(nData)], SEGMENT_VALUE_FLAG);
+    lsmPutU64(&aData[SEGMENT_POINTER_OFFSET(nData)], 0);
+    pMW->nWork++;
+  }
+  return rc;
+}
+
+/*
+** This is called before merge-worker pMW writes its first value to the
+** active value segment. Pages written to the active segment by earlier
+** merges may already be part of a checkpoint, so the values written by 
+** pMW always start on a new page.
+**
+** If the active value segment has grown to at least VALUE_SEAL_BLOCKS
+** blocks and to at least 1/VALUE_SEAL_RATIO of the combined size of all
+** other value segments, it is first sealed (finished) and a new, empty, 
+** active segment started. This keeps the number of value segments 
+** logarithmic in the total size of the values, while allowing sealed 
+** segments that are no longer in use to be deleted.
+*/
+#define VALUE_SEAL_BLOCKS 4
+#define VALUE_SEAL_RATIO  8
+static int mergeWorkerValueBegin(MergeWorker *pMW){
+  lsm_db *pDb = pMW->pDb;
+  Snapshot *pWorker = pDb->pWorker;
+  int rc = LSM_OK;
+
+  if( pWorker->nValue==0 ){
+    memset(&pWorker->aValue[0], 0, sizeof(ValueSegment));
+    pWorker->nValue = 1;
+  }else if( pWorker->nValue<LSM_MAX_VALUE_SEGMENTS && !lsmDatabaseFull(pDb) ){
+    FileSystem *pFS = pDb->pFS;
+    Segment *pActive = &pWorker->aValue[0].seg;
+    int nMin;                     /* Minimum size of segment to seal */
+    int nOld = 0;                 /* Total size of sealed segments */
+    int i;
+
+    nMin = (lsmFsBlockSize(pFS) / lsmFsPageSize(pFS)) * VALUE_SEAL_BLOCKS;
+    for(i=1; i<pWorker->nValue; i++) nOld += pWorker->aValue[i].seg.nSize;
+    if( pActive->nSize>=LSM_MAX(nMin, nOld/VALUE_SEAL_RATIO) ){
+      rc = lsmFsSortedFinish(pFS, pActive);
+      memmove(&pWorker->aValue[1], &pWorker->aValue[0], 
+          sizeof(ValueSegment) * pWorker->nValue
+      );
+      memset(&pWorker->aValue[0], 0, sizeof(ValueSegment));
+      pWorker->nValue++;
+    }
+  }
+
+  if( rc==LSM_OK ) rc = mergeWorkerValuePage(pMW);
+  return rc;
+}
+
+/*
+** Append the nVal byte value in buffer aVal[] to the active value segment.
+** Encode a reference to it in pMW->aRef[] and set *pnRef to the size of
+** the reference in bytes.
+*/
+static int mergeWorkerValueAppend(
+  MergeWorker *pMW,               /* Merge worker object */
+  u8 *aVal, int nVal,             /* Value to append */
+  int *pnRef                      /* OUT: Size of reference in pMW->aRef[] */
+){
+  Snapshot *pWorker = pMW->pDb->pWorker;
+  int rc = LSM_OK;
+  int nRem = nVal;
+  int nRef = 0;
+  u8 *aData;
+  int nData;
+
+  if( pMW->pValPg==0 ){
+    rc = mergeWorkerValueBegin(pMW);
+  }else{
+    aData = fsPageData(pMW->pValPg, &nData);
+    if( pMW->iValOff>=SEGMENT_EOF(nData, 0) ) rc = mergeWorkerValuePage(pMW);
+  }
+
+  if( rc==LSM_OK ){
+    nRef += lsmVarintPut64(&pMW->aRef[nRef], pWorker->aValue[0].seg.iFirst);
+    nRef += lsmVarintPut64(&pMW->aRef[nRef], lsmFsPageNumber(pMW->pValPg));
+    nRef += lsmVarintPut32(&pMW->aRef[nRef], pMW->iValOff);
+    nRef += lsmVarintPut32(&pMW->aRef[nRef], nVal);
+    assert( nRef<=VALUEREF_MAX_SIZE );
+    pWorker->aValue[0].nLive += nVal;
+  }
+
+  while( rc==LSM_OK && nRem>0 ){
+    int nCopy;
+    aData = fsPageData(pMW->pValPg, &nData);
+    nCopy = LSM_MIN(nRem, SEGMENT_EOF(nData, 0) - pMW->iValOff);
+    memcpy(&aData[pMW->iValOff], &aVal[nVal-nRem], nCopy);
+    pMW->iValOff += nCopy;
+    nRem -= nCopy;
+    if( nRem>0 ) rc = mergeWorkerValuePage(pMW);
+  }
+
+  *pnRef = nRef;
+  return rc;
+}
+
+/*
+** This function is called by mergeWorkerWrite() for each LSM_INSERT 
+** record before it is written to the output run. It decides where the
+** value of the record is to be stored:
+**
+**   * If the value is already stored in a value segment (LSM_VALUEREF is
+**     set), the reference is normally copied to the output as is. But if
+**     the value segment is not the active one and is less than half full
+**     of live values, or if value segments are no longer enabled, the 
+**     value is loaded and written to the output run instead.
+**
+**   * Otherwise, if the value is a user value larger than the configured
+**     LSM_CONFIG_VALUE_THRESHOLD, it is appended to the active value 
+**     segment and a reference to it written to the output run.
+**
+** Before returning, *peType, *ppVal and *pnVal are updated to describe
+** the record to write to the output run.
+*/
+static int mergeWorkerValue(
+  MergeWorker *pMW,               /* Merge worker object */
+  int *peType,                    /* IN/OUT: Record type */
+  void **ppVal, int *pnVal        /* IN/OUT: Record value */
+){
+  lsm_db *pDb = pMW->pDb;
+  Snapshot *pWorker = pDb->pWorker;
+  int eType = *peType;
+  int rc = LSM_OK;
+
+  if( eType & LSM_VALUEREF ){
+    Pgno iId, iPg;
+    int iOff, nVal;
+    int iSeg = -1;
+
+    rc = sortedValueRefDecode(*ppVal, *pnVal, &iId, &iPg, &iOff, &nVal);
+    if( rc==LSM_OK ){
+      iSeg = sortedFindValueSegment(pWorker, iId);
+      if( iSeg<0 ) rc = LSM_CORRUPT_BKPT;
+    }
+    if( rc==LSM_OK ){
+      ValueSegment *p = &pWorker->aValue[iSeg];
+      i64 nByte = (i64)p->seg.nSize * lsmFsPageSize(pDb->pFS);
+      if( pDb->nValueThreshold==0 || (iSeg>0 && p->nLive*2<nByte) ){
+        rc = sortedValueLoad(pDb, pWorker, *ppVal, *pnVal, &pMW->val);
+        if( rc==LSM_OK ){
+          *ppVal = pMW->val.pData;
+          *pnVal = pMW->val.nData;
+          *peType = (eType & ~LSM_VALUEREF);
+        }
+      }else{
+        p->nLive += nVal;
+      }
+    }
+  }else if( pDb->nValueThreshold>0 
+         && *pnVal>pDb->nValueThreshold
+         && rtIsSystem(eType)==0
+         && pDb->compress.xCompress==0
+  ){
+    int nRef = 0;
+    rc = mergeWorkerValueAppend(pMW, (u8 *)*ppVal, *pnVal, &nRef);
+    if( rc==LSM_OK ){
+      *ppVal = (void *)pMW->aRef;
+      *pnVal = nRef;
+      *peType = (eType | LSM_VALUEREF);
+    }
+  }
+
+  return rc;
+}
+
 static int mergeWorkerWrite(
   MergeWorker *pMW,               /* Merge worker object to write into */
   int eType,                      /* One of SORTED_SEPARATOR, WRITE or DELETE */
@@ -3948,14 +5507,21 @@ static int mergeWorkerWrite(
   int nRec;                       /* Number of records on page pPg */
   int iFPtr;                      /* Value of pointer in footer of pPg */
   int iRPtr = 0;                  /* Value of pointer written into record */
-  int iOff;                       /* Current write offset within page pPg */
+  int iOff = 0;                   /* Current write offset within page pPg */
   Segment *pSeg;                  /* Segment being written */
   int flags = 0;                  /* If != 0, flags value for page footer */
   int bFirst = 0;                 /* True for first key of output run */
+  int nRestart = 0;               /* Restart interval of page pPg (or 0) */
+  int nPrefix = 0;                /* Bytes shared with the previous key */
 
   pMerge = pMW->pLevel->pMerge;    
   pSeg = &pMW->pLevel->lhs;
 
+  if( rtIsWrite(eType) ){
+    rc = mergeWorkerValue(pMW, &eType, &pVal, &nVal);
+    if( rc!=LSM_OK ) return rc;
+  }
+
   if( pSeg->iFirst==0 && pMW->pPage==0 ){
     rc = mergeWorkerFirstPage(pMW);
     bFirst = 1;
@@ -3966,6 +5532,12 @@ static int mergeWorkerWrite(
     nRec = pageGetNRec(aData, nData);
     iFPtr = pageGetPtr(aData, nData);
     iRPtr = iPtr - iFPtr;
+    if( nRec==0 ){
+      nRestart = pMW->pDb->nPrefixRestart;
+    }else{
+      nRestart = SEGMENT_PREFIX_RESTART(pageGetFlags(aData, nData));
+    }
+    nPrefix = mergeWorkerPrefix(pMW, nRec, nRestart, (u8 *)pKey, nKey);
   }
      
   /* Figure out how much space is required by the new record. The space
@@ -3979,11 +5551,13 @@ static int mergeWorkerWrite(
   **
   **     1) record type - 1 byte.
   **     2) Page-pointer-offset - 1 varint
-  **     3) Key size - 1 varint
-  **     4) Value size - 1 varint (only if LSM_INSERT flag is set)
+  **     3) Prefix size - 1 varint (only on prefix compressed pages)
+  **     4) Key size - 1 varint
+  **     5) Value size - 1 varint (only if LSM_INSERT flag is set)
   */
   if( rc==LSM_OK ){
-    nHdr = 1 + lsmVarintLen32(iRPtr) + lsmVarintLen32(nKey);
+    nHdr = 1 + lsmVarintLen32(iRPtr) + lsmVarintLen32(nKey-nPrefix);
+    if( nRestart ) nHdr += lsmVarintLen32(nPrefix);
     if( rtIsWrite(eType) ) nHdr += lsmVarintLen32(nVal);
 
     /* If the entire header will not fit on page pPg, or if page pPg is 
@@ -3994,6 +5568,8 @@ static int mergeWorkerWrite(
       iRPtr = iPtr - iFPtr;
       iOff = 0;
       nRec = 0;
+      nRestart = pMW->pDb->nPrefixRestart;
+      nPrefix = 0;
       rc = mergeWorkerNextPage(pMW, iFPtr);
       pPg = pMW->pPage;
     }
@@ -4018,6 +5594,9 @@ static int mergeWorkerWrite(
 
     if( pMerge->nSkip ) flags |= PGFTR_SKIP_NEXT_FLAG;
   }
+  if( nRec==0 && nRestart ){
+    flags |= SEGMENT_PREFIX_FLAG | (nRestart << 8);
+  }
 
   /* Update the output segment */
   if( rc==LSM_OK ){
@@ -4031,13 +5610,25 @@ static int mergeWorkerWrite(
     /* Write the entry header into the current page. */
     aData[iOff++] = eType;                                               /* 1 */
     iOff += lsmVarintPut32(&aData[iOff], iRPtr);                         /* 2 */
-    iOff += lsmVarintPut32(&aData[iOff], nKey);                          /* 3 */
-    if( rtIsWrite(eType) ) iOff += lsmVarintPut32(&aData[iOff], nVal);   /* 4 */
+    if( nRestart ) iOff += lsmVarintPut32(&aData[iOff], nPrefix);        /* 3 */
+    iOff += lsmVarintPut32(&aData[iOff], nKey-nPrefix);                  /* 4 */
+    if( rtIsWrite(eType) ) iOff += lsmVarintPut32(&aData[iOff], nVal);   /* 5 */
     pMerge->iOutputOff = iOff;
 
+    /* Save a copy of the key so that the next key written to the same page
+    ** may be prefix compressed against it.  */
+    if( nRestart ){
+      rc = sortedBlobSet(pMW->pDb->pEnv, &pMW->prefix, pKey, nKey);
+      pMW->nPrefixRec = nRec+1;
+    }
+
     /* Write the key and data into the segment. */
     assert( iFPtr==pageGetPtr(aData, nData) );
-    rc = mergeWorkerData(pMW, 0, iFPtr+iRPtr, pKey, nKey);
+    if( rc==LSM_OK ){
+      rc = mergeWorkerData(
+          pMW, 0, iFPtr+iRPtr, &((u8 *)pKey)[nPrefix], nKey-nPrefix
+      );
+    }
     if( rc==LSM_OK && rtIsWrite(eType) ){
       if( rc==LSM_OK ){
         rc = mergeWorkerData(pMW, 0, iFPtr+iRPtr, pVal, nVal);
@@ -4045,9 +5636,282 @@ static int mergeWorkerWrite(
     }
   }
 
+  /* Count the user keys written to the output segment. This is used to
+  ** size the bloom filter once the merge is complete. A segment that 
+  ** contains range-delete markers may not have a bloom filter.  */
+  if( rc==LSM_OK && rtTopic(eType)==0 && pMerge->nKey>=0 ){
+    if( eType & (LSM_START_DELETE|LSM_END_DELETE) ){
+      pMerge->nKey = -1;
+    }else{
+      pMerge->nKey++;
+    }
+  }
+
+  return rc;
+}
+
+
+/*
+** Iterate through the records in the (complete) output segment of merge 
+** worker pMW. Add each user key to the nBit bit bloom filter aBit[] using
+** nHash hash functions.
+*/
+static int mergeWorkerBloomScan(
+  MergeWorker *pMW,               /* Merge worker object */
+  u8 *aBit,                       /* Bloom filter to populate */
+  u32 nBit,                       /* Size of aBit[] in bits */
+  int nHash                       /* Number of hash functions */
+){
+  lsm_db *pDb = pMW->pDb;
+  Segment *pSeg = &pMW->pLevel->lhs;
+  Blob blob = {0, 0, 0, 0};
+  Blob key = {0, 0, 0, 0};        /* Keys decoded from prefix pages */
+  Page *pPg = 0;
+  int nScan = 0;                  /* Number of keys added to filter */
+  int rc;
+
+  rc = lsmFsDbPageGet(pDb->pFS, pSeg, pSeg->iFirst, &pPg);
+  while( rc==LSM_OK && pPg ){
+    Page *pNext = 0;
+    u8 *aData;
+    int nData;
+
+    aData = fsPageData(pPg, &nData);
+    if( (pageGetFlags(aData, nData) & SEGMENT_BTREE_FLAG)==0 ){
+      int nRec = pageGetNRec(aData, nData);
+      int bPrefix = (pageGetFlags(aData, nData) & SEGMENT_PREFIX_FLAG);
+      int i;
+      for(i=0; rc==LSM_OK && i<nRec; i++){
+        u8 *aCell = pageGetCell(aData, nData, i);
+        int eType = *aCell++;
+        int nCellKey;
+        void *pKey;
+
+        /* Each key on a prefix compressed page may depend on the previous
+        ** one, so every key is decoded, including those skipped below. */
+        if( bPrefix ){
+          rc = sortedPrefixKey(pSeg, pPg, i, 1, &key, &blob);
+          if( rc!=LSM_OK ) break;
+        }
+
+        if( rtTopic(eType) ) continue;
+        assert( (eType & (LSM_START_DELETE|LSM_END_DELETE))==0 );
+        if( bPrefix ){
+          pKey = key.pData;
+          nCellKey = key.nData;
+        }else{
+          int nDummy;
+          aCell += lsmVarintGet32(aCell, &nDummy);
+          aCell += lsmVarintGet32(aCell, &nCellKey);
+          if( rtIsWrite(eType) ) aCell += lsmVarintGet32(aCell, &nDummy);
+          rc = sortedReadData(
+              pSeg, pPg, (aCell-aData), nCellKey, &pKey, &blob
+          );
+        }
+        if( rc==LSM_OK ){
+          u32 h = sortedBloomHash((const u8 *)pKey, nCellKey);
+          sortedBloomBits(aBit, nBit, nHash, h, 0);
+          nScan++;
+        }
+      }
+    }
+
+    if( rc==LSM_OK ) rc = lsmFsDbPageNext(pSeg, pPg, 1, &pNext);
+    lsmFsPageRelease(pPg);
+    pPg = pNext;
+  }
+  lsmFsPageRelease(pPg);
+  sortedBlobFree(&blob);
+  sortedBlobFree(&key);
+
+  assert( rc!=LSM_OK || nScan==pMW->pLevel->pMerge->nKey );
+  return rc;
+}
+
+/*
+** Load copies of the smallest and largest user keys in the (complete) 
+** output segment of merge worker pMW into blobs pMin and pMax. If the
+** segment contains no user keys, set *pbEmpty to true.
+**
+** User keys sort before system keys, so the smallest user key is the first
+** key in the segment, and the largest is the last key in the segment that
+** is not a system key.
+*/
+static int mergeWorkerKeyRange(
+  MergeWorker *pMW,               /* Merge worker object */
+  Blob *pMin,                     /* OUT: Smallest user key */
+  Blob *pMax,                     /* OUT: Largest user key */
+  int *pbEmpty                    /* OUT: True if there are no user keys */
+){
+  lsm_db *pDb = pMW->pDb;
+  Segment *pSeg = &pMW->pLevel->lhs;
+  Page *pPg = 0;
+  int bFound = 0;                 /* True once a user key has been found */
+  int iTopic = 0;
+  int rc;
+
+  /* Find the first user key in the segment that is not just a separator.
+  ** User keys sort before system keys, so stop at the first system key. */
+  rc = lsmFsDbPageGet(pDb->pFS, pSeg, pSeg->iFirst, &pPg);
+  while( rc==LSM_OK && pPg && bFound==0 && iTopic==0 ){
+    Page *pNext = 0;
+    u8 *aData;
+    int nData;
+
+    aData = fsPageData(pPg, &nData);
+    if( (pageGetFlags(aData, nData) & SEGMENT_BTREE_FLAG)==0 ){
+      int nRec = pageGetNRec(aData, nData);
+      int i;
+      for(i=0; i<nRec; i++){
+        u8 *aCell = pageGetCell(aData, nData, i);
+        if( rtTopic(*aCell) ){
+          iTopic = rtTopic(*aCell);
+          break;
+        }
+        if( rtIsSeparatorOnly(*aCell)==0 ){
+          rc = pageGetKeyCopy(pDb->pEnv, pSeg, pPg, i, &iTopic, pMin);
+          bFound = 1;
+          break;
+        }
+      }
+    }
+    if( rc==LSM_OK && bFound==0 && iTopic==0 ){
+      rc = lsmFsDbPageNext(pSeg, pPg, 1, &pNext);
+    }
+    lsmFsPageRelease(pPg);
+    pPg = pNext;
+  }
+  lsmFsPageRelease(pPg);
+  pPg = 0;
+
+  /* Search backwards from the end of the segment for the last user key. */
+  if( rc==LSM_OK && bFound ){
+    rc = lsmFsDbPageLast(pDb->pFS, pSeg, &pPg);
+    bFound = 0;
+    while( rc==LSM_OK && pPg && bFound==0 ){
+      Page *pNext = 0;
+      u8 *aData;
+      int nData;
+
+      aData = fsPageData(pPg, &nData);
+      if( (pageGetFlags(aData, nData) & SEGMENT_BTREE_FLAG)==0 ){
+        int i;
+        for(i=pageGetNRec(aData, nData)-1; rc==LSM_OK && i>=0; i--){
+          u8 *aCell = pageGetCell(aData, nData, i);
+          if( rtTopic(*aCell)==0 && rtIsSeparatorOnly(*aCell)==0 ){
+            rc = pageGetKeyCopy(pDb->pEnv, pSeg, pPg, i, &iTopic, pMax);
+            bFound = 1;
+            break;
+          }
+        }
+      }
+      if( rc==LSM_OK && bFound==0 ){
+        rc = lsmFsDbPageNext(pSeg, pPg, -1, &pNext);
+      }
+      lsmFsPageRelease(pPg);
+      pPg = pNext;
+    }
+    lsmFsPageRelease(pPg);
+    if( rc==LSM_OK && bFound==0 ) rc = LSM_CORRUPT_BKPT;
+  }
+
+  *pbEmpty = (bFound==0);
   return rc;
 }
 
+/*
+** This function is called when the merge being performed by merge-worker
+** pMW has finished and the b-tree hierarchy has been written. Append a
+** trailer to the new segment containing its smallest and largest user 
+** keys and, if the connection is configured to do so, a bloom filter
+** containing all user keys in the segment.
+*/
+static int mergeWorkerTrailer(MergeWorker *pMW){
+  lsm_db *pDb = pMW->pDb;
+  FileSystem *pFS = pDb->pFS;
+  Segment *pSeg = &pMW->pLevel->lhs;
+  int nBitPerKey = pDb->nBloomBits;
+  int rc = LSM_OK;
+  Blob min = {0, 0, 0, 0};        /* Smallest user key in segment */
+  Blob max = {0, 0, 0, 0};        /* Largest user key in segment */
+  int bEmpty = 0;                 /* True if segment has no user keys */
+  int nKey = pMW->pLevel->pMerge->nKey;  /* User keys in segment (or -1) */
+  int nHash = 0;                  /* Number of bloom filter hash functions */
+  u32 nByte = 0;                  /* Size of bloom filter in bytes */
+  int nHdr = 0;                   /* Size of header and keys in bytes */
+  u8 *aBuf = 0;                   /* Trailer contents */
+  int nBuf = 0;                   /* Size of aBuf[] in bytes */
+
+  if( pSeg->iFirst==0 ) return LSM_OK;
+
+  /* Make sure all b-tree pages have been written to the db file before
+  ** scanning the segment.  */
+  lsmFsFlushWaiting(pFS, &rc);
+  if( rc==LSM_OK ) rc = mergeWorkerKeyRange(pMW, &min, &max, &bEmpty);
+
+  /* The bloom filter is sized using the number of user keys counted by
+  ** mergeWorkerWrite(), so that the segment need only be scanned once to 
+  ** populate it.  */
+  if( rc==LSM_OK && nBitPerKey>0 && bEmpty==0 && nKey>=0 ){
+    nHash = sortedBloomNHash(nBitPerKey);
+    nByte = (u32)((LSM_MAX((i64)nKey * nBitPerKey, 64) + 7) / 8);
+  }
+
+  if( rc==LSM_OK ){
+    nHdr = TRAILER_HDR_SIZE + (bEmpty ? 0 : min.nData + max.nData);
+    nBuf = nHdr + (int)nByte;
+    aBuf = (u8 *)lsmMallocZeroRc(pDb->pEnv, nBuf, &rc);
+  }
+  if( rc==LSM_OK ){
+    lsmPutU32(&aBuf[0], nByte);
+    lsmPutU32(&aBuf[4], (u32)nHash);
+    if( bEmpty ){
+      lsmPutU32(&aBuf[8], TRAILER_NO_KEYS);
+      lsmPutU32(&aBuf[12], TRAILER_NO_KEYS);
+    }else{
+      lsmPutU32(&aBuf[8], (u32)min.nData);
+      lsmPutU32(&aBuf[12], (u32)max.nData);
+      memcpy(&aBuf[TRAILER_HDR_SIZE], min.pData, min.nData);
+      memcpy(&aBuf[TRAILER_HDR_SIZE+min.nData], max.pData, max.nData);
+    }
+    if( nByte ){
+      rc = mergeWorkerBloomScan(pMW, &aBuf[nHdr], nByte*8, nHash);
+    }
+  }
+
+  /* Append the trailer to the segment. */
+  if( rc==LSM_OK ){
+    Pgno iFirst = 0;              /* First page of trailer */
+    int iOff = 0;                 /* Bytes of aBuf[] written so far */
+    while( rc==LSM_OK && iOff<nBuf ){
+      Page *pPg = 0;
+      rc = lsmFsSortedAppend(pFS, pDb->pWorker, pMW->pLevel, 0, &pPg);
+      if( rc==LSM_OK ){
+        int nData;
+        u8 *aData = fsPageData(pPg, &nData);
+        int nCopy = LSM_MIN(nBuf-iOff, SEGMENT_EOF(nData, 0));
+
+        memset(aData, 0, nData);
+        memcpy(aData, &aBuf[iOff], nCopy);
+        iOff += nCopy;
+        lsmPutU16(&aData[SEGMENT_FLAGS_OFFSET(nData)], SEGMENT_TRAILER_FLAG);
+        if( iOff==nBuf ){
+          lsmPutU64(&aData[SEGMENT_POINTER_OFFSET(nData)], iFirst);
+        }
+
+        rc = lsmFsPagePersist(pPg);
+        if( iFirst==0 ) iFirst = lsmFsPageNumber(pPg);
+        lsmFsPageRelease(pPg);
+        pMW->nWork++;
+      }
+    }
+  }
+
+  sortedBlobFree(&min);
+  sortedBlobFree(&max);
+  lsmFree(pDb->pEnv, aBuf);
+  return rc;
+}
 
 /*
 ** Free all resources allocated by mergeWorkerInit().
@@ -4057,6 +5921,7 @@ static void mergeWorkerShutdown(MergeWorker *pMW, int *pRc){
   int rc = *pRc;
   MultiCursor *pCsr = pMW->pCsr;
   Hierarchy *p = &pMW->hier;
+  int bDone = (pCsr && lsmMCursorValid(pCsr)==0);
 
   /* Unless the merge has finished, save the cursor position in the
   ** Merge.aInput[] array. See function mergeWorkerInit() for the 
@@ -4098,17 +5963,25 @@ static void mergeWorkerShutdown(MergeWorker *pMW, int *pRc){
 
   lsmMCursorClose(pCsr, 0);
 
-  /* Persist and release the output page. */
+  /* Persist and release the output page and value segment page. */
   if( rc==LSM_OK ) rc = mergeWorkerPersistAndRelease(pMW);
+  if( rc==LSM_OK ) rc = mergeWorkerValueRelease(pMW);
   if( rc==LSM_OK ) rc = mergeWorkerBtreeIndirect(pMW);
   if( rc==LSM_OK ) rc = mergeWorkerFinishHierarchy(pMW);
+  if( rc==LSM_OK && bDone ) rc = mergeWorkerTrailer(pMW);
   if( rc==LSM_OK ) rc = mergeWorkerAddPadding(pMW);
-  lsmFsFlushWaiting(pMW->pDb->pFS, &rc);
+
+  /* If an error has occurred, releasing the b-tree hierarchy pages may
+  ** add them to the list of pages waiting to be written. So release all
+  ** pages before flushing (or, following an error, discarding) that list. */
   mergeWorkerReleaseAll(pMW);
+  lsmFsFlushWaiting(pMW->pDb->pFS, &rc);
 
   lsmFree(pMW->pDb->pEnv, pMW->aGobble);
   pMW->aGobble = 0;
   pMW->pCsr = 0;
+  sortedBlobFree(&pMW->prefix);
+  sortedBlobFree(&pMW->val);
 
   *pRc = rc;
 }
@@ -4235,6 +6108,15 @@ static int mergeWorkerStep(MergeWorker *pMW){
   iVal = pCsr->aTree[1];
   mergeRangeDeletes(pCsr, &iVal, &eType);
 
+  /* The value written to the output comes from the record identified by
+  ** iVal. So the LSM_VALUEREF flag must be taken from the same record. */
+  eType &= ~LSM_VALUEREF;
+  if( rtIsWrite(eType) ){
+    int eValType = 0;
+    multiCursorGetKey(pCsr, iVal, &eValType, 0, 0);
+    eType |= (eValType & LSM_VALUEREF);
+  }
+
   if( eType!=0 ){
     if( pMW->aGobble ){
       int iGobble = pCsr->aTree[1] - CURSOR_DATA_SEGMENT;
@@ -4335,7 +6217,7 @@ static int sortedNewToplevel(
       if( (pNext->flags & LEVEL_FREELIST_ONLY) ){
         pDel = pNext;
         pCsr->aPtr = lsmMallocZeroRc(pDb->pEnv, sizeof(SegmentPtr), &rc);
-        multiCursorAddOne(pCsr, pNext, &rc);
+        multiCursorAddOne(pCsr, pNext, 0, &rc);
       }else if( eTree!=TREE_NONE && pNext->lhs.iRoot ){
         pLinked = &pNext->lhs;
         rc = btreeCursorNew(pDb, pLinked, &pCsr->pBtCsr);
@@ -4418,6 +6300,20 @@ static int sortedNewToplevel(
     sortedInvokeWorkHook(pDb);
   }
 
+  /* Record the newest old tree flushed to disk in the worker snapshot. This
+  ** is the log offset written to the next checkpoint (see ckptExportLog()).
+  ** The current tree has no log offset of its own.  */
+  if( rc==LSM_OK && eTree!=TREE_NONE ){
+    int nOld = lsmTreeHasOld(pDb);
+    int iFlushed = nOld-1;
+    if( eTree==TREE_OLD ){
+      iFlushed = lsmTreeFirstUnflushed(pDb, pDb->pWorker->iLogOff);
+    }
+    if( iFlushed>=0 && iFlushed<nOld ){
+      pDb->pWorker->iLogOff = pDb->treehdr.aOld[iFlushed].iLog;
+    }
+  }
+
   if( pnWrite ) *pnWrite = nWrite;
   pDb->pWorker->nWrite += nWrite;
   pDb->pFreelist = 0;
@@ -4476,6 +6372,7 @@ static int sortedMergeSetup(
     for(i=0; i<nMerge; i++){
       assert( p->nRight==0 );
       pNext = p->pNext;
+      pNew->iAge = LSM_MAX(pNew->iAge, p->iAge);
       pNew->aRhs[i] = p->lhs;
       if( (p->flags & LEVEL_FREELIST_ONLY)==0 ) bFreeOnly = 0;
       sortedFreeLevel(pDb->pEnv, p);
@@ -4508,6 +6405,14 @@ static int sortedMergeSetup(
     pNew->pMerge = pMerge;
   }
 
+  /* If an OOM occurred before pNew was linked into the worker snapshot,
+  ** free it. Otherwise it is freed along with the snapshot, which the
+  ** caller discards.  */
+  if( rc!=LSM_OK ){
+    if( pNew && pNew->nRight==0 ) sortedFreeLevel(pDb->pEnv, pNew);
+    pNew = 0;
+  }
+
   *ppNew = pNew;
   return rc;
 }
@@ -4543,7 +6448,7 @@ static int mergeWorkerInit(
   */
   pCsr = multiCursorNew(pDb, &rc);
   if( pCsr ){
-    pCsr->flags |= CURSOR_NEXT_OK;
+    pCsr->flags |= (CURSOR_NEXT_OK | CURSOR_VALUE_GC);
     rc = multiCursorAddRhs(pCsr, pLevel);
   }
   if( rc==LSM_OK && pMerge->nInput > pLevel->nRight ){
@@ -4623,13 +6528,13 @@ static int sortedBtreeGobble(
     aPg = lsmMallocZeroRc(pDb->pEnv, sizeof(Pgno)*32, &rc);
     if( rc==LSM_OK ){
       rc = seekInBtree(pCsr, pSeg, 
-          rtTopic(pCsr->eType), pCsr->key.pData, pCsr->key.nData, aPg, 0
+          rtTopic(pCsr->eType), pCsr->key.pData, pCsr->key.nData, aPg, 0, 0
       ); 
     }
 
     if( rc==LSM_OK ){
       for(nPg=0; aPg[nPg]; nPg++);
-      lsmFsGobble(pDb, pSeg, aPg, nPg);
+      rc = lsmFsGobble(pDb, pSeg, aPg, nPg);
     }
 
     lsmFree(pDb->pEnv, aPg);
@@ -4651,21 +6556,121 @@ static int sortedCountLevels(Level *p){
   return nRet;
 }
 
-static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
-  Level *pTopLevel = lsmDbSnapshotLevel(pDb->pWorker);
+/*
+** Return the total size in pages of all segments in level p.
+*/
+static i64 sortedLevelSize(Level *p){
+  i64 nSize = p->lhs.nSize;
+  int i;
+  for(i=0; i<p->nRight; i++){
+    nSize += p->aRhs[i].nSize;
+  }
+  return nSize;
+}
+
+/*
+** Return true if the LSM_COMPACTION_LEVELED policy may make trivial moves.
+** Because trivial moves allow more levels to accumulate, they are only 
+** made while the structure contains fewer than half the number of 
+** segments that would cause lsmDatabaseFull() to return true.
+*/
+static int sortedTrivialMoveOk(lsm_db *pDb){
+  Level *p;
+  int nSeg = pDb->pWorker->nValue;
+  for(p=lsmDbSnapshotLevel(pDb->pWorker); p; p=p->pNext){
+    nSeg += (p->nRight ? p->nRight : 1);
+  }
+  return (nSeg < SORTED_MAX_TRIVIAL_SEGMENTS);
+}
+
+/*
+** Return true if the trailers of the nLevel levels starting at pFirst show
+** that no two of the levels contain user keys from overlapping ranges. If
+** any of the levels has no trailer, or an error occurs while reading the
+** trailers, return false. None of the levels may be undergoing a merge.
+**
+** An error is not returned to the caller here. If the database is corrupt
+** or an IO error occurs, it will be reported when the levels are merged.
+*/
+static int sortedLevelsDisjoint(lsm_db *pDb, Level *pFirst, int nLevel){
+  int (*xCmp)(void *, int, void *, int) = pDb->xCmp;
   int rc = LSM_OK;
-  Level *pLevel = 0;            /* Output value */
+  int bRet = 0;
+  Trailer **apTrailer;
+  Level *p;
+  int i, j;
+
+  apTrailer = (Trailer **)lsmMallocRc(pDb->pEnv, sizeof(Trailer*)*nLevel, &rc);
+  for(p=pFirst, i=0; rc==LSM_OK && i<nLevel; p=p->pNext, i++){
+    assert( p->nRight==0 );
+    apTrailer[i] = sortedWorkerTrailer(pDb, &p->lhs, &rc);
+    if( rc!=LSM_OK || apTrailer[i]->bRange==0 ) break;
+  }
+
+  if( rc==LSM_OK && i==nLevel ){
+    bRet = 1;
+    for(i=0; bRet && i<nLevel; i++){
+      Trailer *p1 = apTrailer[i];
+      for(j=i+1; bRet && j<nLevel && p1->nMin>=0; j++){
+        Trailer *p2 = apTrailer[j];
+        if( p2->nMin>=0 
+         && xCmp(p1->aMin, p1->nMin, p2->aMax, p2->nMax)<=0
+         && xCmp(p2->aMin, p2->nMin, p1->aMax, p1->nMax)<=0
+        ){
+          bRet = 0;
+        }
+      }
+    }
+  }
+
+  lsmFree(pDb->pEnv, apTrailer);
+  return bRet;
+}
+
+/*
+** Increment the age of each of the nLevel levels starting at pFirst.
+*/
+static void sortedRelabelLevels(Level *pFirst, int nLevel){
+  Level *p = pFirst;
+  int i;
+  for(i=0; i<nLevel; i++){
+    p->iAge++;
+    p = p->pNext;
+  }
+}
+
+/*
+** The following functions implement the compaction policies that may be
+** selected using LSM_CONFIG_COMPACTION. Each identifies a level to work on
+** by setting *ppBest. If *ppBest is a level with no merge underway, it
+** is the first of *pnBest contiguous levels that should be merged together.
+** Otherwise, the merge underway at *ppBest should be continued and *pnBest
+** is ignored. If there is no work to do, *ppBest is left set to NULL.
+**
+** The output of a merge is assigned an age one greater than that of the
+** first level merged, or the age of the oldest level merged, whichever 
+** is larger. See sortedMergeSetup().
+*/
+
+/*
+** LSM_COMPACTION_TIERED: Find the longest contiguous run of levels not 
+** currently undergoing a merge with the same age in the structure. Or the
+** level being merged with the largest number of right-hand segments.
+*/
+static void sortedSelectTiered(
+  lsm_db *pDb,                    /* Database handle */
+  int nMerge,                     /* Minimum levels to merge */
+  Level **ppBest,                 /* OUT: Level to work on */
+  int *pnBest                     /* OUT: Number of levels to merge */
+){
+  Level *pTopLevel = lsmDbSnapshotLevel(pDb->pWorker);
+  Level *pLevel = 0;            /* Used to iterate through levels */
   Level *pBest = 0;             /* Best level to work on found so far */
   int nBest;                    /* Number of segments merged at pBest */
   Level *pThis = 0;             /* First in run of levels with age=iAge */
   int nThis = 0;                /* Number of levels starting at pThis */
 
-  assert( nMerge>=1 );
   nBest = LSM_MAX(1, nMerge-1);
-
-  /* Find the longest contiguous run of levels not currently undergoing a 
-  ** merge with the same age in the structure. Or the level being merged
-  ** with the largest number of right-hand segments. Work on it. */
   for(pLevel=pTopLevel; pLevel; pLevel=pLevel->pNext){
     if( pLevel->nRight==0 && pThis && pLevel->iAge==pThis->iAge ){
       nThis++;
@@ -4697,6 +6702,175 @@ static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
     nBest = nThis;
   }
 
+  *ppBest = pBest;
+  *pnBest = nBest;
+}
+
+/*
+** LSM_COMPACTION_HYBRID: As for LSM_COMPACTION_TIERED, except that if the
+** levels selected are immediately followed by the last level in the 
+** structure, and the last level is no more than nMerge times the size of
+** the levels selected, the last level is merged as well.
+*/
+static void sortedSelectHybrid(
+  lsm_db *pDb,                    /* Database handle */
+  int nMerge,                     /* Minimum levels to merge */
+  Level **ppBest,                 /* OUT: Level to work on */
+  int *pnBest                     /* OUT: Number of levels to merge */
+){
+  sortedSelectTiered(pDb, nMerge, ppBest, pnBest);
+  if( *ppBest && (*ppBest)->nRight==0 ){
+    Level *pAfter = *ppBest;
+    i64 nSize = 0;
+    int i;
+    for(i=0; i<*pnBest; i++){
+      nSize += sortedLevelSize(pAfter);
+      pAfter = pAfter->pNext;
+    }
+    if( pAfter && pAfter->pNext==0 && pAfter->nRight==0 
+     && sortedLevelSize(pAfter)<=nSize*nMerge
+    ){
+      (*pnBest)++;
+    }
+  }
+}
+
+/*
+** LSM_COMPACTION_LEVELED: Each run of levels with the same age N (usually
+** just one level) is assigned a score. For N==0 (levels flushed from the
+** in-memory tree), the score is the number of levels divided by nMerge.
+** Otherwise, it is the total size of the levels divided by the target
+** size for age N. The run with the highest score of 1.0 or greater is
+** merged, along with the following level if it has age N+1.
+**
+** If the selected run consists of a single level and there is no level
+** of age N+1 following it, the level is relabeled as age N+1 without
+** rewriting any data, and the selection is repeated.
+**
+** Trivial moves: Where the run trailers show that the key ranges of a
+** run of levels do not overlap, merging them would only concatenate their
+** contents. So, provided the structure has room for more levels (see
+** sortedTrivialMoveOk()), a run of up to nMerge levels of age N>0 with
+** disjoint key ranges is scored by size alone instead of being merged
+** because it contains more than one level. And if the run selected does
+** not overlap any level of the age N+1 run that follows it, its levels
+** are relabeled as age N+1 instead of being merged with the first level
+** of that run. Or, if this would leave more than nMerge levels of age
+** N+1, the selected run is merged by itself into a single new level of
+** age N+1. With monotonically increasing keys, this means each record
+** is rewritten roughly once for each age instead of once each time the
+** level it belongs to is merged with a newer one.
+*/
+static void sortedSelectLeveled(
+  lsm_db *pDb,                    /* Database handle */
+  int nMerge,                     /* Levels of age 0 to merge */
+  Level **ppBest,                 /* OUT: Level to work on */
+  int *pnBest                     /* OUT: Number of levels to merge */
+){
+  const i64 nMaxTarget = ((i64)1 << 40);
+  Level *pTopLevel = lsmDbSnapshotLevel(pDb->pWorker);
+  i64 nBase;                      /* Target size for age 1, in pages */
+  Level *pLevel;
+  Level *pBest = 0;
+  int nBest = 0;
+  int bTrivial;                   /* True if trivial moves are allowed */
+
+  /* If a merge is already underway, continue it. */
+  for(pLevel=pTopLevel; pLevel; pLevel=pLevel->pNext){
+    if( pLevel->nRight ){
+      *ppBest = pLevel;
+      *pnBest = pLevel->nRight;
+      return;
+    }
+  }
+
+  nBase = ((i64)pDb->nLevelBase * 1024) / lsmFsPageSize(pDb->pFS);
+  nBase = LSM_MAX(nBase, 1);
+  bTrivial = sortedTrivialMoveOk(pDb);
+  while( pBest==0 ){
+    i64 iBestScore = 999;         /* Score of pBest, times 1000 */
+    Level *pAfter = 0;
+    int i;
+
+    for(pLevel=pTopLevel; pLevel; pLevel=pAfter){
+      int nThis = sortedCountLevels(pLevel);
+      i64 iScore;
+
+      pAfter = pLevel;
+      if( pLevel->iAge==0 ){
+        for(i=0; i<nThis; i++) pAfter = pAfter->pNext;
+        iScore = (i64)nThis * 1000 / nMerge;
+      }else{
+        i64 nSize = 0;
+        i64 nTarget = nBase;
+        for(i=0; i<nThis; i++){
+          nSize += sortedLevelSize(pAfter);
+          pAfter = pAfter->pNext;
+        }
+        for(i=1; i<pLevel->iAge && nTarget<nMaxTarget; i++){
+          nTarget = nTarget * pDb->nLevelRatio;
+        }
+        iScore = nSize * 1000 / nTarget;
+        if( nThis>1 && iScore<1000 && (bTrivial==0 || nThis>nMerge
+         || sortedLevelsDisjoint(pDb, pLevel, nThis)==0
+        )){
+          iScore = 1000;
+        }
+      }
+
+      if( iScore>iBestScore ){
+        pBest = pLevel;
+        nBest = nThis;
+        iBestScore = iScore;
+      }
+    }
+    if( pBest==0 ) break;
+
+    /* Find the level following the selected run. If it is of age N+1,
+    ** include it in the merge, unless a trivial move is possible. 
+    ** Otherwise, if the selected run is a single level or a run of levels
+    ** with disjoint key ranges, relabel it and try again.  */
+    pAfter = pBest;
+    for(i=0; i<nBest; i++) pAfter = pAfter->pNext;
+    if( pAfter && pAfter->nRight==0 && pAfter->iAge==pBest->iAge+1 ){
+      int nNext = sortedCountLevels(pAfter);
+      if( bTrivial==0 || sortedLevelsDisjoint(pDb, pBest, nBest+nNext)==0 ){
+        nBest++;
+      }else if( nBest==1 || nBest+nNext<=nMerge ){
+        sortedRelabelLevels(pBest, nBest);
+        pBest = 0;
+      }
+    }else if( nBest==1 || (bTrivial && nBest<=nMerge 
+           && sortedLevelsDisjoint(pDb, pBest, nBest)
+    )){
+      sortedRelabelLevels(pBest, nBest);
+      pBest = 0;
+    }
+  }
+
+  *ppBest = pBest;
+  *pnBest = nBest;
+}
+
+static int sortedSelectLevel(lsm_db *pDb, int nMerge, Level **ppOut){
+  Level *pTopLevel = lsmDbSnapshotLevel(pDb->pWorker);
+  int rc = LSM_OK;
+  Level *pLevel = 0;            /* Used to iterate through levels */
+  Level *pBest = 0;             /* Level to work on */
+  int nBest = 0;                /* Number of segments merged at pBest */
+
+  assert( nMerge>=1 );
+
+  /* A call to lsm_work() with nMerge==1 always uses the tiered policy, 
+  ** so that the database is eventually merged into a single segment. */
+  if( nMerge==1 || pDb->eCompaction==LSM_COMPACTION_TIERED ){
+    sortedSelectTiered(pDb, nMerge, &pBest, &nBest);
+  }else if( pDb->eCompaction==LSM_COMPACTION_LEVELED ){
+    sortedSelectLeveled(pDb, nMerge, &pBest, &nBest);
+  }else{
+    sortedSelectHybrid(pDb, nMerge, &pBest, &nBest);
+  }
+
   if( pBest==0 && nMerge==1 ){
     int nFree = 0;
     int nUsr = 0;
@@ -4776,8 +6950,11 @@ static int sortedMoveBlock(lsm_db *pDb, int *pnWrite){
   *pnWrite = 0;
 
   /* Check that the redirect array is not already full. If it is, return
-  ** without moving any database content.  */
+  ** without moving any database content. Blocks are also not moved if the
+  ** database contains any value segments, as then the last block in the 
+  ** file may not belong to the single remaining sorted run.  */
   if( p->redirect.n>=LSM_MAX_BLOCK_REDIRECTS ) return LSM_OK;
+  if( p->nValue>0 ) return LSM_OK;
 
   /* Find the last block of content in the database file. Do this by 
   ** traversing the free-list in reverse (descending block number) order.
@@ -4917,7 +7094,7 @@ static int sortedWork(
   assert( pWorker );
   if( lsmDbSnapshotLevel(pWorker)==0 ) return LSM_OK;
 
-  while( nRemaining>0 ){
+  while( rc==LSM_OK && nRemaining>0 ){
     Level *pLevel = 0;
 
     /* Find a level to work on. */
@@ -4998,12 +7175,12 @@ static int sortedWork(
         ** the lhs of the level.  */
         if( mergeWorkerDone(&mergeworker)==0 ){
           int i;
-          for(i=0; i<pLevel->nRight; i++){
+          for(i=0; rc==LSM_OK && i<pLevel->nRight; i++){
             SegmentPtr *pGobble = &mergeworker.pCsr->aPtr[i];
             if( pGobble->pSeg->iRoot ){
               rc = sortedBtreeGobble(pDb, mergeworker.pCsr, i);
             }else if( mergeworker.aGobble[i] ){
-              lsmFsGobble(pDb, pGobble->pSeg, &mergeworker.aGobble[i], 1);
+              rc = lsmFsGobble(pDb, pGobble->pSeg, &mergeworker.aGobble[i], 1);
             }
           }
         }else{
@@ -5105,7 +7282,8 @@ static int sortedWork(
 /*
 ** The database connection passed as the first argument must be a worker
 ** connection. This function checks if there exists an "old" in-memory tree
-** ready to be flushed to disk. If so, true is returned. Otherwise false.
+** ready to be flushed to disk - one that is not already part of the worker
+** snapshot. If so, true is returned. Otherwise false.
 **
 ** If an error occurs, *pRc is set to an LSM error code before returning.
 ** It is assumed that *pRc is set to LSM_OK when this function is called.
@@ -5117,8 +7295,7 @@ static int sortedTreeHasOld(lsm_db *pDb, int *pRc){
   assert( pDb->pWorker );
   if( *pRc==LSM_OK ){
     if( rc==LSM_OK 
-        && pDb->treehdr.iOldShmid
-        && pDb->treehdr.iOldLog!=pDb->pWorker->iLogOff 
+        && lsmTreeFirstUnflushed(pDb, pDb->pWorker->iLogOff)<lsmTreeHasOld(pDb)
       ){
       bRet = 1;
     }else{
@@ -5140,10 +7317,15 @@ static int sortedNewFreelistOnly(lsm_db *pDb){
 
 int lsmSaveWorker(lsm_db *pDb, int bFlush){
   Snapshot *p = pDb->pWorker;
+  int rc = LSM_OK;
   if( p->freelist.nEntry>pDb->nMaxFreelist ){
-    int rc = sortedNewFreelistOnly(pDb);
-    if( rc!=LSM_OK ) return rc;
+    rc = sortedNewFreelistOnly(pDb);
   }
+
+  /* Other connections may read the pages written by this worker as soon
+  ** as the snapshot is saved. So write out any batched pages first.  */
+  lsmFsFlushBatch(pDb->pFS, &rc);
+  if( rc!=LSM_OK ) return rc;
   return lsmCheckpointSaveWorker(pDb, bFlush);
 }
 
@@ -5195,7 +7377,10 @@ static int doLsmSingleWork(
   if( pDb->nTransOpen==0 ){
     rc = lsmTreeLoadHeader(pDb, 0);
   }
-  if( sortedTreeHasOld(pDb, &rc) ){
+  /* Old trees are flushed one at a time, oldest first. Each flush is
+  ** saved as a separate snapshot, so that writers may discard each old
+  ** tree as soon as it is safely on disk.  */
+  while( nRem>0 && sortedTreeHasOld(pDb, &rc) ){
     /* sortedDbIsFull() returns non-zero if either (a) there are too many
     ** levels in total in the db, or (b) there are too many levels with the
     ** the same age in the db. Either way, call sortedWork() to merge 
@@ -5213,12 +7398,12 @@ static int doLsmSingleWork(
       rc = sortedNewToplevel(pDb, TREE_OLD, &nPg);
       nRem -= nPg;
       if( rc==LSM_OK ){
-        if( pDb->nTransOpen>0 ){
-          lsmTreeDiscardOld(pDb);
-        }
         rc = lsmSaveWorker(pDb, 1);
         bDirty = 0;
       }
+      if( rc==LSM_OK && pDb->nTransOpen>0 ){
+        lsmTreeDiscardFlushed(pDb, pDb->pWorker->iLogOff);
+      }
     }
   }
 
@@ -5313,8 +7498,6 @@ int lsm_work(lsm_db *pDb, int nMerge, int nKB, int *pnWrite){
   if( pDb->nTransOpen || pDb->pCsr ) return LSM_MISUSE_BKPT;
   if( nMerge<=0 ) nMerge = pDb->nMerge;
 
-  lsmFsPurgeCache(pDb->pFS);
-
   /* Convert from KB to pages */
   nPgsz = lsmFsPageSize(pDb->pFS);
   if( nKB>=0 ){
@@ -5357,6 +7540,199 @@ int lsm_flush(lsm_db *db){
   return rc;
 }
 
+/*
+** Write the entries returned by callback xNext to a new segment and link
+** it into the worker snapshot as the new top level. The caller must be
+** holding the WORKER lock, and the in-memory tree must be empty.
+**
+** The new level is assigned an age one greater than that of the oldest
+** existing level, so that it is not merged with the small segments
+** created by subsequent flushes until they have caught up with it.
+*/
+static int sortedBulkLoad(
+  lsm_db *pDb,                    /* Database handle */
+  int (*xNext)(void *, const void **, int *, const void **, int *),
+  void *pCtx,                     /* First argument passed to xNext */
+  int *pnWrite                    /* OUT: Number of database pages written */
+){
+  int rc = LSM_OK;                /* Return Code */
+  MultiCursor *pCsr = 0;          /* Empty cursor used by merge-worker */
+  Level *pNext;                   /* The current top level */
+  Level *pNew;                    /* The new level itself */
+  Level *p;
+  int nWrite = 0;                 /* Number of database pages written */
+
+  assert( pDb->pWorker && pDb->bUseFreelist==0 );
+
+  pNext = lsmDbSnapshotLevel(pDb->pWorker);
+  pNew = (Level *)lsmMallocZeroRc(pDb->pEnv, sizeof(Level), &rc);
+  if( pNew ){
+    for(p=pNext; p; p=p->pNext){
+      pNew->iAge = LSM_MAX(pNew->iAge, p->iAge+1);
+    }
+    pNew->pNext = pNext;
+    lsmDbSnapshotSetLevel(pDb->pWorker, pNew);
+  }
+
+  /* The merge-worker reads the previous output pointer value via its
+  ** cursor. The new segment contains no pointers to the level below it,
+  ** so the cursor has no inputs and the pointer value is always zero.  */
+  pCsr = multiCursorNew(pDb, &rc);
+  if( rc!=LSM_OK ){
+    lsmMCursorClose(pCsr, 0);
+  }else{
+    Pgno iLeftPtr = 0;
+    Merge merge;                  /* Merge object used to create new level */
+    MergeWorker mergeworker;      /* MergeWorker object for the same purpose */
+    Blob prev;                    /* Copy of previous key written */
+    int bPrev = 0;                /* True once prev is populated */
+    int rcLoad = LSM_OK;          /* Error from xNext, or LSM_MISUSE */
+
+    memset(&merge, 0, sizeof(Merge));
+    memset(&mergeworker, 0, sizeof(MergeWorker));
+    memset(&prev, 0, sizeof(Blob));
+
+    pNew->pMerge = &merge;
+    pNew->flags |= LEVEL_INCOMPLETE;
+    mergeworker.pDb = pDb;
+    mergeworker.pLevel = pNew;
+    mergeworker.pCsr = pCsr;
+    pCsr->pPrevMergePtr = &iLeftPtr;
+
+    /* If xNext fails or returns a key out of order, stop reading entries
+    ** but finish writing the segment as normal, so that the output pages
+    ** are released cleanly. The new level is discarded below.  */
+    while( rc==LSM_OK ){
+      const void *pKey = 0; int nKey = 0;
+      const void *pVal = 0; int nVal = 0;
+
+      rcLoad = xNext(pCtx, &pKey, &nKey, &pVal, &nVal);
+      if( rcLoad!=LSM_OK || pKey==0 ) break;
+
+      if( nKey<0 || nVal<0 || (bPrev && 0<=pDb->xCmp(
+              prev.pData, prev.nData, (void *)pKey, nKey
+      )) ){
+        rcLoad = LSM_MISUSE_BKPT;
+        break;
+      }
+      rc = sortedBlobSet(pDb->pEnv, &prev, (void *)pKey, nKey);
+      bPrev = 1;
+      if( rc==LSM_OK ){
+        rc = mergeWorkerWrite(&mergeworker, LSM_INSERT,
+            (void *)pKey, nKey, (void *)pVal, nVal, 0
+        );
+      }
+    }
+    sortedBlobFree(&prev);
+
+    mergeWorkerShutdown(&mergeworker, &rc);
+    if( rc==LSM_OK && pNew->lhs.iFirst ){
+      rc = lsmFsSortedFinish(pDb->pFS, &pNew->lhs);
+    }
+    if( rc==LSM_OK ) rc = rcLoad;
+    nWrite = mergeworker.nWork;
+    pNew->flags &= ~LEVEL_INCOMPLETE;
+    pNew->pMerge = 0;
+  }
+
+  if( rc!=LSM_OK || pNew->lhs.iFirst==0 ){
+    lsmDbSnapshotSetLevel(pDb->pWorker, pNext);
+    sortedFreeLevel(pDb->pEnv, pNew);
+  }else{
+#if LSM_LOG_STRUCTURE
+    lsmSortedDumpStructure(pDb, pDb->pWorker, LSM_LOG_DATA, 0, "bulk-load");
+#endif
+    assertBtreeOk(pDb, &pNew->lhs);
+    sortedInvokeWorkHook(pDb);
+  }
+
+  if( pnWrite ) *pnWrite = nWrite;
+  pDb->pWorker->nWrite += nWrite;
+  return rc;
+}
+
+/*
+** Write the contents of the in-memory trees to disk as a new top-level
+** segment. Parameter eTree is TREE_OLD to flush the unflushed old trees
+** only, or TREE_BOTH to flush the current tree as well.
+*/
+static int sortedFlushTrees(lsm_db *pDb, int eTree){
+  int rc;
+
+  rc = lsmBeginWork(pDb);
+  while( rc==LSM_OK && sortedDbIsFull(pDb) ){
+    rc = sortedWork(pDb, 256, pDb->nMerge, 1, 0);
+  }
+
+  if( rc==LSM_OK ){
+    rc = sortedNewToplevel(pDb, eTree, 0);
+  }
+
+  lsmFinishWork(pDb, 1, &rc);
+  return rc;
+}
+
+int lsm_bulk_load(
+  lsm_db *db,
+  int (*xNext)(void *, const void **, int *, const void **, int *),
+  void *pCtx
+){
+  int rc;
+
+  if( db->nTransOpen>0 || db->pCsr ){
+    rc = LSM_MISUSE_BKPT;
+  }else{
+    /* Take the WRITER lock for the duration of the load. Flush the
+    ** contents of the in-memory tree (if any) to disk first, as the
+    ** loaded data must be newer than anything already in the database.
+    **
+    ** The current tree is moved to the queue of old trees before it is
+    ** flushed. This way the checkpoint written by the flush records the
+    ** current end of the log file and its checksums. Otherwise it would
+    ** point to a log offset before the records in the current tree, and
+    ** recovery would replay them over the loaded data. If the queue is
+    ** full, the old trees are flushed to make room first.  */
+    rc = lsmBeginWriteTrans(db);
+    if( rc==LSM_OK && lsmTreeSize(db)>0 && lsmTreeMakeOld(db)==0 ){
+      rc = sortedFlushTrees(db, TREE_OLD);
+      if( rc==LSM_OK ){
+        lsmTreeDiscardOld(db);
+        if( lsmTreeMakeOld(db)==0 ) rc = LSM_BUSY;
+      }
+    }
+    if( rc==LSM_OK && lsmTreeHasOld(db) ){
+      rc = sortedFlushTrees(db, TREE_BOTH);
+      if( rc==LSM_OK ) lsmTreeDiscardOld(db);
+    }
+
+    if( rc==LSM_OK ){
+      rc = lsmBeginWork(db);
+      while( rc==LSM_OK && sortedDbIsFull(db) ){
+        rc = sortedWork(db, 256, db->nMerge, 1, 0);
+      }
+      if( rc==LSM_OK ){
+        rc = sortedBulkLoad(db, xNext, pCtx, 0);
+      }
+      lsmFinishWork(db, 0, &rc);
+    }
+
+    if( rc==LSM_OK ){
+      rc = lsmFinishWriteTrans(db, 1);
+    }else{
+      lsmFinishWriteTrans(db, 0);
+    }
+    lsmFinishReadTrans(db);
+
+    /* The loaded data was not written to the log file. It is not durable
+    ** until the snapshot that contains it has been checkpointed.  */
+    if( rc==LSM_OK ){
+      rc = lsm_checkpoint(db, 0);
+    }
+  }
+
+  return rc;
+}
+
 /*
 ** This function is called in auto-work mode to perform merging work on
 ** the data structure. It performs enough merging work to prevent the
@@ -5403,11 +7779,10 @@ int lsmSortedAutoWork(
 
     if( bRestore && pDb->pCsr ){
       lsmMCursorFreeCache(pDb);
-      lsmFreeSnapshot(pDb->pEnv, pDb->pClient);
-      pDb->pClient = 0;
+      lsmClientSnapshotRelease(pDb);
       rc = lsmCheckpointLoad(pDb, 0);
       if( rc==LSM_OK ){
-        rc = lsmCheckpointDeserialize(pDb, 0, pDb->aSnapshot, &pDb->pClient);
+        rc = lsmClientSnapshotLoad(pDb);
       }
       if( rc==LSM_OK ){
         rc = lsmRestoreCursors(pDb);
@@ -5423,19 +7798,7 @@ int lsmSortedAutoWork(
 ** any in-memory trees present (old or current) are written out to disk.
 */
 int lsmFlushTreeToDisk(lsm_db *pDb){
-  int rc;
-
-  rc = lsmBeginWork(pDb);
-  while( rc==LSM_OK && sortedDbIsFull(pDb) ){
-    rc = sortedWork(pDb, 256, pDb->nMerge, 1, 0);
-  }
-
-  if( rc==LSM_OK ){
-    rc = sortedNewToplevel(pDb, TREE_BOTH, 0);
-  }
-
-  lsmFinishWork(pDb, 1, &rc);
-  return rc;
+  return sortedFlushTrees(pDb, TREE_BOTH);
 }
 
 /*
@@ -5544,6 +7907,8 @@ void sortedDumpPage(lsm_db *pDb, Segment *pRun, Page *pPg, int bVals){
       lsmFsDbPageGet(pDb->pFS, pRun, iRef, &pRef);
       aKey = pageGetKey(pRun, pRef, 0, &iTopic, &nKey, &blob);
     }else{
+      /* Only the suffix of a prefix compressed key is shown. */
+      if( flags & SEGMENT_PREFIX_FLAG ) aCell += lsmVarintGet32(aCell, &nKey);
       aCell += lsmVarintGet32(aCell, &nKey);
       if( rtIsWrite(eType) ) aCell += lsmVarintGet32(aCell, &nVal);
       sortedReadData(0, pPg, (aCell-aData), nKey+nVal, (void **)&aKey, &blob);
@@ -5614,6 +7979,10 @@ static void infoCellDump(
       nKey = 11;
     }
   }else{
+    /* Only the suffix of a prefix compressed key is shown. */
+    if( pageGetFlags(aData, nData) & SEGMENT_PREFIX_FLAG ){
+      aCell += lsmVarintGet32(aCell, &nKey);
+    }
     aCell += lsmVarintGet32(aCell, &nKey);
     if( rtIsWrite(eType) ) aCell += lsmVarintGet32(aCell, &nVal);
     sortedReadData(pSeg, pPg, (aCell-aData), nKey+nVal, (void **)&aKey, pBlob);
@@ -5945,8 +8314,10 @@ void lsmSortedFreeLevel(lsm_env *pEnv, Level *pLevel){
 void lsmSortedSaveTreeCursors(lsm_db *pDb){
   MultiCursor *pCsr;
   for(pCsr=pDb->pCsr; pCsr; pCsr=pCsr->pNext){
-    lsmTreeCursorSave(pCsr->apTreeCsr[0]);
-    lsmTreeCursorSave(pCsr->apTreeCsr[1]);
+    int i;
+    for(i=0; i<CURSOR_NTREE; i++){
+      lsmTreeCursorSave(pCsr->apTreeCsr[i]);
+    }
   }
 }
 
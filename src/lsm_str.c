@@ -25,6 +25,9 @@ void lsmStringInit(LsmString *pStr, lsm_env *pEnv){
 /*
 ** Increase the memory allocated for holding the string.  Realloc as needed.
 **
+** The allocation at least doubles in size each time it is increased, so 
+** that building a large string by repeated appends is not quadratic.
+**
 ** If a memory allocation error occurs, set pStr->n to -1 and free the existing
 ** allocation.  If a prior memory allocation has occurred, this routine is a
 ** no-op.
@@ -34,6 +37,9 @@ int lsmStringExtend(LsmString *pStr, int nNew){
   if( pStr->n<0 ) return LSM_NOMEM;
   if( pStr->n + nNew >= pStr->nAlloc ){
     int nAlloc = pStr->n + nNew + 100;
+    if( pStr->nAlloc<(1<<29) && nAlloc<pStr->nAlloc*2 ){
+      nAlloc = pStr->nAlloc*2;
+    }
     char *zNew = lsmRealloc(pStr->pEnv, pStr->z, nAlloc);
     if( zNew==0 ){
       lsmFree(pStr->pEnv, pStr->z);
@@ -94,12 +94,6 @@ typedef struct TreeNode TreeNode;
 typedef struct TreeLeaf TreeLeaf;
 typedef struct NodeVersion NodeVersion;
 
-struct TreeOld {
-  u32 iShmid;                     /* Last shared-memory chunk in use by old */
-  u32 iRoot;                      /* Offset of root node in shm file */
-  u32 nHeight;                    /* Height of tree structure */
-};
-
 #ifndef NDEBUG
 /*
 ** assert() that a TreeKey.flags value is sane. Usage:
@@ -190,6 +184,7 @@ struct TreeBlob {
 struct TreeCursor {
   lsm_db *pDb;                    /* Database handle for this cursor */
   TreeRoot *pRoot;                /* Root node and height of tree to access */
+  TreeRoot oldroot;               /* Copy of root, if pRoot is an old tree */
   int iNode;                      /* Cursor points at apTreeNode[iNode] */
   TreeNode *apTreeNode[MAX_DEPTH];/* Current position in tree */
   u8 aiCell[MAX_DEPTH];           /* Current position in tree */
@@ -557,13 +552,20 @@ void dump_tree_contents(lsm_db *pDb, const char *zCaption){
 
 /*
 ** Initialize a cursor object, the space for which has already been
-** allocated.
+** allocated. If parameter iOld is zero, the cursor is opened on the current
+** in-memory tree. Otherwise, on old tree pDb->treehdr.aOld[iOld-1].
+**
+** Old trees are read-only, so the cursor takes a copy of the root of the
+** old tree. This allows the cursor to remain valid even if aOld[] is
+** modified by lsmTreeDiscardFlushed().
 */
-static void treeCursorInit(lsm_db *pDb, int bOld, TreeCursor *pCsr){
+static void treeCursorInit(lsm_db *pDb, int iOld, TreeCursor *pCsr){
   memset(pCsr, 0, sizeof(TreeCursor));
   pCsr->pDb = pDb;
-  if( bOld ){
-    pCsr->pRoot = &pDb->treehdr.oldroot;
+  if( iOld ){
+    assert( iOld<=(int)pDb->treehdr.nOld );
+    pCsr->oldroot = pDb->treehdr.aOld[iOld-1].root;
+    pCsr->pRoot = &pCsr->oldroot;
   }else{
     pCsr->pRoot = &pDb->treehdr.root;
   }
@@ -1069,7 +1071,34 @@ static int treeInsertLeaf(
   return rc;
 }
 
-void lsmTreeMakeOld(lsm_db *pDb){
+/*
+** Return true if iLog is equal to the snapshot log offset or the iLog 
+** value of any old tree. 
+*/
+static int treeOldLogInUse(lsm_db *pDb, i64 iLog){
+  TreeHeader *p = &pDb->treehdr;
+  int i;
+  if( iLog==pDb->pClient->iLogOff ) return 1;
+  for(i=0; i<(int)p->nOld; i++){
+    if( p->aOld[i].iLog==iLog ) return 1;
+  }
+  return 0;
+}
+
+/*
+** Append the current in-memory tree to the list of old trees and replace
+** it with a new, empty, tree. Return true if successful, or false if there
+** is no room for another old tree. 
+**
+** The queue is considered full if it already contains LSM_CONFIG_MAX_OLD_TREES
+** trees, or if a unique log offset cannot be assigned to the new old tree.
+** The latter only occurs if LSM_CONFIG_USE_LOG is disabled, in which case 
+** log offsets are distinguished by their least significant bit only.
+*/
+int lsmTreeMakeOld(lsm_db *pDb){
+  TreeHeader *p = &pDb->treehdr;
+  TreeOld *pOld;
+  i64 iLog;
 
   /* A write transaction must be open. Otherwise the code below that
   ** assumes (pDb->pClient->iLogOff) is current may malfunction. 
@@ -1079,32 +1108,92 @@ void lsmTreeMakeOld(lsm_db *pDb){
   */
   assert( /* pDb->nTransOpen>0 && */ pDb->iReader>=0 );
 
-  if( pDb->treehdr.iOldShmid==0 ){
-    pDb->treehdr.iOldLog = (pDb->treehdr.log.aRegion[2].iEnd << 1);
-    pDb->treehdr.iOldLog |= (~(pDb->pClient->iLogOff) & (i64)0x0001);
-
-    pDb->treehdr.oldcksum0 = pDb->treehdr.log.cksum0;
-    pDb->treehdr.oldcksum1 = pDb->treehdr.log.cksum1;
-    pDb->treehdr.iOldShmid = pDb->treehdr.iNextShmid-1;
-    memcpy(&pDb->treehdr.oldroot, &pDb->treehdr.root, sizeof(TreeRoot));
+  if( (int)p->nOld>=pDb->nMaxOld ) return 0;
 
-    pDb->treehdr.root.iTransId = 1;
-    pDb->treehdr.root.iRoot = 0;
-    pDb->treehdr.root.nHeight = 0;
-    pDb->treehdr.root.nByte = 0;
+  iLog = (p->log.aRegion[2].iEnd << 1);
+  iLog |= (~(pDb->pClient->iLogOff) & (i64)0x0001);
+  if( treeOldLogInUse(pDb, iLog) ){
+    iLog ^= (i64)0x0001;
+    if( treeOldLogInUse(pDb, iLog) ) return 0;
   }
+
+  pOld = &p->aOld[p->nOld++];
+  pOld->iLog = iLog;
+  pOld->cksum0 = p->log.cksum0;
+  pOld->cksum1 = p->log.cksum1;
+  pOld->iShmid = p->iNextShmid-1;
+  memcpy(&pOld->root, &p->root, sizeof(TreeRoot));
+
+  p->root.iTransId = 1;
+  p->root.iRoot = 0;
+  p->root.nHeight = 0;
+  p->root.nByte = 0;
+  return 1;
 }
 
-void lsmTreeDiscardOld(lsm_db *pDb){
+/*
+** Discard the nDiscard oldest old trees. The shared-memory chunks used by
+** them may be reused once no reader is using them.
+*/
+static void treeDiscardOld(lsm_db *pDb, int nDiscard){
+  TreeHeader *p = &pDb->treehdr;
   assert( lsmShmAssertLock(pDb, LSM_LOCK_WRITER, LSM_LOCK_EXCL) 
        || lsmShmAssertLock(pDb, LSM_LOCK_DMS2, LSM_LOCK_EXCL) 
   );
-  pDb->treehdr.iUsedShmid = pDb->treehdr.iOldShmid;
-  pDb->treehdr.iOldShmid = 0;
+  assert( nDiscard>0 && nDiscard<=(int)p->nOld );
+  p->iUsedShmid = p->aOld[nDiscard-1].iShmid;
+  p->nOld -= nDiscard;
+  memmove(&p->aOld[0], &p->aOld[nDiscard], p->nOld * sizeof(TreeOld));
+  memset(&p->aOld[p->nOld], 0, nDiscard * sizeof(TreeOld));
+}
+
+/*
+** Discard all old trees. This is called after the contents of all trees,
+** old and current, have been flushed to disk.
+*/
+void lsmTreeDiscardOld(lsm_db *pDb){
+  if( pDb->treehdr.nOld>0 ){
+    treeDiscardOld(pDb, (int)pDb->treehdr.nOld);
+  }
+}
+
+/*
+** Discard all old trees that have been flushed to disk according to a
+** snapshot with log offset iLogOff. Return true if one or more trees are
+** discarded, or false otherwise.
+*/
+int lsmTreeDiscardFlushed(lsm_db *pDb, i64 iLogOff){
+  int nFlushed = lsmTreeFirstUnflushed(pDb, iLogOff);
+  if( nFlushed>0 ){
+    treeDiscardOld(pDb, nFlushed);
+  }
+  return (nFlushed>0);
 }
 
+/*
+** Return the number of old trees.
+*/
 int lsmTreeHasOld(lsm_db *pDb){
-  return pDb->treehdr.iOldShmid!=0;
+  return (int)pDb->treehdr.nOld;
+}
+
+/*
+** Return the index in treehdr.aOld[] of the oldest tree that has not been
+** flushed to disk according to a snapshot with log offset iLogOff. If all
+** old trees have been flushed, return treehdr.nOld.
+**
+** Old trees are flushed in order. After aOld[i] has been flushed, the 
+** snapshot log offset is set to aOld[i].iLog. So the first unflushed tree
+** is the one following the tree with an iLog value equal to iLogOff, if
+** any.
+*/
+int lsmTreeFirstUnflushed(lsm_db *pDb, i64 iLogOff){
+  TreeHeader *p = &pDb->treehdr;
+  int i;
+  for(i=(int)p->nOld-1; i>=0; i--){
+    if( p->aOld[i].iLog==iLogOff ) return i+1;
+  }
+  return 0;
 }
 
 /*
@@ -1911,6 +2000,166 @@ int lsmTreeDelete(
   return rc;
 }
 
+/*
+** A single operation decoded from a serialized write batch.
+*/
+typedef struct TreeBatchOp TreeBatchOp;
+struct TreeBatchOp {
+  int eOp;                        /* LSM_BATCH_XXX constant */
+  u8 *pKey; int nKey;             /* Key (or start of range) */
+  u8 *pVal; int nVal;             /* Value (or end of range) */
+};
+
+/*
+** Sort the nOp elements of array aOp[] in key order using a stable
+** merge-sort. Array aSpace[] must be large enough to hold nOp elements.
+*/
+static void treeBatchSort(TreeBatchOp *aOp, TreeBatchOp *aSpace, int nOp){
+  if( nOp>1 ){
+    int n1 = nOp/2;
+    int i1 = 0;
+    int i2 = n1;
+    int iOut = 0;
+
+    treeBatchSort(aOp, aSpace, n1);
+    treeBatchSort(&aOp[n1], aSpace, nOp-n1);
+    while( i1<n1 || i2<nOp ){
+      if( i2>=nOp || (i1<n1 && treeKeycmp(
+              aOp[i1].pKey, aOp[i1].nKey, aOp[i2].pKey, aOp[i2].nKey)<=0
+      )){
+        aSpace[iOut++] = aOp[i1++];
+      }else{
+        aSpace[iOut++] = aOp[i2++];
+      }
+    }
+    memcpy(aOp, aSpace, sizeof(TreeBatchOp) * nOp);
+  }
+}
+
+/*
+** Read a varint from buffer a[], which contains n bytes of valid data.
+** Return the number of bytes consumed, which may be greater than n if
+** the buffer is truncated.
+*/
+static int treeBatchVarint(u8 *a, int n, int *piVal){
+  u8 aVarint[10];
+  memset(aVarint, 0, sizeof(aVarint));
+  memcpy(aVarint, a, LSM_MAX(0, LSM_MIN(n, (int)sizeof(aVarint))));
+  return lsmVarintGet32(aVarint, piVal);
+}
+
+/*
+** Parse the serialized write batch in buffer aBatch[] (size nBatch bytes).
+** If parameter aOp is not NULL, populate it with the decoded operations.
+** Return the number of operations in the batch, or -1 if the buffer is
+** not a well-formed write batch.
+**
+** A serialized write batch is a series of operations, each of which
+** consists of:
+**
+**   * A single LSM_BATCH_INSERT, LSM_BATCH_DELETE or LSM_BATCH_DELETE_RANGE
+**     byte,
+**   * The size of the key (or range start key) in bytes, as a varint,
+**   * For INSERT and DELETE_RANGE operations only, the size of the value
+**     (or range end key) in bytes, as a varint,
+**   * The key data,
+**   * The value (or range end key) data.
+*/
+static int treeBatchParse(u8 *aBatch, int nBatch, TreeBatchOp *aOp){
+  int nOp = 0;
+  int iOff = 0;
+
+  while( iOff<nBatch ){
+    int eOp = aBatch[iOff++];
+    int nKey = 0;
+    int nVal = -1;
+
+    if( eOp<LSM_BATCH_INSERT || eOp>LSM_BATCH_DELETE_RANGE ) return -1;
+    iOff += treeBatchVarint(&aBatch[iOff], nBatch-iOff, &nKey);
+    if( eOp!=LSM_BATCH_DELETE ){
+      iOff += treeBatchVarint(&aBatch[iOff], nBatch-iOff, &nVal);
+      if( nVal<0 ) return -1;
+    }
+    if( iOff>nBatch || nKey<0 || nKey>(nBatch-iOff) ) return -1;
+    if( nVal>(nBatch-iOff-nKey) ) return -1;
+
+    if( aOp ){
+      aOp[nOp].eOp = eOp;
+      aOp[nOp].pKey = &aBatch[iOff];
+      aOp[nOp].nKey = nKey;
+      aOp[nOp].pVal = (nVal>=0 ? &aBatch[iOff+nKey] : 0);
+      aOp[nOp].nVal = nVal;
+    }
+    iOff += nKey + LSM_MAX(nVal, 0);
+    nOp++;
+  }
+
+  return nOp;
+}
+
+/*
+** Apply the operations in serialized write batch aBatch[] (size nBatch
+** bytes) to the in-memory tree. The serialization format is described
+** above treeBatchParse().
+**
+** The result is the same as applying each operation in order. However,
+** each run of insert and delete operations between two delete-range
+** operations is sorted by key before it is applied, so that successive
+** operations descend through the same (cached) tree nodes. Operations
+** that are overwritten by a later operation on the same key within the
+** run are skipped altogether.
+*/
+int lsmTreeInsertBatch(lsm_db *pDb, u8 *aBatch, int nBatch){
+  int rc = LSM_OK;
+  TreeBatchOp *aOp;               /* Decoded operations */
+  int nOp;                        /* Number of entries in aOp[] */
+  int iRun;                       /* Start of current run of point ops */
+  int i;
+
+  /* The batch may have been read from the log file, so check that it is
+  ** well-formed before doing anything else.  */
+  nOp = treeBatchParse(aBatch, nBatch, 0);
+  if( nOp<0 ) return LSM_CORRUPT_BKPT;
+  if( nOp==0 ) return LSM_OK;
+
+  /* Allocate space for the decoded operations and for treeBatchSort(). */
+  aOp = (TreeBatchOp *)lsmMallocRc(pDb->pEnv, sizeof(TreeBatchOp)*nOp*2,&rc);
+  if( rc!=LSM_OK ) return rc;
+  treeBatchParse(aBatch, nBatch, aOp);
+
+  iRun = 0;
+  for(i=0; rc==LSM_OK && i<=nOp; i++){
+    if( i==nOp || aOp[i].eOp==LSM_BATCH_DELETE_RANGE ){
+      int iOp;
+
+      /* Sort and apply the run of point operations aOp[iRun..i-1]. */
+      treeBatchSort(&aOp[iRun], &aOp[nOp], i-iRun);
+      for(iOp=iRun; rc==LSM_OK && iOp<i; iOp++){
+        TreeBatchOp *p = &aOp[iOp];
+        if( iOp+1<i && 0==treeKeycmp(
+              p->pKey, p->nKey, aOp[iOp+1].pKey, aOp[iOp+1].nKey
+        )){
+          continue;
+        }
+        rc = lsmTreeInsert(pDb, p->pKey, p->nKey, p->pVal, p->nVal);
+      }
+
+      /* Apply the delete-range operation, if any. */
+      if( rc==LSM_OK && i<nOp 
+       && treeKeycmp(aOp[i].pKey, aOp[i].nKey, aOp[i].pVal, aOp[i].nVal)<0
+      ){
+        rc = lsmTreeDelete(pDb, 
+            aOp[i].pKey, aOp[i].nKey, aOp[i].pVal, aOp[i].nVal
+        );
+      }
+      iRun = i+1;
+    }
+  }
+
+  lsmFree(pDb->pEnv, aOp);
+  return rc;
+}
+
 /*
 ** Return, in bytes, the amount of memory currently used by the tree 
 ** structure.
@@ -1920,13 +2169,40 @@ int lsmTreeSize(lsm_db *pDb){
 }
 
 /*
-** Open a cursor on the in-memory tree pTree.
+** Return a value indicating how close writers are to being blocked by
+** a full in-memory tree:
+**
+**   0: The current tree is less than 3/4 of the LSM_CONFIG_AUTOFLUSH size.
+**   1: The current tree is at least 3/4 of the LSM_CONFIG_AUTOFLUSH size.
+**   2: The current tree is full and there is no room for another old tree.
+**
+** The tree-header is read directly from shared memory without taking any
+** locks, as the connection may not have a current snapshot (e.g. if it is
+** a background worker). The result is therefore only a hint.
+*/
+int lsmTreePressure(lsm_db *pDb){
+  ShmHeader *pShm = pDb->pShmhdr;
+  int nLimit = pDb->nTreeLimit;
+  int nByte;
+  if( pShm==0 || nLimit<=0 ) return 0;
+  nByte = (int)pShm->hdr1.root.nByte;
+  if( nByte>=nLimit 
+   && (int)pShm->hdr1.nOld>=pDb->nMaxOld 
+  ){
+    return 2;
+  }
+  return (nByte >= (nLimit/4)*3);
+}
+
+/*
+** Open a cursor on the current in-memory tree (if iOld is zero) or on old
+** tree pDb->treehdr.aOld[iOld-1].
 */
-int lsmTreeCursorNew(lsm_db *pDb, int bOld, TreeCursor **ppCsr){
+int lsmTreeCursorNew(lsm_db *pDb, int iOld, TreeCursor **ppCsr){
   TreeCursor *pCsr;
   *ppCsr = pCsr = lsmMalloc(pDb->pEnv, sizeof(TreeCursor));
   if( pCsr ){
-    treeCursorInit(pDb, bOld, pCsr);
+    treeCursorInit(pDb, iOld, pCsr);
     return LSM_OK;
   }
   return LSM_NOMEM_BKPT;
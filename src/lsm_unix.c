@@ -13,9 +13,13 @@
 ** Unix-specific run-time environment implementation for LSM.
 */
 #if defined(__GNUC__) || defined(__TINYC__)
-/* workaround for ftruncate() visibility on gcc. */
+/* workaround for ftruncate(), posix_fadvise() and O_DIRECT visibility 
+** on gcc. */
 # ifndef _XOPEN_SOURCE
-#  define _XOPEN_SOURCE 500
+#  define _XOPEN_SOURCE 600
+# endif
+# ifndef _GNU_SOURCE
+#  define _GNU_SOURCE
 # endif
 #endif
 
@@ -34,8 +38,10 @@
 
 #include <unistd.h>
 #include <errno.h>
+#include <time.h>
 
 #include <sys/mman.h>
+#include <sys/uio.h>
 #include "lsmInt.h"
 
 /* There is no fdatasync() call on Android */
@@ -56,8 +62,22 @@ struct PosixFile {
   off_t nMap;                     /* Size of mapping at pMap in bytes */
   int nShm;                       /* Number of entries in array apShm[] */
   void **apShm;                   /* Array of 32K shared memory segments */
+  int bDirect;                    /* True if fd was opened with O_DIRECT */
+  int nMemAlign;                  /* Buffer alignment required by O_DIRECT */
+  u8 *aBounce;                    /* Aligned buffer for unaligned direct IO */
+  int nBounce;                    /* Size of aBounce[] in bytes */
 };
 
+/*
+** If a file is opened with the LSM_OPEN_DIRECT flag, it is opened with
+** O_DIRECT. Reads and writes of such a file must then begin and end on
+** LSM_POSIX_DIRECT_ALIGN byte boundaries of the file and use buffers 
+** aligned to PosixFile.nMemAlign bytes (initially LSM_POSIX_DIRECT_MEMALIGN).
+** Requests that do not are copied through the PosixFile.aBounce[] buffer.
+*/
+#define LSM_POSIX_DIRECT_ALIGN    4096
+#define LSM_POSIX_DIRECT_MEMALIGN 512
+
 static char *posixShmFile(PosixFile *p){
   char *zShm;
   int nName = strlen(p->zName);
@@ -87,7 +107,16 @@ static int lsmPosixOsOpen(
     memset(p, 0, sizeof(PosixFile));
     p->zName = zFile;
     p->pEnv = pEnv;
-    p->fd = open(zFile, oflags, 0644);
+    p->nMemAlign = LSM_POSIX_DIRECT_MEMALIGN;
+#ifdef O_DIRECT
+    if( flags & LSM_OPEN_DIRECT ){
+      /* If the file-system does not support O_DIRECT (Linux returns EINVAL
+      ** in this case), fall back to buffered IO.  */
+      p->fd = open(zFile, oflags|O_DIRECT, 0644);
+      p->bDirect = (p->fd>=0);
+    }
+#endif
+    if( p->bDirect==0 ) p->fd = open(zFile, oflags, 0644);
     if( p->fd<0 ){
       lsm_free(pEnv, p);
       p = 0;
@@ -103,6 +132,8 @@ static int lsmPosixOsOpen(
   return rc;
 }
 
+static int posixDirectReadWritev(PosixFile*, int, lsm_i64, lsm_iovec*, int);
+
 static int lsmPosixOsWrite(
   lsm_file *pFile,                /* File to write to */
   lsm_i64 iOff,                   /* Offset to write to */
@@ -113,6 +144,13 @@ static int lsmPosixOsWrite(
   PosixFile *p = (PosixFile *)pFile;
   off_t offset;
 
+  if( p->bDirect ){
+    lsm_iovec iov;
+    iov.pData = pData;
+    iov.nData = nData;
+    return posixDirectReadWritev(p, 1, iOff, &iov, 1);
+  }
+
   offset = lseek(p->fd, (off_t)iOff, SEEK_SET);
   if( offset!=iOff ){
     rc = LSM_IOERR_BKPT;
@@ -124,6 +162,180 @@ static int lsmPosixOsWrite(
   return rc;
 }
 
+/*
+** Maximum number of buffers passed to a single readv() or writev() call.
+** This is the smallest value of IOV_MAX permitted by POSIX.
+*/
+#define LSM_POSIX_NIOV 16
+
+/*
+** Read (if bWrite==0) or write (if bWrite!=0) the nIov buffers in array
+** aIov[] from or to file p, starting at offset iOff. If the end of the
+** file is encountered while reading, the remainder of the buffers is 
+** zeroed, as for lsmPosixOsRead().
+*/
+static int posixReadWritev(
+  PosixFile *p,                   /* File to read from or write to */
+  int bWrite,                     /* True to write, false to read */
+  lsm_i64 iOff,                   /* Offset to start at */
+  lsm_iovec *aIov,                /* Array of buffers */
+  int nIov                        /* Number of entries in aIov[] */
+){
+  int i = 0;                      /* First buffer not yet completed */
+  int nDone = 0;                  /* Bytes of aIov[i] already completed */
+
+  if( lseek(p->fd, (off_t)iOff, SEEK_SET)!=iOff ) return LSM_IOERR_BKPT;
+  while( i<nIov ){
+    struct iovec a[LSM_POSIX_NIOV];
+    int n;
+    ssize_t nReq = 0;
+    ssize_t prc;
+    int bEof;
+
+    for(n=0; n<LSM_POSIX_NIOV && i+n<nIov; n++){
+      int iSkip = (n==0 ? nDone : 0);
+      a[n].iov_base = (void *)&((u8 *)aIov[i+n].pData)[iSkip];
+      a[n].iov_len = (size_t)(aIov[i+n].nData - iSkip);
+      nReq += a[n].iov_len;
+    }
+    prc = (bWrite ? writev(p->fd, a, n) : readv(p->fd, a, n));
+    if( prc<0 || (prc==0 && bWrite) ) return LSM_IOERR_BKPT;
+
+    /* A short read from a file opened with O_DIRECT means that the end of
+    ** the file has been reached, as the next read would not be aligned. */
+    bEof = (bWrite==0 && (prc==0 || (p->bDirect && prc<nReq)));
+
+    /* Skip past the buffers completed by this call. writev() may write 
+    ** less than requested, in which case it is called again.  */
+    while( i<nIov && prc>=(aIov[i].nData - nDone) ){
+      prc -= (aIov[i].nData - nDone);
+      nDone = 0;
+      i++;
+    }
+    nDone += (int)prc;
+
+    if( bEof ){
+      /* End of file. Zero the remainder of the buffers. */
+      for(/* no-op */; i<nIov; i++){
+        memset(&((u8 *)aIov[i].pData)[nDone], 0, aIov[i].nData - nDone);
+        nDone = 0;
+      }
+    }
+  }
+
+  return LSM_OK;
+}
+
+/*
+** Read or write the nIov buffers in array aIov[] from or to file p, which 
+** was opened with O_DIRECT, starting at offset iOff. If the request is
+** not suitably aligned, or if it fails because the file-system requires
+** buffers to be aligned more strictly than PosixFile.nMemAlign, the data
+** is copied through the aligned PosixFile.aBounce[] buffer. When writing, 
+** the parts of the first and last LSM_POSIX_DIRECT_ALIGN byte blocks of 
+** the file that are not overwritten are read first.
+*/
+static int posixDirectReadWritev(
+  PosixFile *p,                   /* File to read from or write to */
+  int bWrite,                     /* True to write, false to read */
+  lsm_i64 iOff,                   /* Offset to start at */
+  lsm_iovec *aIov,                /* Array of buffers */
+  int nIov                        /* Number of entries in aIov[] */
+){
+  const int nAlign = LSM_POSIX_DIRECT_ALIGN;
+  int rc = LSM_OK;
+  lsm_i64 iStart;                 /* First byte of aligned region */
+  lsm_i64 iEnd;                   /* First byte past the requested data */
+  lsm_i64 iAlignEnd;              /* First byte past the aligned region */
+  lsm_iovec bounce;               /* Aligned region in aBounce[] */
+  int bAligned = ((iOff % nAlign)==0);
+  u8 *z;
+  int i;
+
+  iEnd = iOff;
+  for(i=0; i<nIov; i++){
+    iEnd += aIov[i].nData;
+    if( (aIov[i].nData % nAlign) || ((size_t)aIov[i].pData % p->nMemAlign) ){
+      bAligned = 0;
+    }
+  }
+  if( bAligned ){
+    rc = posixReadWritev(p, bWrite, iOff, aIov, nIov);
+    if( rc==LSM_OK || errno!=EINVAL ) return rc;
+    p->nMemAlign = nAlign;
+    rc = LSM_OK;
+  }
+
+  /* Make sure the bounce buffer is large enough for the aligned region. */
+  iStart = iOff - (iOff % nAlign);
+  iAlignEnd = iEnd + (nAlign - (iEnd % nAlign)) % nAlign;
+  bounce.nData = (int)(iAlignEnd - iStart);
+  if( bounce.nData>p->nBounce ){
+    void *pNew = 0;
+    free(p->aBounce);
+    p->aBounce = 0;
+    p->nBounce = 0;
+    if( posix_memalign(&pNew, nAlign, bounce.nData) ) return LSM_NOMEM_BKPT;
+    p->aBounce = (u8 *)pNew;
+    p->nBounce = bounce.nData;
+  }
+  bounce.pData = (void *)p->aBounce;
+
+  if( bWrite==0 ){
+    rc = posixReadWritev(p, 0, iStart, &bounce, 1);
+  }else{
+    lsm_iovec edge;
+    edge.nData = nAlign;
+    if( iStart<iOff ){
+      edge.pData = (void *)p->aBounce;
+      rc = posixReadWritev(p, 0, iStart, &edge, 1);
+    }
+    if( rc==LSM_OK && iAlignEnd>iEnd 
+     && (iAlignEnd-nAlign>iStart || iStart==iOff)
+    ){
+      edge.pData = (void *)&p->aBounce[bounce.nData - nAlign];
+      rc = posixReadWritev(p, 0, iAlignEnd - nAlign, &edge, 1);
+    }
+  }
+
+  z = &p->aBounce[iOff - iStart];
+  for(i=0; rc==LSM_OK && i<nIov; i++){
+    if( bWrite ){
+      memcpy(z, aIov[i].pData, aIov[i].nData);
+    }else{
+      memcpy(aIov[i].pData, z, aIov[i].nData);
+    }
+    z += aIov[i].nData;
+  }
+
+  if( rc==LSM_OK && bWrite ){
+    rc = posixReadWritev(p, 1, iStart, &bounce, 1);
+  }
+  return rc;
+}
+
+static int lsmPosixOsReadv(
+  lsm_file *pFile,                /* File to read from */
+  lsm_i64 iOff,                   /* Offset to read from */
+  lsm_iovec *aIov,                /* Read data into these buffers */
+  int nIov                        /* Number of entries in aIov[] */
+){
+  PosixFile *p = (PosixFile *)pFile;
+  if( p->bDirect ) return posixDirectReadWritev(p, 0, iOff, aIov, nIov);
+  return posixReadWritev(p, 0, iOff, aIov, nIov);
+}
+
+static int lsmPosixOsWritev(
+  lsm_file *pFile,                /* File to write to */
+  lsm_i64 iOff,                   /* Offset to write to */
+  lsm_iovec *aIov,                /* Write data from these buffers */
+  int nIov                        /* Number of entries in aIov[] */
+){
+  PosixFile *p = (PosixFile *)pFile;
+  if( p->bDirect ) return posixDirectReadWritev(p, 1, iOff, aIov, nIov);
+  return posixReadWritev(p, 1, iOff, aIov, nIov);
+}
+
 static int lsmPosixOsTruncate(
   lsm_file *pFile,                /* File to write to */
   lsm_i64 nSize                   /* Size to truncate file to */
@@ -152,6 +364,13 @@ static int lsmPosixOsRead(
   PosixFile *p = (PosixFile *)pFile;
   off_t offset;
 
+  if( p->bDirect ){
+    lsm_iovec iov;
+    iov.pData = pData;
+    iov.nData = nData;
+    return posixDirectReadWritev(p, 0, iOff, &iov, 1);
+  }
+
   offset = lseek(p->fd, (off_t)iOff, SEEK_SET);
   if( offset!=iOff ){
     rc = LSM_IOERR_BKPT;
@@ -188,7 +407,8 @@ static int lsmPosixOsSync(lsm_file *pFile){
 }
 
 static int lsmPosixOsSectorSize(lsm_file *pFile){
-  return 512;
+  PosixFile *p = (PosixFile *)pFile;
+  return (p->bDirect ? LSM_POSIX_DIRECT_ALIGN : 512);
 }
 
 static int lsmPosixOsRemap(
@@ -442,6 +662,7 @@ static int lsmPosixOsClose(lsm_file *pFile){
    lsmPosixOsShmUnmap(pFile, 0);
    if( p->pMap ) munmap(p->pMap, p->nMap);
    close(p->fd);
+   free(p->aBounce);
    lsm_free(p->pEnv, p->apShm);
    lsm_free(p->pEnv, p);
    return LSM_OK;
@@ -456,6 +677,42 @@ static int lsmPosixOsSleep(lsm_env *pEnv, int us){
   return LSM_OK;
 }
 
+static int lsmPosixOsCurrentTime(lsm_env *pEnv, lsm_i64 *piUs){
+  struct timespec t;
+  if( clock_gettime(CLOCK_MONOTONIC, &t) ) return LSM_IOERR_BKPT;
+  *piUs = (lsm_i64)t.tv_sec * 1000000 + t.tv_nsec / 1000;
+  return LSM_OK;
+}
+
+/*
+** Tell the OS that the nByte bytes of the file starting at offset iOff
+** will be read soon. This is only a hint - errors are ignored.
+*/
+static int lsmPosixOsReadAhead(lsm_file *pFile, lsm_i64 iOff, lsm_i64 nByte){
+#ifdef POSIX_FADV_WILLNEED
+  PosixFile *p = (PosixFile *)pFile;
+  posix_fadvise(p->fd, (off_t)iOff, (off_t)nByte, POSIX_FADV_WILLNEED);
+#endif
+  return LSM_OK;
+}
+
+/*
+** Allocate space for the nByte bytes of the file starting at offset iOff,
+** extending the file if required. Any data already stored within the 
+** range is not modified. If the platform does not support preallocation,
+** this is a no-op.
+*/
+static int lsmPosixOsFallocate(lsm_file *pFile, lsm_i64 iOff, lsm_i64 nByte){
+  int rc = LSM_OK;
+#if defined(_POSIX_ADVISORY_INFO) && _POSIX_ADVISORY_INFO>0
+  PosixFile *p = (PosixFile *)pFile;
+  if( posix_fallocate(p->fd, (off_t)iOff, (off_t)nByte) ){
+    rc = LSM_IOERR_BKPT;
+  }
+#endif
+  return rc;
+}
+
 /****************************************************************************
 ** Memory allocation routines.
 */
@@ -617,6 +874,96 @@ static int lsmPosixOsMutexNotHeld(lsm_mutex *p){
   return pMutex ? !pthread_equal(pMutex->owner, pthread_self()) : 1;
 }
 #endif
+
+/*
+** Condition variables and threads. These are used to run background
+** work and checkpoint threads (see LSM_CONFIG_BACKGROUND_WORK).
+*/
+typedef struct PthreadCond PthreadCond;
+struct PthreadCond {
+  lsm_env *pEnv;
+  pthread_cond_t cond;
+};
+
+typedef struct PthreadThread PthreadThread;
+struct PthreadThread {
+  lsm_env *pEnv;
+  pthread_t thread;
+  void (*xMain)(void *);
+  void *pArg;
+};
+
+static int lsmPosixOsCondNew(lsm_env *pEnv, lsm_cond **ppNew){
+  PthreadCond *pCond;
+
+  pCond = (PthreadCond *)lsmMallocZero(pEnv, sizeof(PthreadCond));
+  if( !pCond ) return LSM_NOMEM_BKPT;
+  pCond->pEnv = pEnv;
+  pthread_cond_init(&pCond->cond, 0);
+
+  *ppNew = (lsm_cond *)pCond;
+  return LSM_OK;
+}
+
+static void lsmPosixOsCondDel(lsm_cond *p){
+  PthreadCond *pCond = (PthreadCond *)p;
+  pthread_cond_destroy(&pCond->cond);
+  lsmFree(pCond->pEnv, pCond);
+}
+
+static void lsmPosixOsCondWait(lsm_cond *p, lsm_mutex *pMutex){
+  PthreadCond *pCond = (PthreadCond *)p;
+  PthreadMutex *pM = (PthreadMutex *)pMutex;
+#ifdef LSM_DEBUG
+  assert( pthread_equal(pM->owner, pthread_self()) );
+  pM->owner = 0;
+#endif
+  pthread_cond_wait(&pCond->cond, &pM->mutex);
+#ifdef LSM_DEBUG
+  pM->owner = pthread_self();
+#endif
+}
+
+static void lsmPosixOsCondBroadcast(lsm_cond *p){
+  PthreadCond *pCond = (PthreadCond *)p;
+  pthread_cond_broadcast(&pCond->cond);
+}
+
+static void *lsmPosixOsThreadMain(void *pArg){
+  PthreadThread *p = (PthreadThread *)pArg;
+  p->xMain(p->pArg);
+  return 0;
+}
+
+static int lsmPosixOsThreadNew(
+  lsm_env *pEnv,
+  void (*xMain)(void *),
+  void *pArg,
+  lsm_thread **ppNew
+){
+  PthreadThread *p;
+
+  *ppNew = 0;
+  p = (PthreadThread *)lsmMallocZero(pEnv, sizeof(PthreadThread));
+  if( !p ) return LSM_NOMEM_BKPT;
+  p->pEnv = pEnv;
+  p->xMain = xMain;
+  p->pArg = pArg;
+  if( pthread_create(&p->thread, 0, lsmPosixOsThreadMain, (void *)p) ){
+    lsmFree(pEnv, p);
+    return LSM_ERROR;
+  }
+
+  *ppNew = (lsm_thread *)p;
+  return LSM_OK;
+}
+
+static void lsmPosixOsThreadJoin(lsm_thread *pThread){
+  PthreadThread *p = (PthreadThread *)pThread;
+  void *pDummy;
+  pthread_join(p->thread, &pDummy);
+  lsmFree(p->pEnv, p);
+}
 /*
 ** End of pthreads mutex implementation.
 *************************************************************************/
@@ -682,6 +1029,14 @@ static int lsmPosixOsMutexNotHeld(lsm_mutex *pMutex){
   return p ? !p->bHeld : 1;
 }
 #endif
+
+/* Background threads are not available without LSM_MUTEX_PTHREADS */
+#define lsmPosixOsThreadNew     0
+#define lsmPosixOsThreadJoin    0
+#define lsmPosixOsCondNew       0
+#define lsmPosixOsCondDel       0
+#define lsmPosixOsCondWait      0
+#define lsmPosixOsCondBroadcast 0
 /***************************************************************************/
 #endif /* else LSM_MUTEX_NONE */
 
@@ -694,7 +1049,7 @@ static int lsmPosixOsMutexNotHeld(lsm_mutex *pMutex){
 lsm_env *lsm_default_env(void){
   static lsm_env posix_env = {
     sizeof(lsm_env),         /* nByte */
-    1,                       /* iVersion */
+    6,                       /* iVersion */
     /***** file i/o ******************/
     0,                       /* pVfsCtx */
     lsmPosixOsFullpath,      /* xFullpath */
@@ -731,6 +1086,22 @@ lsm_env *lsm_default_env(void){
     lsmPosixOsMutexNotHeld,  /* xMutexNotHeld */
     /***** other *********************/
     lsmPosixOsSleep,         /* xSleep */
+    /***** threads *******************/
+    lsmPosixOsThreadNew,     /* xThreadNew */
+    lsmPosixOsThreadJoin,    /* xThreadJoin */
+    lsmPosixOsCondNew,       /* xCondNew */
+    lsmPosixOsCondDel,       /* xCondDel */
+    lsmPosixOsCondWait,      /* xCondWait */
+    lsmPosixOsCondBroadcast, /* xCondBroadcast */
+    /***** time **********************/
+    lsmPosixOsCurrentTime,   /* xCurrentTime */
+    /***** read-ahead ****************/
+    lsmPosixOsReadAhead,     /* xReadAhead */
+    /***** vectored i/o **************/
+    lsmPosixOsReadv,         /* xReadv */
+    lsmPosixOsWritev,        /* xWritev */
+    /***** preallocation ************/
+    lsmPosixOsFallocate,     /* xFallocate */
   };
   return &posix_env;
 }
@@ -2732,6 +2732,7 @@ case OP_OpenWrite: {
   pCur->isOrdered = 1;
   pCur->iRoot = p2;
   rc = sqlite4KVStoreOpenCursor(pX, &pCur->pKVCur);
+  if( rc==SQLITE4_OK ) rc = sqlite4VdbeSetBounds(pCur);
   pCur->pKeyInfo = pKeyInfo;
 
   /* Set the VdbeCursor.isTable and isIndex variables. Previous versions of
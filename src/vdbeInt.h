@@ -429,6 +429,7 @@ int sqlite4VdbeFrameRestore(VdbeFrame *);
 void sqlite4VdbeMemStoreType(Mem *pMem);
 int sqlite4VdbeTransferError(Vdbe *p);
 int sqlite4VdbeSeekEnd(VdbeCursor*, int);
+int sqlite4VdbeSetBounds(VdbeCursor*);
 int sqlite4VdbeNext(VdbeCursor*);
 int sqlite4VdbePrevious(VdbeCursor*);
 
@@ -56,6 +56,24 @@ int sqlite4VdbeSeekEnd(VdbeCursor *pC, int iEnd){
   return rc;
 }
 
+/*
+** Tell the KV storage engine that VDBE cursor pC will only be used to 
+** visit keys belonging to its table - those that begin with the varint
+** encoding of pC->iRoot. Since varints sort in numeric order, these are
+** the keys that are greater than or equal to the encoding of iRoot and
+** less than that of (iRoot+1).
+*/
+int sqlite4VdbeSetBounds(VdbeCursor *pC){
+  KVByteArray aLower[10];
+  KVByteArray aUpper[10];
+  KVSize nLower;
+  KVSize nUpper;
+
+  nLower = sqlite4PutVarint64(aLower, pC->iRoot);
+  nUpper = sqlite4PutVarint64(aUpper, pC->iRoot+1);
+  return sqlite4KVCursorSetBounds(pC->pKVCur, aLower, nLower, aUpper, nUpper);
+}
+
 /*
 ** Move a VDBE cursor to the next element in its table.
 ** Return SQLITE4_NOTFOUND if the seek falls of the end of the table.
@@ -173,6 +173,36 @@ static int kvwrapSeek(
   return p->pReal->pStoreVfunc->xSeek(pCsr->pReal, aKey, nKey, dir);
 }
 
+/*
+** Restrict a cursor to a range of keys.
+*/
+static int kvwrapSetBounds(
+  KVCursor *pKVCursor,
+  const KVByteArray *aLower, KVSize nLower,
+  const KVByteArray *aUpper, KVSize nUpper
+){
+  KVWrap *p = (KVWrap *)(pKVCursor->pStore);
+  KVWrapCsr *pCsr = (KVWrapCsr *)pKVCursor;
+  const KVStoreMethods *pMethods = p->pReal->pStoreVfunc;
+  if( pMethods->iVersion<2 || pMethods->xSetBounds==0 ) return SQLITE4_OK;
+  return pMethods->xSetBounds(pCsr->pReal, aLower, nLower, aUpper, nUpper);
+}
+
+/*
+** Search for each of an array of keys.
+*/
+static int kvwrapSeekMany(
+  KVCursor *pKVCursor,
+  int nKey, const KVByteArray **apKey, const KVSize *anKey,
+  int (*xFound)(void*, int), void *pCtx
+){
+  KVWrapCsr *pCsr = (KVWrapCsr *)pKVCursor;
+  kvwg.nSeek += nKey;
+  return sqlite4KVCursorSeekMany(
+      pCsr->pReal, nKey, apKey, anKey, xFound, pCtx
+  );
+}
+
 /*
 ** Delete the entry that the cursor is pointing to.
 **
@@ -253,7 +283,7 @@ static int newFileStorage(
 
   /* Virtual methods for an LSM data store */
   static const KVStoreMethods kvwrapMethods = {
-    1,
+    3,
     sizeof(KVStoreMethods),
     kvwrapReplace,
     kvwrapOpenCursor,
@@ -273,7 +303,9 @@ static int newFileStorage(
     kvwrapClose,
     kvwrapControl,
     kvwrapGetMeta,
-    kvwrapPutMeta
+    kvwrapPutMeta,
+    kvwrapSetBounds,
+    kvwrapSeekMany
   };
 
   KVWrap *pNew;
@@ -241,9 +241,11 @@ foreach file {
    hash.c
    opcodes.c
 
+   lsm_cksum.c
    lsm_ckpt.c
    lsm_file.c
    lsm_log.c
+   lsm_lz.c
    lsm_main.c
    lsm_mem.c
    lsm_mutex.c